@@ -274,13 +274,10 @@ static int
 LogUtilsGetLocalTime(struct tm *local) // OUT
 {
    time_t seconds;
-   struct tm *tmp;
    struct timeval tv;
 
    time(&seconds);
-   tmp = localtime(&seconds);
-
-   *local = *tmp;
+   localtime_r(&seconds, local);
 
    gettimeofday(&tv, NULL);
    return tv.tv_usec / 1000;
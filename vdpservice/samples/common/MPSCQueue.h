@@ -0,0 +1,133 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * MPSCQueue.h --
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class MPSCQueue
+ *
+ *    Unbounded lock-free multiple-producer single-consumer FIFO
+ *    (Vyukov's node based queue).  Push() may be called from any
+ *    thread and never blocks; Pop() must only be called from the one
+ *    consumer thread.  The queue is not intrusive: Push() allocates a
+ *    node for the copy of the item, which Pop() frees.
+ *
+ *    A producer which has swapped the head but not yet linked its node
+ *    makes the queue look empty to the consumer for a short moment.
+ *    Pop() returns false in that case and the item shows up on a later
+ *    call, FIFO order per producer is always kept.
+ *
+ *----------------------------------------------------------------------
+ */
+template<typename T>
+class MPSCQueue
+{
+public:
+   MPSCQueue()
+      : m_head(&m_stub),
+        m_tail(&m_stub)
+   {
+      m_stub.next.store(NULL, std::memory_order_relaxed);
+   }
+
+   ~MPSCQueue()
+   {
+      T item;
+      while (Pop(&item)) {
+      }
+   }
+
+   /*
+    * Appends an item, callable from any thread.
+    */
+   void Push(const T& item)     // IN
+   {
+      Node* node = new Node;
+      node->item = item;
+      node->next.store(NULL, std::memory_order_relaxed);
+      PushNode(node);
+   }
+
+   /*
+    * Removes the oldest item, consumer thread only.
+    */
+   bool Pop(T* item)            // OUT
+   {
+      Node* tail = m_tail;
+      Node* next = tail->next.load(std::memory_order_acquire);
+
+      if (tail == &m_stub) {
+         if (next == NULL) {
+            return false;
+         }
+         m_tail = next;
+         tail = next;
+         next = next->next.load(std::memory_order_acquire);
+      }
+
+      if (next != NULL) {
+         m_tail = next;
+         *item = tail->item;
+         delete tail;
+         return true;
+      }
+
+      if (tail != m_head.load(std::memory_order_acquire)) {
+         /* A producer is in the middle of Push(). */
+         return false;
+      }
+
+      m_stub.next.store(NULL, std::memory_order_relaxed);
+      PushNode(&m_stub);
+
+      next = tail->next.load(std::memory_order_acquire);
+      if (next != NULL) {
+         m_tail = next;
+         *item = tail->item;
+         delete tail;
+         return true;
+      }
+
+      return false;
+   }
+
+   /*
+    * Best effort emptiness check, consumer thread only.
+    */
+   bool IsEmpty() const
+   {
+      return m_tail == &m_stub &&
+             m_stub.next.load(std::memory_order_acquire) == NULL;
+   }
+
+private:
+   struct Node {
+      std::atomic<Node*>   next;
+      T                    item;
+   };
+
+   void PushNode(Node* node)    // IN
+   {
+      Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+      prev->next.store(node, std::memory_order_release);
+   }
+
+   std::atomic<Node*>   m_head;
+   Node*                m_tail;
+   Node                 m_stub;
+
+   MPSCQueue(const MPSCQueue&);
+   MPSCQueue& operator=(const MPSCQueue&);
+};
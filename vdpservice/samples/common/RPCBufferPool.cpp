@@ -0,0 +1,330 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCBufferPool.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCBufferPool.h"
+
+/*
+ * Payloads are rounded up so that slightly different sizes reuse the
+ * same buffer instead of growing it each time.
+ */
+#define RPC_BUFFER_MIN_CAPACITY     64
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::RPCBufferPool --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCBufferPool::RPCBufferPool()
+   : m_free(NULL),
+     m_attachedHead(NULL),
+     m_attachedTail(NULL)
+{
+   memset(&m_stats, 0, sizeof m_stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::~RPCBufferPool --
+ *
+ *    Destructor.  Buffers still handed out are leaked rather than
+ *    pulled away from their owner.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCBufferPool::~RPCBufferPool()
+{
+   ReleaseAll();
+
+   if (m_stats.inUse != 0) {
+      LOG("Warning: %u buffers still in use.", m_stats.inUse);
+   }
+
+   while (m_free != NULL) {
+      RPCBuffer* buffer = m_free;
+      m_free = buffer->next;
+      delete [] buffer->data;
+      delete buffer;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::Acquire --
+ *
+ *    Takes a buffer of at least <size> bytes from the pool, allocating
+ *    only if the pool is empty or the buffer is too small.
+ *
+ * Results:
+ *    The buffer, <size> is set to the requested size.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCBuffer*
+RPCBufferPool::Acquire(uint32 size)          // IN
+{
+   RPCBuffer* buffer;
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+
+   buffer = m_free;
+   if (buffer != NULL) {
+      m_free = buffer->next;
+      m_stats.pooled--;
+   }
+
+   m_stats.acquired++;
+   m_stats.inUse++;
+
+   uint32 capacity = buffer != NULL ? buffer->capacity : 0;
+   if (buffer == NULL) {
+      m_stats.heapAllocs++;
+   }
+   if (capacity < size) {
+      m_stats.heapAllocs++;
+   }
+   lock.unlock();
+
+   if (buffer == NULL) {
+      buffer = new RPCBuffer;
+      buffer->data = NULL;
+      buffer->capacity = 0;
+   }
+
+   if (capacity < size) {
+      uint32 newCapacity = RPC_BUFFER_MIN_CAPACITY;
+      while (newCapacity < size) {
+         newCapacity *= 2;
+      }
+
+      delete [] buffer->data;
+      buffer->data = new char[newCapacity];
+      buffer->capacity = newCapacity;
+   }
+
+   buffer->size = size;
+   buffer->msgId = 0;
+   buffer->prev = NULL;
+   buffer->next = NULL;
+   return buffer;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::Release --
+ *
+ *    Gives a buffer that is not attached to a message back.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::Release(RPCBuffer* buffer)    // IN
+{
+   if (buffer == NULL) {
+      return;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   PutFree(buffer);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::Attach --
+ *
+ *    Ties <buffer> to the message <msgId>, it is released together with
+ *    the message by ReleaseMessage() or ReleaseAll().  A message holds
+ *    at most one buffer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::Attach(RPCBuffer* buffer,     // IN
+                      uint32 msgId)          // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   buffer->msgId = msgId;
+   buffer->next = NULL;
+   buffer->prev = m_attachedTail;
+
+   if (m_attachedTail != NULL) {
+      m_attachedTail->next = buffer;
+   } else {
+      m_attachedHead = buffer;
+   }
+   m_attachedTail = buffer;
+   m_stats.attached++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::ReleaseMessage --
+ *
+ *    Releases the buffer attached to the message <msgId>, if any.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::ReleaseMessage(uint32 msgId)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   RPCBuffer* buffer = m_attachedHead;
+   while (buffer != NULL && buffer->msgId != msgId) {
+      buffer = buffer->next;
+   }
+
+   if (buffer == NULL) {
+      return;
+   }
+
+   if (buffer->prev != NULL) {
+      buffer->prev->next = buffer->next;
+   } else {
+      m_attachedHead = buffer->next;
+   }
+   if (buffer->next != NULL) {
+      buffer->next->prev = buffer->prev;
+   } else {
+      m_attachedTail = buffer->prev;
+   }
+
+   m_stats.attached--;
+   PutFree(buffer);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::ReleaseAll --
+ *
+ *    Releases every attached buffer, used when the messages in flight
+ *    can no longer complete.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::ReleaseAll()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   while (m_attachedHead != NULL) {
+      RPCBuffer* buffer = m_attachedHead;
+      m_attachedHead = buffer->next;
+      PutFree(buffer);
+   }
+
+   m_attachedTail = NULL;
+   m_stats.attached = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::GetStats --
+ *
+ *    Returns a snapshot of the counters.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::GetStats(RPCBufferPoolStats* stats)    // OUT
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   *stats = m_stats;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCBufferPool::PutFree --
+ *
+ *    Pushes a buffer on the free list, m_mutex must be held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCBufferPool::PutFree(RPCBuffer* buffer)    // IN
+{
+   buffer->msgId = 0;
+   buffer->prev = NULL;
+   buffer->next = m_free;
+   m_free = buffer;
+
+   m_stats.released++;
+   m_stats.inUse--;
+   m_stats.pooled++;
+}
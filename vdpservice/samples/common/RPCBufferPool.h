@@ -0,0 +1,102 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCBufferPool.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#include <mutex>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCBuffer
+ *
+ *    A payload buffer handed out by RPCBufferPool.  <capacity> never
+ *    shrinks, so once the pool has warmed up to the largest payload in
+ *    use, Acquire() does not allocate any more.
+ *
+ *----------------------------------------------------------------------
+ */
+struct RPCBuffer
+{
+   char*          data;
+   uint32         capacity;
+   uint32         size;
+
+   /* private to RPCBufferPool */
+   uint32         msgId;
+   RPCBuffer*     prev;
+   RPCBuffer*     next;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCBufferPoolStats
+ *
+ *    Counters since the pool was created.  <heapAllocs> counts every
+ *    new[] done by the pool, buffers and payloads alike; in steady state
+ *    it stays flat while <acquired> keeps going up.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         acquired;
+   uint64         released;
+   uint64         heapAllocs;
+   uint32         attached;
+   uint32         inUse;
+   uint32         pooled;
+} RPCBufferPoolStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCBufferPool
+ *
+ *    Free list of RPCBuffer, safe to use from any thread.  A buffer can
+ *    be attached to a message id (one per message), it then goes back
+ *    to the pool when ReleaseMessage() is called with that id (from the
+ *    OnDone/OnAbort path) or ReleaseAll() when the channel goes away.
+ *    Completions normally come in send order, so the attached list is
+ *    searched from the oldest entry.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCBufferPool
+{
+public:
+   RPCBufferPool();
+   ~RPCBufferPool();
+
+   RPCBuffer* Acquire(uint32 size);
+   void Release(RPCBuffer* buffer);
+
+   void Attach(RPCBuffer* buffer, uint32 msgId);
+   void ReleaseMessage(uint32 msgId);
+   void ReleaseAll();
+
+   void GetStats(RPCBufferPoolStats* stats);
+
+private:
+   void PutFree(RPCBuffer* buffer);
+
+   std::mutex           m_mutex;
+   RPCBuffer*           m_free;
+   RPCBuffer*           m_attachedHead;
+   RPCBuffer*           m_attachedTail;
+   RPCBufferPoolStats   m_stats;
+
+   RPCBufferPool(const RPCBufferPool&);
+   RPCBufferPool& operator=(const RPCBufferPool&);
+};
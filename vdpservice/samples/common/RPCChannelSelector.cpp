@@ -0,0 +1,851 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCChannelSelector.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCManager.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+typedef std::chrono::steady_clock ProbeClock;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCChannelSelector::Probe
+ *
+ *    One probe object, either ours (server) or the one answering the
+ *    peer's probe (client, <responder>).
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCChannelSelector::Probe
+{
+public:
+   Probe(RPCChannelSelector* selector, uint32 channelType, bool responder)
+      : selector(selector),
+        channelType(channelType),
+        responder(responder),
+        hObj(NULL),
+        done(false),
+        pingsDone(0),
+        bulkLeft(0)
+   {
+   }
+
+   RPCChannelSelector*     selector;
+   uint32                  channelType;
+   bool                    responder;
+   void*                   hObj;
+   bool                    done;
+   uint32                  pingsDone;
+   uint32                  bulkLeft;
+   std::vector<uint32>     rttUs;
+   ProbeClock::time_point  sentAt;
+   ProbeClock::time_point  bulkStart;
+   ProbeClock::time_point  deadline;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SideChannelOf --
+ *
+ *    The side channel a channel type runs on.
+ *
+ * Results:
+ *    VDPRPC_SideChannelType.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VDPRPC_SideChannelType
+SideChannelOf(uint32 channelType)  // IN
+{
+   return channelType == VDPSERVICE_VCHAN_CHANNEL ? VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP
+                                                  : VDP_RPC_SIDE_CHANNEL_TYPE_TCP;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ElapsedUs --
+ *
+ *    Microseconds since <since>.
+ *
+ * Results:
+ *    The elapsed time, at least 1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+ElapsedUs(ProbeClock::time_point since)  // IN
+{
+   int64 us = std::chrono::duration_cast<std::chrono::microseconds>(
+                 ProbeClock::now() - since).count();
+   return us > 0 ? (uint64)us : 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCChannelSelector
+ *
+ *----------------------------------------------------------------------
+ */
+RPCChannelSelector::RPCChannelSelector()
+   : m_plugin(NULL),
+     m_candidates(0),
+     m_running(false),
+     m_current(NULL),
+     m_payload(RPC_PROBE_BULK_BYTES, 0)
+{
+   memset(m_results, 0, sizeof m_results);
+   memset(m_choice, 0, sizeof m_choice);
+
+   m_probeSink.version = VDP_RPC_OBJECT_NOTIFY_SINK_V1;
+   m_probeSink.v1.OnInvoke = OnProbeInvoke;
+   m_probeSink.v1.OnObjectStateChanged = OnProbeStateChanged;
+
+   m_probeCallback.version = VDP_RPC_REQUEST_CALLBACK_V1;
+   m_probeCallback.v1.OnDone = OnProbeMsgDone;
+   m_probeCallback.v1.OnAbort = OnProbeMsgAbort;
+}
+
+RPCChannelSelector::~RPCChannelSelector()
+{
+   /*
+    * The probe objects went with the channel, only our bookkeeping is
+    * left.
+    */
+   for (size_t i = 0; i < m_probes.size(); i++) {
+      delete m_probes[i];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::Start --
+ *
+ *    Starts probing the candidates that have their side channel
+ *    available.  The server calls it once its channel object is
+ *    connected on the main channel.
+ *
+ * Results:
+ *    false if there is nothing to probe, or the peer cannot answer
+ *    probes.  The first candidate is picked right away then.
+ *
+ * Side Effects:
+ *    RPCPluginInstance::OnChannelSelected() is called once done.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCChannelSelector::Start(RPCPluginInstance* rpcPlugin)  // IN
+{
+   FUNCTION_TRACE;
+   const VDPRPC_ChannelObjectInterface* iChannelObj = rpcPlugin->ChannelObjectInterface();
+
+   Cancel();
+   ReapProbes(true);
+
+   m_plugin = rpcPlugin;
+   memset(m_results, 0, sizeof m_results);
+   memset(m_choice, 0, sizeof m_choice);
+   m_pending.clear();
+
+   for (uint32 type = VDPSERVICE_MAIN_CHANNEL; type < RPC_PROBE_TYPES; type++) {
+      if ((m_candidates & (1 << type)) == 0 ||
+          (rpcPlugin->GetPeerCaps() & VDP_RPC_CAP_PROBE) == 0) {
+         continue;
+      }
+
+      if (type != VDPSERVICE_MAIN_CHANNEL &&
+          (iChannelObj->v2.IsSideChannelAvailable == NULL ||
+           !iChannelObj->v2.IsSideChannelAvailable(SideChannelOf(type)))) {
+         LOG("Channel %s is not available.", ChannelTypeToStr(type));
+         continue;
+      }
+
+      m_pending.push_back(type);
+   }
+
+   if (m_pending.empty()) {
+      LOG("No channel to probe, peer capabilities 0x%x.", rpcPlugin->GetPeerCaps());
+      Finish();
+      return false;
+   }
+
+   m_running = true;
+   NextProbe();
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::Cancel --
+ *
+ *    Stops a running selection, for example because the channel went
+ *    away, and destroys the probe objects still open.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    OnChannelSelected() is not called.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::Cancel()
+{
+   if (m_running) {
+      LOG("Channel selection cancelled.");
+   }
+
+   m_running = false;
+   m_current = NULL;
+   m_pending.clear();
+
+   for (size_t i = 0; i < m_probes.size(); i++) {
+      Probe* probe = m_probes[i];
+
+      if (!probe->done && probe->hObj != NULL) {
+         m_plugin->ChannelObjectInterface()->v1.DestroyChannelObject(probe->hObj);
+      }
+      probe->done = true;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::CheckTimeout --
+ *
+ *    Gives up on the current candidate once it had RPC_PROBE_TIMEOUT_MS
+ *    to connect and answer.  Must be called from the thread that polls
+ *    the channel while the selection runs.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The next candidate is probed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::CheckTimeout()
+{
+   if (!m_running || m_current == NULL ||
+       ProbeClock::now() < m_current->deadline) {
+      return;
+   }
+
+   LOG("Probe of channel %s timed out.", ChannelTypeToStr(m_current->channelType));
+   OnProbeDone(m_current, false);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnPeerObjectCreated --
+ *
+ *    The client answers a probe object of the server with its own, of
+ *    the same name.
+ *
+ * Results:
+ *    true if <objName> is a probe object.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCChannelSelector::OnPeerObjectCreated(RPCPluginInstance* rpcPlugin,  // IN
+                                        const char* objName)           // IN
+{
+   m_plugin = rpcPlugin;
+
+   std::string prefix = ProbePrefix();
+   if (strncmp(objName, prefix.c_str(), prefix.size()) != 0) {
+      return false;
+   }
+
+   uint32 type = (uint32)atoi(objName + prefix.size());
+   if (type < VDPSERVICE_MAIN_CHANNEL || type > VDPSERVICE_TCPRAW_CHANNEL) {
+      LOG("Error: invalid probe object \"%s\".", objName);
+      return true;
+   }
+
+   ReapProbes(false);
+
+   Probe* probe = new Probe(this, type, true);
+   if (!rpcPlugin->ChannelObjectInterface()->v1.
+         CreateChannelObject(objName,
+                             &m_probeSink,
+                             (void*)probe,
+                             (VDPRPC_ObjectConfigurationFlags)rpcPlugin->ChannelObjFlags(),
+                             &probe->hObj)) {
+      LOG("Error: cannot create probe object \"%s\".", objName);
+      delete probe;
+      return true;
+   }
+
+   m_probes.push_back(probe);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::GetChoice --
+ *
+ *    The channel type picked for a traffic class by the last
+ *    selection.
+ *
+ * Results:
+ *    The VdpServiceChannelType, 0 if no selection has finished.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCChannelSelector::GetChoice(RPCTrafficClass trafficClass) const  // IN
+{
+   if (trafficClass < 0 || trafficClass >= RPC_TRAFFIC_CLASSES) {
+      return 0;
+   }
+
+   return m_choice[trafficClass];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::GetResult --
+ *
+ *    What the last selection measured on a channel type.
+ *
+ * Results:
+ *    true if the type was probed successfully.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCChannelSelector::GetResult(uint32 channelType,              // IN
+                              RPCChannelProbeResult* result)   // OUT
+   const
+{
+   if (channelType >= RPC_PROBE_TYPES) {
+      memset(result, 0, sizeof *result);
+      return false;
+   }
+
+   *result = m_results[channelType];
+   return result->probed;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::ChannelTypeToStr --
+ *
+ *    Short name of a channel type, for logs.
+ *
+ * Results:
+ *    The name.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCChannelSelector::ChannelTypeToStr(uint32 channelType)  // IN
+{
+   switch (channelType) {
+   case VDPSERVICE_MAIN_CHANNEL:    return "main";
+   case VDPSERVICE_VCHAN_CHANNEL:   return "vchan";
+   case VDPSERVICE_TCP_CHANNEL:     return "tcp";
+   case VDPSERVICE_TCPRAW_CHANNEL:  return "tcpRaw";
+   default:                         return "unknown";
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::NextProbe --
+ *
+ *    Creates the probe object of the next candidate, or finishes when
+ *    all have been probed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The peer is told about the new object.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::NextProbe()
+{
+   const VDPRPC_ChannelObjectInterface* iChannelObj = m_plugin->ChannelObjectInterface();
+
+   while (!m_pending.empty()) {
+      uint32 type = m_pending.front();
+      m_pending.erase(m_pending.begin());
+
+      std::string name = ProbePrefix() + std::to_string(type);
+      Probe* probe = new Probe(this, type, false);
+      probe->deadline = ProbeClock::now() +
+                        std::chrono::milliseconds(RPC_PROBE_TIMEOUT_MS);
+      m_probes.push_back(probe);
+      m_current = probe;
+
+      if (iChannelObj->v1.
+            CreateChannelObject(name.c_str(),
+                                &m_probeSink,
+                                (void*)probe,
+                                (VDPRPC_ObjectConfigurationFlags)m_plugin->ChannelObjFlags(),
+                                &probe->hObj)) {
+         LOG("Probing channel %s with \"%s\".", ChannelTypeToStr(type), name.c_str());
+         return;
+      }
+
+      LOG("Error: cannot create probe object \"%s\".", name.c_str());
+      probe->hObj = NULL;
+      probe->done = true;
+      m_current = NULL;
+   }
+
+   Finish();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::SendProbe --
+ *
+ *    Sends one VDP_RPC_PROBE message of <bytes> bytes on a probe
+ *    object.  It never goes through compression or batching.
+ *
+ * Results:
+ *    true if the message was sent.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCChannelSelector::SendProbe(Probe* probe,   // IN
+                              uint32 bytes)   // IN
+{
+   const VDPRPC_ChannelObjectInterface* iChannelObj = m_plugin->ChannelObjectInterface();
+   const VDPRPC_ChannelContextInterface* iChannelCtx = m_plugin->ChannelContextInterface();
+   void* messageCtx = NULL;
+
+   if (!iChannelObj->v1.CreateContext(probe->hObj, &messageCtx)) {
+      LOG("Error: cannot create probe message.");
+      return false;
+   }
+
+   iChannelCtx->v1.SetNamedCommand(messageCtx, VDP_RPC_PROBE);
+
+   RPCScratchVariant blob;
+   blob.SetBlob(m_payload.data(), bytes);
+   iChannelCtx->v1.AppendParam(messageCtx, &blob);
+
+   probe->sentAt = ProbeClock::now();
+   if (!iChannelObj->v1.Invoke(probe->hObj, messageCtx, &m_probeCallback,
+                               (void*)probe)) {
+      LOG("Error: cannot send probe message.");
+      iChannelObj->v1.DestroyContext(messageCtx);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnProbeDone --
+ *
+ *    Records the result of the current candidate and moves on.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The probe object is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::OnProbeDone(Probe* probe,  // IN
+                                bool ok)       // IN
+{
+   if (probe != m_current || probe->done) {
+      return;
+   }
+
+   probe->done = true;
+   m_current = NULL;
+
+   RPCChannelProbeResult* result = &m_results[probe->channelType];
+   result->probed = ok && !probe->rttUs.empty();
+   if (result->probed) {
+      std::vector<uint32> rtt = probe->rttUs;
+      std::sort(rtt.begin(), rtt.end());
+      result->rttUs = rtt[rtt.size() / 2];
+      result->minRttUs = rtt.front();
+      LOG("Channel %s: rtt %u us (min %u us), %llu bytes/s.",
+          ChannelTypeToStr(probe->channelType), result->rttUs,
+          result->minRttUs, (unsigned long long)result->bytesPerSec);
+   } else {
+      LOG("Channel %s: probe failed.", ChannelTypeToStr(probe->channelType));
+   }
+
+   m_plugin->ChannelObjectInterface()->v1.DestroyChannelObject(probe->hObj);
+   NextProbe();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::Finish --
+ *
+ *    Picks the lowest median round trip for the interactive class and
+ *    the highest throughput for the bulk class.  When no candidate
+ *    answered both fall back to the first candidate.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    RPCPluginInstance::OnChannelSelected() is called.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::Finish()
+{
+   uint32 fastest = 0;
+   uint32 widest = 0;
+   uint32 fallback = 0;
+
+   for (uint32 type = VDPSERVICE_MAIN_CHANNEL; type < RPC_PROBE_TYPES; type++) {
+      const RPCChannelProbeResult& result = m_results[type];
+
+      if (fallback == 0 && (m_candidates & (1 << type)) != 0) {
+         fallback = type;
+      }
+
+      if (!result.probed) {
+         continue;
+      }
+
+      if (fastest == 0 || result.rttUs < m_results[fastest].rttUs) {
+         fastest = type;
+      }
+
+      if (widest == 0 || result.bytesPerSec > m_results[widest].bytesPerSec) {
+         widest = type;
+      }
+   }
+
+   m_choice[RPC_TRAFFIC_INTERACTIVE] = fastest != 0 ? fastest : fallback;
+   m_choice[RPC_TRAFFIC_BULK] = widest != 0 ? widest : fallback;
+   m_running = false;
+
+   LOG("Channel selected: %s for interactive, %s for bulk traffic.",
+       ChannelTypeToStr(m_choice[RPC_TRAFFIC_INTERACTIVE]),
+       ChannelTypeToStr(m_choice[RPC_TRAFFIC_BULK]));
+
+   m_plugin->OnChannelSelected();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::ReapProbes --
+ *
+ *    Deletes the bookkeeping of probe objects already destroyed, or of
+ *    all of them.  Never called from a callback of a probe object.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::ReapProbes(bool all)  // IN
+{
+   std::vector<Probe*> live;
+
+   for (size_t i = 0; i < m_probes.size(); i++) {
+      if (all || m_probes[i]->done) {
+         delete m_probes[i];
+      } else {
+         live.push_back(m_probes[i]);
+      }
+   }
+
+   m_probes.swap(live);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::ProbePrefix --
+ *
+ *    Probe objects are named after the channel object, followed by
+ *    "Probe" and the channel type they measure.
+ *
+ * Results:
+ *    The name without the channel type.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::string
+RPCChannelSelector::ProbePrefix() const
+{
+   return std::string(m_plugin->GetRPCManager()->m_channelObjName) + "Probe";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnProbeInvoke --
+ *
+ *    A probe message from the peer.  The reply, sent when this returns,
+ *    is the answer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::OnProbeInvoke(void* userData,    // IN
+                                  void* messageCtx,  // IN
+                                  void* reserved)    // IN
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnProbeStateChanged --
+ *
+ *    State change of a probe object.  Once connected both ends ask for
+ *    the side channel of the candidate, then the server starts pinging.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::OnProbeStateChanged(void* userData,   // IN
+                                        void* reserved)   // IN
+{
+   Probe* probe = static_cast<Probe*>(userData);
+   RPCChannelSelector* self = probe->selector;
+   RPCPluginInstance* rpcPlugin = self->m_plugin;
+   const VDPRPC_ChannelObjectInterface* iChannelObj = rpcPlugin->ChannelObjectInterface();
+
+   if (probe->done) {
+      return;
+   }
+
+   VDPRPC_ObjectState state = iChannelObj->v1.GetObjectState(probe->hObj);
+   LOG("Probe object for %s is now %s", ChannelTypeToStr(probe->channelType),
+       RPCManager::ChannelObjectStateToStr(state));
+
+   switch (state) {
+   case VDP_RPC_OBJ_CONNECTED:
+      if (probe->channelType != VDPSERVICE_MAIN_CHANNEL) {
+         iChannelObj->v2.RequestSideChannel(probe->hObj,
+                                            SideChannelOf(probe->channelType),
+                                            rpcPlugin->GetRPCManager()->m_tokenName);
+         break;
+      }
+      // falls through - the main channel has nothing to wait for.
+
+   case VDP_RPC_OBJ_SIDE_CHANNEL_CONNECTED:
+      if (!probe->responder && probe->pingsDone == 0 &&
+          !self->SendProbe(probe, RPC_PROBE_PING_BYTES)) {
+         self->OnProbeDone(probe, false);
+      }
+      break;
+
+   case VDP_RPC_OBJ_DISCONNECTED:
+      if (probe->responder) {
+         iChannelObj->v1.DestroyChannelObject(probe->hObj);
+         probe->done = true;
+      } else {
+         self->OnProbeDone(probe, false);
+      }
+      break;
+
+   default:
+      break;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnProbeMsgDone --
+ *
+ *    The peer answered a probe message.  The RPC_PROBE_PINGS pings go
+ *    one at a time, then RPC_PROBE_BULK_MSGS bulk messages all at once.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::OnProbeMsgDone(void* userData,        // IN
+                                   uint32 requestCtxId,   // IN
+                                   void* returnCtx)       // IN
+{
+   Probe* probe = static_cast<Probe*>(userData);
+   RPCChannelSelector* self = probe->selector;
+
+   if (probe->done) {
+      return;
+   }
+
+   if (probe->pingsDone < RPC_PROBE_PINGS) {
+      probe->rttUs.push_back((uint32)ElapsedUs(probe->sentAt));
+
+      if (++probe->pingsDone < RPC_PROBE_PINGS) {
+         if (!self->SendProbe(probe, RPC_PROBE_PING_BYTES)) {
+            self->OnProbeDone(probe, false);
+         }
+         return;
+      }
+
+      probe->bulkStart = ProbeClock::now();
+      probe->bulkLeft = RPC_PROBE_BULK_MSGS;
+      for (uint32 i = 0; i < RPC_PROBE_BULK_MSGS; i++) {
+         if (!self->SendProbe(probe, RPC_PROBE_BULK_BYTES)) {
+            self->OnProbeDone(probe, false);
+            return;
+         }
+      }
+   } else if (probe->bulkLeft > 0 && --probe->bulkLeft == 0) {
+      uint64 bytes = (uint64)RPC_PROBE_BULK_MSGS * RPC_PROBE_BULK_BYTES;
+      self->m_results[probe->channelType].bytesPerSec =
+         bytes * 1000000 / ElapsedUs(probe->bulkStart);
+      self->OnProbeDone(probe, true);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCChannelSelector::OnProbeMsgAbort --
+ *
+ *    A probe message was lost, the candidate failed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCChannelSelector::OnProbeMsgAbort(void* userData,        // IN
+                                    uint32 requestCtxId,   // IN
+                                    Bool userCancelled,    // IN
+                                    uint32 reason)         // IN
+{
+   Probe* probe = static_cast<Probe*>(userData);
+
+   LOG("Probe message aborted, reason %u.", reason);
+   probe->selector->OnProbeDone(probe, false);
+}
@@ -0,0 +1,138 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCChannelSelector.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+#include "vdprpc_interfaces.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * What a probe sends on each candidate channel.
+ */
+#define RPC_PROBE_PINGS             8
+#define RPC_PROBE_PING_BYTES        64
+#define RPC_PROBE_BULK_MSGS         4
+#define RPC_PROBE_BULK_BYTES        (64 * 1024)
+
+// time a candidate gets to connect and answer its probe.
+#define RPC_PROBE_TIMEOUT_MS        2000
+
+// how often a running selection checks that timeout while waiting.
+#define RPC_PROBE_TICK_MS           50
+
+// channel types are small numbers, see VdpServiceChannelType.
+#define RPC_PROBE_TYPES             8
+
+class RPCPluginInstance;
+
+/* Traffic a plugin instance mostly sends, see SetTrafficClass() */
+typedef enum {
+   RPC_TRAFFIC_INTERACTIVE    = 0,     /* small messages, lowest round trip */
+   RPC_TRAFFIC_BULK           = 1,     /* large payloads, highest throughput */
+   RPC_TRAFFIC_CLASSES
+} RPCTrafficClass;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCChannelProbeResult
+ *
+ *    What the probe of one channel type measured.  <probed> is false if
+ *    it was not a candidate, is not available or did not answer in time.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   bool           probed;
+   uint32         rttUs;            /* median of RPC_PROBE_PINGS */
+   uint32         minRttUs;
+   uint64         bytesPerSec;      /* RPC_PROBE_BULK_MSGS sent at once */
+} RPCChannelProbeResult;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCChannelSelector
+ *
+ *    Picks the channel type of a plugin instance opened with
+ *    VDPSERVICE_AUTO_CHANNEL.  Once the channel object is connected on
+ *    the main channel, and if the peer announced VDP_RPC_CAP_PROBE, the
+ *    server creates one probe object per candidate type in turn.  Each
+ *    gets its side channel like the real object would, answers
+ *    RPC_PROBE_PINGS VDP_RPC_PROBE messages one at a time and then
+ *    RPC_PROBE_BULK_MSGS large ones at once, and is destroyed.  The
+ *    fastest round trip wins the interactive class, the highest
+ *    throughput the bulk class.
+ *
+ *    The client side only answers: the peer's RPCManager creates the
+ *    matching probe objects and replies to the probes.
+ *
+ *    Everything runs from the RPC callbacks of the thread that polls
+ *    the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCChannelSelector
+{
+public:
+   RPCChannelSelector();
+   ~RPCChannelSelector();
+
+   /* bit (1 << VdpServiceChannelType) per candidate */
+   void SetCandidates(uint32 typeMask) { m_candidates = typeMask; }
+   uint32 GetCandidates() const { return m_candidates; }
+
+   bool Start(RPCPluginInstance* rpcPlugin);
+   void Cancel();
+   bool IsRunning() const { return m_running; }
+   void CheckTimeout();
+
+   bool OnPeerObjectCreated(RPCPluginInstance* rpcPlugin, const char* objName);
+
+   uint32 GetChoice(RPCTrafficClass trafficClass) const;
+   bool GetResult(uint32 channelType, RPCChannelProbeResult* result) const;
+
+   static const char* ChannelTypeToStr(uint32 channelType);
+
+private:
+   class Probe;
+
+   RPCPluginInstance*               m_plugin;
+   uint32                           m_candidates;
+   bool                             m_running;
+   std::vector<uint32>              m_pending;        /* types left to probe */
+   Probe*                           m_current;
+   std::vector<Probe*>              m_probes;         /* deleted by ReapProbes() */
+   RPCChannelProbeResult            m_results[RPC_PROBE_TYPES];
+   uint32                           m_choice[RPC_TRAFFIC_CLASSES];
+   std::vector<char>                m_payload;
+
+   VDPRPC_ObjectNotifySink          m_probeSink;
+   VDPRPC_RequestCallback           m_probeCallback;
+
+   void NextProbe();
+   bool SendProbe(Probe* probe, uint32 bytes);
+   void OnProbeDone(Probe* probe, bool ok);
+   void Finish();
+   void ReapProbes(bool all);
+   std::string ProbePrefix() const;
+
+   static void __cdecl OnProbeInvoke(void* userData, void* messageCtx,
+                                     void* reserved);
+   static void __cdecl OnProbeStateChanged(void* userData, void* reserved);
+   static void __cdecl OnProbeMsgDone(void* userData, uint32 requestCtxId,
+                                      void* returnCtx);
+   static void __cdecl OnProbeMsgAbort(void* userData, uint32 requestCtxId,
+                                       Bool userCancelled, uint32 reason);
+};
@@ -0,0 +1,494 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCClockSync.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCClockSync.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// intervals of a round trip this much above the shortest are left out of the fit.
+#define RPC_CLOCK_DELAY_SLACK_NS    50000
+
+// the drift is fitted from this many intervals spanning this long, 0 before.
+#define RPC_CLOCK_FIT_INTERVALS     8
+#define RPC_CLOCK_FIT_SPAN_NS       8000000000ULL
+
+// no crystal is off by more, a steeper fit is noise.
+#define RPC_CLOCK_MAX_DRIFT         500e-6
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::RPCClockSync --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCClockSync::RPCClockSync()
+   : m_samples(0),
+     m_rejected(0),
+     m_refNs(0),
+     m_offsetNs(0),
+     m_drift(0),
+     m_lastNs(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::AddSample --
+ *
+ *    Adds the round trip of <stamp>, answered at <rxNs>.
+ *
+ * Results:
+ *    false if the stamp was not set by the peer or is inconsistent.
+ *
+ * Side Effects:
+ *    The estimate is fitted again when the round trip is the shortest
+ *    of its interval.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCClockSync::AddSample(const RPCClockStamp& stamp,   // IN
+                        uint64 rxNs)                  // IN
+{
+   if (stamp.magic != RPC_CLOCK_STAMP_MAGIC || rxNs < stamp.txNs ||
+       stamp.peerTxNs < stamp.peerRxNs) {
+      return false;
+   }
+
+   uint64 rttNs = rxNs - stamp.txNs;
+   uint64 heldNs = stamp.peerTxNs - stamp.peerRxNs;
+   if (heldNs > rttNs) {
+      return false;
+   }
+
+   /*
+    * The clocks may be far apart, the differences are taken unsigned
+    * and only then read as signed.
+    */
+   Interval sample;
+   sample.localNs = stamp.txNs + rttNs / 2;
+   sample.offsetNs = ((int64)(stamp.peerRxNs - stamp.txNs) +
+                      (int64)(stamp.peerTxNs - rxNs)) / 2;
+   sample.delayNs = rttNs - heldNs;
+   sample.startNs = sample.localNs;
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_samples++;
+   m_lastNs = std::max(m_lastNs, sample.localNs);
+
+   if (m_intervals.empty() ||
+       sample.localNs >= m_intervals.back().startNs + RPC_CLOCK_INTERVAL_NS) {
+      m_intervals.push_back(sample);
+      if (m_intervals.size() > RPC_CLOCK_INTERVALS) {
+         m_intervals.pop_front();
+      }
+   } else if (sample.delayNs < m_intervals.back().delayNs) {
+      sample.startNs = m_intervals.back().startNs;
+      m_intervals.back() = sample;
+   } else {
+      return true;
+   }
+
+   Fit();
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::GetOneWay --
+ *
+ *    Splits the round trip of <stamp>, answered at <rxNs>, into the
+ *    delay to the peer and back, by the current estimate.
+ *
+ * Results:
+ *    false if there is no estimate yet, the stamp is invalid, or the
+ *    estimate puts one of the delays below 0.
+ *
+ * Side Effects:
+ *    A delay below 0 is counted as rejected, see GetStats().
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCClockSync::GetOneWay(const RPCClockStamp& stamp,   // IN
+                        uint64 rxNs,                  // IN
+                        uint64* toPeerNs,             // OUT
+                        uint64* fromPeerNs)           // OUT
+{
+   if (stamp.magic != RPC_CLOCK_STAMP_MAGIC || rxNs < stamp.txNs) {
+      return false;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if (m_intervals.empty()) {
+      return false;
+   }
+
+   /*
+    * A delay below 0 means the estimate is off for this round trip, e.g.
+    * a link slower one way than the shortest round trip let on.  It is
+    * no measurement, the caller is told rather than given a 0.
+    */
+   int64 offsetNs = OffsetAt(stamp.txNs + (rxNs - stamp.txNs) / 2);
+   int64 toNs = (int64)(stamp.peerRxNs - stamp.txNs) - offsetNs;
+   int64 fromNs = (int64)(rxNs - stamp.peerTxNs) + offsetNs;
+
+   if (toNs < 0 || fromNs < 0) {
+      m_rejected++;
+      return false;
+   }
+
+   *toPeerNs = (uint64)toNs;
+   *fromPeerNs = (uint64)fromNs;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::GetOffset --
+ *
+ *    The peer clock minus ours at <localNs> of ours.
+ *
+ * Results:
+ *    The offset in ns, 0 before the first sample.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int64
+RPCClockSync::GetOffset(uint64 localNs)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return OffsetAt(localNs);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::GetStats --
+ *
+ *    Returns the current estimate.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCClockSync::GetStats(RPCClockSyncStats* stats)   // OUT
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   stats->samples = m_samples;
+   stats->rejected = m_rejected;
+   stats->intervals = (uint32)m_intervals.size();
+   stats->offsetNs = OffsetAt(m_lastNs);
+   stats->driftPpm = m_drift * 1e6;
+   stats->minDelayNs = 0;
+
+   for (size_t i = 0; i < m_intervals.size(); i++) {
+      if (i == 0 || m_intervals[i].delayNs < stats->minDelayNs) {
+         stats->minDelayNs = m_intervals[i].delayNs;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::Reset --
+ *
+ *    Forgets the samples, for a peer whose clock may have changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCClockSync::Reset()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_intervals.clear();
+   m_samples = 0;
+   m_rejected = 0;
+   m_refNs = 0;
+   m_offsetNs = 0;
+   m_drift = 0;
+   m_lastNs = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::Fit --
+ *
+ *    Fits the offset and drift to the intervals whose shortest round
+ *    trip is close to the shortest of all, the others queued the whole
+ *    interval.  Until there are enough of them over long enough the
+ *    drift is 0 and the offset that of the shortest round trip.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Called with m_mutex held.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCClockSync::Fit()
+{
+   const Interval* best = &m_intervals.front();
+   for (size_t i = 1; i < m_intervals.size(); i++) {
+      if (m_intervals[i].delayNs < best->delayNs) {
+         best = &m_intervals[i];
+      }
+   }
+
+   std::vector<const Interval*> used;
+   uint64 maxDelayNs = best->delayNs * 2 + RPC_CLOCK_DELAY_SLACK_NS;
+   for (size_t i = 0; i < m_intervals.size(); i++) {
+      if (m_intervals[i].delayNs <= maxDelayNs) {
+         used.push_back(&m_intervals[i]);
+      }
+   }
+
+   if (used.size() < RPC_CLOCK_FIT_INTERVALS ||
+       used.back()->localNs < used.front()->localNs + RPC_CLOCK_FIT_SPAN_NS) {
+      m_refNs = best->localNs;
+      m_offsetNs = (double)best->offsetNs;
+      m_drift = 0;
+      return;
+   }
+
+   /*
+    * Least squares around the mean, the times taken from the first
+    * interval so that doubles keep their precision.
+    */
+   uint64 baseNs = used.front()->localNs;
+   double meanX = 0;
+   double meanY = 0;
+   for (size_t i = 0; i < used.size(); i++) {
+      meanX += (double)(used[i]->localNs - baseNs);
+      meanY += (double)used[i]->offsetNs;
+   }
+   meanX /= used.size();
+   meanY /= used.size();
+
+   double sxy = 0;
+   double sxx = 0;
+   for (size_t i = 0; i < used.size(); i++) {
+      double dx = (double)(used[i]->localNs - baseNs) - meanX;
+      sxy += dx * ((double)used[i]->offsetNs - meanY);
+      sxx += dx * dx;
+   }
+
+   m_refNs = baseNs + (uint64)meanX;
+   m_offsetNs = meanY;
+   m_drift = sxx > 0 ? sxy / sxx : 0;
+   m_drift = std::max(-RPC_CLOCK_MAX_DRIFT, std::min(RPC_CLOCK_MAX_DRIFT, m_drift));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::OffsetAt --
+ *
+ *    The fit at <localNs>.
+ *
+ * Results:
+ *    The offset in ns.
+ *
+ * Side Effects:
+ *    Called with m_mutex held.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int64
+RPCClockSync::OffsetAt(uint64 localNs) const   // IN
+{
+   double sinceNs = (double)(int64)(localNs - m_refNs);
+   return (int64)(m_offsetNs + m_drift * sinceNs);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::NowNs --
+ *
+ *    Nanoseconds of the monotonic clock the stamps are taken from.
+ *
+ * Results:
+ *    The time.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+RPCClockSync::NowNs()
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::InitStamp --
+ *
+ *    Sets <stamp> for a message sent now.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCClockSync::InitStamp(RPCClockStamp* stamp)   // OUT
+{
+   memset(stamp, 0, sizeof *stamp);
+   stamp->magic = RPC_CLOCK_STAMP_MAGIC;
+   stamp->txNs = NowNs();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::IsStamp --
+ *
+ *    Whether a blob parameter or return value is a stamp.
+ *
+ * Results:
+ *    true if it is.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCClockSync::IsStamp(const char* data,   // IN
+                      uint32 size)        // IN
+{
+   uint32 magic;
+
+   if (data == NULL || size != sizeof(RPCClockStamp)) {
+      return false;
+   }
+
+   memcpy(&magic, data, sizeof magic);
+   return magic == RPC_CLOCK_STAMP_MAGIC;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::EchoStamp --
+ *
+ *    The peer side, sets the receive time <rxNs> and the time it
+ *    answers, now, in the stamp at the start of <data> if there is one.
+ *    The stamp need not be aligned.
+ *
+ * Results:
+ *    false if <data> does not start with a stamp.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCClockSync::EchoStamp(char* data,     // IN/OUT
+                        uint32 size,    // IN
+                        uint64 rxNs)    // IN
+{
+   RPCClockStamp stamp;
+
+   if (data == NULL || size < sizeof stamp) {
+      return false;
+   }
+
+   memcpy(&stamp, data, sizeof stamp);
+   if (stamp.magic != RPC_CLOCK_STAMP_MAGIC) {
+      return false;
+   }
+
+   stamp.peerRxNs = rxNs;
+   stamp.peerTxNs = NowNs();
+   memcpy(data, &stamp, sizeof stamp);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCClockSync::ReadStamp --
+ *
+ *    Reads the stamp at the start of an echo, as the peer set it.
+ *
+ * Results:
+ *    false if there is none, or the peer left it as it was sent.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCClockSync::ReadStamp(const char* data,         // IN
+                        uint32 size,              // IN
+                        RPCClockStamp* stamp)     // OUT
+{
+   if (data == NULL || size < sizeof *stamp) {
+      return false;
+   }
+
+   memcpy(stamp, data, sizeof *stamp);
+   return stamp->magic == RPC_CLOCK_STAMP_MAGIC && stamp->peerTxNs != 0;
+}
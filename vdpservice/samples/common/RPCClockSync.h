@@ -0,0 +1,142 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCClockSync.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#include <deque>
+#include <mutex>
+
+// name of the parameter and return value that carry an RPCClockStamp.
+#define RPC_CLOCK_STAMP_NAME        "clockStamp"
+
+// RPCClockStamp::magic, "CLKS".
+#define RPC_CLOCK_STAMP_MAGIC       0x534B4C43
+
+// where the stamp of a raw TCP ping is, after its own timestamp.
+#define RPC_CLOCK_PING_OFFSET       8
+
+// the round trips of this long are reduced to their shortest.
+#define RPC_CLOCK_INTERVAL_NS       1000000000ULL
+
+// intervals the estimate is made from, the oldest are dropped.
+#define RPC_CLOCK_INTERVALS         64
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCClockStamp
+ *
+ *    The timestamps of a round trip, each on the monotonic clock of the
+ *    side that took it.  The sender sets magic and txNs, the peer sets
+ *    peerRxNs when the message arrives and peerTxNs as it answers.  A
+ *    peer that does not know it echoes it unchanged.
+ *
+ *    In a message it is a blob of its own size, named RPC_CLOCK_STAMP_NAME,
+ *    but the peer finds it by its size and magic: batches and the
+ *    journal do not keep the names of parameters.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint32   magic;
+   uint32   reserved;
+   uint64   txNs;
+   uint64   peerRxNs;
+   uint64   peerTxNs;
+} RPCClockStamp;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCClockSyncStats
+ *
+ *    What RPCClockSync estimated.  The offset is the peer clock minus
+ *    ours, the drift how many ns a second the peer clock runs ahead.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64   samples;          /* round trips given to AddSample() */
+   uint64   rejected;         /* GetOneWay() splits with a delay below 0 */
+   uint32   intervals;        /* intervals kept, their shortest round trip each */
+   int64    offsetNs;         /* as of the last sample */
+   double   driftPpm;
+   uint64   minDelayNs;       /* shortest round trip, the peer's time left out */
+} RPCClockSyncStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCClockSync
+ *
+ *    Estimates the offset and drift of the clock of a peer from the
+ *    round trips of pings, as NTP does, so that each round trip can be
+ *    split into its two one-way delays.
+ *
+ *    A round trip gives an offset that is off by half the difference of
+ *    its two delays, so only the shortest round trip of each interval
+ *    is kept, the one that queued the least.  The drift is the slope of
+ *    a least squares fit over those, and the offset the fit at the
+ *    time asked for.
+ *
+ *    Like NTP it cannot tell a link that is slower one way: the
+ *    shortest round trip is split in two equal halves.  The one-way
+ *    delays are right about the time a ping spends above that, the
+ *    queueing and jitter of each direction.  Safe to use from any
+ *    thread.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCClockSync
+{
+public:
+   RPCClockSync();
+
+   bool AddSample(const RPCClockStamp& stamp, uint64 rxNs);
+   bool GetOneWay(const RPCClockStamp& stamp, uint64 rxNs,
+                  uint64* toPeerNs, uint64* fromPeerNs);
+   int64 GetOffset(uint64 localNs);
+   void GetStats(RPCClockSyncStats* stats);
+   void Reset();
+
+   static uint64 NowNs();
+   static void InitStamp(RPCClockStamp* stamp);
+   static bool IsStamp(const char* data, uint32 size);
+   static bool EchoStamp(char* data, uint32 size, uint64 rxNs);
+   static bool ReadStamp(const char* data, uint32 size, RPCClockStamp* stamp);
+
+private:
+   /* the shortest round trip of an interval */
+   typedef struct {
+      uint64   startNs;       /* of the interval */
+      uint64   localNs;       /* midway through the round trip */
+      int64    offsetNs;
+      uint64   delayNs;
+   } Interval;
+
+   void Fit();
+   int64 OffsetAt(uint64 localNs) const;
+
+   std::mutex              m_mutex;
+   std::deque<Interval>    m_intervals;
+   uint64                  m_samples;
+   uint64                  m_rejected;
+   uint64                  m_refNs;        /* where the fit is centered */
+   double                  m_offsetNs;     /* at m_refNs */
+   double                  m_drift;        /* ns per ns */
+   uint64                  m_lastNs;
+
+   RPCClockSync(const RPCClockSync&);
+   RPCClockSync& operator=(const RPCClockSync&);
+};
@@ -0,0 +1,517 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCCommandTable.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCCommandTable.h"
+
+/*
+ * Seeds tried for each size of the name hash before doubling it.
+ */
+#define RPC_COMMAND_HASH_TRIES      64
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::RPCCommandTable --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCCommandTable::RPCCommandTable()
+   : m_nameSeed(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::Build --
+ *
+ *    Builds the lookup tables for <entries>, which must stay valid as
+ *    long as the table is used.
+ *
+ * Results:
+ *    false if a name is too long or a command is declared twice.
+ *
+ * Side Effects:
+ *    Forgets the ids of the peer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCCommandTable::Build(const RPCCommandEntry* entries,  // IN
+                       int count)                       // IN
+{
+   m_entries.assign(entries, entries + count);
+   m_named.clear();
+   m_nameSlots.clear();
+   m_numbered.clear();
+   m_numberedMap.clear();
+   m_peerIds.reset(new std::atomic<uint32>[count > 0 ? count : 1]);
+   ResetPeer();
+
+   for (int i = 0; i < count; i++) {
+      const RPCCommandEntry& e = m_entries[i];
+
+      if (e.name != NULL) {
+         if (strlen(e.name) >= RPC_COMMAND_NAME_MAX) {
+            LOG("Error: command name \"%s\" is too long.", e.name);
+            return false;
+         }
+
+         for (size_t k = 0; k < m_named.size(); k++) {
+            if (strcmp(m_entries[m_named[k]].name, e.name) == 0) {
+               LOG("Error: command \"%s\" declared twice.", e.name);
+               return false;
+            }
+         }
+
+         m_named.push_back(i);
+      } else {
+         if (e.command == 0 || e.command >= VDP_RPC_INTERN_BASE) {
+            LOG("Error: command %u is reserved.", e.command);
+            return false;
+         }
+
+         if (FindNumbered(e.command) >= 0) {
+            LOG("Error: command %u declared twice.", e.command);
+            return false;
+         }
+
+         if (e.command < RPC_COMMAND_DIRECT_MAX) {
+            if (m_numbered.size() <= e.command) {
+               m_numbered.resize(e.command + 1, -1);
+            }
+            m_numbered[e.command] = i;
+         } else {
+            m_numberedMap[e.command] = i;
+         }
+      }
+   }
+
+   if (m_named.empty()) {
+      return true;
+   }
+
+   /*
+    * Look for a seed that gives every name its own slot, in a table at
+    * least twice as large as the number of names this takes a few tries.
+    */
+   uint32 size = 1;
+   while (size < 2 * m_named.size()) {
+      size *= 2;
+   }
+
+   for (;;) {
+      for (uint32 seed = 1; seed <= RPC_COMMAND_HASH_TRIES; seed++) {
+         bool collision = false;
+
+         m_nameSlots.assign(size, -1);
+         for (size_t k = 0; k < m_named.size() && !collision; k++) {
+            int i = m_named[k];
+            uint32 slot = HashName(m_entries[i].name, seed) & (size - 1);
+
+            collision = m_nameSlots[slot] >= 0;
+            m_nameSlots[slot] = i;
+         }
+
+         if (!collision) {
+            m_nameSeed = seed;
+            return true;
+         }
+      }
+
+      size *= 2;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::FindNamed --
+ *
+ *    Looks up the entry of a named command.
+ *
+ * Results:
+ *    The entry index or -1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCCommandTable::FindNamed(const char* name) const    // IN
+{
+   int i = NameSlot(name);
+   return i >= 0 && strcmp(m_entries[i].name, name) == 0 ? i : -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::FindNumbered --
+ *
+ *    Looks up the entry of a numeric command.
+ *
+ * Results:
+ *    The entry index or -1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCCommandTable::FindNumbered(uint32 command) const   // IN
+{
+   if (command < m_numbered.size()) {
+      return m_numbered[command];
+   }
+
+   auto it = m_numberedMap.find(command);
+   return it != m_numberedMap.end() ? it->second : -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::Identify --
+ *
+ *    Finds the entry of a message received from the peer.  Interned and
+ *    numeric commands are resolved without reading the name.
+ *
+ * Results:
+ *    The entry index or -1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCCommandTable::Identify(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+                          void* messageCtx) const                             // IN
+{
+   uint32 command = iChannelCtx->v1.GetCommand(messageCtx);
+
+   if (command >= VDP_RPC_INTERN_BASE) {
+      uint32 k = command - VDP_RPC_INTERN_BASE;
+      return k < m_named.size() ? m_named[k] : -1;
+   }
+
+   if (command != 0) {
+      int i = FindNumbered(command);
+      if (i >= 0) {
+         return i;
+      }
+   }
+
+   char name[RPC_COMMAND_NAME_MAX];
+   if (m_named.empty() ||
+       !iChannelCtx->v1.GetNamedCommand(messageCtx, name, sizeof name)) {
+      return -1;
+   }
+
+   return FindNamed(name);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::Dispatch --
+ *
+ *    Calls the handler of a message received from the peer.
+ *
+ * Results:
+ *    false if the command has no handler.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCCommandTable::Dispatch(RPCPluginInstance* plugin,                          // IN
+                          const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+                          void* messageCtx) const                             // IN
+{
+   if (m_entries.empty()) {
+      return false;
+   }
+
+   int i = Identify(iChannelCtx, messageCtx);
+   if (i < 0 || m_entries[i].handler == NULL) {
+      return false;
+   }
+
+   m_entries[i].handler(plugin, messageCtx);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::SetCommand --
+ *
+ *    Sets the command of entry <index> on an outgoing message, as the
+ *    peer's interned id when there is one.
+ *
+ * Results:
+ *    false if <index> is out of range or the command cannot be set.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCCommandTable::SetCommand(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+                            void* messageCtx,                                   // IN
+                            int index) const                                    // IN
+{
+   if (index < 0 || index >= (int)m_entries.size()) {
+      return false;
+   }
+
+   const RPCCommandEntry& e = m_entries[index];
+   if (e.name == NULL) {
+      return iChannelCtx->v1.SetCommand(messageCtx, e.command) != FALSE;
+   }
+
+   uint32 id = m_peerIds[index].load(std::memory_order_relaxed);
+   if (id != 0) {
+      return iChannelCtx->v1.SetCommand(messageCtx, id) != FALSE;
+   }
+
+   return iChannelCtx->v1.SetNamedCommand(messageCtx, e.name) != FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::IsCommand --
+ *
+ *    Checks whether a message set up with SetCommand(), e.g. the return
+ *    context given to OnDone(), is of entry <index>.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCCommandTable::IsCommand(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+                           void* messageCtx,                                   // IN
+                           int index) const                                    // IN
+{
+   if (index < 0 || index >= (int)m_entries.size()) {
+      return false;
+   }
+
+   const RPCCommandEntry& e = m_entries[index];
+   uint32 command = iChannelCtx->v1.GetCommand(messageCtx);
+
+   if (e.name == NULL) {
+      return command == e.command;
+   }
+
+   uint32 id = m_peerIds[index].load(std::memory_order_relaxed);
+   if (id != 0 && command == id) {
+      return true;
+   }
+
+   /*
+    * Sent before the name was interned.
+    */
+   char name[RPC_COMMAND_NAME_MAX];
+   return iChannelCtx->v1.GetNamedCommand(messageCtx, name, sizeof name) &&
+          strcmp(name, e.name) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::GetNames --
+ *
+ *    The named commands for the peer, NUL terminated one after the
+ *    other.  The position of a name is its interned id.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::string
+RPCCommandTable::GetNames() const
+{
+   std::string names;
+
+   for (size_t k = 0; k < m_named.size(); k++) {
+      names.append(m_entries[m_named[k]].name);
+      names.push_back('\0');
+   }
+
+   return names;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::SetPeerNames --
+ *
+ *    Takes the GetNames() of the peer, the names we know are sent
+ *    interned from now on.
+ *
+ * Results:
+ *    The number of names interned.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCCommandTable::SetPeerNames(const char* names,   // IN
+                              uint32 size)         // IN
+{
+   uint32 pos = 0;
+   uint32 id = 0;
+   int interned = 0;
+
+   while (pos < size && id < VDP_RPC_JOURNAL_ID - VDP_RPC_INTERN_BASE) {
+      const char* name = names + pos;
+      const char* end = (const char*)memchr(name, '\0', size - pos);
+      if (end == NULL) {
+         break;
+      }
+
+      int i = FindNamed(name);
+      if (i >= 0) {
+         m_peerIds[i].store(VDP_RPC_INTERN_BASE + id, std::memory_order_relaxed);
+         interned++;
+      }
+
+      pos += (uint32)(end - name) + 1;
+      id++;
+   }
+
+   return interned;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::ResetPeer --
+ *
+ *    Forgets the ids of the peer, used when the channel goes away.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCCommandTable::ResetPeer()
+{
+   for (size_t i = 0; i < m_entries.size(); i++) {
+      m_peerIds[i].store(0, std::memory_order_relaxed);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::HashName --
+ *
+ *    FNV-1a of <name> started from <seed>.
+ *
+ * Results:
+ *    The hash.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCCommandTable::HashName(const char* name,    // IN
+                          uint32 seed)         // IN
+{
+   uint32 h = 2166136261u ^ (seed * 2654435761u);
+
+   for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; p++) {
+      h ^= *p;
+      h *= 16777619u;
+   }
+
+   return h ^ (h >> 15);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCommandTable::NameSlot --
+ *
+ *    The entry in the slot <name> hashes to, not compared yet.
+ *
+ * Results:
+ *    The entry index or -1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCCommandTable::NameSlot(const char* name) const   // IN
+{
+   if (m_nameSlots.empty()) {
+      return -1;
+   }
+
+   uint32 mask = (uint32)m_nameSlots.size() - 1;
+   return m_nameSlots[HashName(name, m_nameSeed) & mask];
+}
@@ -0,0 +1,149 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCCommandTable.h --
+ *
+ */
+
+#pragma once
+
+#include "vdprpc_interfaces.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class RPCPluginInstance;
+
+/*
+ * Numeric commands from VDP_RPC_INTERN_BASE on stand for named commands
+ * interned during the VDP_PING_CHANNEL handshake, VDP_RPC_BATCH_ID for
+ * VDP_RPC_BATCH, VDP_RPC_CHUNK_ID for VDP_RPC_CHUNK and VDP_RPC_JOURNAL_ID
+ * for VDP_RPC_JOURNAL.  Only peers that announced VDP_RPC_CAP_INTERN use
+ * them.
+ */
+#define VDP_RPC_INTERN_BASE    0xFFFF0000
+#define VDP_RPC_JOURNAL_ID     0xFFFFFFFD
+#define VDP_RPC_CHUNK_ID       0xFFFFFFFE
+#define VDP_RPC_BATCH_ID       0xFFFFFFFF
+
+// longest named command the table handles.
+#define RPC_COMMAND_NAME_MAX   64
+
+// numeric commands below this are looked up by direct index.
+#define RPC_COMMAND_DIRECT_MAX 1024
+
+typedef void (*RPCCommandHandler)(RPCPluginInstance* plugin, void* messageCtx);
+
+template<typename T, void (T::*Method)(void*)>
+void
+RPCCommandThunk(RPCPluginInstance* plugin,   // IN
+                void* messageCtx)            // IN
+{
+   (static_cast<T*>(plugin)->*Method)(messageCtx);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCCommandEntry
+ *
+ *    One command of a plugin, named (<name> set) or numeric.  Entries
+ *    without a handler are only sent, see RPCPluginInstance::SetCommand().
+ *    Numeric command 0 is reserved, it is what a named message reads as.
+ *
+ *       static const RPCCommandEntry commands[] = {
+ *          RPC_NAMED_COMMAND("PING", MyPlugin, OnPing),
+ *          RPC_NUMBERED_COMMAND(MY_ECHO, MyPlugin, OnEcho),
+ *          RPC_SEND_COMMAND("STATUS"),
+ *       };
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   const char*          name;
+   uint32               command;
+   RPCCommandHandler    handler;
+} RPCCommandEntry;
+
+#define RPC_NAMED_COMMAND(name, Class, Method) \
+   { name, 0, &RPCCommandThunk<Class, &Class::Method> }
+
+#define RPC_NUMBERED_COMMAND(command, Class, Method) \
+   { NULL, command, &RPCCommandThunk<Class, &Class::Method> }
+
+#define RPC_SEND_COMMAND(name) \
+   { name, 0, NULL }
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCCommandTable
+ *
+ *    Dispatch table built once from the RPCCommandEntry array of a
+ *    plugin.  Numeric commands are found by direct index, named ones
+ *    through a perfect hash of the names so a lookup costs one hash and
+ *    one compare.  The named commands are exchanged with the peer during
+ *    the handshake: a named command both sides know is then sent as the
+ *    numeric id the receiver gave it, which the receiver maps back with
+ *    a direct index, so these messages carry and compare no string.
+ *
+ *    Build() must be called before the channel connects, the peer ids
+ *    are safe to read from any thread.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCCommandTable
+{
+public:
+   RPCCommandTable();
+
+   bool Build(const RPCCommandEntry* entries, int count);
+   int Count() const { return (int)m_entries.size(); }
+
+   int FindNamed(const char* name) const;
+   int FindNumbered(uint32 command) const;
+   int Identify(const VDPRPC_ChannelContextInterface* iChannelCtx,
+                void* messageCtx) const;
+   bool Dispatch(RPCPluginInstance* plugin,
+                 const VDPRPC_ChannelContextInterface* iChannelCtx,
+                 void* messageCtx) const;
+
+   bool SetCommand(const VDPRPC_ChannelContextInterface* iChannelCtx,
+                   void* messageCtx, int index) const;
+   bool IsCommand(const VDPRPC_ChannelContextInterface* iChannelCtx,
+                  void* messageCtx, int index) const;
+
+   std::string GetNames() const;
+   int SetPeerNames(const char* names, uint32 size);
+   void ResetPeer();
+
+private:
+   std::vector<RPCCommandEntry>     m_entries;
+
+   /* named entries in the order of GetNames(), i.e. by interned id */
+   std::vector<int>                 m_named;
+
+   /* perfect hash of the names, entry index or -1 */
+   std::vector<int>                 m_nameSlots;
+   uint32                           m_nameSeed;
+
+   /* numeric commands, direct index or -1 and a map for larger ones */
+   std::vector<int>                 m_numbered;
+   std::unordered_map<uint32, int>  m_numberedMap;
+
+   /* per entry, the id the peer interned its name as, 0 if none */
+   std::unique_ptr<std::atomic<uint32>[]> m_peerIds;
+
+   static uint32 HashName(const char* name, uint32 seed);
+   int NameSlot(const char* name) const;
+
+   RPCCommandTable(const RPCCommandTable&);
+   RPCCommandTable& operator=(const RPCCommandTable&);
+};
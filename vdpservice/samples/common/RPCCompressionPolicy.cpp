@@ -0,0 +1,328 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCCompressionPolicy.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCCompressionPolicy.h"
+
+#include <math.h>
+
+/*
+ * The first RPC_COMP_WARMUP payloads of a command are all sampled,
+ * later ones only every RPC_COMP_SAMPLE_EVERY.  At most
+ * RPC_COMP_SAMPLE_BYTES of a payload are looked at.
+ */
+#define RPC_COMP_WARMUP             8
+#define RPC_COMP_SAMPLE_EVERY       16
+#define RPC_COMP_SAMPLE_BYTES       4096
+
+/*
+ * Ratios are in 1/256th of the payload size.  Above RPC_COMP_MAX_RATIO
+ * compressing is not worth the CPU, zlib is only used for payloads
+ * predicted to shrink to RPC_COMP_ZLIB_RATIO or better.
+ */
+#define RPC_COMP_MAX_RATIO          230
+#define RPC_COMP_ZLIB_RATIO         128
+
+/*
+ * A repeated 4-byte sequence is assumed to cost about this much once
+ * replaced by a back reference.
+ */
+#define RPC_COMP_MATCH_RATIO        26
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::RPCCompressionPolicy --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCCompressionPolicy::RPCCompressionPolicy()
+   : m_minBytes(RPC_COMP_MIN_BYTES),
+     m_zlibMinBytes(RPC_COMP_ZLIB_MIN_BYTES)
+{
+   memset(m_commands, 0, sizeof m_commands);
+   memset(&m_stats, 0, sizeof m_stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::SetThresholds --
+ *
+ *    Payloads under <minBytes> are sent uncompressed, zlib is only
+ *    considered from <zlibMinBytes> on.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCCompressionPolicy::SetThresholds(uint32 minBytes,       // IN
+                                    uint32 zlibMinBytes)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_minBytes = minBytes;
+   m_zlibMinBytes = zlibMinBytes;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::Choose --
+ *
+ *    Picks the compression for a message of <command> carrying
+ *    <payload>.  <supported> holds the VDP_RPC_COMP_* flags both sides
+ *    agreed on.
+ *
+ * Results:
+ *    0, VDP_RPC_COMP_SNAPPY or VDP_RPC_COMP_ZLIB.
+ *
+ * Side Effects:
+ *    Updates the estimate of <command> when the payload is sampled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCCompressionPolicy::Choose(uint32 command,           // IN
+                             const void* payload,      // IN
+                             uint32 payloadBytes,      // IN
+                             uint32 supported)         // IN
+{
+   uint32 comp = 0;
+   bool sample = false;
+
+   supported &= VDP_RPC_COMP_SNAPPY | VDP_RPC_COMP_ZLIB;
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+
+   if (supported != 0 && payloadBytes >= m_minBytes && payload != NULL) {
+      CommandStats* cs = Lookup(command);
+      if (cs != NULL) {
+         sample = cs->seen < RPC_COMP_WARMUP || cs->seen % RPC_COMP_SAMPLE_EVERY == 0;
+         cs->seen++;
+      }
+   }
+
+   if (sample) {
+      lock.unlock();
+      uint32 estimate = EstimateRatio(payload, payloadBytes);
+      lock.lock();
+
+      /* the slot found above stays the command's, none is ever freed */
+      CommandStats* cs = Lookup(command);
+      cs->ratio = cs->seen <= 1 ? estimate : (cs->ratio * 3 + estimate) / 4;
+      m_stats.samples++;
+   }
+
+   if (supported != 0 && payloadBytes >= m_minBytes && payload != NULL) {
+      CommandStats* cs = Lookup(command);
+      uint32 ratio = cs != NULL ? cs->ratio : RPC_COMP_ZLIB_RATIO;
+
+      if (ratio > RPC_COMP_MAX_RATIO) {
+         comp = 0;
+      } else if ((supported & VDP_RPC_COMP_ZLIB) != 0 &&
+                 (payloadBytes >= m_zlibMinBytes || (supported & VDP_RPC_COMP_SNAPPY) == 0) &&
+                 ratio <= RPC_COMP_ZLIB_RATIO) {
+         comp = VDP_RPC_COMP_ZLIB;
+      } else if ((supported & VDP_RPC_COMP_SNAPPY) != 0) {
+         comp = VDP_RPC_COMP_SNAPPY;
+      }
+
+      if (comp != 0) {
+         m_stats.estSavedBytes += (uint64)payloadBytes * (256 - ratio) / 256;
+      }
+   }
+
+   if (comp == VDP_RPC_COMP_ZLIB) {
+      m_stats.zlib++;
+      m_stats.zlibBytes += payloadBytes;
+   } else if (comp == VDP_RPC_COMP_SNAPPY) {
+      m_stats.snappy++;
+      m_stats.snappyBytes += payloadBytes;
+   } else {
+      m_stats.none++;
+      m_stats.noneBytes += payloadBytes;
+   }
+
+   return comp;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::ChooseUnknown --
+ *
+ *    Compression for a message whose payload is not known up front,
+ *    Snappy if available as before.
+ *
+ * Results:
+ *    0 or VDP_RPC_COMP_SNAPPY.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCCompressionPolicy::ChooseUnknown(uint32 supported)    // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_stats.unknown++;
+   return supported & VDP_RPC_COMP_SNAPPY;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::GetStats --
+ *
+ *    Returns a snapshot of the counters.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCCompressionPolicy::GetStats(RPCCompressionStats* stats)  // OUT
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   *stats = m_stats;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::EstimateRatio --
+ *
+ *    Cheap guess of how well <data> compresses, from the start of it.
+ *    Bytes that repeat an earlier 4-byte sequence are counted as back
+ *    references, the others cost their order-0 entropy.
+ *
+ * Results:
+ *    Estimated compressed size in 1/256th of the input, 256 means
+ *    incompressible.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCCompressionPolicy::EstimateRatio(const void* data,   // IN
+                                    uint32 size)        // IN
+{
+   const unsigned char* p = (const unsigned char*)data;
+   uint32 n = size < RPC_COMP_SAMPLE_BYTES ? size : RPC_COMP_SAMPLE_BYTES;
+
+   if (n < 16) {
+      return 256;
+   }
+
+   uint32 counts[256];
+   uint16 last[4096];
+   uint32 matched = 0;
+
+   memset(counts, 0, sizeof counts);
+   memset(last, 0xff, sizeof last);
+
+   for (uint32 i = 0; i < n; i++) {
+      counts[p[i]]++;
+   }
+
+   for (uint32 i = 0; i + 4 <= n; i++) {
+      uint32 v;
+      memcpy(&v, p + i, sizeof v);
+      uint32 h = (v * 2654435761u) >> 20;
+
+      if (last[h] != 0xffff && memcmp(p + last[h], p + i, 4) == 0) {
+         matched++;
+      }
+      last[h] = (uint16)i;
+   }
+
+   double bits = 0;
+   for (int c = 0; c < 256; c++) {
+      if (counts[c] != 0) {
+         double f = (double)counts[c] / n;
+         bits -= f * log(f) / log(2.0);
+      }
+   }
+
+   double matchFrac = (double)matched / n;
+   double ratio = (1.0 - matchFrac) * (bits / 8.0) +
+                  matchFrac * (RPC_COMP_MATCH_RATIO / 256.0);
+
+   uint32 r = (uint32)(ratio * 256.0 + 0.5);
+   return r > 256 ? 256 : r;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCCompressionPolicy::Lookup --
+ *
+ *    Finds the slot of <command>, or takes a free one for it.  A
+ *    colliding command goes on to the next slot, the estimate of the
+ *    one already there is kept.  m_mutex must be held.
+ *
+ * Results:
+ *    The slot, NULL once every slot has a command of its own.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCCompressionPolicy::CommandStats*
+RPCCompressionPolicy::Lookup(uint32 command)    // IN
+{
+   const uint32 slots = sizeof m_commands / sizeof m_commands[0];
+   uint32 slot = (command * 2654435761u >> 16) % slots;
+
+   for (uint32 i = 0; i < slots; i++, slot = (slot + 1) % slots) {
+      CommandStats* cs = &m_commands[slot];
+
+      if (!cs->used) {
+         cs->command = command;
+         cs->seen = 0;
+         cs->ratio = RPC_COMP_ZLIB_RATIO;
+         cs->used = true;
+         return cs;
+      }
+      if (cs->command == command) {
+         return cs;
+      }
+   }
+
+   return NULL;
+}
@@ -0,0 +1,95 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCCompressionPolicy.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+#include "vdprpc_defines.h"
+
+#include <mutex>
+
+/*
+ * Defaults of RPCCompressionPolicy::SetThresholds().
+ */
+#define RPC_COMP_MIN_BYTES          512
+#define RPC_COMP_ZLIB_MIN_BYTES     (16 * 1024)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCCompressionStats
+ *
+ *    Decisions made by RPCCompressionPolicy.  Messages created without
+ *    a payload hint count as <unknown>.  <estSavedBytes> is what the
+ *    sampled ratios predict for the compressed messages, the library
+ *    does not report the real numbers.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         none;
+   uint64         snappy;
+   uint64         zlib;
+   uint64         unknown;
+   uint64         noneBytes;
+   uint64         snappyBytes;
+   uint64         zlibBytes;
+   uint64         estSavedBytes;
+   uint64         samples;
+} RPCCompressionStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCCompressionPolicy
+ *
+ *    Picks the compression of a message from its payload.  Payloads
+ *    under the minimum size are never compressed.  For the others an
+ *    estimate of the compressed size is kept per command, refreshed
+ *    from a sample of the payloads (every one at first, then one in
+ *    RPC_COMP_SAMPLE_EVERY).  Commands whose payloads don't shrink go
+ *    uncompressed, large payloads that shrink a lot use zlib and the
+ *    rest Snappy.  The commands past the first 64 keep the default
+ *    estimate, they are not sampled.  Safe to use from any thread.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCCompressionPolicy
+{
+public:
+   RPCCompressionPolicy();
+
+   void SetThresholds(uint32 minBytes, uint32 zlibMinBytes);
+
+   uint32 Choose(uint32 command, const void* payload, uint32 payloadBytes,
+                 uint32 supported);
+   uint32 ChooseUnknown(uint32 supported);
+
+   void GetStats(RPCCompressionStats* stats);
+
+   static uint32 EstimateRatio(const void* data, uint32 size);
+
+private:
+   typedef struct {
+      uint32      command;
+      uint32      seen;
+      uint32      ratio;      // estimated compressed size in 1/256th
+      bool        used;
+   } CommandStats;
+
+   CommandStats* Lookup(uint32 command);
+
+   std::mutex           m_mutex;
+   uint32               m_minBytes;
+   uint32               m_zlibMinBytes;
+   CommandStats         m_commands[64];
+   RPCCompressionStats  m_stats;
+};
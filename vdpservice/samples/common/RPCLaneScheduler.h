@@ -0,0 +1,194 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCLaneScheduler.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+#include "RPCChannelSelector.h"
+
+#include <chrono>
+#include <deque>
+
+// bytes a lane may send per round unless SetQuantum() says otherwise.
+#define RPC_LANE_QUANTUM_INTERACTIVE   (64 * 1024)
+#define RPC_LANE_QUANTUM_BULK          (16 * 1024)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCLaneStats
+ *
+ *    Counters of one lane.  An item is a whole message or one chunk of
+ *    a large one.  The queue delay is the time from Push() to Pop().
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         enqueued;
+   uint64         dequeued;
+   uint64         bytes;            /* total pushed */
+   uint32         depth;            /* items queued now */
+   uint64         depthBytes;
+   uint64         queueUs;          /* sum over the dequeued items */
+   uint64         maxQueueUs;
+} RPCLaneStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCLaneScheduler
+ *
+ *    Deficit round robin over one FIFO per RPCTrafficClass.  Each round
+ *    a lane that has items gets its quantum of bytes added to its
+ *    deficit and sends items while the one at its head fits, so the
+ *    quanta set the share of the bandwidth each lane gets when all are
+ *    busy.  A lane with nothing queued keeps no deficit, so an idle
+ *    interactive lane cannot save up a burst.
+ *
+ *    Not thread safe, the owner serializes the calls.
+ *
+ *----------------------------------------------------------------------
+ */
+template<typename T>
+class RPCLaneScheduler
+{
+public:
+   RPCLaneScheduler()
+      : m_current(0),
+        m_credited(false),
+        m_count(0)
+   {
+      for (int i = 0; i < RPC_TRAFFIC_CLASSES; i++) {
+         m_lanes[i].quantum = RPC_LANE_QUANTUM_BULK;
+         m_lanes[i].deficit = 0;
+         m_lanes[i].stats = RPCLaneStats();
+      }
+      m_lanes[RPC_TRAFFIC_INTERACTIVE].quantum = RPC_LANE_QUANTUM_INTERACTIVE;
+   }
+
+   void SetQuantum(RPCTrafficClass lane,      // IN
+                   uint32 bytes)              // IN
+   {
+      m_lanes[lane].quantum = bytes > 0 ? bytes : 1;
+   }
+
+   uint32 GetQuantum(RPCTrafficClass lane) const { return m_lanes[lane].quantum; }
+
+   bool IsEmpty() const { return m_count == 0; }
+
+   void Push(RPCTrafficClass lane,            // IN
+             const T& item,                   // IN
+             uint32 bytes)                    // IN
+   {
+      Lane& l = m_lanes[lane];
+      Entry entry;
+
+      entry.item = item;
+      entry.bytes = bytes;
+      entry.queuedAt = std::chrono::steady_clock::now();
+      l.queue.push_back(entry);
+      m_count++;
+
+      l.stats.enqueued++;
+      l.stats.bytes += bytes;
+      l.stats.depth++;
+      l.stats.depthBytes += bytes;
+   }
+
+   /*
+    * Removes the next item to send.
+    */
+   bool Pop(T* item,                          // OUT
+            uint32* bytes,                    // OUT
+            RPCTrafficClass* lane)            // OUT
+   {
+      if (m_count == 0) {
+         return false;
+      }
+
+      for (;;) {
+         Lane& l = m_lanes[m_current];
+
+         if (l.queue.empty()) {
+            l.deficit = 0;
+            NextLane();
+            continue;
+         }
+
+         if (!m_credited) {
+            l.deficit += l.quantum;
+            m_credited = true;
+         }
+
+         Entry& head = l.queue.front();
+         if (head.bytes > l.deficit) {
+            NextLane();
+            continue;
+         }
+
+         uint64 queueUs = (uint64)std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - head.queuedAt).count();
+
+         l.deficit -= head.bytes;
+         l.stats.dequeued++;
+         l.stats.depth--;
+         l.stats.depthBytes -= head.bytes;
+         l.stats.queueUs += queueUs;
+         if (queueUs > l.stats.maxQueueUs) {
+            l.stats.maxQueueUs = queueUs;
+         }
+
+         *item = head.item;
+         *bytes = head.bytes;
+         *lane = (RPCTrafficClass)m_current;
+         l.queue.pop_front();
+         m_count--;
+         if (l.queue.empty()) {
+            l.deficit = 0;
+         }
+         return true;
+      }
+   }
+
+   void GetStats(RPCTrafficClass lane,        // IN
+                 RPCLaneStats* stats) const   // OUT
+   {
+      *stats = m_lanes[lane].stats;
+   }
+
+private:
+   typedef struct {
+      T                                      item;
+      uint32                                 bytes;
+      std::chrono::steady_clock::time_point  queuedAt;
+   } Entry;
+
+   typedef struct {
+      std::deque<Entry>    queue;
+      uint32               quantum;
+      uint64               deficit;
+      RPCLaneStats         stats;
+   } Lane;
+
+   Lane                    m_lanes[RPC_TRAFFIC_CLASSES];
+   int                     m_current;
+   bool                    m_credited;       /* m_current got its quantum */
+   size_t                  m_count;
+
+   void NextLane()
+   {
+      m_current = (m_current + 1) % RPC_TRAFFIC_CLASSES;
+      m_credited = false;
+   }
+
+   RPCLaneScheduler(const RPCLaneScheduler&);
+   RPCLaneScheduler& operator=(const RPCLaneScheduler&);
+};
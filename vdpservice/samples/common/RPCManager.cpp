@@ -14,6 +14,13 @@
 #define INVALID_SOCKET        -1
 #endif
 
+/*
+ * How long the pump thread waits for work in one go.  The short slice
+ * is used when nothing can interrupt the wait on incoming messages.
+ */
+#define PUMP_IDLE_MS          100
+#define PUMP_POLL_MS          1
+
 /*
  * RPCManager::s_instance
  *
@@ -21,6 +28,15 @@
  */
 RPCManager* RPCManager::s_instance = NULL;
 
+/*
+ * RPCManager::s_serverEntryPoints
+ *
+ *    The vdpService exports the server side is opened and closed with,
+ *    NULL if there is none.
+ */
+const RPCServerEntryPoints* RPCManager::s_serverEntryPoints =
+   RPCManager::RMServerEntryPoints();
+
 #ifndef _WIN32
    #if !defined(_TRUNCATE)
    #define _TRUNCATE (-1)
@@ -124,6 +140,7 @@ RPCManager::VDPPluginDestroyInstance(void* userData)  // IN
    LOG_FUNC_NAME;
    RPCPluginInstance* rpcPlugin = static_cast<RPCPluginInstance*>(userData);
 
+   PumpFlush(rpcPlugin);
    rpcPlugin->ChannelDisconnect();
    rpcPlugin->UnregisterChannelSink();
 
@@ -145,7 +162,18 @@ RPCManager::RPCManager(const char* tokenName)   // IN
      m_initialized(false),
      m_channelType(VDPSERVICE_MAIN_CHANNEL),
      m_compressionEnabled(true),
-     m_encryptionEnabled(true)
+     m_encryptionEnabled(true),
+     m_autoPlugin(NULL),
+     m_pumpRunning(false),
+     m_pumpStop(false),
+     m_pumpSleeping(false),
+     m_pumpWakeRequested(false),
+     m_pumpPollsChannel(false),
+     m_pumpFlushWaiters(0),
+     m_workersPoll(false),
+     m_pumpChannel(NULL),
+     m_pumpDispatcher(0),
+     m_pollDispatcher(0)
 {
    s_instance = this;
 
@@ -163,6 +191,7 @@ RPCManager::RPCManager(const char* tokenName)   // IN
    memset(&m_iOverlayClient, 0, sizeof m_iOverlayClient);
    memset(&m_iStreamData,    0, sizeof m_iStreamData);
    memset(&m_iVdpObserverInterface, 0, sizeof m_iVdpObserverInterface);
+   memset(&m_iLocalJob,      0, sizeof m_iLocalJob);
 
    m_channelSink.version = VDP_SERVICE_CHANNEL_NOTIFY_SINK_V1;
    m_channelSink.v1.OnConnectionStateChanged = OnConnectionStateChanged;
@@ -180,6 +209,31 @@ RPCManager::RPCManager(const char* tokenName)   // IN
 
 RPCManager::~RPCManager()
 {
+   StopPumpThread();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::SetServerEntryPoints --
+ *
+ *    Replaces the server entry points of the platform with those of a
+ *    host that emulates the agent side, or restores them for NULL.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    AllowRunAsServer() follows, on Linux.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCManager::SetServerEntryPoints(const RPCServerEntryPoints* entryPoints)   // IN/OPT
+{
+   s_serverEntryPoints = entryPoints != NULL ? entryPoints : RMServerEntryPoints();
 }
 
 
@@ -214,7 +268,6 @@ RPCManager::ServerInit2(DWORD sid,                     // IN
       return false;
    }
 
-#ifdef _WIN32
    if (m_initialized) {
       FUNCTION_EXIT_MSG("Already initialized");
       return false;
@@ -222,13 +275,34 @@ RPCManager::ServerInit2(DWORD sid,                     // IN
 
    void* hChannel = NULL;
    m_channelType = type;
+   m_autoPlugin = NULL;
+
+   /*
+    * An automatic channel starts on the main channel, the candidates
+    * are measured there before the instance gets ready.  TCPRAW hands
+    * the socket to the application and is never picked automatically.
+    */
+   if (type == VDPSERVICE_AUTO_CHANNEL) {
+      uint32 candidates = (1 << VDPSERVICE_MAIN_CHANNEL) |
+                          (1 << VDPSERVICE_VCHAN_CHANNEL) |
+                          (1 << VDPSERVICE_TCP_CHANNEL);
+      if (encryptionEnabled) {
+         candidates = 1 << VDPSERVICE_TCP_CHANNEL;
+      } else if (compressionEnabled) {
+         candidates &= ~(1 << VDPSERVICE_MAIN_CHANNEL);
+      }
+
+      rpcPlugin->m_selector.SetCandidates(candidates);
+      m_autoPlugin = rpcPlugin;
+      m_channelType = VDPSERVICE_MAIN_CHANNEL;
+   }
 
    VDP_SERVICE_QUERY_INTERFACE qi;
    // You could call VDPService_ServerInit for CURRENT SESSION
-   m_serverInit = VDPService_ServerInit2(sid,
-                                         m_tokenName,
-                                         &qi,
-                                         &hChannel) != 0;
+   m_serverInit = s_serverEntryPoints->ServerInit2(sid,
+                                                   m_tokenName,
+                                                   &qi,
+                                                   &hChannel) != 0;
    if (!m_serverInit) {
       FUNCTION_EXIT_MSG("VDPService_ServerInit2() failed");
       return false;
@@ -244,6 +318,17 @@ RPCManager::ServerInit2(DWORD sid,                     // IN
       return false;
    }
 
+   /*
+    * This thread polls the channel, a local job on its dispatcher
+    * interrupts the Poll() WaitForEvent() blocks in when an event is
+    * set from another thread.
+    */
+   if (m_iChannel.version >= VDP_SERVICE_CHANNEL_INTERFACE_V4 &&
+       m_iChannel.v4.GetChannelLocalJobDispatcher != NULL &&
+       m_iLocalJob.v1.Request != NULL) {
+      m_pollDispatcher = m_iChannel.v4.GetChannelLocalJobDispatcher(hChannel);
+   }
+
    if (msTimeoutReady != 0) {
       if (!rpcPlugin->WaitUntilReady(msTimeoutReady)) {
          FUNCTION_EXIT_MSG("WaitUntilReady() failed");
@@ -253,30 +338,36 @@ RPCManager::ServerInit2(DWORD sid,                     // IN
 
    if (encryptionEnabled) {
       // Ensure the setting of encryption is valid.
-      VM_ASSERT(m_channelType == VDPSERVICE_TCP_CHANNEL ||
+      VM_ASSERT(m_autoPlugin != NULL ||
+                m_channelType == VDPSERVICE_TCP_CHANNEL ||
                 m_channelType == VDPSERVICE_TCPRAW_CHANNEL);
       if ((VDP_RPC_CRYPTO_AES & rpcPlugin->m_channelObjOptions) == 0) {
          LOG("Error: Peer does not support encryption.\n");
-         VDPService_ServerExit2(sid);
+         s_serverEntryPoints->ServerExit2(sid);
          return false;
       } else {
          m_encryptionEnabled = encryptionEnabled;
       }
+   } else {
+      m_encryptionEnabled = false;
    }
 
    if (compressionEnabled) {
-      VM_ASSERT(m_channelType != VDPSERVICE_MAIN_CHANNEL);
+      VM_ASSERT(m_autoPlugin != NULL ||
+                m_channelType != VDPSERVICE_MAIN_CHANNEL);
       if ((VDP_RPC_COMP_SNAPPY & rpcPlugin->m_channelObjOptions) == 0) {
-         VDPService_ServerExit2(sid);
+         s_serverEntryPoints->ServerExit2(sid);
          LOG("Error: Peer dose not support compression.\n");
          return false;
       } else {
          m_compressionEnabled = compressionEnabled;
       }
+   } else {
+      /* the agent only compresses when asked to, unlike the client */
+      m_compressionEnabled = false;
    }
 
    OnServerInit();
-#endif
 
    m_initialized = true;
    return true;
@@ -337,7 +428,8 @@ RPCManager::ServerExit2(DWORD sid,                    // IN
       return false;
    }
 
-#ifdef _WIN32
+   StopPumpThread();
+
    static const uint32 msTimeout = 10*1000;
    rpcPlugin->WaitForPendingMessages(msTimeout);
 
@@ -352,7 +444,7 @@ RPCManager::ServerExit2(DWORD sid,                    // IN
    }
 
    if (m_serverInit) {
-      if (!VDPService_ServerExit2(sid)) {
+      if (!s_serverEntryPoints->ServerExit2(sid)) {
          LOG("VDPService_ServerExit2() failed");
          ok = false;
       } else {
@@ -361,8 +453,9 @@ RPCManager::ServerExit2(DWORD sid,                    // IN
       m_serverInit = false;
    }
 
+   m_autoPlugin = NULL;
+   m_pollDispatcher = 0;
    OnServerExit();
-#endif
 
    m_initialized = false;
    return ok;
@@ -457,6 +550,8 @@ RPCManager::ClientExit()
       return false;
    }
 
+   StopPumpThread();
+
    m_initialized = false;
    OnClientExit();
    return true;
@@ -485,15 +580,27 @@ RPCManager::Init(bool isServer,                         // IN
 {
    FUNCTION_TRACE;
 
-   if (!qi->QueryInterface(&GUID_VDPService_ChannelInterface_V2,
-                           (void*)&m_iChannel)) {
-      if (!qi->QueryInterface(&GUID_VDPService_ChannelInterface_V1,
+   /*
+    * Version 3 adds a Poll() that blocks until the next message, which
+    * RMWaitForEvent() uses to wait without spinning.  Version 4 adds
+    * the local job dispatcher of a thread, which the pump thread is
+    * woken up through while it blocks in that Poll().
+    */
+   if (!qi->QueryInterface(&GUID_VDPService_ChannelInterface_V4,
+                           (void*)&m_iChannel) &&
+       !qi->QueryInterface(&GUID_VDPService_ChannelInterface_V3,
                            (void*)&m_iChannel)) {
-         FUNCTION_EXIT_MSG("Failed to get VDPService_ChannelInterface.");
-         return false;
+      LOG("Warning: Failed to get version3 VDPService_ChannelInterface.");
+      if (!qi->QueryInterface(&GUID_VDPService_ChannelInterface_V2,
+                              (void*)&m_iChannel)) {
+         if (!qi->QueryInterface(&GUID_VDPService_ChannelInterface_V1,
+                                 (void*)&m_iChannel)) {
+            FUNCTION_EXIT_MSG("Failed to get VDPService_ChannelInterface.");
+            return false;
+         }
+      } else {
+         LOG("Warning: Failed to get version2 VDPService_ChannelInterface.");
       }
-   } else {
-      LOG("Warning: Failed to get version2 VDPService_ChannelInterface.");
    }
 
    if (!qi->QueryInterface(&GUID_VDPRPC_ChannelObjectInterface_V3,
@@ -586,6 +693,15 @@ RPCManager::Init(bool isServer,                         // IN
       return false;
    }
 
+   /*
+    * Optional, only used to wake up the pump thread.
+    */
+   if (!qi->QueryInterface(&GUID_VDPService_LocalJobInterface_V1,
+                           (void *)&m_iLocalJob)) {
+      LOG("Warning: Failed to get VDPService_LocalJobInterface.");
+      memset(&m_iLocalJob, 0, sizeof m_iLocalJob);
+   }
+
    m_isServer = isServer;
    m_qi = *qi;
    return true;
@@ -765,9 +881,10 @@ RPCManager::OnChannelStateChanged(void *userData,                         // IN
  *
  *    Callback function for the peer creating an object.
  *
- *    Currently, the RPCManager only supports one object name. Also
- *    assumes that object creation is always initiated by the server/agent,
- *    which will be true if the RPCManager is used on both ends.
+ *    Currently, the RPCManager only supports one object name, besides
+ *    the probe objects of RPCChannelSelector. Also assumes that object
+ *    creation is always initiated by the server/agent, which will be
+ *    true if the RPCManager is used on both ends.
  *
  * Results:
  *    None.
@@ -791,9 +908,12 @@ RPCManager::OnPeerChannelObjectCreated(void *userData,       // IN
     * The client creates the channel object in response
     * to the server creating its channel object.
     */
-   if (rpcManager->IsClient() &&
-       strcmp(objName, rpcManager->m_channelObjName) == 0) {
-      rpcPlugin->ChannelObjCreate();
+   if (rpcManager->IsClient()) {
+      if (strcmp(objName, rpcManager->m_channelObjName) == 0) {
+         rpcPlugin->ChannelObjCreate();
+      } else {
+         rpcPlugin->m_selector.OnPeerObjectCreated(rpcPlugin, objName);
+      }
    }
 }
 
@@ -888,13 +1008,29 @@ RPCManager::OnMsgDone(void* userData,        // IN
    const VDPRPC_ChannelContextInterface* iChannelCtx;
 
    /*
-    * skip OnDone for channelType request.
+    * Interned commands need no name compare, skip OnDone for channelType
+    * request.
     */
    iChannelCtx = rpcPlugin->ChannelContextInterface();
-   iChannelCtx->v1.GetNamedCommand(returnCtx, cmd, sizeof cmd);
-   if (strcmp(cmd, VDP_PING_CHANNEL) != 0) {
-      rpcPlugin->TrackPendingMessages(false, NULL, 0);
-      rpcPlugin->OnDone(requestCtxId, returnCtx);
+   uint32 command = iChannelCtx->v1.GetCommand(returnCtx);
+   if (command >= VDP_RPC_INTERN_BASE) {
+      cmd[0] = '\0';
+   } else {
+      iChannelCtx->v1.GetNamedCommand(returnCtx, cmd, sizeof cmd);
+   }
+
+   if (command == VDP_RPC_BATCH_ID) {
+      rpcPlugin->OnBatchDone(requestCtxId, returnCtx);
+   } else if (command == VDP_RPC_CHUNK_ID) {
+      rpcPlugin->OnChunkDone(requestCtxId, returnCtx);
+   } else if (strcmp(cmd, VDP_PING_CHANNEL) == 0) {
+      rpcPlugin->OnChannelTypeDone(returnCtx);
+   } else if (strcmp(cmd, VDP_RPC_BATCH) == 0) {
+      rpcPlugin->OnBatchDone(requestCtxId, returnCtx);
+   } else if (strcmp(cmd, VDP_RPC_CHUNK) == 0) {
+      rpcPlugin->OnChunkDone(requestCtxId, returnCtx);
+   } else {
+      rpcPlugin->CompleteMessage(requestCtxId, returnCtx);
    }
 }
 
@@ -922,8 +1058,16 @@ RPCManager::OnMsgAbort(void* userData,       // IN
                        uint32 reason)        // IN
 {
    RPCPluginInstance* rpcPlugin = static_cast<RPCPluginInstance*>(userData);
-   rpcPlugin->TrackPendingMessages(false, NULL, 0);
-   rpcPlugin->OnAbort(requestCtxId, userCancelled, reason);
+
+   /*
+    * A batch or a chunk was never charged any credit, its messages were.
+    */
+   if (rpcPlugin->AbortBatch(requestCtxId, userCancelled, reason) ||
+       rpcPlugin->AbortChunk(requestCtxId, userCancelled, reason)) {
+      return;
+   }
+
+   rpcPlugin->AbortMessage(requestCtxId, userCancelled, reason);
 }
 
 
@@ -965,10 +1109,35 @@ RPCManager::OnMsgInvoke(void* userData,   // IN
          LOG("Receive unexpect cmd[%s], could be old Agent.\n", cmd);
 
          rpcPlugin->m_isReady = true;
-         rpcPlugin->OnInvoke(messageCtx);
+         rpcPlugin->DeliverInvoke(messageCtx);
       }
    } else {
-      rpcPlugin->OnInvoke(messageCtx);
+      char cmd[32] = "";
+      const VDPRPC_ChannelContextInterface* iChannelCtx;
+      iChannelCtx = rpcPlugin->ChannelContextInterface();
+      uint32 command = iChannelCtx->v1.GetCommand(messageCtx);
+
+      if (command == VDP_RPC_BATCH_ID) {
+         rpcPlugin->OnBatchInvoke(messageCtx);
+      } else if (command == VDP_RPC_CHUNK_ID) {
+         rpcPlugin->OnChunkInvoke(messageCtx);
+      } else if (command == VDP_RPC_JOURNAL_ID) {
+         rpcPlugin->OnJournalInvoke(messageCtx);
+      } else if (command >= VDP_RPC_INTERN_BASE) {
+         rpcPlugin->DeliverInvoke(messageCtx);
+      } else if (iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd) &&
+                 strcmp(cmd, VDP_RPC_BATCH) == 0) {
+         rpcPlugin->OnBatchInvoke(messageCtx);
+      } else if (strcmp(cmd, VDP_RPC_CHUNK) == 0) {
+         rpcPlugin->OnChunkInvoke(messageCtx);
+      } else if (strcmp(cmd, VDP_RPC_JOURNAL) == 0) {
+         rpcPlugin->OnJournalInvoke(messageCtx);
+      } else if (rpcManager->IsClient() && strcmp(cmd, VDP_PING_CHANNEL) == 0) {
+         // an automatic channel moves once the server has measured it.
+         rpcPlugin->OnChannelTypeInvoke(messageCtx);
+      } else {
+         rpcPlugin->DeliverInvoke(messageCtx);
+      }
    }
 }
 
@@ -996,6 +1165,14 @@ RPCManager::OnMsgInvoke(void* userData,   // IN
 void
 RPCManager::Poll(uint32 msTimeout)  // IN
 {
+   /*
+    * The pump thread or the session workers are already giving RPC all
+    * the time it needs.
+    */
+   if (!PollHere()) {
+      return;
+   }
+
    WaitForEvent(NULL, msTimeout);
 }
 
@@ -1022,181 +1199,290 @@ bool
 RPCManager::WaitForEvent(HANDLE hEvent,      // IN
                          uint32 msTimeout)   // IN
 {
-   return RMWaitForEvent(hEvent, msTimeout);
+   /*
+    * The channel selection of an automatic channel has to notice a
+    * candidate that never answers, so it gets a look every
+    * RPC_PROBE_TICK_MS when this thread polls.
+    */
+   std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+   uint32 msElapsed = 0;
+
+   while (m_autoPlugin != NULL && PollHere() &&
+          msTimeout - msElapsed > RPC_PROBE_TICK_MS) {
+      if (RMWaitForEvent(hEvent, RPC_PROBE_TICK_MS)) {
+         return true;
+      }
+
+      CheckChannelSelection();
+
+      int64 ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+      msElapsed = ms < (int64)msTimeout ? (uint32)ms : msTimeout;
+   }
+
+   return RMWaitForEvent(hEvent, msTimeout - msElapsed);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCManager::ConnectionStateToStr --
+ * RPCManager::CheckChannelSelection --
  *
- *    Converts the VDPService_ConnectionState into a user readable
- *    string.
+ *    Lets a running channel selection give up on a silent candidate.
+ *    Only called from the thread that polls the channel.
  *
  * Results:
- *    User readable string representation of connState.
+ *    None.
  *
  * Side Effects:
- *    None.
+ *    See RPCChannelSelector::CheckTimeout().
  *
  *----------------------------------------------------------------------
  */
 
-const char*
-RPCManager::ConnectionStateToStr(VDPService_ConnectionState connState) //IN
+void
+RPCManager::CheckChannelSelection()
 {
-   switch(connState)
-   {
-   CASE_RETURN(VDP_SERVICE_CONN_, UNINITIALIZED);
-   CASE_RETURN(VDP_SERVICE_CONN_, DISCONNECTED);
-   CASE_RETURN(VDP_SERVICE_CONN_, PENDING);
-   CASE_RETURN(VDP_SERVICE_CONN_, CONNECTED);
+   if (m_autoPlugin != NULL && m_autoPlugin->m_selector.IsRunning()) {
+      m_autoPlugin->m_selector.CheckTimeout();
    }
-
-   static char str[32];
-   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", connState);
-   return str;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCManager::ChannelStateToStr --
+ * RPCManager::StartPumpThread --
  *
- *    Converts the VDPService_ChannelState into a user readable
- *    string.
+ *    Starts the dedicated RPC pump thread.  The pump calls into the
+ *    channel of the given plugin instance, and on the server it also
+ *    polls it.
  *
  * Results:
- *    User readable string representation of chanState.
+ *    Returns true if the pump thread is running.
  *
  * Side Effects:
- *    None.
+ *    From now on InvokeMessage() queues the messages for the pump.
  *
  *----------------------------------------------------------------------
  */
 
-const char*
-RPCManager::ChannelStateToStr(VDPService_ChannelState chanState) //IN
+bool
+RPCManager::StartPumpThread(RPCPluginInstance* rpcPlugin)  // IN
 {
-   switch(chanState)
-   {
-   CASE_RETURN(VDP_SERVICE_CHAN_, UNINITIALIZED);
-   CASE_RETURN(VDP_SERVICE_CHAN_, DISCONNECTED);
-   CASE_RETURN(VDP_SERVICE_CHAN_, PENDING);
-   CASE_RETURN(VDP_SERVICE_CHAN_, CONNECTED);
+   FUNCTION_TRACE;
+
+   if (!m_initialized) {
+      FUNCTION_EXIT_MSG("Not initialized");
+      return false;
    }
 
-   static char str[32];
-   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", chanState);
-   return str;
+   if (m_pumpRunning) {
+      FUNCTION_EXIT_MSG("Pump thread already running");
+      return true;
+   }
+
+   m_pumpPollsChannel = IsServer() && rpcPlugin != NULL;
+   m_pumpChannel = rpcPlugin != NULL ? rpcPlugin->m_hChannel : NULL;
+   m_pumpDispatcher = 0;
+   m_pumpStop = false;
+   m_pumpSleeping = false;
+   m_pumpWakeRequested = false;
+   m_pumpRunning = true;
+
+   try {
+      m_pumpThread = std::thread(&RPCManager::PumpThreadMain, this);
+   } catch (...) {
+      m_pumpRunning = false;
+      FUNCTION_EXIT_MSG("Failed to create the pump thread");
+      return false;
+   }
+
+   FUNCTION_EXIT_MSG("Pump thread started%s",
+                     m_pumpPollsChannel ? " (polling the channel)" : "");
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCManager::ChannelObjectStateToStr --
+ * RPCManager::StopPumpThread --
  *
- *    Converts the VDPRPC_ObjectState into a user readable
- *    string.
+ *    Stops the pump thread after it has sent all the queued messages.
+ *    Must not be called from the pump thread itself.
  *
  * Results:
- *    User readable string representation of objState.
+ *    None.
  *
  * Side Effects:
- *    None.
+ *    InvokeMessage() goes straight to the channel object again.
  *
  *----------------------------------------------------------------------
  */
 
-const char*
-RPCManager::ChannelObjectStateToStr(VDPRPC_ObjectState objState) //IN
+void
+RPCManager::StopPumpThread()
 {
-   switch(objState)
-   {
-   CASE_RETURN(VDP_RPC_OBJ_, UNINITIALIZED);
-   CASE_RETURN(VDP_RPC_OBJ_, DISCONNECTED);
-   CASE_RETURN(VDP_RPC_OBJ_, PENDING);
-   CASE_RETURN(VDP_RPC_OBJ_, CONNECTED);
-   CASE_RETURN(VDP_RPC_OBJ_, SIDE_CHANNEL_PENDING);
-   CASE_RETURN(VDP_RPC_OBJ_, SIDE_CHANNEL_CONNECTED);
-   default:
-      break;
+   if (!m_pumpThread.joinable()) {
+      return;
    }
 
-   static char str[32];
-   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", objState);
-   return str;
+   VM_ASSERT(std::this_thread::get_id() != m_pumpThreadId);
+   FUNCTION_TRACE;
+
+   m_pumpStop = true;
+   PumpWake();
+   m_pumpThread.join();
+
+   m_pumpRunning = false;
+   m_pumpPollsChannel = false;
+   m_pumpChannel = NULL;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * Class RPCPluginInstance
+ * RPCManager::PumpThreadMain --
+ *
+ *    Body of the pump thread.  Sends the queued messages and gives RPC
+ *    its timeslices until StopPumpThread() is called.
+ *
+ *    When the channel interface has the blocking v3 Poll() the thread
+ *    sleeps inside Poll() and a local job is used to wake it up when a
+ *    message is queued.  Otherwise it waits on a condition variable,
+ *    with a short timeout if it also has to poll the channel.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
-RPCPluginInstance::RPCPluginInstance(RPCManager *rpcManagerPtr)
-   : m_rpcManager(rpcManagerPtr),
-     m_hChannel(NULL),
-     m_hChannelObj(NULL),
-     m_hChannelSink(VDP_SERVICE_INVALID_SINK_HANDLE),
-     m_connectRequested(false),
-     m_connected(false),
-     m_sideChannelPending(false),
-     m_isReady(false),
-     m_pendingMsgCount(0),
-     m_socketHandle((int)INVALID_SOCKET),
-     m_channelObjOptions(0)
+
+void
+RPCManager::PumpThreadMain()
 {
-   InitializeEventsAndMutexes();
+   m_pumpThreadId = std::this_thread::get_id();
+   LOG("Pump thread 0x%x running", (uint32)(uintptr_t)GetCurrentThreadId());
 
-   LOG("RPCPluginInstance 0x%x created", this);
-}
+   /*
+    * PumpDrain() invokes the messages on this thread, which the channel
+    * has to know on the client as well, only the server polls it here.
+    */
+   if (m_pumpChannel != NULL) {
+      if (m_iChannel.version >= VDP_SERVICE_CHANNEL_INTERFACE_V4 &&
+          m_iChannel.v4.ThreadInitialize != NULL) {
+         m_pumpDispatcher = m_iChannel.v4.ThreadInitialize(m_pumpChannel, 0);
+      } else {
+         m_iChannel.v1.ThreadInitialize(m_pumpChannel, 0);
+      }
+   }
 
-RPCPluginInstance::~RPCPluginInstance()
-{
-   CloseEventsAndMutexes();
+   bool blockingPoll = m_pumpPollsChannel &&
+                       m_iChannel.version >= VDP_SERVICE_CHANNEL_INTERFACE_V3 &&
+                       m_iChannel.v3.Poll != NULL;
 
-   LOG("RPCPluginInstance 0x%x destroyed", this);
+   /*
+    * Without a way to interrupt Poll() the local job dispatcher is useless.
+    */
+   if (!blockingPoll || m_iLocalJob.v1.Request == NULL) {
+      m_pumpDispatcher = 0;
+   }
+
+   uint32 msSlice = PUMP_IDLE_MS;
+   if (m_pumpPollsChannel && m_pumpDispatcher == 0) {
+      msSlice = PUMP_POLL_MS;
+   }
+
+   while (!m_pumpStop) {
+      PumpDrain();
+
+      if (m_pumpPollsChannel) {
+         CheckChannelSelection();
+      }
+
+      /*
+       * The fence after m_pumpSleeping is set pairs with the one in
+       * PumpWake(): either the queue is seen not empty here, or the
+       * producer sees the pump sleeping and wakes it up.
+       */
+      if (blockingPoll) {
+         m_pumpSleeping = true;
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (m_pumpQueue.IsEmpty() && !m_pumpStop) {
+            m_iChannel.v3.Poll((int)msSlice);
+         }
+         m_pumpSleeping = false;
+      } else {
+         if (m_pumpPollsChannel) {
+            m_iChannel.v1.Poll();
+         }
+
+         std::unique_lock<std::mutex> lock(m_pumpMutex);
+         m_pumpSleeping = true;
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (m_pumpQueue.IsEmpty() && !m_pumpStop) {
+            m_pumpCond.wait_for(lock, std::chrono::milliseconds(msSlice));
+         }
+         m_pumpSleeping = false;
+      }
+   }
+
+   PumpDrain();
+
+   if (m_pumpChannel != NULL) {
+      m_iChannel.v1.ThreadUninitialize();
+   }
+
+   m_pumpDispatcher = 0;
+   LOG("Pump thread 0x%x exiting", (uint32)(uintptr_t)GetCurrentThreadId());
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelObjectInterface --
+ * RPCManager::PumpSubmit --
  *
- *    Returns the channel Object interface.
+ *    Queues a message for the pump thread, callable from any thread.
  *
  * Results:
- *    Pointer to VDPRPC_ChannelObjectInterface.
+ *    None.
  *
  * Side Effects:
- *    None.
+ *    The pump thread is woken up if it is waiting.
  *
  *----------------------------------------------------------------------
  */
 
-const VDPRPC_ChannelObjectInterface*
-RPCPluginInstance::ChannelObjectInterface()
+void
+RPCManager::PumpSubmit(RPCPluginInstance* rpcPlugin, // IN
+                       void* messageCtx)             // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   return &rpcManager->m_iChannelObj;
+   PumpItem item;
+   item.plugin = rpcPlugin;
+   item.messageCtx = messageCtx;
+
+   rpcPlugin->m_pumpQueued++;
+   m_pumpQueue.Push(item);
+   PumpWake();
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelContextInterface --
+ * RPCManager::PumpWake --
  *
- *    Returns the channel context interface.
+ *    Wakes the pump thread up if it is waiting for work.
  *
  * Results:
- *    Pointer to VDPRPC_ChannelContextInterface.
+ *    None.
  *
  * Side Effects:
  *    None.
@@ -1204,23 +1490,39 @@ RPCPluginInstance::ChannelObjectInterface()
  *----------------------------------------------------------------------
  */
 
-const VDPRPC_ChannelContextInterface*
-RPCPluginInstance::ChannelContextInterface()
+void
+RPCManager::PumpWake()
 {
-   RPCManager* rpcManager = GetRPCManager();
-   return &rpcManager->m_iChannelCtx;
+   /*
+    * Orders the push of the caller before the load of m_pumpSleeping,
+    * see PumpThreadMain().
+    */
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (!m_pumpSleeping) {
+      return;
+   }
+
+   if (m_pumpDispatcher != 0) {
+      if (!m_pumpWakeRequested.exchange(true)) {
+         m_iLocalJob.v1.Request(m_pumpDispatcher, PumpWakeJob, this);
+      }
+   } else {
+      std::lock_guard<std::mutex> lock(m_pumpMutex);
+      m_pumpCond.notify_one();
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::VariantInterface --
+ * RPCManager::PumpWakeJob --
  *
- *    Returns the variant interface.
+ *    Local job requested by PumpWake().  Running it is enough to make
+ *    the blocking Poll() of the pump thread return.
  *
  * Results:
- *    Pointer to VDPRPC_VariantInterface.
+ *    TRUE.
  *
  * Side Effects:
  *    None.
@@ -1228,314 +1530,3875 @@ RPCPluginInstance::ChannelContextInterface()
  *----------------------------------------------------------------------
  */
 
-const VDPRPC_VariantInterface*
-RPCPluginInstance::VariantInterface()
+Bool
+RPCManager::PumpWakeJob(void* userData)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   return &rpcManager->m_iVariant;
+   RPCManager* rpcManager = static_cast<RPCManager*>(userData);
+   rpcManager->m_pumpWakeRequested = false;
+   return TRUE;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VDPRPC_StreamDataInterface* StreamDataInterface --
+ * RPCManager::PumpDrain --
  *
- *    Returns the StreamData interface.
+ *    Invokes every queued message, pump thread only.  A message that
+ *    cannot be invoked is destroyed and reported through OnAbort()
+ *    because its sender has already given up ownership.
  *
  * Results:
- *    Pointer to VDPRPC_StreamDataInterface.
+ *    None.
  *
  * Side Effects:
- *    None.
+ *    The callers of PumpFlush() are woken up if anything was invoked.
  *
  *----------------------------------------------------------------------
  */
 
-const VDPRPC_StreamDataInterface*
-RPCPluginInstance::StreamDataInterface()
+void
+RPCManager::PumpDrain()
 {
-   RPCManager* rpcManager = GetRPCManager();
+   PumpItem item;
+   bool drained = false;
 
-   return &rpcManager->m_iStreamData;
+   while (m_pumpQueue.Pop(&item)) {
+      RPCPluginInstance* rpcPlugin = item.plugin;
+
+      if (!rpcPlugin->InvokeQueuedMessage(item.messageCtx)) {
+         uint32 requestCtxId = m_iChannelCtx.v1.GetId(item.messageCtx);
+         rpcPlugin->DestroyMessage(item.messageCtx);
+         OnMsgAbort(rpcPlugin, requestCtxId, FALSE, 0);
+      }
+
+      rpcPlugin->m_pumpQueued--;
+      drained = true;
+   }
+
+   if (drained && m_pumpFlushWaiters > 0) {
+      std::lock_guard<std::mutex> lock(m_pumpFlushMutex);
+      m_pumpFlushCond.notify_all();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::PumpFlush --
+ *
+ *    Waits until the pump thread has handed all the queued messages of
+ *    the given plugin instance to RPC, so the instance can be destroyed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCManager::PumpFlush(RPCPluginInstance* rpcPlugin)  // IN
+{
+   if (!m_pumpRunning) {
+      return;
+   }
+
+   if (std::this_thread::get_id() == m_pumpThreadId) {
+      PumpDrain();
+      return;
+   }
+
+   /*
+    * m_pumpFlushWaiters is raised before m_pumpQueued is checked, and
+    * PumpDrain() lowers m_pumpQueued before it checks the waiters, so
+    * one of the two always sees the other.  The timeout only guards
+    * against the pump thread going away.
+    */
+   m_pumpFlushWaiters++;
+   PumpWake();
+
+   {
+      std::unique_lock<std::mutex> lock(m_pumpFlushMutex);
+      while (rpcPlugin->m_pumpQueued > 0 && m_pumpThread.joinable()) {
+         m_pumpFlushCond.wait_for(lock, std::chrono::milliseconds(PUMP_IDLE_MS));
+      }
+   }
+
+   m_pumpFlushWaiters--;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::ConnectionStateToStr --
+ *
+ *    Converts the VDPService_ConnectionState into a user readable
+ *    string.
+ *
+ * Results:
+ *    User readable string representation of connState.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCManager::ConnectionStateToStr(VDPService_ConnectionState connState) //IN
+{
+   switch(connState)
+   {
+   CASE_RETURN(VDP_SERVICE_CONN_, UNINITIALIZED);
+   CASE_RETURN(VDP_SERVICE_CONN_, DISCONNECTED);
+   CASE_RETURN(VDP_SERVICE_CONN_, PENDING);
+   CASE_RETURN(VDP_SERVICE_CONN_, CONNECTED);
+   }
+
+   static char str[32];
+   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", connState);
+   return str;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::ChannelStateToStr --
+ *
+ *    Converts the VDPService_ChannelState into a user readable
+ *    string.
+ *
+ * Results:
+ *    User readable string representation of chanState.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCManager::ChannelStateToStr(VDPService_ChannelState chanState) //IN
+{
+   switch(chanState)
+   {
+   CASE_RETURN(VDP_SERVICE_CHAN_, UNINITIALIZED);
+   CASE_RETURN(VDP_SERVICE_CHAN_, DISCONNECTED);
+   CASE_RETURN(VDP_SERVICE_CHAN_, PENDING);
+   CASE_RETURN(VDP_SERVICE_CHAN_, CONNECTED);
+   }
+
+   static char str[32];
+   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", chanState);
+   return str;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::ChannelObjectStateToStr --
+ *
+ *    Converts the VDPRPC_ObjectState into a user readable
+ *    string.
+ *
+ * Results:
+ *    User readable string representation of objState.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCManager::ChannelObjectStateToStr(VDPRPC_ObjectState objState) //IN
+{
+   switch(objState)
+   {
+   CASE_RETURN(VDP_RPC_OBJ_, UNINITIALIZED);
+   CASE_RETURN(VDP_RPC_OBJ_, DISCONNECTED);
+   CASE_RETURN(VDP_RPC_OBJ_, PENDING);
+   CASE_RETURN(VDP_RPC_OBJ_, CONNECTED);
+   CASE_RETURN(VDP_RPC_OBJ_, SIDE_CHANNEL_PENDING);
+   CASE_RETURN(VDP_RPC_OBJ_, SIDE_CHANNEL_CONNECTED);
+   default:
+      break;
+   }
+
+   static char str[32];
+   _snprintf_s(str, ARRAYSIZE(str), _TRUNCATE, "unknown%d", objState);
+   return str;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCPluginInstance
+ *
+ *----------------------------------------------------------------------
+ */
+RPCPluginInstance::RPCPluginInstance(RPCManager *rpcManagerPtr)
+   : m_rpcManager(rpcManagerPtr),
+     m_hChannel(NULL),
+     m_hChannelObj(NULL),
+     m_hChannelSink(VDP_SERVICE_INVALID_SINK_HANDLE),
+     m_connectRequested(false),
+     m_connected(false),
+     m_sideChannelPending(false),
+     m_isReady(false),
+     m_pendingMsgCount(0),
+     m_pendingMsgBytes(0),
+     m_creditMaxMsgs(0),
+     m_creditMaxBytes(0),
+     m_creditBlocked(false),
+     m_creditEvent(NULL),
+     m_socketHandle((int)INVALID_SOCKET),
+     m_channelObjOptions(0),
+     m_peerCaps(0),
+     m_trafficClass(RPC_TRAFFIC_INTERACTIVE),
+     m_sessionId((DWORD)VDP_CURRENT_SESSION),
+     m_sessionWorker(-1),
+     m_batchStop(false),
+     m_batchMaxDelayUs(0),
+     m_batchMaxBytes(0),
+     m_batchCtx(NULL),
+     m_batchBytes(0),
+     m_laneWindow(0),
+     m_laneChunkBytes(0),
+     m_laneInFlightBytes(0),
+     m_laneSending(false),
+     m_journalMaxMsgs(0),
+     m_journalMaxBytes(0),
+     m_journalSeq(0),
+     m_journalBytes(0),
+     m_peerJournalEpoch(0),
+     m_peerJournalSeq(0),
+     m_pumpQueued(0)
+{
+   InitializeEventsAndMutexes();
+
+   /*
+    * The peer instance can outlive this one, a new epoch tells it that
+    * our journal sequence numbers start over.
+    */
+   m_journalEpoch = (uint32)std::chrono::steady_clock::now().time_since_epoch().count() ^
+                    (uint32)(uintptr_t)this;
+   if (m_journalEpoch == 0) {
+      m_journalEpoch = 1;
+   }
+   m_journalStats = RPCJournalStats();
+
+   LOG("RPCPluginInstance 0x%x created", this);
+}
+
+RPCPluginInstance::~RPCPluginInstance()
+{
+   StopBatchThread();
+   AbortJournal(true);
+   AbortAllAsync();
+   CloseEventsAndMutexes();
+
+   LOG("RPCPluginInstance 0x%x destroyed", this);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelObjectInterface --
+ *
+ *    Returns the channel Object interface.
+ *
+ * Results:
+ *    Pointer to VDPRPC_ChannelObjectInterface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPRPC_ChannelObjectInterface*
+RPCPluginInstance::ChannelObjectInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   return &rpcManager->m_iChannelObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelContextInterface --
+ *
+ *    Returns the channel context interface.
+ *
+ * Results:
+ *    Pointer to VDPRPC_ChannelContextInterface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPRPC_ChannelContextInterface*
+RPCPluginInstance::ChannelContextInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   return &rpcManager->m_iChannelCtx;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::VariantInterface --
+ *
+ *    Returns the variant interface.
+ *
+ * Results:
+ *    Pointer to VDPRPC_VariantInterface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPRPC_VariantInterface*
+RPCPluginInstance::VariantInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   return &rpcManager->m_iVariant;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VDPRPC_StreamDataInterface* StreamDataInterface --
+ *
+ *    Returns the StreamData interface.
+ *
+ * Results:
+ *    Pointer to VDPRPC_StreamDataInterface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPRPC_StreamDataInterface*
+RPCPluginInstance::StreamDataInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   return &rpcManager->m_iStreamData;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VDPService_ObserverInterface* VdpObserverInterface --
+ *
+ *    Returns the vdp observer interface.
+ *
+ * Results:
+ *    Pointer to VDPService_ObserverInterface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPService_ObserverInterface*
+RPCPluginInstance::VdpObserverInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   return &rpcManager->m_iVdpObserverInterface;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OverlayGuestInterface --
+ *
+ *    Returns the overlay guest interface.
+ *
+ * Results:
+ *    Pointer to VDPOverlayGuest_Interface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPOverlayGuest_Interface*
+RPCPluginInstance::OverlayGuestInterface()
+{
+   RPCManager *rpcManager = GetRPCManager();
+   if (!rpcManager->AllowRunAsServer()) {
+      LOG("Cannot use overlay guest interface due to server "
+          "not being supported.");
+      return NULL;
+   }
+   return &rpcManager->m_iOverlayGuest;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OverlayClientInterface --
+ *
+ *    Returns the overlay client interface.
+ *
+ * Results:
+ *    Pointer to VDPOverlayClient_Interface.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VDPOverlayClient_Interface*
+RPCPluginInstance::OverlayClientInterface()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   return &rpcManager->m_iOverlayClient;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::GetChannelType --
+ *
+ *    Returns ping channel type.
+ *
+ * Results:
+ *    type of channel.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const VdpServiceChannelType
+RPCPluginInstance::GetChannelType()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   return rpcManager->m_channelType;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::WaitUntilReady --
+ *
+ *    Messages can only be sent to the peer when the RPCManager
+ *    is ready.  This method will block until either the timeout
+ *    occurs or the ready event is signaled.
+ *
+ * Results:
+ *    true if the ready event was signaled.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::WaitUntilReady(uint32 msTimeout) // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+   FUNCTION_TRACE_MSG("timeout %d", msTimeout);
+
+   bool ok = rpcManager->WaitForEvent(m_hReadyEvent, msTimeout);
+
+   FUNCTION_EXIT_MSG(ok ? "Ready" : "Not ready");
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::RegisterChannelSink --
+ *
+ *    Registers the RPCManager channel sink callbacks for the
+ *    given channel.
+ *
+ * Results:
+ *    true if the callbacks were successfully registered.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::RegisterChannelSink(void* hChannel) // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+   FUNCTION_TRACE;
+
+   /*
+    * Make sure that were aren't already registered
+    */
+   if (m_hChannelSink != (uint32)VDP_SERVICE_INVALID_SINK_HANDLE) {
+      FUNCTION_EXIT_MSG("Channel sink already registered");
+      return true;
+   }
+
+   if (!rpcManager->m_iChannel.v1.
+         RegisterChannelNotifySink(&rpcManager->m_channelSink,
+                                   (void*)this,
+                                   &m_hChannelSink)) {
+      FUNCTION_EXIT_MSG("Channel.v1.RegisterChannelNotifySink() failed");
+      return false;
+   }
+
+   m_hChannel = hChannel;
+   LOG("Channel.v1.RegisterChannelNotifySink() [OK]");
+
+
+   /*
+    * I'll simulate a connect callback if we are already connected
+    */
+   if (rpcManager->m_iChannel.v1.
+         GetConnectionState() == VDP_SERVICE_CONN_CONNECTED) {
+      VDPService_ConnectionState cs = VDP_SERVICE_CONN_CONNECTED;
+      LOG("Simulating connect callback");
+      RPCManager::OnConnectionStateChanged((void*)this, cs, cs, NULL);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::UnregisterChannelSink --
+ *
+ *    Unregisters the RPCManager channel sink callbacks for the
+ *    given channel.
+ *
+ * Results:
+ *    true if the callbacks were successfully unregistered.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::UnregisterChannelSink()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   bool ok = true;
+   FUNCTION_TRACE;
+
+   /*
+    * Make sure that were are registered
+    */
+   if (m_hChannelSink == (uint32)VDP_SERVICE_INVALID_SINK_HANDLE) {
+      FUNCTION_EXIT_MSG("Channel sink not registered");
+      return true;
+   }
+
+   /*
+    * I'll simulate a disconnect callback if we are still connected
+    */
+   if (rpcManager->m_iChannel.v1.
+         GetConnectionState() == VDP_SERVICE_CONN_CONNECTED) {
+      VDPService_ConnectionState cs = VDP_SERVICE_CONN_DISCONNECTED;
+      LOG("Simulating disconnect callback");
+      RPCManager::OnConnectionStateChanged((void*)this, cs, cs, NULL);
+   }
+
+   if (!rpcManager->m_iChannel.v1.
+         UnregisterChannelNotifySink(m_hChannelSink)) {
+      FUNCTION_EXIT_MSG("Channel.v1.UnregisterChannelNotifySink() failed");
+      ok = false;
+   } else {
+      FUNCTION_EXIT_MSG("Channel.v1.UnregisterChannelNotifySink() [OK]");
+   }
+
+   m_hChannel = NULL;
+   m_hChannelSink = VDP_SERVICE_INVALID_SINK_HANDLE;
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelConnect --
+ *
+ *    Connects the underlying channel for this application/plugin pair.
+ *
+ * Results:
+ *    true if the connect call succeeded.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::ChannelConnect()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   FUNCTION_TRACE;
+
+   if (!rpcManager->m_iChannel.v1.Connect()) {
+      FUNCTION_EXIT_MSG("Channel.v1.Connect() failed");
+      return false;
+   }
+
+   FUNCTION_EXIT_MSG("Channel.v1.Connect() [OK]");
+   m_connectRequested = true;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelDisconnect --
+ *
+ *    Disconnects the underlying channel for this application/plugin pair.
+ *
+ * Results:
+ *    true if the disconnect call succeeded.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::ChannelDisconnect()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   bool ok = true;
+   FUNCTION_TRACE;
+
+   if (m_connectRequested) {
+      if (!rpcManager->m_iChannel.v1.Disconnect()) {
+         LOG("Channel.v1.Disconnect() failed");
+         ok = false;
+      } else {
+         LOG("Channel.v1.Disconnect() [OK]");
+      }
+   }
+
+   OnChannelDisconnected();
+   return ok;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelTypeInvoke --
+ *
+ *    Callback to notify that the channel type message is received.
+ *    It should only happen on client side.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    1) The OnReady() callback will be fired and the m_hReadyEvent will
+ *       be set for main channel.
+ *    2) Otherwise sidechannel request will be issued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelTypeInvoke(void* messageCtx)             // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+   const VDPRPC_ChannelObjectInterface *iChannelObj = ChannelObjectInterface();
+   const VDPRPC_ChannelContextInterface *iChannelCtx = ChannelContextInterface();
+
+   char cmd[32];
+   iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd);
+
+   if (strcmp(cmd, VDP_PING_CHANNEL) == 0) {
+      RPCVariant var(this);
+      if (iChannelCtx->v1.GetParam(messageCtx, 0, &var) &&
+          var.vt == VDP_RPC_VT_UI4) {
+
+         // receive channel type from agent.
+         rpcManager->SetChannelType((VdpServiceChannelType) var.ulVal);
+
+         /*
+          * Newer agents add their capabilities, answer with ours.  Old
+          * agents ignore the return value.
+          */
+         RPCVariant caps(this);
+         const VDPRPC_VariantInterface *iVariant = VariantInterface();
+         if (iChannelCtx->v1.GetParamCount(messageCtx) > 1 &&
+             iChannelCtx->v1.GetParam(messageCtx, 1, &caps) &&
+             caps.vt == VDP_RPC_VT_UI4) {
+            m_peerCaps = caps.ulVal;
+         }
+         LOG("Peer capabilities 0x%x.", (uint32)m_peerCaps);
+
+         RPCVariant names(this);
+         if (iChannelCtx->v1.GetParamCount(messageCtx) > 2 &&
+             iChannelCtx->v1.GetParam(messageCtx, 2, &names)) {
+            SetPeerCommands(&names);
+         }
+
+         iVariant->v1.VariantClear(&caps);
+         iVariant->v1.VariantFromUInt32(&caps, VDP_RPC_CAPS);
+         iChannelCtx->v1.AppendReturnVal(messageCtx, &caps);
+
+         // the names we accept interned, by their position.
+         std::string ourNames = m_commands.GetNames();
+         if (!ourNames.empty()) {
+            RPCScratchVariant blob;
+            blob.SetBlob(ourNames.data(), (uint32)ourNames.size());
+            iChannelCtx->v1.AppendReturnVal(messageCtx, &blob);
+         }
+
+         /*
+          * An automatic channel is moved off the main channel once
+          * measured, it is not ready again until the side channel is.
+          */
+         if (m_isReady && var.ulVal != VDPSERVICE_MAIN_CHANNEL) {
+            RMResetEvent(m_hReadyEvent);
+            m_isReady = false;
+            OnNotReady();
+         }
+
+         switch (var.ulVal) {
+         case VDPSERVICE_MAIN_CHANNEL:
+            SetReady();
+            break;
+         case VDPSERVICE_VCHAN_CHANNEL:
+            iChannelObj->v2.RequestSideChannel(m_hChannelObj,
+                                               VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP,
+                                               rpcManager->m_tokenName);
+            break;
+         case VDPSERVICE_TCP_CHANNEL:
+         case VDPSERVICE_TCPRAW_CHANNEL:
+            iChannelObj->v2.RequestSideChannel(m_hChannelObj,
+                                               VDP_RPC_SIDE_CHANNEL_TYPE_TCP,
+                                               rpcManager->m_tokenName);
+            break;
+         default:
+            LOG("Error: invalid channel type [%d].", var.ulVal);
+            break;
+         }
+      } else {
+         LOG("Error: GetParam failed [%d].", var.vt);
+      }
+   } else {
+      LOG("Discard command [%s] before channel type is received.", cmd);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelTypeDone --
+ *
+ *    The client has received the channel type message.  A client that
+ *    knows about capabilities returns its own.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelTypeDone(void* returnCtx)  // IN
+{
+   const VDPRPC_ChannelContextInterface *iChannelCtx = ChannelContextInterface();
+   RPCVariant caps(this);
+
+   if (iChannelCtx->v1.GetReturnValCount(returnCtx) > 0 &&
+       iChannelCtx->v1.GetReturnVal(returnCtx, 0, &caps) &&
+       caps.vt == VDP_RPC_VT_UI4) {
+      m_peerCaps = caps.ulVal;
+   }
+
+   LOG("Peer capabilities 0x%x.", (uint32)m_peerCaps);
+
+   RPCVariant names(this);
+   if (iChannelCtx->v1.GetReturnValCount(returnCtx) > 1 &&
+       iChannelCtx->v1.GetReturnVal(returnCtx, 1, &names)) {
+      SetPeerCommands(&names);
+   }
+
+   /*
+    * The channel of VDPSERVICE_AUTO_CHANNEL is measured once the peer
+    * has answered on the main channel.  The VDP_PING_CHANNEL that then
+    * moves it elsewhere does not start another measurement.
+    */
+   RPCManager* rpcManager = GetRPCManager();
+   if (rpcManager->m_autoPlugin == this && !m_isReady &&
+       rpcManager->m_channelType == VDPSERVICE_MAIN_CHANNEL &&
+       !m_selector.IsRunning()) {
+      m_selector.Start(this);
+   }
+
+   if (m_isReady) {
+      ReplayJournal();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetPeerCommands --
+ *
+ *    Interns the named commands the peer listed in the handshake.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Named commands known to both sides are sent as numbers from now on.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::SetPeerCommands(const VDP_RPC_VARIANT* names)  // IN
+{
+   if (names->vt != VDP_RPC_VT_BLOB || names->blobVal.blobData == NULL ||
+       (m_peerCaps & VDP_RPC_CAP_INTERN) == 0) {
+      return;
+   }
+
+   int interned = m_commands.SetPeerNames(names->blobVal.blobData,
+                                          names->blobVal.size);
+   LOG("%d named commands interned.", interned);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::RegisterCommands --
+ *
+ *    Sets up the command table, see RPCCommandTable.  Must be called
+ *    before the channel connects, typically from the constructor.
+ *
+ * Results:
+ *    false if the table is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::RegisterCommands(const RPCCommandEntry* entries,  // IN
+                                    int count)                       // IN
+{
+   if (!m_commands.Build(entries, count)) {
+      m_commands.Build(NULL, 0);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::DeliverInvoke --
+ *
+ *    Hands a message from the peer to its handler in the command table
+ *    or, if it has none, to OnInvoke().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::DeliverInvoke(void* messageCtx)  // IN
+{
+   if (!m_commands.Dispatch(this, ChannelContextInterface(), messageCtx)) {
+      OnInvoke(messageCtx);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelConnected --
+ *
+ *    Callback to notify that the channel has been connected.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelConnected()
+{
+   FUNCTION_TRACE;
+   m_connected = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelDisconnected --
+ *
+ *    Callback to notify that the channel has been disconnected.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelDisconnected()
+{
+   FUNCTION_TRACE;
+
+   /*
+    * Update variables that tell me the status of the channel
+    */
+   m_connectRequested = false;
+   m_connected = false;
+
+   /*
+    * I need to destroy the channel object when the channel closes
+    */
+   ChannelObjDestroy();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelObjCreate --
+ *
+ *    Instantiates the channel object to be used by this
+ *    application/plugin pair. Note that RPCManager only supports
+ *    one channel object currently (named m_channelObjName).
+ *
+ * Results:
+ *    true if the object was created successfully.
+ *
+ * Side Effects:
+ *    A message is sent by VDPService to the peer to notify them that
+ *    the channel object has been created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::ChannelObjCreate()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   FUNCTION_TRACE;
+
+   if (m_hChannelObj != NULL) {
+      FUNCTION_EXIT_MSG("Channel object \"%s\" already created", rpcManager->m_channelObjName);
+      return true;
+   }
+
+   if (!rpcManager->m_iChannelObj.v1.
+         CreateChannelObject(rpcManager->m_channelObjName,
+                             &rpcManager->m_channelObjSink,
+                             (void*)this,
+                             (VDPRPC_ObjectConfigurationFlags) ChannelObjFlags(),
+                             &m_hChannelObj)) {
+      FUNCTION_EXIT_MSG("Failed to create channel object \"%s\"", rpcManager->m_channelObjName);
+      return false;
+   }
+
+   FUNCTION_EXIT_MSG("Channel object \"%s\" created", rpcManager->m_channelObjName);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelObjFlags --
+ *
+ *    Configuration of the channel objects, the probe objects of
+ *    RPCChannelSelector use the same.
+ *
+ *    1) For client, both encryption and compression are enabled to perform
+ *       all kind of tests.
+ *    2) For agent, app pass encryption and compression options from ServerInit.
+ *
+ * Results:
+ *    VDPRPC_ObjectConfigurationFlags.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCPluginInstance::ChannelObjFlags()
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   int flags = VDP_RPC_OBJ_CONFIG_INVOKE_ALLOW_ANY_THREAD;
+   flags |= rpcManager->m_encryptionEnabled ? VDP_RPC_OBJ_SUPPORT_ENCRYPTION : 0;
+   flags |= rpcManager->m_compressionEnabled ? VDP_RPC_OBJ_SUPPORT_COMPRESSION : 0;
+   return flags;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ChannelObjDestroy --
+ *
+ *    Destroys the channel object used by this
+ *    application/plugin pair. Note that RPCManager only supports
+ *    one channel object currently (named m_channelObjName).
+ *
+ * Results:
+ *    true if the object was destroyed successfully.
+ *
+ * Side Effects:
+ *    A message is sent by VDPService to the peer to notify them that
+ *    the channel object has been destroyed. Also, the OnNotReady()
+ *    callback will be fired (can be overridden by subclasses).
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::ChannelObjDestroy()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   bool ok = true;
+   FUNCTION_TRACE;
+
+   if (m_hChannelObj != NULL) {
+      DiscardOpenBatch();
+
+      if (!rpcManager->m_iChannelObj.v1.DestroyChannelObject(m_hChannelObj)) {
+         LOG("Failed to destroy channel object \"%s\"", rpcManager->m_channelObjName);
+         ok = false;
+      } else {
+         LOG("Channel object \"%s\" destroyed", rpcManager->m_channelObjName);
+      }
+
+      m_hChannelObj = NULL;
+   }
+
+   /*
+    * Outstanding requests died with the channel object, and so did a
+    * channel measurement.
+    */
+   m_selector.Cancel();
+   AbortAllBatches();
+   DiscardLanes();
+   ResetJournalWire();
+   AbortAllAsync();
+   ResetCredit();
+   m_peerCaps = 0;
+   m_commands.ResetPeer();
+
+   if (m_isReady) {
+      RMResetEvent(m_hReadyEvent);
+      m_isReady = false;
+      OnNotReady();
+   }
+
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelObjConnected --
+ *
+ *    Callback function to notify that the peer object has been created
+ *    and the connection is complete. This indicates that the object
+ *    can now be used to send messages to the peer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The OnReady() callback will be fired and the m_hReadyEvent will
+ *    be set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelObjConnected()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   FUNCTION_TRACE;
+
+   /*
+    * It should be ready to run ping program now.
+    *
+    * But to demostrate sending data via different channels, both
+    * agent app and client plugin need to setup the same type
+    * sidechannel if it is necessary.
+    *
+    * For common practice, it could be hard coded, regKey configured
+    * or from another channel.
+    *
+    * Here we just send a message to client via main channel before ping
+    * program start.
+    *
+    */
+
+   if (rpcManager->IsServer()) {
+      /*
+       * An automatic channel is measured again on every connection,
+       * starting from the main channel.  OnChannelTypeDone() starts
+       * the measurement.
+       */
+      bool autoChannel = rpcManager->m_autoPlugin == this;
+      if (autoChannel) {
+         m_selector.Cancel();
+         rpcManager->m_channelType = VDPSERVICE_MAIN_CHANNEL;
+      }
+
+      if (SendChannelType() && !autoChannel) {
+         ConnectChannelType();
+      }
+   } // Client need to get channel type first.
+
+   // Query channel object options (e.g compression and encryption)
+   const VDPRPC_ChannelObjectInterface* iObj = ChannelObjectInterface();
+   if (iObj->v3.GetObjectOptions != NULL) {
+      iObj->v3.GetObjectOptions(m_hChannelObj, &m_channelObjOptions);
+   }
+   LOG("Channel Object options : 0x%08x.", m_channelObjOptions);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SendChannelType --
+ *
+ *    Sends the VDP_PING_CHANNEL message with the channel type, our
+ *    capabilities and the names we accept interned to the client.
+ *
+ * Results:
+ *    true if the message was sent.
+ *
+ * Side Effects:
+ *    OnChannelTypeDone() is called with the answer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SendChannelType()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   void* messageCtx = NULL;
+
+   if (!CreateMessage(&messageCtx)) {
+      LOG("Error: cannot create channelCtx to send channel type.");
+      return false;
+   }
+
+   rpcManager->m_iChannelCtx.v1.SetNamedCommand(messageCtx, VDP_PING_CHANNEL);
+   RPCVariant var(this);
+   const VDPRPC_VariantInterface *iVariant = VariantInterface();
+   const VDPRPC_ChannelContextInterface *iChannelCtx = ChannelContextInterface();
+
+   iVariant->v1.VariantFromUInt32(&var, rpcManager->m_channelType);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
+   // older clients ignore the extra parameter and return nothing.
+   iVariant->v1.VariantClear(&var);
+   iVariant->v1.VariantFromUInt32(&var, VDP_RPC_CAPS);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
+   // and the names we accept interned, by their position.
+   std::string names = m_commands.GetNames();
+   if (!names.empty()) {
+      RPCScratchVariant blob;
+      blob.SetBlob(names.data(), (uint32)names.size());
+      iChannelCtx->v1.AppendParam(messageCtx, &blob);
+   }
+
+   /*
+    * After a successfull call to invoke, the RPC library owns
+    * the message context and will destroy it.  We only need to
+    * destroy it if InvokeMessage() fails.
+    */
+   if (!InvokeMessage(messageCtx, true)) {
+      DestroyMessage(messageCtx);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ConnectChannelType --
+ *
+ *    Gets ready on the main channel or requests the side channel of
+ *    the channel type, the client does the same when it receives it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    On the main channel the OnReady() callback will be fired and the
+ *    m_hReadyEvent will be set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::ConnectChannelType()
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   if (rpcManager->m_channelType == VDPSERVICE_MAIN_CHANNEL) {
+      SetReady();
+   } else if (rpcManager->m_channelType == VDPSERVICE_VCHAN_CHANNEL) {
+      rpcManager->m_iChannelObj.v2.RequestSideChannel(m_hChannelObj,
+                                                      VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP,
+                                                      rpcManager->m_tokenName);
+   } else { //request tcp sidechannel
+      rpcManager->m_iChannelObj.v2.RequestSideChannel(m_hChannelObj,
+                                                      VDP_RPC_SIDE_CHANNEL_TYPE_TCP,
+                                                      rpcManager->m_tokenName);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelSelected --
+ *
+ *    RPCChannelSelector has measured the candidates.  The client has
+ *    been on the main channel since the first VDP_PING_CHANNEL, it is
+ *    told about any other choice with a second one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    See ConnectChannelType().
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelSelected()
+{
+   RPCManager* rpcManager = GetRPCManager();
+   VdpServiceChannelType type = GetChannelChoice(m_trafficClass);
+
+   FUNCTION_TRACE_MSG("Channel %s selected", RPCChannelSelector::ChannelTypeToStr(type));
+
+   if (type != VDPSERVICE_MAIN_CHANNEL) {
+      rpcManager->m_channelType = type;
+      if (!SendChannelType()) {
+         return;
+      }
+   }
+
+   ConnectChannelType();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnSidechannelConnected --
+ *
+ *    Callback function to notify that sidechannel is connected.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The OnReady() callback will be fired and the m_hReadyEvent will be set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnSidechannelConnected()
+{
+   SetReady();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetReady --
+ *
+ *    The channel can be used, sends what the journal holds from the
+ *    last connection and then tells the application.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The OnReady() callback will be fired and the m_hReadyEvent will be set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::SetReady()
+{
+   /*
+    * Ready before the event, WaitUntilReady() can return on another
+    * thread, e.g. for RPCSessionManager::OpenSession().
+    */
+   m_isReady = true;
+   RMSetEvent(m_hReadyEvent);
+
+   /*
+    * On the main channel the server gets ready before the client has
+    * answered with its capabilities, OnChannelTypeDone() replays then.
+    */
+   if (m_peerCaps != 0) {
+      ReplayJournal();
+   }
+
+   OnReady();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChannelObjDisconnected --
+ *
+ *    Callback function to notify that the peer object has been destroyed.
+ *    In response, we will destroy our local object.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChannelObjDisconnected()
+{
+   FUNCTION_TRACE;
+   ChannelObjDestroy();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::CreateMessage --
+ *
+ *    Allocates a message context to be used to send an RPC to the peer.
+ *
+ * Results:
+ *    true if the message context was created successfully.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::CreateMessage(void** pMessageCtx) // OUT
+{
+   return CreateMessageCtx(pMessageCtx, false, 0, NULL, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::CreateMessage --
+ *
+ *    Same as above, the compression of the message is chosen for
+ *    <payload> by m_compressionPolicy.
+ *
+ * Results:
+ *    true if the message context was created successfully.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::CreateMessage(void** pMessageCtx,  // OUT
+                                 uint32 command,      // IN
+                                 const void* payload, // IN
+                                 uint32 payloadBytes) // IN
+{
+   return CreateMessageCtx(pMessageCtx, true, command, payload, payloadBytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::CreateMessageCtx --
+ *
+ *    Implementation of both CreateMessage().
+ *
+ * Results:
+ *    true if the message context was created successfully.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::CreateMessageCtx(void** pMessageCtx,  // OUT
+                                    bool hasPayload,     // IN
+                                    uint32 command,      // IN
+                                    const void* payload, // IN
+                                    uint32 payloadBytes) // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   if (m_hChannelObj == NULL) {
+      LOG("Failed to create message (not ready)");
+      return false;
+   }
+
+   if (m_isReady) {
+      /*
+       * Here we choose client always perform encryption and compression if possible.
+       * (because encryption and compression are always true for client). For agent, it
+       * uses configuration from user. And it is up to user to use right one for their app.
+       * Which compression, if any, is up to the policy.
+       */
+      uint32 comp = 0;
+      uint32 enc  = rpcManager->m_encryptionEnabled ? VDP_RPC_CRYPTO_AES : 0;
+
+      if (rpcManager->m_compressionEnabled) {
+         uint32 supported = m_channelObjOptions &
+                            (VDP_RPC_COMP_SNAPPY | VDP_RPC_COMP_ZLIB);
+
+         if (supported == 0) {
+            LOG("Error: vdpservice object does not support compression.");
+         } else if (hasPayload) {
+            comp = m_compressionPolicy.Choose(command, payload, payloadBytes,
+                                              supported);
+         } else {
+            comp = m_compressionPolicy.ChooseUnknown(supported);
+         }
+      }
+
+      if (enc && (m_channelObjOptions & enc) == 0) {
+         LOG("Error: vdpservice object does not support encryption.");
+      }
+
+      uint32 options = comp | (m_channelObjOptions & enc);
+
+      if (!rpcManager->m_iChannelObj.v3.CreateContext(m_hChannelObj, options, pMessageCtx)) {
+         LOG("Failed to create message (CreateContext failed)");
+         return false;
+      }
+   } else {
+      // Let Channel type message send through.
+      if (!rpcManager->m_iChannelObj.v1.CreateContext(m_hChannelObj, pMessageCtx)) {
+         LOG("Failed to create message (CreateContext failed)");
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::DestroyMessage --
+ *
+ *    Frees a message that was previously created. Note that this should
+ *    ONLY be done if a call to Invoke failed, or the message is not
+ *    going to be sent. The Invoke call will free the message if
+ *    successful.
+ *
+ * Results:
+ *    true if the message context was destroyed successfully.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::DestroyMessage(void* messageCtx) // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   if (!rpcManager->m_iChannelObj.v1.DestroyContext(messageCtx)) {
+      LOG("Failed to destroy message (DestroyContext failed)");
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::InvokeMessage --
+ *
+ *    Sends the given message to the peer.
+ *
+ * Results:
+ *    true if the message context was sent successfully.
+ *
+ * Side Effects:
+ *    If successful, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::InvokeMessage(void* messageCtx,     // IN
+                                 bool  channelTypeMsg) // IN
+{
+   if (m_hChannelObj == NULL || !(m_isReady || channelTypeMsg)) {
+      LOG("Failed to send message (not ready)");
+      return false;
+   }
+
+   if (!channelTypeMsg) {
+      uint32 requestCtxId = ChannelContextInterface()->v1.GetId(messageCtx);
+      uint32 msgBytes = MessageBytes(messageCtx);
+      AcquireCredit(requestCtxId, msgBytes, true);
+
+      if (!SubmitMessage(messageCtx, -1, msgBytes)) {
+         ReleaseCredit(requestCtxId);
+         return false;
+      }
+      return true;
+   }
+
+   return SendMessage(messageCtx, true, false);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::InvokeMessage --
+ *
+ *    Sends the given message to the peer through the given lane.
+ *
+ * Results:
+ *    true if the message context was sent (or queued) successfully.
+ *
+ * Side Effects:
+ *    If successful, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::InvokeMessage(void* messageCtx,     // IN
+                                 RPCTrafficClass lane) // IN
+{
+   if (m_hChannelObj == NULL || !m_isReady) {
+      LOG("Failed to send message (not ready)");
+      return false;
+   }
+
+   uint32 requestCtxId = ChannelContextInterface()->v1.GetId(messageCtx);
+   uint32 msgBytes = MessageBytes(messageCtx);
+   AcquireCredit(requestCtxId, msgBytes, true);
+
+   if (!SubmitMessage(messageCtx, lane, msgBytes)) {
+      ReleaseCredit(requestCtxId);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::TryInvokeMessage --
+ *
+ *    Sends the given message to the peer if the credit window allows.
+ *
+ * Results:
+ *    RPC_INVOKE_OK if the message context was sent successfully.
+ *    RPC_INVOKE_WOULD_BLOCK if the window is full.
+ *    RPC_INVOKE_FAILED on error.
+ *
+ * Side Effects:
+ *    If RPC_INVOKE_OK, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCInvokeResult
+RPCPluginInstance::TryInvokeMessage(void* messageCtx,  // IN
+                                    uint32 msgBytes)   // IN
+{
+   if (m_hChannelObj == NULL || !m_isReady) {
+      LOG("Failed to send message (not ready)");
+      return RPC_INVOKE_FAILED;
+   }
+
+   if (msgBytes == 0) {
+      msgBytes = MessageBytes(messageCtx);
+   }
+
+   uint32 requestCtxId = ChannelContextInterface()->v1.GetId(messageCtx);
+   if (!AcquireCredit(requestCtxId, msgBytes, false)) {
+      return RPC_INVOKE_WOULD_BLOCK;
+   }
+
+   if (!SubmitMessage(messageCtx, -1, msgBytes)) {
+      ReleaseCredit(requestCtxId);
+      return RPC_INVOKE_FAILED;
+   }
+
+   return RPC_INVOKE_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AttachBuffer --
+ *
+ *    Ties a pooled buffer to the message it is used by, it is released
+ *    by ReleaseCredit() when the message completes or fails to send.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AttachBuffer(void* messageCtx,     // IN
+                                RPCBuffer* buffer)    // IN
+{
+   uint32 requestCtxId = ChannelContextInterface()->v1.GetId(messageCtx);
+   m_bufferPool.Attach(buffer, requestCtxId);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SendMessage --
+ *
+ *    Hands the message to RPC (or to the pump thread).  If batching
+ *    is on and <allowBatch> is set, the message is held for the next
+ *    batch instead.
+ *
+ * Results:
+ *    true if the message context was sent successfully.
+ *
+ * Side Effects:
+ *    If successful, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SendMessage(void* messageCtx,     // IN
+                               bool  channelTypeMsg, // IN
+                               bool  allowBatch)     // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   if (allowBatch && m_batchMaxDelayUs != 0 &&
+       (m_peerCaps & VDP_RPC_CAP_BATCH) != 0 && BatchMessage(messageCtx)) {
+      return true;
+   }
+
+   if (!channelTypeMsg) {
+      /*
+       * The channel type message is sent from the RPC callback that
+       * makes us ready, so it never waits behind queued messages.
+       */
+      if (rpcManager->m_pumpRunning) {
+         rpcManager->PumpSubmit(this, messageCtx);
+         return true;
+      }
+   }
+
+   if (!rpcManager->m_iChannelObj.v1.Invoke(m_hChannelObj,
+                                            messageCtx,
+                                            &rpcManager->m_requestSink,
+                                            (void*)this)) {
+      LOG("Failed to send message (Invoke failed)");
+      return false;
+   }
+
+   return true;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::InvokeAsync --
+ *
+ *    Sends the given message to the peer.  The completion is returned
+ *    through <reply> instead of OnDone() and OnAbort().
+ *
+ * Results:
+ *    true if the message context was sent successfully.
+ *
+ * Side Effects:
+ *    If successful, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::InvokeAsync(void* messageCtx,              // IN
+                               std::future<RPCReply>* reply)  // OUT
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+
+   /*
+    * The completion can come in on another thread before Invoke()
+    * returns, so the promise has to be in the table first.
+    */
+   uint32 requestCtxId = iChannelCtx->v1.GetId(messageCtx);
+   std::promise<RPCReply> promise;
+   *reply = promise.get_future();
+
+   {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      if (!m_asyncReplies.emplace(requestCtxId, std::move(promise)).second) {
+         LOG("Failed to send message (request %u already pending)", requestCtxId);
+         *reply = std::future<RPCReply>();
+         return false;
+      }
+   }
+
+   if (!InvokeMessage(messageCtx)) {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      m_asyncReplies.erase(requestCtxId);
+      *reply = std::future<RPCReply>();
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::CompleteAsync --
+ *
+ *    Resolves the future of an InvokeAsync() request with the return
+ *    values of the peer.
+ *
+ * Results:
+ *    false if <requestCtxId> was not sent with InvokeAsync().
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::CompleteAsync(uint32 requestCtxId,  // IN
+                                 void* returnCtx)      // IN
+{
+   std::promise<RPCReply> promise;
+
+   {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      auto it = m_asyncReplies.find(requestCtxId);
+      if (it == m_asyncReplies.end()) {
+         return false;
+      }
+
+      promise = std::move(it->second);
+      m_asyncReplies.erase(it);
+   }
+
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   RPCReply reply;
+
+   reply.m_iVariant = iVariant;
+   reply.m_requestCtxId = requestCtxId;
+   reply.m_done = true;
+   reply.m_returnCode = iChannelCtx->v1.GetReturnCode(returnCtx);
+
+   int count = iChannelCtx->v1.GetReturnValCount(returnCtx);
+   reply.m_returnVals.resize(count > 0 ? count : 0);
+
+   for (int i = 0; i < count; i++) {
+      iVariant->v1.VariantInit(&reply.m_returnVals[i]);
+      iChannelCtx->v1.GetReturnVal(returnCtx, i, &reply.m_returnVals[i]);
+   }
+
+   promise.set_value(std::move(reply));
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortAsync --
+ *
+ *    Resolves the future of an InvokeAsync() request that was aborted.
+ *
+ * Results:
+ *    false if <requestCtxId> was not sent with InvokeAsync().
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::AbortAsync(uint32 requestCtxId,  // IN
+                              Bool userCancelled,   // IN
+                              uint32 reason)        // IN
+{
+   std::promise<RPCReply> promise;
+
+   {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      auto it = m_asyncReplies.find(requestCtxId);
+      if (it == m_asyncReplies.end()) {
+         return false;
+      }
+
+      promise = std::move(it->second);
+      m_asyncReplies.erase(it);
+   }
+
+   RPCReply reply;
+   reply.m_requestCtxId = requestCtxId;
+   reply.m_userCancelled = userCancelled;
+   reply.m_reason = reason;
+
+   promise.set_value(std::move(reply));
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortAllAsync --
+ *
+ *    Aborts every outstanding InvokeAsync() request, used when the
+ *    channel object goes away.  Journaled requests stay outstanding.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AbortAllAsync()
+{
+   std::unordered_map<uint32, std::promise<RPCReply> > replies;
+
+   {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      replies.swap(m_asyncReplies);
+   }
+
+   /*
+    * Journaled requests are sent again on the next connection.
+    */
+   std::unordered_map<uint32, std::promise<RPCReply> > kept;
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      for (auto it = m_journal.begin(); it != m_journal.end() && !replies.empty(); ++it) {
+         auto reply = replies.find((*it)->requestCtxId);
+         if (reply != replies.end()) {
+            kept.emplace(reply->first, std::move(reply->second));
+            replies.erase(reply);
+         }
+      }
+   }
+
+   if (!kept.empty()) {
+      std::lock_guard<std::mutex> lock(m_asyncMutex);
+      for (auto it = kept.begin(); it != kept.end(); ++it) {
+         m_asyncReplies.emplace(it->first, std::move(it->second));
+      }
+   }
+
+   if (!replies.empty()) {
+      LOG("Aborting %d outstanding request(s)", (int)replies.size());
+   }
+
+   for (auto it = replies.begin(); it != replies.end(); ++it) {
+      RPCReply reply;
+      reply.m_requestCtxId = it->first;
+      it->second.set_value(std::move(reply));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::CompleteMessage --
+ *
+ *    Completes a message the peer has processed: a journaled message
+ *    through its journal entry, any other by giving back its credit and
+ *    resolving its future or calling OnDone().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::CompleteMessage(uint32 requestCtxId,  // IN
+                                   void* returnCtx)      // IN
+{
+   if (OnJournalDone(requestCtxId, returnCtx)) {
+      return;
+   }
+
+   ReleaseCredit(requestCtxId);
+   if (!CompleteAsync(requestCtxId, returnCtx)) {
+      OnDone(requestCtxId, returnCtx);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortMessage --
+ *
+ *    Counterpart of CompleteMessage() for a message that failed to be
+ *    sent.  A journaled message is kept to be sent again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AbortMessage(uint32 requestCtxId,  // IN
+                                Bool userCancelled,   // IN
+                                uint32 reason)        // IN
+{
+   if (OnJournalAbort(requestCtxId)) {
+      return;
+   }
+
+   ReleaseCredit(requestCtxId);
+   if (!AbortAsync(requestCtxId, userCancelled, reason)) {
+      OnAbort(requestCtxId, userCancelled, reason);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::InvokeQueuedMessage --
+ *
+ *    Sends a message that InvokeMessage() queued for the pump thread.
+ *
+ * Results:
+ *    true if the message context was sent successfully.
+ *
+ * Side Effects:
+ *    If successful, the given messageCtx was destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::InvokeQueuedMessage(void* messageCtx)  // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   if (m_hChannelObj == NULL) {
+      LOG("Failed to send queued message (not ready)");
+      return false;
+   }
+
+   if (!rpcManager->m_iChannelObj.v1.Invoke(m_hChannelObj,
+                                            messageCtx,
+                                            &rpcManager->m_requestSink,
+                                            (void*)this)) {
+      LOG("Failed to send queued message (Invoke failed)");
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::WaitForPendingMessages --
+ *
+ *    This method waits for the peer to process and respond to all
+ *    messages before returning.  While waiting it ensures that RPC
+ *    is being given timeslices so that it can do its work.
+ *
+ * Results:
+ *    This method returns TRUE if all pending messages have been
+ *    processed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::WaitForPendingMessages(uint32 msTimeout)  // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   FlushBatch();
+
+   /*
+    * WaitForEvent calls Poll() which will ASSERT for TCPRAW channels
+    */
+   if (rpcManager->m_channelType == VDPSERVICE_TCPRAW_CHANNEL) {
+      LOG("Channel type is TCPRAW, skipping wait");
+   } else {
+      rpcManager->WaitForEvent(m_pendingMsgEvent, msTimeout);
+   }
+
+   if (m_pendingMsgCount != 0) {
+      const char* s = m_pendingMsgCount == 1 ? "" : "s";
+      LOG("%d message%s still pending", m_pendingMsgCount, s);
+      ResetCredit();
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::WaitForCredit --
+ *
+ *    Waits for a message that TryInvokeMessage() refused to fit in the
+ *    credit window again.  While waiting it ensures that RPC is being
+ *    given timeslices so that it can do its work.
+ *
+ * Results:
+ *    true if there is credit again.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::WaitForCredit(uint32 msTimeout)  // IN
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   /*
+    * WaitForEvent calls Poll() which will ASSERT for TCPRAW channels
+    */
+   if (rpcManager->m_channelType == VDPSERVICE_TCPRAW_CHANNEL) {
+      return !m_creditBlocked;
+   }
+
+   return rpcManager->WaitForEvent(m_creditEvent, msTimeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BatchVariantSize --
+ *
+ *    Rough wire size of a variant, used for the batch byte limit.
+ *
+ * Results:
+ *    Number of bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+BatchVariantSize(const VDP_RPC_VARIANT* var)  // IN
+{
+   switch (var->vt) {
+   case VDP_RPC_VT_LPSTR:
+      return var->strVal != NULL ? (uint32)strlen(var->strVal) + 1 : 1;
+   case VDP_RPC_VT_BLOB:
+      return var->blobVal.size;
+   default:
+      return sizeof(uint64);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetBatching --
+ *
+ *    Turns the coalescing of sent messages on or off.  Turning it off
+ *    sends whatever is held right away.
+ *
+ * Results:
+ *    false if the parameters are invalid.
+ *
+ * Side effects:
+ *    Starts or stops the thread that sends a batch when its delay is
+ *    up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SetBatching(uint32 maxDelayUs,  // IN
+                               uint32 maxBytes)    // IN
+{
+   if (maxDelayUs == 0 && maxBytes != 0) {
+      LOG("Error: batching needs a delay.");
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      m_batchMaxDelayUs = maxDelayUs;
+      m_batchMaxBytes = maxBytes;
+      if (maxDelayUs == 0) {
+         m_postedMsgs.clear();
+      }
+   }
+
+   if (maxDelayUs == 0) {
+      FlushBatch();
+      StopBatchThread();
+      LOG("Batching off");
+      return true;
+   }
+
+   if (!m_batchThread.joinable()) {
+      m_batchStop = false;
+      m_batchThread = std::thread(&RPCPluginInstance::BatchThreadMain, this);
+   }
+
+   LOG("Batching up to %uus, %u bytes (peer %s)", maxDelayUs, maxBytes,
+       (m_peerCaps & VDP_RPC_CAP_BATCH) != 0 ? "supports it" : "unknown yet");
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::BatchMessage --
+ *
+ *    Copies the command and parameters of a message into the open batch.
+ *    The message context itself is kept to report its completion.  A
+ *    message posted with SetPostMode(), or sent while nothing else is in
+ *    flight and no batch is open, is not batched.
+ *
+ *    Each message is laid out in the batch parameters as
+ *       LPSTR  named command ("" if the command is an index)
+ *       UI4    command index
+ *       UI4    parameter count
+ *       ...    parameters
+ *
+ * Results:
+ *    false if the message was not batched and has to be sent as is.
+ *
+ * Side effects:
+ *    The batch is sent if it reached the byte limit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::BatchMessage(void* messageCtx)  // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   std::unique_lock<std::mutex> lock(m_batchMutex);
+
+   if (m_batchMaxDelayUs == 0) {
+      return false;
+   }
+
+   if (!m_postedMsgs.empty() &&
+       m_postedMsgs.erase(iChannelCtx->v1.GetId(messageCtx)) != 0) {
+      return false;
+   }
+
+   if (m_batchCtx == NULL) {
+      /*
+       * The credit of this message is already taken, so it is alone
+       * when the count is 1.  No completion would flush a batch then.
+       */
+      RMLockMutex(m_pendingMsgMutex);
+      bool idle = m_pendingMsgCount <= 1;
+      RMUnlockMutex(m_pendingMsgMutex);
+
+      if (idle) {
+         return false;
+      }
+
+      if (!CreateMessage(&m_batchCtx)) {
+         m_batchCtx = NULL;
+         return false;
+      }
+
+      if ((m_peerCaps & VDP_RPC_CAP_INTERN) != 0) {
+         iChannelCtx->v1.SetCommand(m_batchCtx, VDP_RPC_BATCH_ID);
+      } else {
+         iChannelCtx->v1.SetNamedCommand(m_batchCtx, VDP_RPC_BATCH);
+      }
+      m_batchBytes = 0;
+      m_batchDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::microseconds(m_batchMaxDelayUs);
+      m_batchCond.notify_one();
+   }
+
+   char cmd[64];
+   if (!iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd)) {
+      cmd[0] = '\0';
+   }
+
+   RPCVariant var(this);
+   int count = iChannelCtx->v1.GetParamCount(messageCtx);
+
+   iVariant->v1.VariantFromStr(&var, cmd);
+   iChannelCtx->v1.AppendParam(m_batchCtx, &var);
+   iVariant->v1.VariantClear(&var);
+
+   iVariant->v1.VariantFromUInt32(&var, iChannelCtx->v1.GetCommand(messageCtx));
+   iChannelCtx->v1.AppendParam(m_batchCtx, &var);
+
+   iVariant->v1.VariantFromUInt32(&var, (uint32)count);
+   iChannelCtx->v1.AppendParam(m_batchCtx, &var);
+
+   uint32 bytes = (uint32)strlen(cmd) + 1 + 2 * sizeof(uint32);
+
+   for (int i = 0; i < count; i++) {
+      /*
+       * A parameter that cannot be copied still takes its slot, an
+       * empty variant keeps the layout intact.
+       */
+      iVariant->v1.VariantInit(&var);
+      if (!iChannelCtx->v1.GetParam(messageCtx, i, &var)) {
+         LOG("Error: cannot copy parameter %d into batch.", i);
+      }
+      bytes += BatchVariantSize(&var);
+      iChannelCtx->v1.AppendParam(m_batchCtx, &var);
+      iVariant->v1.VariantClear(&var);
+   }
+
+   m_batchBytes += bytes;
+   m_batchMsgs.push_back(messageCtx);
+
+   bool full = m_batchMaxBytes != 0 && m_batchBytes >= m_batchMaxBytes;
+   lock.unlock();
+
+   if (full) {
+      FlushBatch();
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::FlushBatch --
+ *
+ *    Sends the open batch now, if there is one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    If the batch cannot be sent, its messages are aborted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::FlushBatch()
+{
+   /*
+    * Batches have to leave in the order they were filled.
+    */
+   std::lock_guard<std::mutex> sendLock(m_batchSendMutex);
+   SendOpenBatch();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SendOpenBatch --
+ *
+ *    Sends the open batch, if there is one, with m_batchSendMutex held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    If the batch cannot be sent, its messages are aborted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::SendOpenBatch()
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   void* batchCtx;
+   uint32 batchId;
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      if (m_batchCtx == NULL) {
+         return;
+      }
+
+      batchCtx = m_batchCtx;
+      batchId = iChannelCtx->v1.GetId(batchCtx);
+      m_batchesInFlight[batchId].swap(m_batchMsgs);
+      m_batchCtx = NULL;
+      m_batchBytes = 0;
+   }
+
+   if (!SendMessage(batchCtx, false, false)) {
+      DestroyMessage(batchCtx);
+      AbortBatch(batchId, FALSE, 0);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::FlushIdleBatch --
+ *
+ *    Sends the open batch as soon as the messages it waited behind have
+ *    all completed, rather than when its delay is up.  Called by
+ *    ReleaseCredit(), so it runs on the thread that polls RPC.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::FlushIdleBatch()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      if (m_batchCtx == NULL) {
+         return;
+      }
+
+      RMLockMutex(m_pendingMsgMutex);
+      bool idle = (size_t)m_pendingMsgCount <= m_batchMsgs.size();
+      RMUnlockMutex(m_pendingMsgMutex);
+
+      if (!idle) {
+         return;
+      }
+   }
+
+   /*
+    * A flush already under way, possibly further up this very stack
+    * when it aborts a batch, sends or aborts this one as well.
+    */
+   std::unique_lock<std::mutex> sendLock(m_batchSendMutex, std::try_to_lock);
+   if (sendLock.owns_lock()) {
+      SendOpenBatch();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetPostMode --
+ *
+ *    Sets VDP_RPC_CHANNEL_CONTEXT_OPT_POST on a message to send.  A
+ *    batch cannot carry the option, so the message is kept out of them.
+ *
+ * Results:
+ *    false if the option could not be set.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SetPostMode(void* messageCtx,  // IN
+                               bool post)         // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   RPCScratchVariant var;
+
+   var.SetUInt32(post ? 1 : 0);
+   if (!iChannelCtx->v2.SetOps(messageCtx, VDP_RPC_CHANNEL_CONTEXT_OPT_POST, &var)) {
+      return false;
+   }
+
+   std::lock_guard<std::mutex> lock(m_batchMutex);
+   uint32 requestCtxId = iChannelCtx->v1.GetId(messageCtx);
+
+   if (!post) {
+      m_postedMsgs.erase(requestCtxId);
+   } else if (m_batchMaxDelayUs != 0) {
+      m_postedMsgs.insert(requestCtxId);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::BatchThreadMain --
+ *
+ *    Sends the open batch once its delay is up.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::BatchThreadMain()
+{
+   RPCManager* rpcManager = GetRPCManager();
+
+   /*
+    * FlushBatch() invokes the batch on this thread, which the channel
+    * has to know like any other thread that calls into it.
+    */
+   bool initialized = m_hChannel != NULL &&
+                      rpcManager->m_iChannel.v1.ThreadInitialize(m_hChannel, 0);
+
+   std::unique_lock<std::mutex> lock(m_batchMutex);
+
+   while (!m_batchStop) {
+      if (m_batchCtx == NULL) {
+         m_batchCond.wait(lock);
+      } else if (std::chrono::steady_clock::now() < m_batchDeadline) {
+         m_batchCond.wait_until(lock, m_batchDeadline);
+      } else {
+         lock.unlock();
+         FlushBatch();
+         lock.lock();
+      }
+   }
+
+   lock.unlock();
+   if (initialized) {
+      rpcManager->m_iChannel.v1.ThreadUninitialize();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::StopBatchThread --
+ *
+ *    Stops the thread started by SetBatching().
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::StopBatchThread()
+{
+   if (!m_batchThread.joinable()) {
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      m_batchStop = true;
+      m_batchCond.notify_one();
+   }
+
+   if (m_batchThread.get_id() == std::this_thread::get_id()) {
+      m_batchThread.detach();
+   } else {
+      m_batchThread.join();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnBatchInvoke --
+ *
+ *    Splits a VDP_RPC_BATCH message from the peer into one OnInvoke()
+ *    call per message.  The return code and values of each message are
+ *    appended to the return values of the batch as
+ *       UI4    return code
+ *       UI4    return value count
+ *       ...    return values
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnBatchInvoke(void* messageCtx)  // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   RPCManager* rpcManager = GetRPCManager();
+
+   int count = iChannelCtx->v1.GetParamCount(messageCtx);
+   int pos = 0;
+
+   while (pos + 3 <= count) {
+      RPCVariant name(this);
+      RPCVariant cmd(this);
+      RPCVariant nParams(this);
+
+      if (!iChannelCtx->v1.GetParam(messageCtx, pos, &name) ||
+          !iChannelCtx->v1.GetParam(messageCtx, pos + 1, &cmd) ||
+          !iChannelCtx->v1.GetParam(messageCtx, pos + 2, &nParams) ||
+          name.vt != VDP_RPC_VT_LPSTR || cmd.vt != VDP_RPC_VT_UI4 ||
+          nParams.vt != VDP_RPC_VT_UI4 ||
+          pos + 3 + (int)nParams.ulVal > count) {
+         LOG("Error: malformed batch at parameter %d.", pos);
+         break;
+      }
+      pos += 3;
+
+      /*
+       * A context of our own stands in for the message, the application
+       * sees the same command, parameters and return value calls.
+       */
+      void* subCtx = NULL;
+      if (!rpcManager->m_iChannelObj.v1.CreateContext(m_hChannelObj, &subCtx)) {
+         LOG("Error: cannot create context to unpack batch.");
+         break;
+      }
+
+      if (name.strVal != NULL && name.strVal[0] != '\0') {
+         iChannelCtx->v1.SetNamedCommand(subCtx, name.strVal);
+      } else {
+         iChannelCtx->v1.SetCommand(subCtx, cmd.ulVal);
+      }
+
+      RPCVariant var(this);
+      for (uint32 i = 0; i < nParams.ulVal; i++, pos++) {
+         iVariant->v1.VariantInit(&var);
+         iChannelCtx->v1.GetParam(messageCtx, pos, &var);
+         iChannelCtx->v1.AppendParam(subCtx, &var);
+         iVariant->v1.VariantClear(&var);
+      }
+
+      if (IsJournalMessage(subCtx)) {
+         OnJournalInvoke(subCtx);
+      } else {
+         DeliverInvoke(subCtx);
+      }
+      AppendReturns(subCtx, messageCtx);
+      DestroyMessage(subCtx);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AppendReturns --
+ *
+ *    Appends the return code and values of a message unpacked from a
+ *    batch or from chunks to the return values of the message that
+ *    carried it, as
+ *       UI4    return code
+ *       UI4    return value count
+ *       ...    return values
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AppendReturns(void* subCtx,       // IN
+                                 void* messageCtx)   // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   RPCVariant var(this);
+
+   int nReturns = iChannelCtx->v1.GetReturnValCount(subCtx);
+
+   iVariant->v1.VariantFromUInt32(&var, iChannelCtx->v1.GetReturnCode(subCtx));
+   iChannelCtx->v1.AppendReturnVal(messageCtx, &var);
+   iVariant->v1.VariantFromUInt32(&var, nReturns > 0 ? (uint32)nReturns : 0);
+   iChannelCtx->v1.AppendReturnVal(messageCtx, &var);
+
+   for (int i = 0; i < nReturns; i++) {
+      iVariant->v1.VariantInit(&var);
+      iChannelCtx->v1.GetReturnVal(subCtx, i, &var);
+      iChannelCtx->v1.AppendReturnVal(messageCtx, &var);
+      iVariant->v1.VariantClear(&var);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::TakeReturns --
+ *
+ *    Counterpart of AppendReturns(), copies the return code and values
+ *    found at <*pos> of <returnCtx> into the context of the message
+ *    they belong to.
+ *
+ * Results:
+ *    false if there is no result at <*pos>.
+ *
+ * Side effects:
+ *    <*pos> is moved past the result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::TakeReturns(void* returnCtx,    // IN
+                               int* pos,           // IN/OUT
+                               void* messageCtx)   // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   int count = iChannelCtx->v1.GetReturnValCount(returnCtx);
+   RPCVariant code(this);
+   RPCVariant nReturns(this);
+
+   if (*pos + 2 > count ||
+       !iChannelCtx->v1.GetReturnVal(returnCtx, *pos, &code) ||
+       !iChannelCtx->v1.GetReturnVal(returnCtx, *pos + 1, &nReturns) ||
+       code.vt != VDP_RPC_VT_UI4 || nReturns.vt != VDP_RPC_VT_UI4) {
+      return false;
+   }
+
+   *pos += 2;
+   iChannelCtx->v1.SetReturnCode(messageCtx, code.ulVal);
+
+   RPCVariant var(this);
+   for (uint32 i = 0; i < nReturns.ulVal && *pos < count; i++, (*pos)++) {
+      iVariant->v1.VariantInit(&var);
+      iChannelCtx->v1.GetReturnVal(returnCtx, *pos, &var);
+      iChannelCtx->v1.AppendReturnVal(messageCtx, &var);
+      iVariant->v1.VariantClear(&var);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnBatchDone --
+ *
+ *    The peer has processed a batch.  Hands the return values of each
+ *    message to its own context and completes it like OnMsgDone() does.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The message contexts of the batch are destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnBatchDone(uint32 batchId,     // IN
+                               void* returnCtx)    // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   std::vector<void*> msgs;
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      auto it = m_batchesInFlight.find(batchId);
+      if (it == m_batchesInFlight.end()) {
+         LOG("Unknown batch %u completed", batchId);
+         return;
+      }
+
+      msgs.swap(it->second);
+      m_batchesInFlight.erase(it);
+   }
+
+   int pos = 0;
+
+   for (size_t m = 0; m < msgs.size(); m++) {
+      void* msgCtx = msgs[m];
+      uint32 requestCtxId = iChannelCtx->v1.GetId(msgCtx);
+
+      if (!TakeReturns(returnCtx, &pos, msgCtx)) {
+         LOG("Error: batch %u has no result for request %u.", batchId,
+             requestCtxId);
+      }
+
+      CompleteMessage(requestCtxId, msgCtx);
+      DestroyMessage(msgCtx);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortBatch --
+ *
+ *    Aborts every message of a batch that failed to be sent.
+ *
+ * Results:
+ *    false if <batchId> is not a batch.
+ *
+ * Side effects:
+ *    The message contexts of the batch are destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::AbortBatch(uint32 batchId,       // IN
+                              Bool userCancelled,   // IN
+                              uint32 reason)        // IN
+{
+   std::vector<void*> msgs;
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      auto it = m_batchesInFlight.find(batchId);
+      if (it == m_batchesInFlight.end()) {
+         return false;
+      }
+
+      msgs.swap(it->second);
+      m_batchesInFlight.erase(it);
+   }
+
+   AbortBatchedMessages(msgs, userCancelled, reason);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortBatchedMessages --
+ *
+ *    Reports OnAbort() for each of the given held messages.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The message contexts are destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AbortBatchedMessages(std::vector<void*>& msgs,  // IN
+                                        Bool userCancelled,        // IN
+                                        uint32 reason)             // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+
+   for (size_t m = 0; m < msgs.size(); m++) {
+      uint32 requestCtxId = iChannelCtx->v1.GetId(msgs[m]);
+      DestroyMessage(msgs[m]);
+      AbortMessage(requestCtxId, userCancelled, reason);
+   }
+
+   msgs.clear();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::DiscardOpenBatch --
+ *
+ *    Aborts the messages of the batch that has not been sent yet, called
+ *    while the channel object still exists.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::DiscardOpenBatch()
+{
+   std::lock_guard<std::mutex> sendLock(m_batchSendMutex);
+   std::vector<void*> msgs;
+   void* batchCtx;
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      batchCtx = m_batchCtx;
+      msgs.swap(m_batchMsgs);
+      m_batchCtx = NULL;
+      m_batchBytes = 0;
+   }
+
+   if (batchCtx != NULL) {
+      DestroyMessage(batchCtx);
+   }
+
+   AbortBatchedMessages(msgs, FALSE, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortAllBatches --
+ *
+ *    Aborts the messages of every batch still waiting for the peer,
+ *    used when the channel object goes away.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AbortAllBatches()
+{
+   std::unordered_map<uint32, std::vector<void*> > batches;
+
+   DiscardOpenBatch();
+
+   {
+      std::lock_guard<std::mutex> lock(m_batchMutex);
+      batches.swap(m_batchesInFlight);
+   }
+
+   for (auto it = batches.begin(); it != batches.end(); ++it) {
+      AbortBatchedMessages(it->second, FALSE, 0);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LaneMessageBytes --
+ *
+ *    Rough wire size of a message, the same way BatchMessage() counts.
+ *
+ * Results:
+ *    Number of bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+LaneMessageBytes(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+                 const VDPRPC_VariantInterface* iVariant,            // IN
+                 void* messageCtx)                                   // IN
+{
+   char cmd[64];
+   if (!iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd)) {
+      cmd[0] = '\0';
+   }
+
+   uint32 bytes = (uint32)strlen(cmd) + 1 + 2 * sizeof(uint32);
+   int count = iChannelCtx->v1.GetParamCount(messageCtx);
+   VDP_RPC_VARIANT var;
+
+   for (int i = 0; i < count; i++) {
+      iVariant->v1.VariantInit(&var);
+      if (iChannelCtx->v1.GetParam(messageCtx, i, &var)) {
+         bytes += BatchVariantSize(&var);
+      }
+      iVariant->v1.VariantClear(&var);
+   }
+
+   return bytes;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::MessageBytes --
+ *
+ *    Rough wire size of a message, what the messages sent without a
+ *    size are charged against the byte credit window.
+ *
+ * Results:
+ *    Number of bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCPluginInstance::MessageBytes(void* messageCtx)  // IN
+{
+   return LaneMessageBytes(ChannelContextInterface(), VariantInterface(),
+                           messageCtx);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetPriorityLanes --
+ *
+ *    Turns the priority lanes on or off.  Turning them off sends
+ *    whatever is queued right away.
+ *
+ * Results:
+ *    false if the parameters are invalid.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SetPriorityLanes(uint32 windowBytes,  // IN
+                                    uint32 chunkBytes)   // IN
+{
+   if (windowBytes != 0 && chunkBytes == 0) {
+      LOG("Error: priority lanes need a chunk size.");
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      m_laneWindow = windowBytes;
+      m_laneChunkBytes = chunkBytes;
+   }
+
+   if (windowBytes == 0) {
+      DispatchLanes();
+      LOG("Priority lanes off");
+      return true;
+   }
+
+   LOG("Priority lanes with %u bytes in flight, chunks of %u bytes (peer %s)",
+       windowBytes, chunkBytes,
+       (m_peerCaps & VDP_RPC_CAP_CHUNK) != 0 ? "supports chunks" : "unknown yet");
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SetLaneQuantum --
+ *
+ *    Sets the bytes <lane> may send per round, its weight against the
+ *    other lane.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::SetLaneQuantum(RPCTrafficClass lane,  // IN
+                                  uint32 bytes)          // IN
+{
+   std::lock_guard<std::mutex> lock(m_laneMutex);
+   m_lanes.SetQuantum(lane, bytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::GetLaneStats --
+ *
+ *    Returns the counters and the queue delay of <lane>.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::GetLaneStats(RPCTrafficClass lane,   // IN
+                                RPCLaneStats* stats)    // OUT
+{
+   std::lock_guard<std::mutex> lock(m_laneMutex);
+   m_lanes.GetStats(lane, stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::SubmitMessage --
+ *
+ *    Sends a message of the application, through the journal if it is
+ *    on and the peer supports it.  See QueueMessage() for the rest.
+ *
+ * Results:
+ *    true if the message context was journaled, queued or sent
+ *    successfully.
+ *
+ * Side effects:
+ *    If successful, the given messageCtx is owned by RPCPluginInstance.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::SubmitMessage(void* messageCtx,  // IN
+                                 int lane,          // IN
+                                 uint32 msgBytes)   // IN
+{
+   bool journal;
+
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      journal = m_journalMaxMsgs != 0;
+   }
+
+   if (journal && (m_peerCaps & VDP_RPC_CAP_JOURNAL) != 0) {
+      return JournalMessage(messageCtx, lane, msgBytes);
+   }
+
+   return QueueMessage(messageCtx, lane, msgBytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::QueueMessage --
+ *
+ *    Queues a message on its lane, split into chunks if it is large and
+ *    the peer can put it back together, or sends it right away when the
+ *    priority lanes are off.  A <lane> of -1 picks the lane by size,
+ *    <msgBytes> of 0 has the size estimated.
+ *
+ * Results:
+ *    true if the message context was queued or sent successfully.
+ *
+ * Side effects:
+ *    If successful, the given messageCtx is owned by the lanes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::QueueMessage(void* messageCtx,  // IN
+                                int lane,          // IN
+                                uint32 msgBytes)   // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   uint32 chunkBytes;
+
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      chunkBytes = m_laneChunkBytes;
+      if (m_laneWindow == 0) {
+         chunkBytes = 0;
+      }
+   }
+
+   if (chunkBytes == 0) {
+      return SendMessage(messageCtx, false, true);
+   }
+
+   uint32 bytes = msgBytes != 0
+                ? msgBytes
+                : LaneMessageBytes(iChannelCtx, VariantInterface(), messageCtx);
+   if (lane < 0) {
+      lane = bytes >= chunkBytes ? RPC_TRAFFIC_BULK : RPC_TRAFFIC_INTERACTIVE;
+   }
+
+   std::shared_ptr<ChunkTransfer> transfer;
+   if (bytes > chunkBytes && (m_peerCaps & VDP_RPC_CAP_CHUNK) != 0) {
+      transfer = std::make_shared<ChunkTransfer>();
+      if (SerializeMessage(messageCtx, &transfer->data) &&
+          transfer->data.size() > chunkBytes) {
+         transfer->messageCtx = messageCtx;
+         transfer->requestCtxId = iChannelCtx->v1.GetId(messageCtx);
+         transfer->chunkBytes = chunkBytes;
+         transfer->chunks = (uint32)((transfer->data.size() + chunkBytes - 1) /
+                                     chunkBytes);
+         transfer->finished = false;
+      } else {
+         transfer.reset();
+      }
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      LaneItem item;
+
+      if (transfer != NULL) {
+         uint32 left = (uint32)transfer->data.size();
+         item.messageCtx = NULL;
+         item.transfer = transfer;
+         for (item.chunk = 0; item.chunk < transfer->chunks; item.chunk++) {
+            uint32 size = left < chunkBytes ? left : chunkBytes;
+            m_lanes.Push((RPCTrafficClass)lane, item, size);
+            left -= size;
+         }
+      } else {
+         item.messageCtx = messageCtx;
+         item.chunk = 0;
+         m_lanes.Push((RPCTrafficClass)lane, item, bytes);
+      }
+   }
+
+   DispatchLanes();
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VDPService_ObserverInterface* VdpObserverInterface --
+ * RPCPluginInstance::DispatchLanes --
  *
- *    Returns the vdp observer interface.
+ *    Hands queued messages and chunks to RPC, in the order of the lane
+ *    scheduler, while the window has room.  One thread at a time does
+ *    it, a call while another thread is at it returns right away and
+ *    that thread picks up the new work.
  *
  * Results:
- *    Pointer to VDPService_ObserverInterface.
- *
- * Side Effects:
  *    None.
  *
+ * Side effects:
+ *    Messages that cannot be sent are aborted.
+ *
  *----------------------------------------------------------------------
  */
 
-const VDPService_ObserverInterface*
-RPCPluginInstance::VdpObserverInterface()
+void
+RPCPluginInstance::DispatchLanes()
 {
-   RPCManager* rpcManager = GetRPCManager();
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   std::unique_lock<std::mutex> lock(m_laneMutex);
 
-   return &rpcManager->m_iVdpObserverInterface;
+   if (m_laneSending) {
+      return;
+   }
+   m_laneSending = true;
+
+   LaneItem item;
+   uint32 bytes;
+   RPCTrafficClass lane;
+
+   while ((m_laneWindow == 0 || m_laneInFlightBytes < m_laneWindow) &&
+          m_lanes.Pop(&item, &bytes, &lane)) {
+      void* messageCtx = item.messageCtx;
+
+      if (item.transfer != NULL) {
+         // the rest of an aborted message.
+         if (item.transfer->finished) {
+            continue;
+         }
+
+         lock.unlock();
+         messageCtx = CreateChunkMessage(item);
+         lock.lock();
+
+         if (messageCtx == NULL) {
+            lock.unlock();
+            FinishTransfer(item.transfer, NULL, FALSE, 0);
+            lock.lock();
+            continue;
+         }
+      }
+
+      /*
+       * The completion can come in on another thread before Invoke()
+       * returns, so the message has to be in flight first.
+       */
+      uint32 requestCtxId = iChannelCtx->v1.GetId(messageCtx);
+      m_laneInFlight[requestCtxId] = bytes;
+      m_laneInFlightBytes += bytes;
+      if (item.transfer != NULL) {
+         m_chunksInFlight[requestCtxId] = item;
+      }
+      lock.unlock();
+
+      bool sent = m_hChannelObj != NULL &&
+                  SendMessage(messageCtx, false, item.transfer == NULL);
+      if (!sent) {
+         LOG("Failed to send %s %u from lane %d", item.transfer != NULL ?
+             "chunk" : "message", requestCtxId, lane);
+         if (item.transfer != NULL) {
+            DestroyMessage(messageCtx);
+            AbortChunk(requestCtxId, FALSE, 0);
+         } else {
+            std::vector<void*> msgs(1, messageCtx);
+            AbortBatchedMessages(msgs, FALSE, 0);
+         }
+      }
+
+      item.transfer.reset();
+      lock.lock();
+   }
+
+   m_laneSending = false;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OverlayGuestInterface --
+ * RPCPluginInstance::ReleaseLane --
  *
- *    Returns the overlay guest interface.
+ *    Gives back the window room of a message or chunk that completed,
+ *    and sends what fits now.
  *
  * Results:
- *    Pointer to VDPOverlayGuest_Interface.
+ *    None.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-const VDPOverlayGuest_Interface*
-RPCPluginInstance::OverlayGuestInterface()
+void
+RPCPluginInstance::ReleaseLane(uint32 requestCtxId)  // IN
 {
-   RPCManager *rpcManager = GetRPCManager();
-   if (!rpcManager->AllowRunAsServer()) {
-      LOG("Cannot use overlay guest interface due to server "
-          "not being supported.");
-      return NULL;
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      auto it = m_laneInFlight.find(requestCtxId);
+      if (it == m_laneInFlight.end()) {
+         return;
+      }
+
+      m_laneInFlightBytes -= it->second;
+      m_laneInFlight.erase(it);
    }
-   return &rpcManager->m_iOverlayGuest;
+
+   DispatchLanes();
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OverlayClientInterface --
+ * RPCPluginInstance::DiscardLanes --
  *
- *    Returns the overlay client interface.
+ *    Aborts the queued messages and the large messages whose chunks
+ *    are still out, and drops the chunks received from the peer, used
+ *    when the channel object goes away.
  *
  * Results:
- *    Pointer to VDPOverlayClient_Interface.
+ *    None.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-const VDPOverlayClient_Interface*
-RPCPluginInstance::OverlayClientInterface()
+void
+RPCPluginInstance::DiscardLanes()
 {
-   RPCManager* rpcManager = GetRPCManager();
-   return &rpcManager->m_iOverlayClient;
+   std::vector<void*> msgs;
+   std::vector<std::shared_ptr<ChunkTransfer> > transfers;
+
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      LaneItem item;
+      uint32 bytes;
+      RPCTrafficClass lane;
+
+      while (m_lanes.Pop(&item, &bytes, &lane)) {
+         if (item.transfer != NULL) {
+            transfers.push_back(item.transfer);
+         } else {
+            msgs.push_back(item.messageCtx);
+         }
+      }
+
+      for (auto it = m_chunksInFlight.begin(); it != m_chunksInFlight.end(); ++it) {
+         transfers.push_back(it->second.transfer);
+      }
+
+      m_chunksInFlight.clear();
+      m_laneInFlight.clear();
+      m_laneInFlightBytes = 0;
+      m_chunksReceived.clear();
+   }
+
+   AbortBatchedMessages(msgs, FALSE, 0);
+
+   for (size_t i = 0; i < transfers.size(); i++) {
+      FinishTransfer(transfers[i], NULL, FALSE, 0);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::GetChannelType --
+ * RPCPluginInstance::SerializeMessage --
  *
- *    Returns ping channel type.
+ *    Flattens the command and the parameters of a message so that it
+ *    can be sent in chunks, as
+ *       uint32   length of the named command ("" if it is an index)
+ *       ...      named command, no terminating NUL
+ *       uint32   command index
+ *       uint32   parameter count
+ *    and for each parameter
+ *       uint32   variant type
+ *       uint32   length
+ *       ...      the string with its NUL, the blob, or the 8 bytes of
+ *                any other value
  *
  * Results:
- *    type of channel.
+ *    false if a parameter cannot be read.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-const VdpServiceChannelType
-RPCPluginInstance::GetChannelType()
+bool
+RPCPluginInstance::SerializeMessage(void* messageCtx,          // IN
+                                    std::vector<char>* data)   // OUT
 {
-   RPCManager* rpcManager = GetRPCManager();
-   return rpcManager->m_channelType;
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const VDPRPC_VariantInterface* iVariant = VariantInterface();
+
+   auto put = [data](const void* bytes, uint32 size) {
+      data->insert(data->end(), (const char*)bytes, (const char*)bytes + size);
+   };
+   auto putUInt32 = [&put](uint32 value) {
+      put(&value, sizeof value);
+   };
+
+   char cmd[64];
+   if (!iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd)) {
+      cmd[0] = '\0';
+   }
+
+   int count = iChannelCtx->v1.GetParamCount(messageCtx);
+
+   data->clear();
+   putUInt32((uint32)strlen(cmd));
+   put(cmd, (uint32)strlen(cmd));
+   putUInt32(iChannelCtx->v1.GetCommand(messageCtx));
+   putUInt32(count > 0 ? (uint32)count : 0);
+
+   RPCVariant var(this);
+   for (int i = 0; i < count; i++) {
+      iVariant->v1.VariantInit(&var);
+      if (!iChannelCtx->v1.GetParam(messageCtx, i, &var)) {
+         LOG("Error: cannot read parameter %d to chunk.", i);
+         return false;
+      }
+
+      putUInt32(var.vt);
+      if (var.vt == VDP_RPC_VT_LPSTR) {
+         const char* str = var.strVal != NULL ? var.strVal : "";
+         putUInt32((uint32)strlen(str) + 1);
+         put(str, (uint32)strlen(str) + 1);
+      } else if (var.vt == VDP_RPC_VT_BLOB) {
+         putUInt32(var.blobVal.size);
+         put(var.blobVal.blobData, var.blobVal.size);
+      } else {
+         putUInt32(sizeof var.ullVal);
+         put(&var.ullVal, sizeof var.ullVal);
+      }
+      iVariant->v1.VariantClear(&var);
+   }
+
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::WaitUntilReady --
+ * RPCPluginInstance::DeserializeMessage --
  *
- *    Messages can only be sent to the peer when the RPCManager
- *    is ready.  This method will block until either the timeout
- *    occurs or the ready event is signaled.
+ *    Sets the command and the parameters flattened by SerializeMessage()
+ *    on a message context.
  *
  * Results:
- *    true if the ready event was signaled.
+ *    false if <data> is malformed.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::WaitUntilReady(uint32 msTimeout) // IN
+RPCPluginInstance::DeserializeMessage(const std::vector<char>& data,  // IN
+                                      void* messageCtx)               // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   FUNCTION_TRACE_MSG("timeout %d", msTimeout);
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   size_t pos = 0;
 
-   bool ok = rpcManager->WaitForEvent(m_hReadyEvent, msTimeout);
+   auto get = [&data, &pos](uint32 size) -> const char* {
+      if (data.size() - pos < size) {
+         return NULL;
+      }
+      pos += size;
+      return data.data() + pos - size;
+   };
+   auto getUInt32 = [&get](uint32* value) {
+      const char* p = get(sizeof *value);
+      if (p != NULL) {
+         memcpy(value, p, sizeof *value);
+      }
+      return p != NULL;
+   };
 
-   FUNCTION_EXIT_MSG(ok ? "Ready" : "Not ready");
-   return ok;
+   uint32 nameLen;
+   uint32 command;
+   uint32 count;
+   const char* name;
+
+   if (!getUInt32(&nameLen) || (name = get(nameLen)) == NULL ||
+       !getUInt32(&command) || !getUInt32(&count)) {
+      return false;
+   }
+
+   if (nameLen > 0) {
+      iChannelCtx->v1.SetNamedCommand(messageCtx, std::string(name, nameLen).c_str());
+   } else {
+      iChannelCtx->v1.SetCommand(messageCtx, command);
+   }
+
+   RPCScratchVariant var;
+   for (uint32 i = 0; i < count; i++) {
+      uint32 vt;
+      uint32 len;
+      const char* value;
+
+      if (!getUInt32(&vt) || !getUInt32(&len) || (value = get(len)) == NULL) {
+         return false;
+      }
+
+      if (vt == VDP_RPC_VT_LPSTR) {
+         if (len == 0 || value[len - 1] != '\0') {
+            return false;
+         }
+         var.SetStr(value);
+      } else if (vt == VDP_RPC_VT_BLOB) {
+         var.SetBlob(value, len);
+      } else {
+         if (len != sizeof var.ullVal) {
+            return false;
+         }
+         var.vt = (VDP_RPC_VARTYPE)vt;
+         memcpy(&var.ullVal, value, len);
+      }
+
+      iChannelCtx->v1.AppendParam(messageCtx, &var);
+   }
+
+   return pos == data.size();
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::RegisterChannelSink --
+ * RPCPluginInstance::CreateChunkMessage --
  *
- *    Registers the RPCManager channel sink callbacks for the
- *    given channel.
+ *    Creates the VDP_RPC_CHUNK message of one chunk, its parameters are
+ *       UI4    transfer id (request id of the large message)
+ *       UI4    chunk index
+ *       UI4    chunk count
+ *       BLOB   the chunk
  *
  * Results:
- *    true if the callbacks were successfully registered.
+ *    The message context, NULL on failure.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-bool
-RPCPluginInstance::RegisterChannelSink(void* hChannel) // IN
+void*
+RPCPluginInstance::CreateChunkMessage(const LaneItem& item)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   FUNCTION_TRACE;
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   const ChunkTransfer& transfer = *item.transfer;
+   size_t offset = (size_t)item.chunk * transfer.chunkBytes;
+   uint32 size = (uint32)std::min<size_t>(transfer.chunkBytes,
+                                          transfer.data.size() - offset);
+   void* messageCtx = NULL;
+
+   if (!CreateMessage(&messageCtx, VDP_RPC_CHUNK_ID, &transfer.data[offset], size)) {
+      return NULL;
+   }
 
-   /*
-    * Make sure that were aren't already registered
-    */
-   if (m_hChannelSink != (uint32)VDP_SERVICE_INVALID_SINK_HANDLE) {
-      FUNCTION_EXIT_MSG("Channel sink already registered");
-      return true;
+   if ((m_peerCaps & VDP_RPC_CAP_INTERN) != 0) {
+      iChannelCtx->v1.SetCommand(messageCtx, VDP_RPC_CHUNK_ID);
+   } else {
+      iChannelCtx->v1.SetNamedCommand(messageCtx, VDP_RPC_CHUNK);
    }
 
-   if (!rpcManager->m_iChannel.v1.
-         RegisterChannelNotifySink(&rpcManager->m_channelSink,
-                                   (void*)this,
-                                   &m_hChannelSink)) {
-      FUNCTION_EXIT_MSG("Channel.v1.RegisterChannelNotifySink() failed");
-      return false;
+   RPCScratchVariant var;
+   var.SetUInt32(transfer.requestCtxId);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetUInt32(item.chunk);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetUInt32(transfer.chunks);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetBlob(&transfer.data[offset], size);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
+   return messageCtx;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnChunkInvoke --
+ *
+ *    Collects a VDP_RPC_CHUNK message from the peer.  Once the last
+ *    chunk of a message is in, the message goes to OnInvoke() like any
+ *    other, and its return code and values are the return values of
+ *    the last chunk, laid out as for a batch.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::OnChunkInvoke(void* messageCtx)  // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   RPCManager* rpcManager = GetRPCManager();
+   RPCVariant id(this);
+   RPCVariant index(this);
+   RPCVariant count(this);
+   RPCVariant chunk(this);
+
+   if (!iChannelCtx->v1.GetParam(messageCtx, 0, &id) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 1, &index) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 2, &count) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 3, &chunk) ||
+       id.vt != VDP_RPC_VT_UI4 || index.vt != VDP_RPC_VT_UI4 ||
+       count.vt != VDP_RPC_VT_UI4 || chunk.vt != VDP_RPC_VT_BLOB) {
+      LOG("Error: malformed chunk.");
+      return;
    }
 
-   m_hChannel = hChannel;
-   LOG("Channel.v1.RegisterChannelNotifySink() [OK]");
+   std::vector<char> data;
 
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      ChunkAssembly& assembly = m_chunksReceived[id.ulVal];
 
-   /*
-    * I'll simulate a connect callback if we are already connected
-    */
-   if (rpcManager->m_iChannel.v1.
-         GetConnectionState() == VDP_SERVICE_CONN_CONNECTED) {
-      VDPService_ConnectionState cs = VDP_SERVICE_CONN_CONNECTED;
-      LOG("Simulating connect callback");
-      RPCManager::OnConnectionStateChanged((void*)this, cs, cs, NULL);
+      if (index.ulVal == 0) {
+         assembly.next = 0;
+         assembly.data.clear();
+         assembly.data.reserve((size_t)count.ulVal * chunk.blobVal.size);
+      }
+
+      if (index.ulVal != assembly.next || index.ulVal >= count.ulVal) {
+         LOG("Error: chunk %u of %u of transfer %u out of order.",
+             index.ulVal, count.ulVal, id.ulVal);
+         m_chunksReceived.erase(id.ulVal);
+         return;
+      }
+
+      assembly.data.insert(assembly.data.end(), chunk.blobVal.blobData,
+                           chunk.blobVal.blobData + chunk.blobVal.size);
+      assembly.next++;
+
+      if (assembly.next < count.ulVal) {
+         return;
+      }
+
+      data.swap(assembly.data);
+      m_chunksReceived.erase(id.ulVal);
    }
 
-   return true;
+   void* subCtx = NULL;
+   if (!rpcManager->m_iChannelObj.v1.CreateContext(m_hChannelObj, &subCtx)) {
+      LOG("Error: cannot create context to unpack transfer %u.", id.ulVal);
+      return;
+   }
+
+   if (!DeserializeMessage(data, subCtx)) {
+      LOG("Error: malformed transfer %u.", id.ulVal);
+   } else {
+      if (IsJournalMessage(subCtx)) {
+         OnJournalInvoke(subCtx);
+      } else {
+         DeliverInvoke(subCtx);
+      }
+      AppendReturns(subCtx, messageCtx);
+   }
+
+   DestroyMessage(subCtx);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::UnregisterChannelSink --
+ * RPCPluginInstance::OnChunkDone --
  *
- *    Unregisters the RPCManager channel sink callbacks for the
- *    given channel.
+ *    The peer has received a chunk.  The last one completes the large
+ *    message it belongs to.
  *
  * Results:
- *    true if the callbacks were successfully unregistered.
+ *    None.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-bool
-RPCPluginInstance::UnregisterChannelSink()
+void
+RPCPluginInstance::OnChunkDone(uint32 chunkId,     // IN
+                               void* returnCtx)    // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   bool ok = true;
-   FUNCTION_TRACE;
+   LaneItem item;
 
-   /*
-    * Make sure that were are registered
-    */
-   if (m_hChannelSink == (uint32)VDP_SERVICE_INVALID_SINK_HANDLE) {
-      FUNCTION_EXIT_MSG("Channel sink not registered");
-      return true;
-   }
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      auto it = m_chunksInFlight.find(chunkId);
+      if (it == m_chunksInFlight.end()) {
+         LOG("Unknown chunk %u completed", chunkId);
+         return;
+      }
 
-   /*
-    * I'll simulate a disconnect callback if we are still connected
-    */
-   if (rpcManager->m_iChannel.v1.
-         GetConnectionState() == VDP_SERVICE_CONN_CONNECTED) {
-      VDPService_ConnectionState cs = VDP_SERVICE_CONN_DISCONNECTED;
-      LOG("Simulating disconnect callback");
-      RPCManager::OnConnectionStateChanged((void*)this, cs, cs, NULL);
+      item = it->second;
+      m_chunksInFlight.erase(it);
    }
 
-   if (!rpcManager->m_iChannel.v1.
-         UnregisterChannelNotifySink(m_hChannelSink)) {
-      FUNCTION_EXIT_MSG("Channel.v1.UnregisterChannelNotifySink() failed");
-      ok = false;
-   } else {
-      FUNCTION_EXIT_MSG("Channel.v1.UnregisterChannelNotifySink() [OK]");
+   if (item.chunk + 1 == item.transfer->chunks) {
+      FinishTransfer(item.transfer, returnCtx, FALSE, 0);
    }
 
-   m_hChannel = NULL;
-   m_hChannelSink = VDP_SERVICE_INVALID_SINK_HANDLE;
-   return ok;
+   ReleaseLane(chunkId);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelConnect --
+ * RPCPluginInstance::AbortChunk --
  *
- *    Connects the underlying channel for this application/plugin pair.
+ *    A chunk failed to be sent, which aborts the large message it
+ *    belongs to.  Its chunks still queued are dropped.
  *
  * Results:
- *    true if the connect call succeeded.
+ *    false if <chunkId> is not a chunk.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::ChannelConnect()
+RPCPluginInstance::AbortChunk(uint32 chunkId,       // IN
+                              Bool userCancelled,   // IN
+                              uint32 reason)        // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   FUNCTION_TRACE;
+   LaneItem item;
+
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      auto it = m_chunksInFlight.find(chunkId);
+      if (it == m_chunksInFlight.end()) {
+         return false;
+      }
 
-   if (!rpcManager->m_iChannel.v1.Connect()) {
-      FUNCTION_EXIT_MSG("Channel.v1.Connect() failed");
-      return false;
+      item = it->second;
+      m_chunksInFlight.erase(it);
    }
 
-   FUNCTION_EXIT_MSG("Channel.v1.Connect() [OK]");
-   m_connectRequested = true;
+   FinishTransfer(item.transfer, NULL, userCancelled, reason);
+   ReleaseLane(chunkId);
    return true;
 }
 
@@ -1543,213 +5406,272 @@ RPCPluginInstance::ChannelConnect()
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelDisconnect --
+ * RPCPluginInstance::FinishTransfer --
  *
- *    Disconnects the underlying channel for this application/plugin pair.
+ *    Completes a large message sent in chunks with the return values of
+ *    its last chunk, or aborts it if there are none.  Only the first
+ *    call for a transfer does anything.
  *
  * Results:
- *    true if the disconnect call succeeded.
- *
- * Side Effects:
  *    None.
  *
+ * Side effects:
+ *    The message context of the transfer is destroyed.
+ *
  *----------------------------------------------------------------------
  */
 
-bool
-RPCPluginInstance::ChannelDisconnect()
+void
+RPCPluginInstance::FinishTransfer(const std::shared_ptr<ChunkTransfer>& transfer,  // IN
+                                  void* returnCtx,       // IN
+                                  Bool userCancelled,    // IN
+                                  uint32 reason)         // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   bool ok = true;
-   FUNCTION_TRACE;
+   {
+      std::lock_guard<std::mutex> lock(m_laneMutex);
+      if (transfer->finished) {
+         return;
+      }
+      transfer->finished = true;
+   }
 
-   if (m_connectRequested) {
-      if (!rpcManager->m_iChannel.v1.Disconnect()) {
-         LOG("Channel.v1.Disconnect() failed");
-         ok = false;
-      } else {
-         LOG("Channel.v1.Disconnect() [OK]");
+   void* msgCtx = transfer->messageCtx;
+   uint32 requestCtxId = transfer->requestCtxId;
+   int pos = 0;
+
+   if (returnCtx == NULL || !TakeReturns(returnCtx, &pos, msgCtx)) {
+      if (returnCtx != NULL) {
+         LOG("Error: peer did not process transfer %u.", requestCtxId);
       }
+      std::vector<void*> msgs(1, msgCtx);
+      AbortBatchedMessages(msgs, userCancelled, reason);
+      return;
    }
 
-   OnChannelDisconnected();
-   return ok;
+   CompleteMessage(requestCtxId, msgCtx);
+   DestroyMessage(msgCtx);
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnChannelTypeInvoke --
+ * RPCPluginInstance::SetJournal --
  *
- *    Callback to notify that the channel type message is received.
- *    It should only happen on client side.
+ *    Sets the bounds of the journal, a <maxMsgs> of 0 turns it off.
  *
  * Results:
  *    None.
  *
- * Side Effects:
- *    1) The OnReady() callback will be fired and the m_hReadyEvent will
- *       be set for main channel.
- *    2) Otherwise sidechannel request will be issued.
+ * Side effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
 void
-RPCPluginInstance::OnChannelTypeInvoke(void* messageCtx)             // IN
+RPCPluginInstance::SetJournal(uint32 maxMsgs,    // IN
+                              uint32 maxBytes)   // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   const VDPRPC_ChannelObjectInterface *iChannelObj = ChannelObjectInterface();
-   const VDPRPC_ChannelContextInterface *iChannelCtx = ChannelContextInterface();
-
-   char cmd[32];
-   iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd);
-
-   if (strcmp(cmd, VDP_PING_CHANNEL) == 0) {
-      RPCVariant var(this);
-      if (iChannelCtx->v1.GetParam(messageCtx, 0, &var) &&
-          var.vt == VDP_RPC_VT_UI4) {
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      m_journalMaxMsgs = maxMsgs;
+      m_journalMaxBytes = maxBytes;
+   }
 
-         // receive channel type from agent.
-         rpcManager->SetChannelType((VdpServiceChannelType) var.ulVal);
-         switch (var.ulVal) {
-         case VDPSERVICE_MAIN_CHANNEL:
-            RMSetEvent(m_hReadyEvent);
-            m_isReady = true;
-            OnReady();
-            break;
-         case VDPSERVICE_VCHAN_CHANNEL:
-            iChannelObj->v2.RequestSideChannel(m_hChannelObj,
-                                               VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP,
-                                               rpcManager->m_tokenName);
-            break;
-         case VDPSERVICE_TCP_CHANNEL:
-         case VDPSERVICE_TCPRAW_CHANNEL:
-            iChannelObj->v2.RequestSideChannel(m_hChannelObj,
-                                               VDP_RPC_SIDE_CHANNEL_TYPE_TCP,
-                                               rpcManager->m_tokenName);
-            break;
-         default:
-            LOG("Error: invalid channel type [%d].", var.ulVal);
-            break;
-         }
-      } else {
-         LOG("Error: GetParam failed [%d].", var.vt);
-      }
-   } else {
-      LOG("Discard command [%s] before channel type is received.", cmd);
+   if (maxMsgs == 0) {
+      LOG("Journal off");
+      return;
    }
+
+   LOG("Journal of %u messages, %u bytes (peer %s)", maxMsgs, maxBytes,
+       (m_peerCaps & VDP_RPC_CAP_JOURNAL) != 0 ? "supports it" : "unknown yet");
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnChannelConnected --
+ * RPCPluginInstance::GetJournalStats --
  *
- *    Callback to notify that the channel has been connected.
+ *    Returns the counters and the depth of the journal.
  *
  * Results:
  *    None.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
 void
-RPCPluginInstance::OnChannelConnected()
+RPCPluginInstance::GetJournalStats(RPCJournalStats* stats)  // OUT
 {
-   FUNCTION_TRACE;
-   m_connected = true;
+   std::lock_guard<std::mutex> lock(m_journalMutex);
+
+   *stats = m_journalStats;
+   stats->depth = (uint32)m_journal.size();
+   stats->depthBytes = m_journalBytes;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnChannelDisconnected --
+ * RPCPluginInstance::JournalMessage --
  *
- *    Callback to notify that the channel has been disconnected.
+ *    Keeps a copy of a message in the journal and sends it as a
+ *    VDP_RPC_JOURNAL message.
  *
  * Results:
- *    None.
+ *    false if the journal is full or the message cannot be sent, the
+ *    caller still owns the message context then.
  *
- * Side Effects:
- *    None.
+ * Side effects:
+ *    If successful, the given messageCtx is owned by the journal.
  *
  *----------------------------------------------------------------------
  */
 
-void
-RPCPluginInstance::OnChannelDisconnected()
+bool
+RPCPluginInstance::JournalMessage(void* messageCtx,  // IN
+                                  int lane,          // IN
+                                  uint32 msgBytes)   // IN
 {
-   FUNCTION_TRACE;
+   std::shared_ptr<JournalEntry> entry = std::make_shared<JournalEntry>();
+
+   if (!SerializeMessage(messageCtx, &entry->data)) {
+      return false;
+   }
+
+   entry->messageCtx = messageCtx;
+   entry->requestCtxId = ChannelContextInterface()->v1.GetId(messageCtx);
+   entry->msgBytes = msgBytes;
+   entry->charged = true;
+   entry->lane = lane;
+   entry->wireId = 0;
 
    /*
-    * Update variables that tell me the status of the channel
+    * The messages go out in the order of their sequence numbers, and
+    * none of them before a replay in progress.
     */
-   m_connectRequested = false;
-   m_connected = false;
+   std::lock_guard<std::mutex> sendLock(m_journalSendMutex);
+
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+
+      if (m_journal.size() >= m_journalMaxMsgs ||
+          (m_journalMaxBytes != 0 &&
+           m_journalBytes + entry->data.size() > m_journalMaxBytes)) {
+         LOG("Error: journal full, %u messages of %llu bytes.",
+             (uint32)m_journal.size(), (unsigned long long)m_journalBytes);
+         return false;
+      }
+
+      entry->seq = ++m_journalSeq;
+      m_journalBytes += entry->data.size();
+      m_journal.push_back(entry);
+   }
 
    /*
-    * I need to destroy the channel object when the channel closes
+    * Entries still waiting to be replayed go first.
     */
-   ChannelObjDestroy();
+   bool sent = SendPendingJournal(entry->seq);
+
+   std::lock_guard<std::mutex> lock(m_journalMutex);
+
+   if (!sent) {
+      for (auto it = m_journal.begin(); it != m_journal.end(); ++it) {
+         if (*it == entry) {
+            m_journalBytes -= entry->data.size();
+            m_journal.erase(it);
+            break;
+         }
+      }
+      return false;
+   }
+
+   m_journalStats.journaled++;
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelObjCreate --
+ * RPCPluginInstance::SendJournalEntry --
  *
- *    Instantiates the channel object to be used by this
- *    application/plugin pair. Note that RPCManager only supports
- *    one channel object currently (named m_channelObjName).
+ *    Sends the VDP_RPC_JOURNAL message of a journal entry, its
+ *    parameters are
+ *       UI4    epoch of this instance
+ *       UI4    sequence number of the message
+ *       UI4    oldest sequence number still journaled
+ *       BLOB   the message, see SerializeMessage()
+ *    The peer has seen or never will see anything older than the third
+ *    one, so it can forget about it.
  *
  * Results:
- *    true if the object was created successfully.
+ *    false if the message cannot be sent.
  *
- * Side Effects:
- *    A message is sent by VDPService to the peer to notify them that
- *    the channel object has been created.
+ * Side effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::ChannelObjCreate()
+RPCPluginInstance::SendJournalEntry(const std::shared_ptr<JournalEntry>& entry)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   FUNCTION_TRACE;
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   uint32 size = (uint32)entry->data.size();
+   uint32 oldest;
+   void* messageCtx = NULL;
 
-   if (m_hChannelObj != NULL) {
-      FUNCTION_EXIT_MSG("Channel object \"%s\" already created", rpcManager->m_channelObjName);
-      return true;
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      oldest = m_journal.empty() ? entry->seq : m_journal.front()->seq;
+   }
+
+   if (!CreateMessage(&messageCtx, VDP_RPC_JOURNAL_ID, entry->data.data(), size)) {
+      return false;
+   }
+
+   if ((m_peerCaps & VDP_RPC_CAP_INTERN) != 0) {
+      iChannelCtx->v1.SetCommand(messageCtx, VDP_RPC_JOURNAL_ID);
+   } else {
+      iChannelCtx->v1.SetNamedCommand(messageCtx, VDP_RPC_JOURNAL);
    }
 
+   RPCScratchVariant var;
+   var.SetUInt32(m_journalEpoch);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetUInt32(entry->seq);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetUInt32(oldest);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetBlob(entry->data.data(), size);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
    /*
-    * 1) For client, both encryption and compression are enabled to perform
-    *    all kind of tests.
-    * 2) For agent, app pass encryption and compression options from ServerInit.
+    * The completion can come in on another thread before Invoke()
+    * returns, so the message has to be in flight first.
     */
-   int flags = VDP_RPC_OBJ_CONFIG_INVOKE_ALLOW_ANY_THREAD;
-   flags |= rpcManager->m_encryptionEnabled ? VDP_RPC_OBJ_SUPPORT_ENCRYPTION : 0;
-   flags |= rpcManager->m_compressionEnabled ? VDP_RPC_OBJ_SUPPORT_COMPRESSION : 0;
+   uint32 wireId = iChannelCtx->v1.GetId(messageCtx);
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      entry->wireId = wireId;
+      m_journalWire[wireId] = entry;
+   }
 
-   if (!rpcManager->m_iChannelObj.v1.
-         CreateChannelObject(rpcManager->m_channelObjName,
-                             &rpcManager->m_channelObjSink,
-                             (void*)this,
-                             (VDPRPC_ObjectConfigurationFlags) flags,
-                             &m_hChannelObj)) {
-      FUNCTION_EXIT_MSG("Failed to create channel object \"%s\"", rpcManager->m_channelObjName);
+   if (!QueueMessage(messageCtx, entry->lane, 0)) {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+      m_journalWire.erase(wireId);
+      entry->wireId = 0;
+      DestroyMessage(messageCtx);
       return false;
    }
 
-   FUNCTION_EXIT_MSG("Channel object \"%s\" created", rpcManager->m_channelObjName);
    return true;
 }
 
@@ -1757,249 +5679,420 @@ RPCPluginInstance::ChannelObjCreate()
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::ChannelObjDestroy --
+ * RPCPluginInstance::SendPendingJournal --
  *
- *    Destroys the channel object used by this
- *    application/plugin pair. Note that RPCManager only supports
- *    one channel object currently (named m_channelObjName).
+ *    Sends the journaled messages that are not in flight, in order,
+ *    m_journalSendMutex must be held.  All but the one of sequence
+ *    number <fresh> are replays.
  *
  * Results:
- *    true if the object was destroyed successfully.
+ *    false if one could not be sent, it and those after it stay in the
+ *    journal.
  *
- * Side Effects:
- *    A message is sent by VDPService to the peer to notify them that
- *    the channel object has been destroyed. Also, the OnNotReady()
- *    callback will be fired (can be overridden by subclasses).
+ * Side effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::ChannelObjDestroy()
+RPCPluginInstance::SendPendingJournal(uint32 fresh)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
-   bool ok = true;
-   FUNCTION_TRACE;
+   std::vector<std::shared_ptr<JournalEntry> > entries;
 
-   if (m_hChannelObj != NULL) {
-      if (!rpcManager->m_iChannelObj.v1.DestroyChannelObject(m_hChannelObj)) {
-         LOG("Failed to destroy channel object \"%s\"", rpcManager->m_channelObjName);
-         ok = false;
-      } else {
-         LOG("Channel object \"%s\" destroyed", rpcManager->m_channelObjName);
-      }
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
 
-      m_hChannelObj = NULL;
+      for (auto it = m_journal.begin(); it != m_journal.end(); ++it) {
+         if ((*it)->wireId == 0) {
+            entries.push_back(*it);
+         }
+      }
    }
 
-   if (m_isReady) {
-      RMResetEvent(m_hReadyEvent);
-      m_isReady = false;
-      OnNotReady();
+   for (size_t i = 0; i < entries.size(); i++) {
+      const std::shared_ptr<JournalEntry>& entry = entries[i];
+      bool charge;
+
+      /*
+       * ResetCredit() forgot the messages lost with the channel object.
+       */
+      {
+         std::lock_guard<std::mutex> lock(m_journalMutex);
+         charge = !entry->charged;
+         entry->charged = true;
+      }
+
+      if (charge) {
+         AcquireCredit(entry->requestCtxId, entry->msgBytes, true);
+      }
+
+      if (!SendJournalEntry(entry)) {
+         LOG("Error: cannot send journaled message %u, %d left.",
+             entry->seq, (int)(entries.size() - i));
+         return false;
+      }
+
+      if (entry->seq != fresh) {
+         std::lock_guard<std::mutex> lock(m_journalMutex);
+         m_journalStats.replayed++;
+      }
    }
 
-   return ok;
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnChannelObjConnected --
+ * RPCPluginInstance::ReplayJournal --
  *
- *    Callback function to notify that the peer object has been created
- *    and the connection is complete. This indicates that the object
- *    can now be used to send messages to the peer.
+ *    Sends the journaled messages that are not in flight again once
+ *    ready and the peer capabilities are known.  If the journal has
+ *    been turned off or the peer does not support it, they are aborted
+ *    instead.
  *
  * Results:
  *    None.
  *
- * Side Effects:
- *    The OnReady() callback will be fired and the m_hReadyEvent will
- *    be set.
+ * Side effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
 void
-RPCPluginInstance::OnChannelObjConnected()
+RPCPluginInstance::ReplayJournal()
 {
-   RPCManager* rpcManager = GetRPCManager();
-   FUNCTION_TRACE;
+   std::lock_guard<std::mutex> sendLock(m_journalSendMutex);
+   int pending = 0;
+   bool replay;
 
-   /*
-    * It should be ready to run ping program now.
-    *
-    * But to demostrate sending data via different channels, both
-    * agent app and client plugin need to setup the same type
-    * sidechannel if it is necessary.
-    *
-    * For common practice, it could be hard coded, regKey configured
-    * or from another channel.
-    *
-    * Here we just send a message to client via main channel before ping
-    * program start.
-    *
-    */
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+
+      replay = m_journalMaxMsgs != 0 && (m_peerCaps & VDP_RPC_CAP_JOURNAL) != 0;
+      for (auto it = m_journal.begin(); it != m_journal.end(); ++it) {
+         pending += (*it)->wireId == 0 ? 1 : 0;
+      }
+   }
+
+   if (pending == 0) {
+      return;
+   }
+
+   if (!replay) {
+      AbortJournal(false);
+      return;
+   }
+
+   LOG("Replaying %d journaled message(s)", pending);
+   SendPendingJournal(0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::AbortJournal --
+ *
+ *    Aborts the journaled messages, only those not in flight unless
+ *    <all> is set.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The message contexts are destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::AbortJournal(bool all)  // IN
+{
+   std::vector<void*> msgs;
+   std::vector<std::pair<uint32, uint32> > uncharged;
 
-   if (rpcManager->IsServer()) {
-      void* messageCtx = NULL;
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
 
-      if (!CreateMessage(&messageCtx)) {
-         LOG("Error: cannot create channelCtx to send channel type.");
-         return;
-      }
+      for (auto it = m_journal.begin(); it != m_journal.end();) {
+         std::shared_ptr<JournalEntry> entry = *it;
 
-      rpcManager->m_iChannelCtx.v1.SetNamedCommand(messageCtx, VDP_PING_CHANNEL);
-      RPCVariant var(this);
-      const VDPRPC_VariantInterface *iVariant = VariantInterface();
-      const VDPRPC_ChannelContextInterface *iChannelCtx = ChannelContextInterface();
+         if (!all && entry->wireId != 0) {
+            ++it;
+            continue;
+         }
 
-      iVariant->v1.VariantFromUInt32(&var, rpcManager->m_channelType);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
+         if (entry->wireId != 0) {
+            m_journalWire.erase(entry->wireId);
+         }
+         if (!entry->charged) {
+            uncharged.push_back(std::make_pair(entry->requestCtxId, entry->msgBytes));
+         }
 
-      /*
-       * After a successfull call to invoke, the RPC library owns
-       * the message context and will destroy it.  We only need to
-       * destroy it if InvokeMessage() fails.
-       */
-      if (!InvokeMessage(messageCtx, true)) {
-         DestroyMessage(messageCtx);
-         return;
+         msgs.push_back(entry->messageCtx);
+         m_journalBytes -= entry->data.size();
+         it = m_journal.erase(it);
       }
+   }
 
-      if (rpcManager->m_channelType == VDPSERVICE_MAIN_CHANNEL) {
-         RMSetEvent(m_hReadyEvent);
-         m_isReady = true;
-         OnReady();
-      } else if (rpcManager->m_channelType == VDPSERVICE_VCHAN_CHANNEL) {
-         rpcManager->m_iChannelObj.v2.RequestSideChannel(m_hChannelObj,
-                                                         VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP,
-                                                         rpcManager->m_tokenName);
-      } else { //request tcp sidechannel
-         rpcManager->m_iChannelObj.v2.RequestSideChannel(m_hChannelObj,
-                                                         VDP_RPC_SIDE_CHANNEL_TYPE_TCP,
-                                                         rpcManager->m_tokenName);
+   if (msgs.empty()) {
+      return;
+   }
 
-      }
-   } // Client need to get channel type first.
+   LOG("Aborting %d journaled message(s)", (int)msgs.size());
 
-   // Query channel object options (e.g compression and encryption)
-   const VDPRPC_ChannelObjectInterface* iObj = ChannelObjectInterface();
-   if (iObj->v3.GetObjectOptions != NULL) {
-      iObj->v3.GetObjectOptions(m_hChannelObj, &m_channelObjOptions);
+   /*
+    * The abort gives back credit, also for what ResetCredit() forgot.
+    */
+   for (size_t i = 0; i < uncharged.size(); i++) {
+      AcquireCredit(uncharged[i].first, uncharged[i].second, true);
    }
-   LOG("Channel Object options : 0x%08x.", m_channelObjOptions);
+
+   AbortBatchedMessages(msgs, FALSE, 0);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnSidechannelConnected --
+ * RPCPluginInstance::ResetJournalWire --
  *
- *    Callback function to notify that sidechannel is connected.
+ *    Forgets the VDP_RPC_JOURNAL messages in flight, used when the
+ *    channel object goes away.  Their entries are sent again by
+ *    ReplayJournal().
  *
  * Results:
  *    None.
  *
- * Side Effects:
- *    The OnReady() callback will be fired and the m_hReadyEvent will be set.
+ * Side effects:
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
 void
-RPCPluginInstance::OnSidechannelConnected()
+RPCPluginInstance::ResetJournalWire()
 {
-   RMSetEvent(m_hReadyEvent);
-   m_isReady = true;
-   OnReady();
+   std::lock_guard<std::mutex> lock(m_journalMutex);
+
+   for (auto it = m_journal.begin(); it != m_journal.end(); ++it) {
+      (*it)->wireId = 0;
+      (*it)->charged = false;
+   }
+
+   m_journalWire.clear();
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::OnChannelObjDisconnected --
+ * RPCPluginInstance::IsJournalMessage --
  *
- *    Callback function to notify that the peer object has been destroyed.
- *    In response, we will destroy our local object.
+ *    Tells a VDP_RPC_JOURNAL message unpacked from a batch or from
+ *    chunks.
  *
  * Results:
- *    None.
+ *    true if it is one.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-void
-RPCPluginInstance::OnChannelObjDisconnected()
+bool
+RPCPluginInstance::IsJournalMessage(void* messageCtx)  // IN
 {
-   FUNCTION_TRACE;
-   ChannelObjDestroy();
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   uint32 command = iChannelCtx->v1.GetCommand(messageCtx);
+   char cmd[32];
+
+   if (command == VDP_RPC_JOURNAL_ID) {
+      return true;
+   }
+
+   return command < VDP_RPC_INTERN_BASE &&
+          iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd) &&
+          strcmp(cmd, VDP_RPC_JOURNAL) == 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::CreateMessage --
+ * RPCPluginInstance::OnJournalInvoke --
  *
- *    Allocates a message context to be used to send an RPC to the peer.
+ *    Delivers a VDP_RPC_JOURNAL message from the peer unless it was
+ *    delivered before.  The return values are
+ *       UI4    0, or 1 for a duplicate
+ *    and for a message delivered now its return code and values laid
+ *    out as for a batch.
  *
  * Results:
- *    true if the message context was created successfully.
+ *    None.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
-bool
-RPCPluginInstance::CreateMessage(void** pMessageCtx) // OUT
+void
+RPCPluginInstance::OnJournalInvoke(void* messageCtx)  // IN
 {
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
    RPCManager* rpcManager = GetRPCManager();
-
-   if (m_hChannelObj == NULL) {
-      LOG("Failed to create message (not ready)");
-      return false;
+   RPCVariant epoch(this);
+   RPCVariant seq(this);
+   RPCVariant oldest(this);
+   RPCVariant data(this);
+
+   if (!iChannelCtx->v1.GetParam(messageCtx, 0, &epoch) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 1, &seq) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 2, &oldest) ||
+       !iChannelCtx->v1.GetParam(messageCtx, 3, &data) ||
+       epoch.vt != VDP_RPC_VT_UI4 || seq.vt != VDP_RPC_VT_UI4 ||
+       oldest.vt != VDP_RPC_VT_UI4 || data.vt != VDP_RPC_VT_BLOB) {
+      LOG("Error: malformed journaled message.");
+      return;
    }
 
-   if (m_isReady) {
-      /*
-       * Here we choose client always perform encryption and compression if possible.
-       * (because encryption and compression are always true for client). For agent, it
-       * uses configuration from user. And it is up to user to use right one for their app.
-       */
+   bool duplicate;
 
-      uint32 comp = rpcManager->m_compressionEnabled ? VDP_RPC_COMP_SNAPPY : 0;
-      uint32 enc  = rpcManager->m_encryptionEnabled ? VDP_RPC_CRYPTO_AES : 0;
-      uint32 options = m_channelObjOptions & (comp | enc);
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
 
-      if (comp && (m_channelObjOptions & comp) == 0) {
-         LOG("Error: vdpservice object does not support compression.");
+      if (epoch.ulVal != m_peerJournalEpoch) {
+         m_peerJournalEpoch = epoch.ulVal;
+         m_peerJournalSeq = 0;
+         m_peerJournalSeen.clear();
       }
 
-      if (enc && (m_channelObjOptions & enc) == 0) {
-         LOG("Error: vdpservice object does not support encryption.");
+      if (oldest.ulVal > m_peerJournalSeq + 1) {
+         m_peerJournalSeq = oldest.ulVal - 1;
+         m_peerJournalSeen.erase(m_peerJournalSeen.begin(),
+                                 m_peerJournalSeen.upper_bound(m_peerJournalSeq));
       }
 
-      if (!rpcManager->m_iChannelObj.v3.CreateContext(m_hChannelObj, options, pMessageCtx)) {
-         LOG("Failed to create message (CreateContext failed)");
-         return false;
+      /*
+       * The lanes can reorder messages, so the ones delivered ahead of
+       * the others are remembered until the gap is filled.
+       */
+      duplicate = seq.ulVal <= m_peerJournalSeq ||
+                  m_peerJournalSeen.count(seq.ulVal) != 0;
+      if (duplicate) {
+         m_journalStats.duplicates++;
+      } else {
+         m_peerJournalSeen.insert(seq.ulVal);
+         while (!m_peerJournalSeen.empty() &&
+                *m_peerJournalSeen.begin() == m_peerJournalSeq + 1) {
+            m_peerJournalSeq++;
+            m_peerJournalSeen.erase(m_peerJournalSeen.begin());
+         }
       }
+   }
+
+   RPCScratchVariant status;
+
+   if (duplicate) {
+      LOG("Journaled message %u already delivered.", seq.ulVal);
+      status.SetUInt32(1);
+      iChannelCtx->v1.AppendReturnVal(messageCtx, &status);
+      return;
+   }
+
+   void* subCtx = NULL;
+   if (!rpcManager->m_iChannelObj.v1.CreateContext(m_hChannelObj, &subCtx)) {
+      LOG("Error: cannot create context to unpack journaled message %u.",
+          seq.ulVal);
+      return;
+   }
+
+   std::vector<char> bytes(data.blobVal.blobData,
+                           data.blobVal.blobData + data.blobVal.size);
+   if (!DeserializeMessage(bytes, subCtx)) {
+      LOG("Error: malformed journaled message %u.", seq.ulVal);
    } else {
-      // Let Channel type message send through.
-      if (!rpcManager->m_iChannelObj.v1.CreateContext(m_hChannelObj, pMessageCtx)) {
-         LOG("Failed to create message (CreateContext failed)");
+      status.SetUInt32(0);
+      iChannelCtx->v1.AppendReturnVal(messageCtx, &status);
+      DeliverInvoke(subCtx);
+      AppendReturns(subCtx, messageCtx);
+   }
+
+   DestroyMessage(subCtx);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::OnJournalDone --
+ *
+ *    The peer has processed a VDP_RPC_JOURNAL message.  Drops it from
+ *    the journal and completes the message it carried.
+ *
+ * Results:
+ *    false if <wireId> is not a VDP_RPC_JOURNAL message.
+ *
+ * Side effects:
+ *    The message context of the entry is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPluginInstance::OnJournalDone(uint32 wireId,      // IN
+                                 void* returnCtx)    // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   std::shared_ptr<JournalEntry> entry;
+
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
+
+      auto it = m_journalWire.find(wireId);
+      if (it == m_journalWire.end()) {
          return false;
       }
+
+      entry = it->second;
+      m_journalWire.erase(it);
+      entry->wireId = 0;
+
+      // mostly the oldest one.
+      for (auto e = m_journal.begin(); e != m_journal.end(); ++e) {
+         if (*e == entry) {
+            m_journalBytes -= entry->data.size();
+            m_journal.erase(e);
+            break;
+         }
+      }
+      m_journalStats.acked++;
+   }
+
+   ReleaseLane(wireId);
+
+   void* msgCtx = entry->messageCtx;
+   RPCVariant status(this);
+   int pos = 1;
+
+   if (iChannelCtx->v1.GetReturnValCount(returnCtx) < 1 ||
+       !iChannelCtx->v1.GetReturnVal(returnCtx, 0, &status) ||
+       status.vt != VDP_RPC_VT_UI4 || status.ulVal > 1 ||
+       (status.ulVal == 0 && !TakeReturns(returnCtx, &pos, msgCtx))) {
+      LOG("Error: peer did not process journaled message %u.", entry->seq);
+      std::vector<void*> msgs(1, msgCtx);
+      AbortBatchedMessages(msgs, FALSE, 0);
+      return true;
    }
 
+   CompleteMessage(entry->requestCtxId, msgCtx);
+   DestroyMessage(msgCtx);
    return true;
 }
 
@@ -2007,32 +6100,36 @@ RPCPluginInstance::CreateMessage(void** pMessageCtx) // OUT
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::DestroyMessage --
+ * RPCPluginInstance::OnJournalAbort --
  *
- *    Frees a message that was previously created. Note that this should
- *    ONLY be done if a call to Invoke failed, or the message is not
- *    going to be sent. The Invoke call will free the message if
- *    successful.
+ *    A VDP_RPC_JOURNAL message failed to be sent, its entry stays in the
+ *    journal for ReplayJournal().
  *
  * Results:
- *    true if the message context was destroyed successfully.
+ *    false if <wireId> is not a VDP_RPC_JOURNAL message.
  *
- * Side Effects:
+ * Side effects:
  *    None.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::DestroyMessage(void* messageCtx) // IN
+RPCPluginInstance::OnJournalAbort(uint32 wireId)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
+   {
+      std::lock_guard<std::mutex> lock(m_journalMutex);
 
-   if (!rpcManager->m_iChannelObj.v1.DestroyContext(messageCtx)) {
-      LOG("Failed to destroy message (DestroyContext failed)");
-      return false;
+      auto it = m_journalWire.find(wireId);
+      if (it == m_journalWire.end()) {
+         return false;
+      }
+
+      it->second->wireId = 0;
+      m_journalWire.erase(it);
    }
 
+   ReleaseLane(wireId);
    return true;
 }
 
@@ -2040,86 +6137,117 @@ RPCPluginInstance::DestroyMessage(void* messageCtx) // IN
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::InvokeMessage --
+ * RPCPluginInstance::SetCreditWindow --
  *
- *    Sends the given message to the peer.
+ *    Sets the flow control window, 0 means unlimited.
  *
  * Results:
- *    true if the message context was sent successfully.
+ *    None.
  *
- * Side Effects:
- *    If successful, the given messageCtx was destroyed.
+ * Side effects:
+ *    OnCreditAvailable() is called if a blocked sender can go on.
  *
  *----------------------------------------------------------------------
  */
 
-bool
-RPCPluginInstance::InvokeMessage(void* messageCtx,     // IN
-                                 bool  channelTypeMsg) // IN
+void
+RPCPluginInstance::SetCreditWindow(uint32 maxMsgs,   // IN
+                                   uint32 maxBytes)  // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
+   RMLockMutex(m_pendingMsgMutex);
+   m_creditMaxMsgs = maxMsgs;
+   m_creditMaxBytes = maxBytes;
+   RMUnlockMutex(m_pendingMsgMutex);
 
-   if (m_hChannelObj == NULL || !(m_isReady || channelTypeMsg)) {
-      LOG("Failed to send message (not ready)");
-      return false;
-   }
+   LOG("Credit window %u messages, %u bytes", maxMsgs, maxBytes);
+   ReleaseCredit(0);
+}
 
-   if (!channelTypeMsg) {
-      TrackPendingMessages(true, NULL, 0);
-   }
 
-   if (!rpcManager->m_iChannelObj.v1.Invoke(m_hChannelObj,
-                                            messageCtx,
-                                            &rpcManager->m_requestSink,
-                                            (void*)this)) {
-      LOG("Failed to send message (Invoke failed)");
-      return false;
-   }
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::GetCreditUsage --
+ *
+ *    Returns the number of messages and bytes currently in flight.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   return true;
+void
+RPCPluginInstance::GetCreditUsage(uint32* inFlightMsgs,   // OUT
+                                  uint32* inFlightBytes)  // OUT
+{
+   RMLockMutex(m_pendingMsgMutex);
+   if (inFlightMsgs != NULL) {
+      *inFlightMsgs = (uint32)m_pendingMsgCount;
+   }
+   if (inFlightBytes != NULL) {
+      *inFlightBytes = m_pendingMsgBytes;
+   }
+   RMUnlockMutex(m_pendingMsgMutex);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::WaitForPendingMessages --
+ * RPCPluginInstance::AcquireCredit --
  *
- *    This method waits for the peer to process and respond to all
- *    messages before returning.  While waiting it ensures that RPC
- *    is being given timeslices so that it can do its work.
+ *    Charges a message about to be sent against the credit window.
+ *    This replaces the plain pending message counter, the pending
+ *    message event is still signaled whenever nothing is in flight.
  *
  * Results:
- *    This method returns TRUE if all pending messages have been
- *    processed.
+ *    false if the window is full and <force> is not set.
  *
  * Side effects:
- *    None.
+ *    On failure the instance is marked blocked so that the next
+ *    ReleaseCredit() that frees room calls OnCreditAvailable() and
+ *    signals the credit event.
  *
  *----------------------------------------------------------------------
  */
 
 bool
-RPCPluginInstance::WaitForPendingMessages(uint32 msTimeout)  // IN
+RPCPluginInstance::AcquireCredit(uint32 requestCtxId,  // IN
+                                 uint32 msgBytes,      // IN
+                                 bool force)           // IN
 {
-   RPCManager* rpcManager = GetRPCManager();
+   RMLockMutex(m_pendingMsgMutex);
 
-   /*
-    * WaitForEvent calls Poll() which will ASSERT for TCPRAW channels
-    */
-   if (rpcManager->m_channelType == VDPSERVICE_TCPRAW_CHANNEL) {
-      LOG("Channel type is TCPRAW, skipping wait");
-   } else {
-      rpcManager->WaitForEvent(m_pendingMsgEvent, msTimeout);
+   if (!force && m_pendingMsgCount > 0) {
+      bool msgsFull = m_creditMaxMsgs != 0 &&
+                      (uint32)m_pendingMsgCount >= m_creditMaxMsgs;
+      bool bytesFull = m_creditMaxBytes != 0 &&
+                       m_pendingMsgBytes + msgBytes > m_creditMaxBytes;
+
+      if (msgsFull || bytesFull) {
+         m_creditBlocked = true;
+         RMResetEvent(m_creditEvent);
+         RMUnlockMutex(m_pendingMsgMutex);
+         return false;
+      }
    }
 
-   if (m_pendingMsgCount != 0) {
-      const char* s = m_pendingMsgCount == 1 ? "" : "s";
-      LOG("%d message%s still pending", m_pendingMsgCount, s);
-      m_pendingMsgCount = 0;
-      return false;
+   m_pendingMsgCount++;
+   if (msgBytes != 0) {
+      /*
+       * A vector rather than a map so that steady state sending does
+       * not allocate, completions mostly come in order.
+       */
+      m_pendingMsgBytes += msgBytes;
+      m_pendingMsgSizes.push_back(std::make_pair(requestCtxId, msgBytes));
    }
 
+   RMResetEvent(m_pendingMsgEvent);
+   RMUnlockMutex(m_pendingMsgMutex);
    return true;
 }
 
@@ -2127,57 +6255,108 @@ RPCPluginInstance::WaitForPendingMessages(uint32 msTimeout)  // IN
 /*
  *----------------------------------------------------------------------
  *
- * RPCPluginInstance::TrackPendingMessages --
+ * RPCPluginInstance::ReleaseCredit --
  *
- *    This function is called from SndMsg() with <msgSent> set to
- *    TRUE to track the number of pending messages.
- *
- *    This function is called by OnMsgDone() and OnMsgAbort() with
- *    <msgSent> set to FALSE to track the number of pending messages.
+ *    Called by OnMsgDone() and OnMsgAbort() to give back the credit of
+ *    a completed message.  <requestCtxId> 0 only re-checks the window.
  *
  * Results:
- *    A debugging message is returned via <msg> that can be written
- *    to the logs to track the number of pending messages
+ *    None.
  *
  * Side effects:
  *    When the number of pending messages is 0 an event is signaled.
+ *    OnCreditAvailable() is called and the credit event signaled if a
+ *    blocked sender can go on.
+ *    The buffer attached to the message goes back to the pool and its
+ *    room in the priority lane window is given back.  The open batch is
+ *    sent if it no longer waits for any message in flight.
  *
  *----------------------------------------------------------------------
  */
 
-int32
-RPCPluginInstance::TrackPendingMessages(bool msgSent,     // IN
-                                        char* msg,        // OUT
-                                        int32 maxMsgLen)  // IN
+void
+RPCPluginInstance::ReleaseCredit(uint32 requestCtxId)  // IN
 {
-   RMLockMutex(m_pendingMsgMutex);
-   int32 pendingMsgCount = m_pendingMsgCount + (msgSent ? 1 : -1);
+   bool notify = false;
 
-   if (pendingMsgCount < 0) {
-      pendingMsgCount = 0;
+   RMLockMutex(m_pendingMsgMutex);
 
-      if (msg != NULL && maxMsgLen > 0 ) {
-         _snprintf_s(msg, maxMsgLen, _TRUNCATE, " (unexpected message)");
+   if (requestCtxId != 0) {
+      if (m_pendingMsgCount > 0) {
+         m_pendingMsgCount--;
+      } else {
+         LOG("Unexpected completion of request %u", requestCtxId);
       }
 
-   } else {
-      if (msg != NULL && maxMsgLen > 0 ) {
-         const char* s = pendingMsgCount == 1 ? "" : "s";
-         _snprintf_s(msg, maxMsgLen, _TRUNCATE,
-                     " (%d message%s pending)", pendingMsgCount, s);
+      for (auto it = m_pendingMsgSizes.begin(); it != m_pendingMsgSizes.end(); ++it) {
+         if (it->first == requestCtxId) {
+            m_pendingMsgBytes -= it->second;
+            m_pendingMsgSizes.erase(it);
+            break;
+         }
       }
    }
 
-   if (pendingMsgCount == 0) {
+   if (m_pendingMsgCount == 0) {
       RMSetEvent(m_pendingMsgEvent);
-   } else {
-      RMResetEvent(m_pendingMsgEvent);
    }
 
-   m_pendingMsgCount = pendingMsgCount;
+   if (m_creditBlocked) {
+      bool msgsFull = m_creditMaxMsgs != 0 &&
+                      (uint32)m_pendingMsgCount >= m_creditMaxMsgs;
+      bool bytesFull = m_creditMaxBytes != 0 &&
+                       m_pendingMsgBytes >= m_creditMaxBytes;
+      if (!msgsFull && !bytesFull) {
+         m_creditBlocked = false;
+         RMSetEvent(m_creditEvent);
+         notify = true;
+      }
+   }
+
+   RMUnlockMutex(m_pendingMsgMutex);
+
+   if (requestCtxId != 0) {
+      m_bufferPool.ReleaseMessage(requestCtxId);
+      ReleaseLane(requestCtxId);
+   }
+
+   if (notify) {
+      OnCreditAvailable();
+   }
+
+   FlushIdleBatch();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPluginInstance::ResetCredit --
+ *
+ *    Forgets every message in flight, used when they can no longer
+ *    complete (channel object destroyed or wait timed out).
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The pending message event is signaled, attached buffers are
+ *    released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCPluginInstance::ResetCredit()
+{
+   RMLockMutex(m_pendingMsgMutex);
+   m_pendingMsgCount = 0;
+   m_pendingMsgBytes = 0;
+   m_pendingMsgSizes.clear();
    RMUnlockMutex(m_pendingMsgMutex);
 
-   return pendingMsgCount;
+   m_bufferPool.ReleaseAll();
+   ReleaseCredit(0);
 }
 
 
@@ -15,10 +15,54 @@
 #include "vdprpc_interfaces.h"
 #include "vdpOverlay.h"
 #include "helpers.h"
+#include "MPSCQueue.h"
+#include "RPCBufferPool.h"
+#include "RPCChannelSelector.h"
+#include "RPCCommandTable.h"
+#include "RPCCompressionPolicy.h"
+#include "RPCLaneScheduler.h"
+#include "RPCMessage.h"
+#include "RPCPackedStruct.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 // command to send the channel type of ping program.
 #define VDP_PING_CHANNEL       "VdpPingChannel"
 
+// command carrying several coalesced messages, see SetBatching().
+#define VDP_RPC_BATCH          "VdpRpcBatch"
+
+// command measuring a candidate channel, see RPCChannelSelector.
+#define VDP_RPC_PROBE          "VdpRpcProbe"
+
+// command carrying one piece of a large message, see SetPriorityLanes().
+#define VDP_RPC_CHUNK          "VdpRpcChunk"
+
+// command carrying a journaled message, see SetJournal().
+#define VDP_RPC_JOURNAL        "VdpRpcJournal"
+
+// capabilities exchanged with the VDP_PING_CHANNEL message.
+#define VDP_RPC_CAP_BATCH      0x1
+#define VDP_RPC_CAP_PACKED     0x2
+#define VDP_RPC_CAP_INTERN     0x4
+#define VDP_RPC_CAP_PROBE      0x8
+#define VDP_RPC_CAP_CHUNK      0x10
+#define VDP_RPC_CAP_JOURNAL    0x20
+#define VDP_RPC_CAPS           (VDP_RPC_CAP_BATCH | VDP_RPC_CAP_PACKED | \
+                                VDP_RPC_CAP_INTERN | VDP_RPC_CAP_PROBE | \
+                                VDP_RPC_CAP_CHUNK | VDP_RPC_CAP_JOURNAL)
+
 // command for TCP ECHO.
 #define VDP_PING_CMD           1
 #define VDP_PING_ECHO          2
@@ -27,13 +71,33 @@
 // For current windows session
 #define VDP_CURRENT_SESSION    -1
 
+/* Result of RPCPluginInstance::TryInvokeMessage() */
+typedef enum {
+   RPC_INVOKE_OK              = 0,     /* message sent (or queued) */
+   RPC_INVOKE_WOULD_BLOCK     = 1,     /* credit window full, try again
+                                          after OnCreditAvailable() */
+   RPC_INVOKE_FAILED          = 2      /* not ready or Invoke failed */
+} RPCInvokeResult;
+
+/* Counters of RPCPluginInstance::SetJournal() */
+typedef struct {
+   uint64         journaled;        /* messages sent through the journal */
+   uint64         acked;            /* completed by the peer */
+   uint64         replayed;         /* sent again after a reconnect */
+   uint64         duplicates;       /* from the peer, already delivered */
+   uint32         depth;            /* messages journaled now */
+   uint64         depthBytes;
+} RPCJournalStats;
+
 /* The different channels to send ping packet  */
 typedef enum {
    VDPSERVICE_MAIN_CHANNEL    = 0x1,   /* vdpservice main channel */
    VDPSERVICE_VCHAN_CHANNEL   = 0x2,   /* vdpservice virtual side channel */
    VDPSERVICE_TCP_CHANNEL     = 0x3,   /* vdpservice tcp side channel */
-   VDPSERVICE_TCPRAW_CHANNEL  = 0x4    /* vdpservice tcp side channel
+   VDPSERVICE_TCPRAW_CHANNEL  = 0x4,   /* vdpservice tcp side channel
                                           streamData mode(raw tcp socket) */
+   VDPSERVICE_AUTO_CHANNEL    = 0x5    /* ServerInit2() only: measure the
+                                          channels above and pick one */
 } VdpServiceChannelType;
 
 
@@ -46,7 +110,20 @@ typedef enum {
 #define EXPORTFN __attribute__((visibility("default")))
 #endif
 
+/*
+ * The vdpService exports the agent side needs.  The Windows SDK has
+ * them, on Linux there is no agent unless a host such as the loopback
+ * emulator in samples/loopback hands in its own, see
+ * RPCManager::SetServerEntryPoints().
+ */
+typedef struct {
+   Bool (*ServerInit2)(unsigned long sessionId, const char* token,
+                       VDP_SERVICE_QUERY_INTERFACE* qi, void** channelHandle);
+   Bool (*ServerExit2)(unsigned long sessionId);
+} RPCServerEntryPoints;
+
 class RPCManager;
+class RPCReply;
 
 /*
  *----------------------------------------------------------------------
@@ -54,9 +131,10 @@ class RPCManager;
  * Class RPCPluginInstance
  *
  *    This class tracks an instance of an RPC plugin.  On the server
- *    there is only a single instance per process.  On the client
- *    there can be multiple instances, each instance talks to a
- *    different process on the server.
+ *    there is one instance per session: a single one per process with
+ *    ServerInit2(), one for each session an RPCSessionManager opens.
+ *    On the client there can be multiple instances, each instance
+ *    talks to a different session on the server.
  *
  *----------------------------------------------------------------------
  */
@@ -90,8 +168,118 @@ public:
     */
    bool WaitForPendingMessages(uint32 msTimeout);
 
+   /*
+    * Flow control window for the messages sent by this instance.  A
+    * message holds one message credit plus its byte count from the time
+    * it is sent until OnDone() or OnAbort().  TryInvokeMessage() refuses
+    * to exceed either limit, 0 means unlimited (the default).  A single
+    * message larger than the byte window is let through when nothing
+    * else is in flight.
+    */
+   void SetCreditWindow(uint32 maxMsgs, uint32 maxBytes);
+   void GetCreditUsage(uint32* inFlightMsgs, uint32* inFlightBytes);
+
+   /*
+    * Opt-in coalescing of small messages.  A message sent while nothing
+    * is in flight goes out right away.  Otherwise sent messages are
+    * held until the messages in flight have completed, for at most
+    * <maxDelayUs> microseconds, or until about <maxBytes> bytes (0
+    * means no limit) are held, and then go out as one VDP_RPC_BATCH
+    * message.  The peer splits it back into separate OnInvoke() calls
+    * and each message still gets its own OnDone() or OnAbort().  Only
+    * the command and the positional parameters are carried, so a
+    * message posted with SetPostMode() is always sent on its own, other
+    * options set with SetOps() are lost.  Nothing is held unless the
+    * peer announced VDP_RPC_CAP_BATCH.  A <maxDelayUs> of 0 turns it
+    * off.
+    */
+   bool SetBatching(uint32 maxDelayUs, uint32 maxBytes);
+   void FlushBatch();
+
+   /*
+    * Same as SetOps() of the channel context interface with
+    * VDP_RPC_CHANNEL_CONTEXT_OPT_POST, but also keeps the message out
+    * of the batches of SetBatching().
+    */
+   bool SetPostMode(void* messageCtx, bool post);
+   uint32 GetPeerCaps() const { return m_peerCaps; }
+
+   /*
+    * Opt-in priority lanes.  Sent messages are queued per traffic class
+    * and handed to RPC by a deficit round robin (see RPCLaneScheduler)
+    * while less than <windowBytes> are in flight, so a small message
+    * never waits behind more than about a window of bulk data.  Messages
+    * of <chunkBytes> or more go to the bulk lane, all others to the
+    * interactive lane, unless sent with InvokeMessage(ctx, lane).  If the
+    * peer announced VDP_RPC_CAP_CHUNK a message larger than <chunkBytes>
+    * is sent as VDP_RPC_CHUNK pieces of that size, other messages can go
+    * out between them, and the peer gets it back as one OnInvoke().  A
+    * <windowBytes> of 0 turns the lanes off and sends what is queued.
+    */
+   bool SetPriorityLanes(uint32 windowBytes, uint32 chunkBytes);
+   void SetLaneQuantum(RPCTrafficClass lane, uint32 bytes);
+   void GetLaneStats(RPCTrafficClass lane, RPCLaneStats* stats);
+
+   /*
+    * Opt-in journal of unacknowledged messages.  Once the peer announced
+    * VDP_RPC_CAP_JOURNAL every sent message is kept, up to <maxMsgs>
+    * messages and <maxBytes> bytes (0 means no byte limit), until the
+    * peer has processed it, and goes out as a VDP_RPC_JOURNAL message
+    * with a sequence number.  When the channel object is lost the
+    * messages still journaled do not complete.  They are sent again, in
+    * order, once the channel object is connected and ready again, and
+    * the peer drops the ones it already handled by their sequence
+    * number.  Such a duplicate completes with no return values.  As for
+    * batches, options set with SetOps() are not carried.  A message that
+    * does not fit is refused.  A <maxMsgs> of 0 turns it off, messages
+    * still journaled then are aborted on the next connect.
+    */
+   void SetJournal(uint32 maxMsgs, uint32 maxBytes);
+   void GetJournalStats(RPCJournalStats* stats);
+
+   /*
+    * Allocation counters of the payload buffer pool, see AcquireBuffer().
+    */
+   void GetBufferStats(RPCBufferPoolStats* stats) { m_bufferPool.GetStats(stats); }
+
+   /*
+    * When compression is enabled, messages created with a payload hint
+    * are compressed with no compression, Snappy or zlib as decided by
+    * RPCCompressionPolicy.  Messages without a hint use Snappy.
+    */
+   void SetCompressionThresholds(uint32 minBytes, uint32 zlibMinBytes)
+   {
+      m_compressionPolicy.SetThresholds(minBytes, zlibMinBytes);
+   }
+   void GetCompressionStats(RPCCompressionStats* stats) { m_compressionPolicy.GetStats(stats); }
+
    const VdpServiceChannelType GetChannelType();
 
+   /*
+    * With VDPSERVICE_AUTO_CHANNEL the server measures the round trip
+    * and the throughput of each candidate channel (see
+    * RPCChannelSelector) before it gets ready, and picks the best one
+    * for the traffic class set here, RPC_TRAFFIC_INTERACTIVE by default.
+    * Set it before ServerInit2().  The measurement is repeated when the
+    * channel object reconnects.  GetChannelType() returns the channel
+    * in use once ready.
+    */
+   void SetTrafficClass(RPCTrafficClass trafficClass) { m_trafficClass = trafficClass; }
+   VdpServiceChannelType GetChannelChoice(RPCTrafficClass trafficClass) const
+   {
+      return (VdpServiceChannelType)m_selector.GetChoice(trafficClass);
+   }
+   bool GetProbeResult(VdpServiceChannelType type, RPCChannelProbeResult* result) const
+   {
+      return m_selector.GetResult(type, result);
+   }
+
+   /*
+    * Session this instance serves when it was opened through
+    * RPCSessionManager::OpenSession(), VDP_CURRENT_SESSION otherwise.
+    */
+   DWORD GetSessionId() const { return m_sessionId; }
+
    /* make it public for RPCVariant */
    const VDPRPC_VariantInterface* VariantInterface();
 
@@ -105,6 +293,153 @@ protected:
    bool DestroyMessage(void* messageCtx);
    bool InvokeMessage(void* messageCtx, bool channelTypeMessage=false);
 
+   /*
+    * Same as InvokeMessage() on the given lane when the priority lanes
+    * are on, see SetPriorityLanes().
+    */
+   bool InvokeMessage(void* messageCtx, RPCTrafficClass lane);
+
+   /*
+    * Same as CreateMessage() with the largest part of the payload that
+    * is going to be appended, so that the compression can be chosen
+    * for it.  <command> groups messages of the same kind for the
+    * compression statistics.
+    */
+   bool CreateMessage(void** pMessageCtx, uint32 command,
+                      const void* payload, uint32 payloadBytes);
+
+   /*
+    * Non-blocking send subject to the credit window.  <msgBytes> is the
+    * payload size charged against the byte window, 0 has the size of
+    * the message estimated.  On
+    * RPC_INVOKE_WOULD_BLOCK the caller still owns the message context
+    * and OnCreditAvailable() is called once credit has come back.
+    * InvokeMessage() always sends but its messages still use credit,
+    * one each plus their estimated size.
+    */
+   RPCInvokeResult TryInvokeMessage(void* messageCtx, uint32 msgBytes=0);
+
+   /*
+    * Waits up to <msTimeout> for the credit TryInvokeMessage() lacked
+    * to come back, giving RPC its timeslices meanwhile.  Returns as
+    * soon as it is back rather than at the end of the timeout.
+    */
+   bool WaitForCredit(uint32 msTimeout);
+
+   /*
+    * Same as InvokeMessage() but the completion is delivered through
+    * <reply> instead of OnDone()/OnAbort().  The future becomes ready
+    * when the peer has responded (RPCReply::IsDone() is true) or the
+    * message was aborted or lost with the channel object.  Any number
+    * of requests can be in flight; the future can be polled with
+    * wait_for(0) from any thread.
+    */
+   bool InvokeAsync(void* messageCtx, std::future<RPCReply>* reply);
+
+   /*
+    * Pooled payload buffers.  A buffer passed to AttachBuffer() stays
+    * valid until the message completes (OnDone() or OnAbort(), also for
+    * batched messages) and then goes back to the pool by itself.  Call
+    * AttachBuffer() before invoking, at most once per message.  If the
+    * message is destroyed without being sent, ReleaseBuffer() it.
+    */
+   RPCBuffer* AcquireBuffer(uint32 size) { return m_bufferPool.Acquire(size); }
+   void ReleaseBuffer(RPCBuffer* buffer) { m_bufferPool.Release(buffer); }
+   void AttachBuffer(void* messageCtx, RPCBuffer* buffer);
+
+   /*
+    * Typed counterparts of the above for messages described by an
+    * RPCMessage<> typedef (see RPCMessage.h).  InvokeCommand() creates,
+    * fills and sends the message in one go, Decode() reads the
+    * parameters of a message received in OnInvoke().
+    */
+   template<typename Msg, typename... Args>
+   bool InvokeCommand(const Args&... args)
+   {
+      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+      void* messageCtx = NULL;
+
+      /*
+       * Scalar only messages are too small to be worth compressing.
+       */
+      bool created = Msg::Scalar
+                   ? CreateMessage(&messageCtx, Msg::Command, NULL, 0)
+                   : CreateMessage(&messageCtx);
+      if (!created) {
+         return false;
+      }
+
+      iChannelCtx->v1.SetCommand(messageCtx, Msg::Command);
+
+      if (!Msg::Encode(iChannelCtx, messageCtx, args...) ||
+          !InvokeMessage(messageCtx)) {
+         DestroyMessage(messageCtx);
+         return false;
+      }
+
+      return true;
+   }
+
+   template<typename Msg, typename... Args>
+   bool Decode(void* messageCtx, Args&... args)
+   {
+      return Msg::Decode(ChannelContextInterface(), VariantInterface(),
+                         messageCtx, args...);
+   }
+
+   /*
+    * Same for a RPC_PACKED_STRUCT (see RPCPackedStruct.h).  The struct
+    * goes out as a single blob when the peer announced
+    * VDP_RPC_CAP_PACKED and as one parameter per field otherwise,
+    * DecodeStruct() accepts both.
+    */
+   template<typename S>
+   bool InvokeStruct(uint32 command, const S& value)
+   {
+      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+      void* messageCtx = NULL;
+
+      if (!CreateMessage(&messageCtx, command, &value, (uint32)sizeof value)) {
+         return false;
+      }
+
+      iChannelCtx->v1.SetCommand(messageCtx, command);
+
+      bool packed = (GetPeerCaps() & VDP_RPC_CAP_PACKED) != 0;
+      if (!S::Encode(iChannelCtx, messageCtx, value, packed) ||
+          !InvokeMessage(messageCtx)) {
+         DestroyMessage(messageCtx);
+         return false;
+      }
+
+      return true;
+   }
+
+   template<typename S>
+   bool DecodeStruct(void* messageCtx, S* value)
+   {
+      return S::Decode(ChannelContextInterface(), VariantInterface(),
+                       messageCtx, value);
+   }
+
+   /*
+    * Optional command table (see RPCCommandTable.h), register it from
+    * the constructor.  Received messages whose command has a handler go
+    * to the handler, all others to OnInvoke().  SetCommand() sets the
+    * command of entry <index> on a message to send, interned if the
+    * peer knows it, and IsCommand() tells the command of a sent message
+    * in OnDone().
+    */
+   bool RegisterCommands(const RPCCommandEntry* entries, int count);
+   bool SetCommand(void* messageCtx, int index)
+   {
+      return m_commands.SetCommand(ChannelContextInterface(), messageCtx, index);
+   }
+   bool IsCommand(void* messageCtx, int index)
+   {
+      return m_commands.IsCommand(ChannelContextInterface(), messageCtx, index);
+   }
+
    /*
     * ChannelContextInterface() and VariantInterface() can be used
     * to get incoming parameters and set outgoing parameters.
@@ -143,6 +478,12 @@ private:
    virtual void OnDone(uint32 requestCtxId, void *returnCtx) { }
    virtual void OnAbort(uint32 requestCtxId, Bool userCancelled, uint32 reason) { }
 
+   /*
+    * Called from the completion callbacks when credit is available
+    * again after TryInvokeMessage() returned RPC_INVOKE_WOULD_BLOCK.
+    */
+   virtual void OnCreditAvailable() { }
+
    /*
     * This method can be overriden to be notified when the peer
     * has sent you a message.  ChannelContextInterface and
@@ -180,28 +521,194 @@ private:
    bool              m_connected;
    bool              m_sideChannelPending;
 
-   bool              m_isReady;
+   std::atomic<bool> m_isReady;
    HANDLE            m_hReadyEvent;
 
    HANDLE            m_pendingMsgMutex;
    HANDLE            m_pendingMsgEvent;
    int32             m_pendingMsgCount;
+   uint32            m_pendingMsgBytes;
+   uint32            m_creditMaxMsgs;
+   uint32            m_creditMaxBytes;
+   bool              m_creditBlocked;
+   HANDLE            m_creditEvent;
+   std::vector<std::pair<uint32, uint32> > m_pendingMsgSizes;
+   RPCBufferPool     m_bufferPool;
+   RPCCompressionPolicy m_compressionPolicy;
    int               m_socketHandle;
 
    uint32            m_channelObjOptions;
-   int32 TrackPendingMessages(bool msgSent, char* msg, int32 maxMsgLen);
+   std::atomic<uint32> m_peerCaps;
+   RPCCommandTable   m_commands;
+
+   /* VDPSERVICE_AUTO_CHANNEL */
+   RPCChannelSelector m_selector;
+   RPCTrafficClass   m_trafficClass;
+
+   /* set by RPCSessionManager */
+   DWORD             m_sessionId;
+   int               m_sessionWorker;
+
+   /* messages held by SetBatching() and batches waiting for OnDone */
+   std::mutex        m_batchMutex;
+   std::mutex        m_batchSendMutex;
+   std::condition_variable m_batchCond;
+   std::thread       m_batchThread;
+   bool              m_batchStop;
+   uint32            m_batchMaxDelayUs;
+   uint32            m_batchMaxBytes;
+   void*             m_batchCtx;
+   uint32            m_batchBytes;
+   std::vector<void*> m_batchMsgs;
+   std::unordered_set<uint32> m_postedMsgs;
+   std::chrono::steady_clock::time_point m_batchDeadline;
+   std::unordered_map<uint32, std::vector<void*> > m_batchesInFlight;
+
+   /* large message split by SetPriorityLanes(), kept by each of its chunks */
+   typedef struct {
+      void*             messageCtx;       /* the original, completed at the end */
+      uint32            requestCtxId;
+      std::vector<char> data;             /* see SerializeMessage() */
+      uint32            chunkBytes;
+      uint32            chunks;
+      bool              finished;
+   } ChunkTransfer;
+
+   typedef struct {
+      void*             messageCtx;       /* NULL for a chunk */
+      std::shared_ptr<ChunkTransfer> transfer;
+      uint32            chunk;
+   } LaneItem;
+
+   /* chunks of the peer being put back together */
+   typedef struct {
+      uint32            next;
+      std::vector<char> data;
+   } ChunkAssembly;
+
+   /* messages queued by SetPriorityLanes() and what they have in flight */
+   std::mutex        m_laneMutex;
+   RPCLaneScheduler<LaneItem> m_lanes;
+   uint32            m_laneWindow;
+   uint32            m_laneChunkBytes;
+   uint32            m_laneInFlightBytes;
+   bool              m_laneSending;
+   std::unordered_map<uint32, uint32> m_laneInFlight;
+   std::unordered_map<uint32, LaneItem> m_chunksInFlight;
+   std::unordered_map<uint32, ChunkAssembly> m_chunksReceived;
+
+   /* message kept by SetJournal() until the peer has processed it */
+   typedef struct {
+      uint32            seq;
+      void*             messageCtx;       /* the original, completed at the end */
+      uint32            requestCtxId;
+      uint32            msgBytes;         /* charged credit, see AcquireCredit() */
+      bool              charged;          /* false once ResetCredit() forgot it */
+      int               lane;
+      uint32            wireId;           /* VDP_RPC_JOURNAL in flight, or 0 */
+      std::vector<char> data;             /* see SerializeMessage() */
+   } JournalEntry;
+
+   /* send order of the journal and what the peer delivered of ours */
+   std::mutex        m_journalMutex;
+   std::mutex        m_journalSendMutex;
+   uint32            m_journalMaxMsgs;
+   uint32            m_journalMaxBytes;
+   uint32            m_journalEpoch;
+   uint32            m_journalSeq;
+   uint64            m_journalBytes;
+   std::deque<std::shared_ptr<JournalEntry> > m_journal;
+   std::unordered_map<uint32, std::shared_ptr<JournalEntry> > m_journalWire;
+   uint32            m_peerJournalEpoch;
+   uint32            m_peerJournalSeq;   /* all up to here delivered */
+   std::set<uint32>  m_peerJournalSeen;  /* delivered above m_peerJournalSeq */
+   RPCJournalStats   m_journalStats;
+
+   /* messages of this instance waiting in the RPCManager pump queue */
+   std::atomic<int32> m_pumpQueued;
+
+   /* outstanding InvokeAsync() requests keyed by request context id */
+   std::mutex        m_asyncMutex;
+   std::unordered_map<uint32, std::promise<RPCReply> > m_asyncReplies;
+
+   bool CompleteAsync(uint32 requestCtxId, void* returnCtx);
+   bool AbortAsync(uint32 requestCtxId, Bool userCancelled, uint32 reason);
+   void AbortAllAsync();
+
+   bool AcquireCredit(uint32 requestCtxId, uint32 msgBytes, bool force);
+   uint32 MessageBytes(void* messageCtx);
+   void ReleaseCredit(uint32 requestCtxId);
+   void ResetCredit();
+   bool SendMessage(void* messageCtx, bool channelTypeMsg, bool allowBatch);
+   bool CreateMessageCtx(void** pMessageCtx, bool hasPayload, uint32 command,
+                         const void* payload, uint32 payloadBytes);
+   bool InvokeQueuedMessage(void* messageCtx);
+
+   bool BatchMessage(void* messageCtx);
+   void SendOpenBatch();
+   void FlushIdleBatch();
+   void BatchThreadMain();
+   void StopBatchThread();
+   void OnBatchInvoke(void* messageCtx);
+   void OnBatchDone(uint32 batchId, void* returnCtx);
+   void AppendReturns(void* subCtx, void* messageCtx);
+   bool TakeReturns(void* returnCtx, int* pos, void* messageCtx);
+   bool AbortBatch(uint32 batchId, Bool userCancelled, uint32 reason);
+   void AbortBatchedMessages(std::vector<void*>& msgs, Bool userCancelled,
+                             uint32 reason);
+   void DiscardOpenBatch();
+   void AbortAllBatches();
+
+   bool SubmitMessage(void* messageCtx, int lane, uint32 msgBytes);
+   bool QueueMessage(void* messageCtx, int lane, uint32 msgBytes);
+   void DispatchLanes();
+   void ReleaseLane(uint32 requestCtxId);
+   void DiscardLanes();
+   void* CreateChunkMessage(const LaneItem& item);
+   bool SerializeMessage(void* messageCtx, std::vector<char>* data);
+   bool DeserializeMessage(const std::vector<char>& data, void* messageCtx);
+   void OnChunkInvoke(void* messageCtx);
+   void OnChunkDone(uint32 chunkId, void* returnCtx);
+   bool AbortChunk(uint32 chunkId, Bool userCancelled, uint32 reason);
+   void FinishTransfer(const std::shared_ptr<ChunkTransfer>& transfer,
+                       void* returnCtx, Bool userCancelled, uint32 reason);
+
+   bool JournalMessage(void* messageCtx, int lane, uint32 msgBytes);
+   bool SendJournalEntry(const std::shared_ptr<JournalEntry>& entry);
+   bool SendPendingJournal(uint32 fresh);
+   void ReplayJournal();
+   void AbortJournal(bool all);
+   void ResetJournalWire();
+   bool IsJournalMessage(void* messageCtx);
+   void OnJournalInvoke(void* messageCtx);
+   bool OnJournalDone(uint32 wireId, void* returnCtx);
+   bool OnJournalAbort(uint32 wireId);
+
+   void CompleteMessage(uint32 requestCtxId, void* returnCtx);
+   void AbortMessage(uint32 requestCtxId, Bool userCancelled, uint32 reason);
+
+   void OnChannelTypeDone(void* returnCtx);
+   void SetPeerCommands(const VDP_RPC_VARIANT* names);
+   void DeliverInvoke(void* messageCtx);
 
    void OnChannelConnected();
    void OnChannelDisconnected();
 
    bool ChannelObjCreate();
    bool ChannelObjDestroy();
+   int  ChannelObjFlags();
 
    void OnChannelObjConnected();
    void OnChannelObjDisconnected();
    void OnSidechannelConnected();
+   void SetReady();
+   bool SendChannelType();
+   void ConnectChannelType();
+   void OnChannelSelected();
 
    friend class RPCManager;
+   friend class RPCSessionManager;
+   friend class RPCChannelSelector;
 
    /*
     * Implementation/platform specific implementations
@@ -224,7 +731,9 @@ private:
  *    This class does all the bookkeeping for sending and receiving RPC
  *    messages.  There can only be one instance of this class per process.
  *    It handles the desktop connection and channel connection callbacks.
- *    It supports a single channel object to send and receive messages.
+ *    Each RPCPluginInstance has its own channel object to send and
+ *    receive messages: the only one with ServerInit2(), one per session
+ *    with RPCSessionManager, one per plugin instance on the client.
  *
  *----------------------------------------------------------------------
  */
@@ -273,6 +782,13 @@ public:
    virtual void OnServerInit() { }
    virtual void OnServerExit() { }
 
+   /*
+    * Replaces the vdpService exports ServerInit2() and RPCSessionManager
+    * open and close the sessions with, before either is called.  NULL
+    * restores the platform's own, none on Linux.
+    */
+   static void SetServerEntryPoints(const RPCServerEntryPoints* entryPoints);
+
    /*
     * Because RPC takes a single-threaded approach it needs to be given
     * timeslices to do it's work when an application is doing work.
@@ -327,8 +843,26 @@ public:
 
    void SetChannelType(VdpServiceChannelType t) { m_channelType = t; }
 
+   /*
+    * Optionally hand the RPC work to a dedicated pump thread.  While the
+    * pump runs InvokeMessage() only pushes the message onto a lock-free
+    * queue and returns, so any application thread can send without doing
+    * RPC work itself.  The pump thread invokes the queued messages and,
+    * on the server, also polls the channel of <rpcPlugin>.  Poll() then
+    * returns immediately and WaitForEvent() only waits for the event.
+    * On the client the vdpservice host keeps polling, the pump thread
+    * is only registered with the channel of <rpcPlugin>.
+    *
+    * StopPumpThread() sends whatever is still queued before it returns.
+    * ServerExit2() and ClientExit() stop the pump if it is running.
+    */
+   bool StartPumpThread(RPCPluginInstance* rpcPlugin);
+   void StopPumpThread();
+   bool IsPumpRunning() { return m_pumpRunning; }
+
 private:
    static RPCManager*               s_instance;
+   static const RPCServerEntryPoints* s_serverEntryPoints;
 
    bool                             m_isServer;
    bool                             m_serverInit;
@@ -337,6 +871,9 @@ private:
    bool                             m_compressionEnabled;
    bool                             m_encryptionEnabled;
 
+   /* the instance of ServerInit2(VDPSERVICE_AUTO_CHANNEL) */
+   RPCPluginInstance*               m_autoPlugin;
+
 
    char                             m_tokenName[60];
    char                             m_channelObjName[64];
@@ -356,9 +893,57 @@ private:
 
    VDPRPC_StreamDataInterface       m_iStreamData;
    VDPService_ObserverInterface     m_iVdpObserverInterface;
+   VDPService_LocalJobInterface     m_iLocalJob;
+
+   typedef struct {
+      RPCPluginInstance*            plugin;
+      void*                         messageCtx;
+   } PumpItem;
+
+   MPSCQueue<PumpItem>              m_pumpQueue;
+   std::thread                      m_pumpThread;
+   std::thread::id                  m_pumpThreadId;
+   std::mutex                       m_pumpMutex;
+   std::condition_variable          m_pumpCond;
+   std::atomic<bool>                m_pumpRunning;
+   std::atomic<bool>                m_pumpStop;
+   std::atomic<bool>                m_pumpSleeping;
+   std::atomic<bool>                m_pumpWakeRequested;
+   bool                             m_pumpPollsChannel;
+
+   /* PumpFlush() waits for PumpDrain() */
+   std::mutex                       m_pumpFlushMutex;
+   std::condition_variable          m_pumpFlushCond;
+   std::atomic<int32>               m_pumpFlushWaiters;
+
+   /* RPCSessionManager workers poll the channels */
+   std::atomic<bool>                m_workersPoll;
+   void*                            m_pumpChannel;
+   VdpLocalJobDispatcher            m_pumpDispatcher;
+
+   /* of the thread that polls in WaitForEvent(), see RMSetEvent() */
+   VdpLocalJobDispatcher            m_pollDispatcher;
 
    bool Init(bool isServer, const VDP_SERVICE_QUERY_INTERFACE* qi);
 
+   /*
+    * False while another thread (the pump or the session workers) gives
+    * RPC its timeslices, Poll() and WaitForEvent() then only wait.
+    */
+   bool PollHere() const
+   {
+      return !(m_pumpRunning && m_pumpPollsChannel) && !m_workersPoll;
+   }
+
+   void CheckChannelSelection();
+
+   void PumpThreadMain();
+   void PumpSubmit(RPCPluginInstance* rpcPlugin, void* messageCtx);
+   void PumpWake();
+   void PumpDrain();
+   void PumpFlush(RPCPluginInstance* rpcPlugin);
+   static Bool PumpWakeJob(void* userData);
+
    static void __cdecl OnConnectionStateChanged(
                   void *userData,
                   VDPService_ConnectionState currentState,
@@ -406,11 +991,14 @@ private:
    ChannelObjectStateToStr(VDPRPC_ObjectState objState);
 
    friend class RPCPluginInstance;
+   friend class RPCSessionManager;
+   friend class RPCChannelSelector;
 
    /*
     * Implementation/platform specific implementations
     * RM == RPCManager
     */
+   static const RPCServerEntryPoints* RMServerEntryPoints();
    virtual bool AllowRunAsServer();
    bool RMWaitForEvent(HANDLE hEvent, uint32 msTimeout);
 };
@@ -455,6 +1043,148 @@ public:
 
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCScratchVariant
+ *
+ *    Variant for building outgoing parameters that only ever points at
+ *    memory owned by the caller, such as a pooled RPCBuffer.
+ *    AppendParam() copies it, so it is never passed to VariantClear()
+ *    and can be reused for any number of parameters without touching
+ *    the heap.  Never use it to receive a parameter.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCScratchVariant : public VDP_RPC_VARIANT
+{
+public:
+   RPCScratchVariant() { Reset(); }
+
+   void Reset()
+   {
+      vt = VDP_RPC_VT_EMPTY;
+      ullVal = 0;
+   }
+
+   void SetUInt32(uint32 value)                       // IN
+   {
+      vt = VDP_RPC_VT_UI4;
+      ulVal = value;
+   }
+
+   void SetStr(const char* str)                       // IN
+   {
+      vt = VDP_RPC_VT_LPSTR;
+      strVal = const_cast<char*>(str);
+   }
+
+   void SetBlob(const char* data, uint32 size)        // IN
+   {
+      vt = VDP_RPC_VT_BLOB;
+      blobVal.size = size;
+      blobVal.blobData = const_cast<char*>(data);
+   }
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCReply
+ *
+ *    Completion of a message sent with RPCPluginInstance::InvokeAsync().
+ *    It owns copies of the return values of the peer, so it stays valid
+ *    after the RPC callback returns.  The plugin instance that created
+ *    it must outlive it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+class RPCReply
+{
+public:
+   RPCReply()
+      : m_iVariant(NULL),
+        m_requestCtxId(0),
+        m_done(false),
+        m_userCancelled(FALSE),
+        m_reason(0),
+        m_returnCode(0)
+   {
+   }
+
+   RPCReply(RPCReply&& other)       // IN
+      : m_iVariant(NULL)
+   {
+      *this = std::move(other);
+   }
+
+   RPCReply& operator=(RPCReply&& other)  // IN
+   {
+      if (this != &other) {
+         Clear();
+         m_iVariant = other.m_iVariant;
+         m_requestCtxId = other.m_requestCtxId;
+         m_done = other.m_done;
+         m_userCancelled = other.m_userCancelled;
+         m_reason = other.m_reason;
+         m_returnCode = other.m_returnCode;
+         m_returnVals.swap(other.m_returnVals);
+         other.m_iVariant = NULL;
+      }
+      return *this;
+   }
+
+   ~RPCReply()
+   {
+      Clear();
+   }
+
+   /*
+    * true if the peer responded, false if the message was aborted.
+    */
+   bool IsDone() const { return m_done; }
+
+   uint32 RequestCtxId() const { return m_requestCtxId; }
+   uint32 ReturnCode() const { return m_returnCode; }
+   Bool UserCancelled() const { return m_userCancelled; }
+   uint32 AbortReason() const { return m_reason; }
+
+   int ReturnValCount() const { return (int)m_returnVals.size(); }
+
+   const VDP_RPC_VARIANT* ReturnVal(int i) const    // IN
+   {
+      return i >= 0 && i < ReturnValCount() ? &m_returnVals[i] : NULL;
+   }
+
+private:
+   const VDPRPC_VariantInterface*   m_iVariant;
+   uint32                           m_requestCtxId;
+   bool                             m_done;
+   Bool                             m_userCancelled;
+   uint32                           m_reason;
+   uint32                           m_returnCode;
+   std::vector<VDP_RPC_VARIANT>     m_returnVals;
+
+   void Clear()
+   {
+      if (m_iVariant != NULL) {
+         for (size_t i = 0; i < m_returnVals.size(); i++) {
+            m_iVariant->v1.VariantClear(&m_returnVals[i]);
+         }
+      }
+      m_returnVals.clear();
+   }
+
+   RPCReply(const RPCReply&);
+   RPCReply& operator=(const RPCReply&);
+
+   friend class RPCPluginInstance;
+};
+
+
+
 /*
  * MACRO DEFINITIONS
  */
@@ -10,6 +10,264 @@
 #include "stdafx.h"
 #include "RPCManager.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+
+/*
+ * The Win32 Event/Mutex objects used by RPCPluginInstance are emulated
+ * with a pthread mutex and a condition variable bound to CLOCK_MONOTONIC
+ * so that timed waits are not affected by wall clock changes.  The HANDLE
+ * values handed out by InitializeEventsAndMutexes() point to these.
+ */
+typedef struct {
+   pthread_mutex_t   mutex;
+   pthread_cond_t    cond;
+   bool              manualReset;
+   bool              signaled;
+   VdpLocalJobDispatcher waiter;    /* blocked in Poll() for the event */
+} RMPosixEvent;
+
+typedef struct {
+   pthread_mutex_t   mutex;
+} RMPosixMutex;
+
+/*
+ * Upper bound of a single wait slice in RMWaitForEvent().  Matches the
+ * granularity RPCManagerWin uses between two calls to Poll().  A
+ * blocking Poll() that no local job can interrupt is given shorter
+ * slices, they bound how late an event set by another thread is seen.
+ */
+#define RM_WAIT_SLICE_MS 100
+#define RM_POLL_SLICE_MS 5
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMGetTickCount --
+ *
+ *    Milliseconds elapsed on the monotonic clock.
+ *
+ * Results:
+ *    Monotonic time in milliseconds.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64_t
+RMGetTickCount()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMCreateEvent --
+ *
+ *    Posix counterpart of CreateEvent().
+ *
+ * Results:
+ *    The event handle or NULL on failure.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HANDLE
+RMCreateEvent(bool manualReset,  // IN
+              bool initialState) // IN
+{
+   RMPosixEvent *event = new RMPosixEvent;
+   pthread_condattr_t attr;
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+   if (pthread_mutex_init(&event->mutex, NULL) != 0) {
+      pthread_condattr_destroy(&attr);
+      delete event;
+      return NULL;
+   }
+
+   if (pthread_cond_init(&event->cond, &attr) != 0) {
+      pthread_condattr_destroy(&attr);
+      pthread_mutex_destroy(&event->mutex);
+      delete event;
+      return NULL;
+   }
+
+   pthread_condattr_destroy(&attr);
+   event->manualReset = manualReset;
+   event->signaled = initialState;
+   event->waiter = 0;
+   return event;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMCloseEvent --
+ *
+ *    Posix counterpart of CloseHandle() for an event.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RMCloseEvent(HANDLE hEvent) // IN
+{
+   RMPosixEvent *event = static_cast<RMPosixEvent*>(hEvent);
+
+   pthread_cond_destroy(&event->cond);
+   pthread_mutex_destroy(&event->mutex);
+   delete event;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMWaitForSingleEvent --
+ *
+ *    Posix counterpart of WaitForSingleObject() for an event.  An
+ *    auto-reset event is reset by a successful wait.
+ *
+ * Results:
+ *    WAIT_OBJECT_0 if the event was signaled, WAIT_TIMEOUT otherwise.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DWORD
+RMWaitForSingleEvent(HANDLE hEvent,    // IN
+                     uint32 msTimeout) // IN
+{
+   RMPosixEvent *event = static_cast<RMPosixEvent*>(hEvent);
+   struct timespec deadline;
+   DWORD rc = WAIT_OBJECT_0;
+
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += msTimeout / 1000;
+   deadline.tv_nsec += (long)(msTimeout % 1000) * 1000000;
+   if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+   }
+
+   pthread_mutex_lock(&event->mutex);
+
+   while (!event->signaled) {
+      int err = msTimeout == INFINITE
+              ? pthread_cond_wait(&event->cond, &event->mutex)
+              : pthread_cond_timedwait(&event->cond, &event->mutex, &deadline);
+      if (err == ETIMEDOUT) {
+         break;
+      }
+   }
+
+   if (event->signaled) {
+      if (!event->manualReset) {
+         event->signaled = false;
+      }
+   } else {
+      rc = WAIT_TIMEOUT;
+   }
+
+   pthread_mutex_unlock(&event->mutex);
+   return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMPollForEvent --
+ *
+ *    Polls the channel for up to <msTimeout> unless the event is
+ *    already signaled.  With a <dispatcher> the Poll() returns as soon
+ *    as RMSetEvent() sets the event from another thread.
+ *
+ * Results:
+ *    WAIT_OBJECT_0 if the event was signaled before the poll.
+ *
+ * Side Effects:
+ *    An auto-reset event is reset by a successful wait.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DWORD
+RMPollForEvent(HANDLE hEvent,                                 // IN
+               const VDPService_ChannelInterface* iChannel,   // IN
+               VdpLocalJobDispatcher dispatcher,              // IN
+               uint32 msTimeout)                              // IN
+{
+   RMPosixEvent *event = static_cast<RMPosixEvent*>(hEvent);
+
+   pthread_mutex_lock(&event->mutex);
+   if (event->signaled) {
+      if (!event->manualReset) {
+         event->signaled = false;
+      }
+      pthread_mutex_unlock(&event->mutex);
+      return WAIT_OBJECT_0;
+   }
+   event->waiter = dispatcher;
+   pthread_mutex_unlock(&event->mutex);
+
+   iChannel->v3.Poll((int)msTimeout);
+
+   pthread_mutex_lock(&event->mutex);
+   event->waiter = 0;
+   pthread_mutex_unlock(&event->mutex);
+   return WAIT_TIMEOUT;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RMWakeJob --
+ *
+ *    Local job requested by RMSetEvent(), running it is enough to make
+ *    the Poll() of RMPollForEvent() return.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+RMWakeJob(void* userData)   // IN
+{
+   return TRUE;
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -19,7 +277,8 @@
  *    Whether the RPCManager is allowed to run as server.
  *
  * Results:
- *    Returns false (non-Windows Agent not supported).
+ *    Returns false (non-Windows Agent not supported), unless a host
+ *    handed in the server entry points, see SetServerEntryPoints().
  *
  * Side Effects:
  *    None.
@@ -30,7 +289,30 @@
 bool
 RPCManager::AllowRunAsServer()
 {
-   return false;
+   return s_serverEntryPoints != NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::RMServerEntryPoints --
+ *
+ *    The server entry points of the platform.
+ *
+ * Results:
+ *    NULL, vdpService has no agent side on Linux.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const RPCServerEntryPoints*
+RPCManager::RMServerEntryPoints()
+{
+   return NULL;
 }
 
 
@@ -56,7 +338,75 @@ bool
 RPCManager::RMWaitForEvent(HANDLE hEvent,    // IN
                            uint32 msTimeout) // IN
 {
-   return false;
+   uint64_t msBegin = RMGetTickCount();
+   uint64_t msCurrent = 0;
+
+   /*
+    * Version 3 of the channel interface has a Poll() that blocks until
+    * the next message arrives or the timeout expires.  In that case
+    * the poll itself is the wait, RMSetEvent() interrupts it with a
+    * local job on the dispatcher of the polling thread, or the event is
+    * only checked between two short polls without one.  Otherwise we
+    * fall back to the non blocking v1 Poll() followed by a timed wait
+    * on the event, the same as on Windows.  When the pump thread or the
+    * session workers own the channel we only wait.
+    */
+   bool pollChannel = PollHere();
+   bool blockingPoll = pollChannel &&
+                       m_iChannel.version >= VDP_SERVICE_CHANNEL_INTERFACE_V3 &&
+                       m_iChannel.v3.Poll != NULL;
+
+   /*
+    * A timeout of 0 is a single pass that does not wait at all, so a
+    * caller that polls between two sends is not held to one message
+    * per millisecond.
+    */
+   if (msTimeout == 0) {
+      if (blockingPoll) {
+         m_iChannel.v3.Poll(0);
+      } else if (pollChannel && m_iChannel.v1.Poll != NULL) {
+         m_iChannel.v1.Poll();
+      }
+
+      return hEvent != NULL &&
+             RMWaitForSingleEvent(hEvent, 0) == WAIT_OBJECT_0;
+   }
+
+   uint32 msSlice = RM_WAIT_SLICE_MS;
+   if (blockingPoll && hEvent != NULL && m_pollDispatcher == 0) {
+      msSlice = RM_POLL_SLICE_MS;
+   }
+
+   while (msCurrent < msTimeout) {
+      uint32 msSleep = (uint32)(msTimeout - msCurrent);
+      if (msSleep > msSlice) msSleep = msSlice;
+
+      if (blockingPoll) {
+         if (hEvent == NULL) {
+            m_iChannel.v3.Poll((int)msSleep);
+         } else if (RMPollForEvent(hEvent, &m_iChannel, m_pollDispatcher,
+                                   msSleep) == WAIT_OBJECT_0) {
+            return true;
+         }
+      } else {
+         if (pollChannel && m_iChannel.v1.Poll != NULL) {
+            m_iChannel.v1.Poll();
+         }
+
+         if (hEvent != NULL) {
+            if (RMWaitForSingleEvent(hEvent, msSleep) == WAIT_OBJECT_0) {
+               return true;
+            }
+         } else {
+            Sleep(msSleep);
+         }
+      }
+
+      msCurrent = RMGetTickCount() - msBegin;
+   }
+
+   return blockingPoll && hEvent != NULL &&
+          RMWaitForSingleEvent(hEvent, 0) == WAIT_OBJECT_0;
 }
 
 
@@ -79,9 +429,25 @@ RPCManager::RMWaitForEvent(HANDLE hEvent,    // IN
 void
 RPCPluginInstance::InitializeEventsAndMutexes()
 {
-   m_hReadyEvent = NULL;
-   m_pendingMsgMutex = NULL;
-   m_pendingMsgEvent = NULL;
+   pthread_mutexattr_t attr;
+   RMPosixMutex *mutex = new RMPosixMutex;
+
+   /*
+    * Win32 mutexes can be re-acquired by the owning thread.
+    */
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   if (pthread_mutex_init(&mutex->mutex, &attr) != 0) {
+      LOG("Error: Failed to create pending message mutex.");
+      delete mutex;
+      mutex = NULL;
+   }
+   pthread_mutexattr_destroy(&attr);
+
+   m_hReadyEvent = RMCreateEvent(true, false);
+   m_pendingMsgMutex = mutex;
+   m_pendingMsgEvent = RMCreateEvent(true, true);
+   m_creditEvent = RMCreateEvent(true, true);
 }
 
 
@@ -104,6 +470,27 @@ RPCPluginInstance::InitializeEventsAndMutexes()
 void
 RPCPluginInstance::CloseEventsAndMutexes()
 {
+   if (m_hReadyEvent != NULL) {
+      RMCloseEvent(m_hReadyEvent);
+      m_hReadyEvent = NULL;
+   }
+
+   if (m_pendingMsgEvent != NULL) {
+      RMCloseEvent(m_pendingMsgEvent);
+      m_pendingMsgEvent = NULL;
+   }
+
+   if (m_creditEvent != NULL) {
+      RMCloseEvent(m_creditEvent);
+      m_creditEvent = NULL;
+   }
+
+   if (m_pendingMsgMutex != NULL) {
+      RMPosixMutex *mutex = static_cast<RMPosixMutex*>(m_pendingMsgMutex);
+      pthread_mutex_destroy(&mutex->mutex);
+      delete mutex;
+      m_pendingMsgMutex = NULL;
+   }
 }
 
 
@@ -126,6 +513,9 @@ RPCPluginInstance::CloseEventsAndMutexes()
 void
 RPCPluginInstance::RMLockMutex(HANDLE hMutex) // IN
 {
+   if (hMutex != NULL) {
+      pthread_mutex_lock(&static_cast<RMPosixMutex*>(hMutex)->mutex);
+   }
 }
 
 
@@ -148,6 +538,9 @@ RPCPluginInstance::RMLockMutex(HANDLE hMutex) // IN
 void
 RPCPluginInstance::RMUnlockMutex(HANDLE hMutex) // IN
 {
+   if (hMutex != NULL) {
+      pthread_mutex_unlock(&static_cast<RMPosixMutex*>(hMutex)->mutex);
+   }
 }
 
 
@@ -162,7 +555,8 @@ RPCPluginInstance::RMUnlockMutex(HANDLE hMutex) // IN
  *    None.
  *
  * Side Effects:
- *    None.
+ *    Interrupts the Poll() of a thread waiting for the event in
+ *    RMWaitForEvent().
  *
  *----------------------------------------------------------------------
  */
@@ -170,6 +564,29 @@ RPCPluginInstance::RMUnlockMutex(HANDLE hMutex) // IN
 void
 RPCPluginInstance::RMSetEvent(HANDLE hEvent) // IN
 {
+   RMPosixEvent *event = static_cast<RMPosixEvent*>(hEvent);
+
+   if (event == NULL) {
+      return;
+   }
+
+   pthread_mutex_lock(&event->mutex);
+   event->signaled = true;
+   if (event->manualReset) {
+      pthread_cond_broadcast(&event->cond);
+   } else {
+      pthread_cond_signal(&event->cond);
+   }
+   VdpLocalJobDispatcher waiter = event->waiter;
+   pthread_mutex_unlock(&event->mutex);
+
+   /*
+    * The job stays queued if the waiter has not entered Poll() yet, so
+    * that one returns at once.
+    */
+   if (waiter != 0) {
+      GetRPCManager()->m_iLocalJob.v1.Request(waiter, RMWakeJob, NULL);
+   }
 }
 
 
@@ -192,4 +609,13 @@ RPCPluginInstance::RMSetEvent(HANDLE hEvent) // IN
 void
 RPCPluginInstance::RMResetEvent(HANDLE hEvent) // IN
 {
+   RMPosixEvent *event = static_cast<RMPosixEvent*>(hEvent);
+
+   if (event == NULL) {
+      return;
+   }
+
+   pthread_mutex_lock(&event->mutex);
+   event->signaled = false;
+   pthread_mutex_unlock(&event->mutex);
 }
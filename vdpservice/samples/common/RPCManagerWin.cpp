@@ -34,6 +34,34 @@ RPCManager::AllowRunAsServer()
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCManager::RMServerEntryPoints --
+ *
+ *    The server entry points of the platform.
+ *
+ * Results:
+ *    The exports of the vdpService SDK.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const RPCServerEntryPoints*
+RPCManager::RMServerEntryPoints()
+{
+   static const RPCServerEntryPoints entryPoints = {
+      VDPService_ServerInit2,
+      VDPService_ServerExit2
+   };
+
+   return &entryPoints;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -60,7 +88,9 @@ RPCManager::RMWaitForEvent(HANDLE hEvent,    // IN
    uint32 msCurrent = 0;
 
    while (msCurrent < max(msTimeout,1)) {
-      m_iChannel.v1.Poll();
+      if (PollHere()) {
+         m_iChannel.v1.Poll();
+      }
 
       uint32 msSleep = msTimeout - msCurrent;
       if (msSleep > 100) msSleep = 100;
@@ -104,6 +134,7 @@ RPCPluginInstance::InitializeEventsAndMutexes()
    m_hReadyEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
    m_pendingMsgMutex = CreateMutex(NULL, FALSE, NULL);
    m_pendingMsgEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+   m_creditEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
 }
 
 
@@ -136,6 +167,11 @@ RPCPluginInstance::CloseEventsAndMutexes()
       m_pendingMsgEvent = NULL;
    }
 
+   if (m_creditEvent != NULL) {
+      CloseHandle(m_creditEvent);
+      m_creditEvent = NULL;
+   }
+
    if (m_pendingMsgMutex != NULL) {
       CloseHandle(m_pendingMsgMutex);
       m_pendingMsgMutex = NULL;
@@ -0,0 +1,257 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCMessage.h --
+ *
+ */
+
+#pragma once
+
+#include "vdprpc_interfaces.h"
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCVariantTraits
+ *
+ *    Compile-time mapping of a C++ type to its VDP_RPC_VARIANT type and
+ *    union member.  Set() fills in a variant without allocating, the
+ *    strings and blobs it points at are copied by AppendParam().  Get()
+ *    reads a variant whose vt has already been checked.  Using a type
+ *    without a specialization is a compile error.
+ *
+ *    Enums travel as VDP_RPC_VT_UI4, which is what the samples have
+ *    always used for them.
+ *
+ *----------------------------------------------------------------------
+ */
+template<typename T, typename Enable = void>
+struct RPCVariantTraits;
+
+#define RPC_VARIANT_TRAITS(type, vtype, member)                                \
+template<>                                                                     \
+struct RPCVariantTraits<type>                                                  \
+{                                                                              \
+   static const VDP_RPC_VARTYPE vt = vtype;                                    \
+   static void Set(VDP_RPC_VARIANT* v, const type& x) { v->member = x; }       \
+   static void Get(const VDP_RPC_VARIANT* v, type* x) { *x = v->member; }      \
+};
+
+RPC_VARIANT_TRAITS(char,     VDP_RPC_VT_I1,    cVal)
+RPC_VARIANT_TRAITS(int16,    VDP_RPC_VT_I2,    iVal)
+RPC_VARIANT_TRAITS(uint16,   VDP_RPC_VT_UI2,   uiVal)
+RPC_VARIANT_TRAITS(int32,    VDP_RPC_VT_I4,    lVal)
+RPC_VARIANT_TRAITS(uint32,   VDP_RPC_VT_UI4,   ulVal)
+RPC_VARIANT_TRAITS(int64,    VDP_RPC_VT_I8,    llVal)
+RPC_VARIANT_TRAITS(uint64,   VDP_RPC_VT_UI8,   ullVal)
+RPC_VARIANT_TRAITS(float,    VDP_RPC_VT_R4,    fVal)
+RPC_VARIANT_TRAITS(double,   VDP_RPC_VT_R8,    dVal)
+
+#undef RPC_VARIANT_TRAITS
+
+template<typename T>
+struct RPCVariantTraits<T, typename std::enable_if<std::is_enum<T>::value>::type>
+{
+   static const VDP_RPC_VARTYPE vt = VDP_RPC_VT_UI4;
+   static void Set(VDP_RPC_VARIANT* v, const T& x) { v->ulVal = (uint32)x; }
+   static void Get(const VDP_RPC_VARIANT* v, T* x) { *x = (T)v->ulVal; }
+};
+
+/* encode only, decode into std::string */
+template<>
+struct RPCVariantTraits<const char*>
+{
+   static const VDP_RPC_VARTYPE vt = VDP_RPC_VT_LPSTR;
+   static void Set(VDP_RPC_VARIANT* v, const char* x) { v->strVal = const_cast<char*>(x); }
+};
+
+template<>
+struct RPCVariantTraits<std::string>
+{
+   static const VDP_RPC_VARTYPE vt = VDP_RPC_VT_LPSTR;
+   static void Set(VDP_RPC_VARIANT* v, const std::string& x) { v->strVal = const_cast<char*>(x.c_str()); }
+   static void Get(const VDP_RPC_VARIANT* v, std::string* x) { x->assign(v->strVal != NULL ? v->strVal : ""); }
+};
+
+/* encode only, decode into std::vector<char> */
+template<>
+struct RPCVariantTraits<VDP_RPC_BLOB>
+{
+   static const VDP_RPC_VARTYPE vt = VDP_RPC_VT_BLOB;
+   static void Set(VDP_RPC_VARIANT* v, const VDP_RPC_BLOB& x) { v->blobVal = x; }
+};
+
+template<>
+struct RPCVariantTraits<std::vector<char> >
+{
+   static const VDP_RPC_VARTYPE vt = VDP_RPC_VT_BLOB;
+
+   static void Set(VDP_RPC_VARIANT* v, const std::vector<char>& x)
+   {
+      v->blobVal.size = (uint32)x.size();
+      v->blobVal.blobData = const_cast<char*>(x.empty() ? NULL : &x[0]);
+   }
+
+   static void Get(const VDP_RPC_VARIANT* v, std::vector<char>* x)
+   {
+      const char* data = v->blobVal.blobData;
+      x->assign(data, data != NULL ? data + v->blobVal.size : data);
+   }
+};
+
+
+/*
+ * True if every parameter is a fixed size scalar, such messages are
+ * known to be tiny without looking at them.
+ */
+template<typename... Args>
+struct RPCAllScalar : std::true_type { };
+
+template<typename T, typename... Rest>
+struct RPCAllScalar<T, Rest...>
+   : std::integral_constant<bool, (std::is_arithmetic<T>::value ||
+                                   std::is_enum<T>::value) &&
+                                  RPCAllScalar<Rest...>::value> { };
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCEncodeParam --
+ *
+ *    Appends one typed parameter through the caller's scratch variant.
+ *
+ * Results:
+ *    true if the parameter was appended.
+ *
+ *----------------------------------------------------------------------
+ */
+template<typename T>
+inline bool
+RPCEncodeParam(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+               void* messageCtx,                                   // IN
+               VDP_RPC_VARIANT* var,                               // IN
+               const T& value)                                     // IN
+{
+   var->vt = RPCVariantTraits<T>::vt;
+   RPCVariantTraits<T>::Set(var, value);
+   return iChannelCtx->v1.AppendParam(messageCtx, var) != FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCDecodeParam --
+ *
+ *    Reads parameter <i> after checking its vt against the type.
+ *
+ * Results:
+ *    false if the parameter is missing or has another type.
+ *
+ *----------------------------------------------------------------------
+ */
+template<typename T>
+inline bool
+RPCDecodeParam(const VDPRPC_ChannelContextInterface* iChannelCtx,  // IN
+               const VDPRPC_VariantInterface* iVariant,            // IN
+               void* messageCtx,                                   // IN
+               int i,                                              // IN
+               T* value)                                           // OUT
+{
+   VDP_RPC_VARIANT var;
+   var.vt = VDP_RPC_VT_EMPTY;
+   var.ullVal = 0;
+
+   if (!iChannelCtx->v1.GetParam(messageCtx, i, &var)) {
+      return false;
+   }
+
+   bool ok = var.vt == RPCVariantTraits<T>::vt;
+   if (ok) {
+      RPCVariantTraits<T>::Get(&var, value);
+   }
+
+   /*
+    * Only the copies of strings and blobs own memory.
+    */
+   if (var.vt == VDP_RPC_VT_LPSTR || var.vt == VDP_RPC_VT_BLOB) {
+      iVariant->v1.VariantClear(&var);
+   }
+
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCMessage
+ *
+ *    Typed description of a command and its positional parameters.
+ *    Encode() appends the parameters through a single scratch variant
+ *    that never owns memory, so there is no VariantInit()/VariantClear()
+ *    per parameter.  Decode() checks the vt of every parameter against
+ *    the declared type before reading the union, so a UInt32 parameter
+ *    can no longer be read through ullVal.
+ *
+ *    typedef RPCMessage<MY_SET_POSITION, int32, int32> SetPositionMsg;
+ *
+ *    RPCPluginInstance::InvokeCommand<SetPositionMsg>(x, y) sends one and
+ *    RPCPluginInstance::Decode<SetPositionMsg>(messageCtx, x, y) reads it.
+ *
+ *----------------------------------------------------------------------
+ */
+template<uint32 Cmd, typename... Args>
+class RPCMessage
+{
+public:
+   static const uint32 Command = Cmd;
+   static const int ParamCount = (int)sizeof...(Args);
+   static const bool Scalar = RPCAllScalar<Args...>::value;
+
+   /*
+    * Appends the parameters to <messageCtx>, the command is not set.
+    */
+   static bool Encode(const VDPRPC_ChannelContextInterface* iChannelCtx,   // IN
+                      void* messageCtx,                                    // IN
+                      const Args&... args)                                 // IN
+   {
+      VDP_RPC_VARIANT var;
+      bool ok = true;
+
+      int expand[] = { 0, (ok = ok && RPCEncodeParam(iChannelCtx, messageCtx,
+                                                     &var, args), 0)... };
+      (void)expand;
+      return ok;
+   }
+
+   /*
+    * Reads the parameters from <messageCtx>.  Extra parameters sent by a
+    * newer peer are ignored, missing or mistyped ones fail.
+    */
+   static bool Decode(const VDPRPC_ChannelContextInterface* iChannelCtx,   // IN
+                      const VDPRPC_VariantInterface* iVariant,             // IN
+                      void* messageCtx,                                    // IN
+                      Args&... args)                                       // OUT
+   {
+      if (iChannelCtx->v1.GetParamCount(messageCtx) < ParamCount) {
+         return false;
+      }
+
+      bool ok = true;
+      int i = 0;
+
+      int expand[] = { 0, (ok = ok && RPCDecodeParam(iChannelCtx, iVariant,
+                                                     messageCtx, i++, &args), 0)... };
+      (void)expand;
+      return ok;
+   }
+};
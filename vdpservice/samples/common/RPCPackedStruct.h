@@ -0,0 +1,197 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCPackedStruct.h --
+ *
+ */
+
+#pragma once
+
+#include "RPCMessage.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCPackedHeader
+ *
+ *    Leads every packed struct.  <size> is the number of bytes the
+ *    writer packed, header included.  Fields are only ever appended to a
+ *    schema, with <version> bumped each time, so a reader takes the
+ *    fields both sides know and zero-fills the rest.  The header is 8
+ *    bytes so that the fields after it keep their natural alignment.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint16      version;
+   uint16      size;
+   uint32      reserved;
+} RPCPackedHeader;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPC_PACKED_STRUCT --
+ *
+ *    Generates a struct from an X-macro field list:
+ *
+ *    #define MY_RECT_FIELDS(FIELD)  \
+ *       FIELD(int32, x)             \
+ *       FIELD(int32, y)             \
+ *       FIELD(int32, w)             \
+ *       FIELD(int32, h)
+ *
+ *    RPC_PACKED_STRUCT(MyRect, 1, MY_RECT_FIELDS)
+ *
+ *    The struct holds a RPCPackedHeader and then the fields as plain
+ *    members, so it can go on the wire as one VDP_RPC_BLOB parameter
+ *    and be read straight out of the blob with View().  The generated
+ *    static methods are
+ *
+ *    Encode()   appends the struct to a message, packed into one blob
+ *               or, for peers without VDP_RPC_CAP_PACKED, as one variant
+ *               per field in schema order.
+ *    Decode()   reads either form, a single blob parameter is taken as
+ *               the packed form.
+ *    View()     returns the struct in place inside a received blob.
+ *
+ *    Fields must be fixed size scalars (int32, uint64, double ...) and
+ *    are stored in host order, both ends are little endian.  The schema
+ *    must not need padding, order the fields by size, so the layout is
+ *    the same for every compiler.  This is checked at compile time.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define RPC_PACKED_FIELD_DECL(type, name)     type name;
+#define RPC_PACKED_FIELD_SIZE(type, name)     + sizeof(type)
+#define RPC_PACKED_FIELD_COUNT(type, name)    + 1
+#define RPC_PACKED_FIELD_CHECK(type, name)                                     \
+   static_assert(std::is_arithmetic<type>::value,                              \
+                 "packed field " #name " must be a scalar");
+#define RPC_PACKED_FIELD_ENCODE(type, name)                                    \
+   ok = ok && RPCEncodeParam(iChannelCtx, messageCtx, &var, value.name);
+#define RPC_PACKED_FIELD_DECODE(type, name)                                    \
+   ok = ok && RPCDecodeParam(iChannelCtx, iVariant, messageCtx, i++,           \
+                             &value->name);
+
+#define RPC_PACKED_STRUCT(Name, Ver, FIELDS)                                   \
+struct Name                                                                    \
+{                                                                              \
+   RPCPackedHeader header;                                                     \
+   FIELDS(RPC_PACKED_FIELD_DECL)                                               \
+   FIELDS(RPC_PACKED_FIELD_CHECK)                                              \
+                                                                               \
+   static const uint16 Version = Ver;                                          \
+   static const int FieldCount = 0 FIELDS(RPC_PACKED_FIELD_COUNT);             \
+                                                                               \
+   static bool                                                                 \
+   Encode(const VDPRPC_ChannelContextInterface* iChannelCtx, /* IN */          \
+          void* messageCtx,                                  /* IN */          \
+          const Name& value,                                 /* IN */          \
+          bool packed)                                       /* IN */          \
+   {                                                                           \
+      VDP_RPC_VARIANT var;                                                     \
+      bool ok = true;                                                          \
+                                                                               \
+      if (packed) {                                                            \
+         Name wire = value;                                                    \
+         wire.header.version = Version;                                        \
+         wire.header.size = (uint16)sizeof(Name);                              \
+         wire.header.reserved = 0;                                             \
+                                                                               \
+         var.vt = VDP_RPC_VT_BLOB;                                             \
+         var.blobVal.size = (uint32)sizeof(Name);                              \
+         var.blobVal.blobData = (char*)&wire;                                  \
+         return iChannelCtx->v1.AppendParam(messageCtx, &var) != FALSE;        \
+      }                                                                        \
+                                                                               \
+      FIELDS(RPC_PACKED_FIELD_ENCODE)                                          \
+      return ok;                                                               \
+   }                                                                           \
+                                                                               \
+   static bool                                                                 \
+   Decode(const VDPRPC_ChannelContextInterface* iChannelCtx, /* IN */          \
+          const VDPRPC_VariantInterface* iVariant,           /* IN */          \
+          void* messageCtx,                                  /* IN */          \
+          Name* value)                                       /* OUT */         \
+   {                                                                           \
+      memset(value, 0, sizeof *value);                                         \
+                                                                               \
+      int count = iChannelCtx->v1.GetParamCount(messageCtx);                   \
+      if (count == 1 || count < FieldCount) {                                  \
+         bool isBlob = false;                                                  \
+         bool ok = DecodePacked(iChannelCtx, iVariant, messageCtx, value,      \
+                                &isBlob);                                      \
+         if (isBlob || count < FieldCount) {                                   \
+            return ok;                                                         \
+         }                                                                     \
+      }                                                                        \
+                                                                               \
+      bool ok = true;                                                          \
+      int i = 0;                                                               \
+      FIELDS(RPC_PACKED_FIELD_DECODE)                                          \
+      return ok;                                                               \
+   }                                                                           \
+                                                                               \
+   static const Name*                                                          \
+   View(const VDP_RPC_BLOB& blob)                                /* IN */      \
+   {                                                                           \
+      const Name* p = reinterpret_cast<const Name*>(blob.blobData);            \
+      if (p == NULL || blob.size < sizeof(Name) ||                             \
+          ((uintptr_t)p & (alignof(Name) - 1)) != 0 ||                         \
+          p->header.size < sizeof(Name) || p->header.size > blob.size) {       \
+         return NULL;                                                          \
+      }                                                                        \
+      return p;                                                                \
+   }                                                                           \
+                                                                               \
+private:                                                                       \
+   static bool                                                                 \
+   DecodePacked(const VDPRPC_ChannelContextInterface* iChannelCtx,             \
+                const VDPRPC_VariantInterface* iVariant,                       \
+                void* messageCtx,                                              \
+                Name* value,                                                   \
+                bool* isBlob)                                                  \
+   {                                                                           \
+      VDP_RPC_VARIANT var;                                                     \
+      var.vt = VDP_RPC_VT_EMPTY;                                               \
+      var.ullVal = 0;                                                          \
+                                                                               \
+      if (!iChannelCtx->v1.GetParam(messageCtx, 0, &var)) {                    \
+         return false;                                                         \
+      }                                                                        \
+                                                                               \
+      bool ok = false;                                                         \
+      *isBlob = var.vt == VDP_RPC_VT_BLOB;                                     \
+                                                                               \
+      if (*isBlob && var.blobVal.blobData != NULL &&                           \
+          var.blobVal.size >= sizeof(RPCPackedHeader)) {                       \
+         RPCPackedHeader header;                                               \
+         memcpy(&header, var.blobVal.blobData, sizeof header);                 \
+                                                                               \
+         if (header.size >= sizeof header && header.size <= var.blobVal.size) {\
+            size_t n = header.size < sizeof(Name) ? header.size : sizeof(Name);\
+            memcpy(value, var.blobVal.blobData, n);                            \
+            ok = true;                                                         \
+         }                                                                     \
+      }                                                                        \
+                                                                               \
+      if (var.vt == VDP_RPC_VT_LPSTR || var.vt == VDP_RPC_VT_BLOB) {           \
+         iVariant->v1.VariantClear(&var);                                      \
+      }                                                                        \
+                                                                               \
+      return ok;                                                               \
+   }                                                                           \
+                                                                               \
+};                                                                             \
+static_assert(sizeof(Name) == sizeof(RPCPackedHeader)                          \
+              FIELDS(RPC_PACKED_FIELD_SIZE),                                   \
+              #Name " needs padding, reorder its fields");
@@ -0,0 +1,294 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCPayloadCorpus.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCPayloadCorpus.h"
+
+#include <algorithm>
+#include <random>
+
+// a pixel row is a line of a 1920 pixel wide, 32 bpp screen.
+#define RPC_PAYLOAD_ROW_PIXELS      1920
+
+// a row is the same as the one above this often, in percent.
+#define RPC_PAYLOAD_ROW_REPEAT      30
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FillPixels --
+ *
+ *    Fills <data> with rows of pixels as a desktop has them: mostly
+ *    flat areas of a few colours, some gradients and a little noise
+ *    where a picture is, and rows that repeat the one above.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FillPixels(std::vector<char>* data,   // IN/OUT
+           std::mt19937_64& rng)      // IN/OUT
+{
+   static const uint32 palette[] = {
+      0xFFFFFFFF, 0xFFF0F0F0, 0xFFD4D0C8, 0xFF808080,
+      0xFF000000, 0xFF0078D7, 0xFF1E1E1E, 0xFF2D7D9A,
+   };
+   const size_t nColors = sizeof palette / sizeof palette[0];
+   const size_t rowBytes = RPC_PAYLOAD_ROW_PIXELS * sizeof(uint32);
+   std::vector<uint32> row(RPC_PAYLOAD_ROW_PIXELS);
+   size_t offset = 0;
+
+   while (offset < data->size()) {
+      if (offset == 0 || rng() % 100 >= RPC_PAYLOAD_ROW_REPEAT) {
+         int x = 0;
+         while (x < RPC_PAYLOAD_ROW_PIXELS) {
+            int len = 16 + (int)(rng() % 497);
+            uint32 kind = (uint32)(rng() % 10);
+            uint32 color = palette[rng() % nColors];
+            int step = (int)(rng() % 5) - 2;
+
+            for (int i = 0; i < len && x < RPC_PAYLOAD_ROW_PIXELS; i++, x++) {
+               uint32 pixel = color;
+               if (kind >= 6) {
+                  /* gradient, or a picture when noisy */
+                  int delta = kind == 9 ? (int)(rng() % 17) - 8 : step * i / 4;
+                  uint32 c = 0xFF000000;
+                  for (int shift = 0; shift < 24; shift += 8) {
+                     int v = (int)((color >> shift) & 0xFF) + delta;
+                     c |= (uint32)(v < 0 ? 0 : v > 0xFF ? 0xFF : v) << shift;
+                  }
+                  pixel = c;
+               }
+               row[x] = pixel;
+            }
+         }
+      }
+
+      size_t n = std::min(rowBytes, data->size() - offset);
+      memcpy(data->data() + offset, row.data(), n);
+      offset += n;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FillJson --
+ *
+ *    Fills <data> with JSON-like records, one per line.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FillJson(std::vector<char>* data,   // IN/OUT
+         std::mt19937_64& rng)      // IN/OUT
+{
+   static const char* words[] = {
+      "display", "audio", "usb", "clipboard", "printer", "session",
+      "monitor", "keyboard", "mouse", "scanner", "camera", "smartcard",
+   };
+   const size_t nWords = sizeof words / sizeof words[0];
+   size_t offset = 0;
+   uint32 seq = 0;
+
+   while (offset < data->size()) {
+      char record[256];
+      int len = snprintf(record, sizeof record,
+                         "{\"id\":%u,\"name\":\"%s-%04x\",\"seq\":%u,"
+                         "\"active\":%s,\"score\":%.3f,\"tags\":[\"%s\",\"%s\"]},\n",
+                         (uint32)(rng() % 1000000), words[rng() % nWords],
+                         (uint32)(rng() & 0xFFFF), seq++,
+                         rng() % 2 ? "true" : "false", (rng() % 100000) / 1000.0,
+                         words[rng() % nWords],
+                         words[rng() % nWords]);
+
+      size_t n = std::min((size_t)len, data->size() - offset);
+      memcpy(data->data() + offset, record, n);
+      offset += n;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPayloadCorpus::RPCPayloadCorpus --
+ *
+ *    Constructor, builds the corpus for payloads of up to <maxPayload>
+ *    bytes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCPayloadCorpus::RPCPayloadCorpus(RPCPayloadClass payloadClass,   // IN
+                                   double entropy,                 // IN
+                                   uint32 maxPayload,              // IN
+                                   uint64 seed)                    // IN
+   : m_class(payloadClass),
+     m_entropy(entropy < 0 ? 0 : entropy > 1 ? 1 : entropy),
+     m_data(std::max((size_t)RPC_PAYLOAD_CORPUS_MIN_BYTES, (size_t)maxPayload * 2)),
+     m_next(0)
+{
+   std::mt19937_64 rng(seed);
+
+   switch (m_class) {
+   case RPC_PAYLOAD_ZEROS:
+      break;
+   case RPC_PAYLOAD_PATTERN:
+      for (size_t i = 0; i < m_data.size(); i++) {
+         m_data[i] = (char)((i % 64) + '0');
+      }
+      break;
+   case RPC_PAYLOAD_PIXELS:
+      FillPixels(&m_data, rng);
+      break;
+   case RPC_PAYLOAD_JSON:
+      FillJson(&m_data, rng);
+      break;
+   case RPC_PAYLOAD_RANDOM:
+      m_entropy = 1;
+      break;
+   }
+
+   /*
+    * The bytes replaced are drawn by the gaps between them, one draw
+    * per random byte rather than per byte.
+    */
+   if (m_entropy >= 1) {
+      for (size_t i = 0; i < m_data.size(); i++) {
+         m_data[i] = (char)rng();
+      }
+   } else if (m_entropy > 0) {
+      std::geometric_distribution<size_t> gap(m_entropy);
+      for (size_t i = gap(rng); i < m_data.size(); i += gap(rng) + 1) {
+         m_data[i] = (char)rng();
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPayloadCorpus::Next --
+ *
+ *    The next payload of <size> bytes, no more than the maximum given
+ *    to the constructor.
+ *
+ * Results:
+ *    The payload, valid as long as the corpus.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCPayloadCorpus::Next(uint32 size)   // IN
+{
+   VM_ASSERT(size <= m_data.size());
+
+   /*
+    * The slices follow each other around the corpus, the offset wraps
+    * so that none runs past its end.
+    */
+   uint64 offset = m_next.fetch_add(size) % (m_data.size() - size + 1);
+   return m_data.data() + offset;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPayloadCorpus::ClassToStr --
+ *
+ *    Name of a payload class, as Parse() takes it.
+ *
+ * Results:
+ *    The name.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCPayloadCorpus::ClassToStr(RPCPayloadClass payloadClass)   // IN
+{
+   switch (payloadClass) {
+   case RPC_PAYLOAD_ZEROS:    return "zeros";
+   case RPC_PAYLOAD_PATTERN:  return "pattern";
+   case RPC_PAYLOAD_PIXELS:   return "pixels";
+   case RPC_PAYLOAD_JSON:     return "json";
+   case RPC_PAYLOAD_RANDOM:   return "random";
+   default:                   return "unknown";
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCPayloadCorpus::Parse --
+ *
+ *    Parses "class[:entropy]", a class name and the share of random
+ *    bytes, 0 if it is left out.
+ *
+ * Results:
+ *    false if it is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCPayloadCorpus::Parse(const char* spec,                  // IN
+                        RPCPayloadClass* payloadClass,     // OUT
+                        double* entropy)                   // OUT
+{
+   const char* colon = strchr(spec, ':');
+   size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+   *entropy = 0;
+   if (colon != NULL) {
+      char* end;
+      *entropy = strtod(colon + 1, &end);
+      if (end == colon + 1 || *end != '\0' || *entropy < 0 || *entropy > 1) {
+         return false;
+      }
+   }
+
+   for (int c = RPC_PAYLOAD_ZEROS; c <= RPC_PAYLOAD_RANDOM; c++) {
+      const char* name = ClassToStr((RPCPayloadClass)c);
+      if (strlen(name) == len && strncmp(spec, name, len) == 0) {
+         *payloadClass = (RPCPayloadClass)c;
+         return true;
+      }
+   }
+   return false;
+}
@@ -0,0 +1,85 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCPayloadCorpus.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#include <atomic>
+#include <vector>
+
+/*
+ * Smallest corpus, so that consecutive payloads don't repeat within
+ * the window of a compressor.
+ */
+#define RPC_PAYLOAD_CORPUS_MIN_BYTES   (4 * 1024 * 1024)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Enum RPCPayloadClass
+ *
+ *    The kinds of payload in a corpus, from the most compressible to
+ *    the least:
+ *       ZEROS    all zero bytes.
+ *       PATTERN  the repeating (v % 64) + '0' text pings always sent.
+ *       PIXELS   rows of 32 bpp pixels, flat areas and gradients.
+ *       JSON     JSON-like records of names, numbers and flags.
+ *       RANDOM   uniformly random bytes, incompressible.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef enum {
+   RPC_PAYLOAD_ZEROS,
+   RPC_PAYLOAD_PATTERN,
+   RPC_PAYLOAD_PIXELS,
+   RPC_PAYLOAD_JSON,
+   RPC_PAYLOAD_RANDOM,
+} RPCPayloadClass;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCPayloadCorpus
+ *
+ *    Preallocated payloads of one class.  <entropy>, from 0 to 1, is
+ *    the share of the bytes replaced by random ones, so a class can be
+ *    made less compressible step by step.  Next() hands out slices of
+ *    the corpus in turn, nothing is generated or allocated per payload.
+ *    The same <seed> gives the same corpus.  Safe to use from any
+ *    thread.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCPayloadCorpus
+{
+public:
+   RPCPayloadCorpus(RPCPayloadClass payloadClass, double entropy,
+                    uint32 maxPayload, uint64 seed);
+
+   const char* Next(uint32 size);
+
+   RPCPayloadClass GetClass() const { return m_class; }
+   double GetEntropy() const { return m_entropy; }
+
+   static const char* ClassToStr(RPCPayloadClass payloadClass);
+   static bool Parse(const char* spec, RPCPayloadClass* payloadClass,
+                     double* entropy);
+
+private:
+   RPCPayloadClass      m_class;
+   double               m_entropy;
+   std::vector<char>    m_data;
+   std::atomic<uint64>  m_next;
+
+   RPCPayloadCorpus(const RPCPayloadCorpus&);
+   RPCPayloadCorpus& operator=(const RPCPayloadCorpus&);
+};
@@ -0,0 +1,670 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCSessionManager.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCSessionManager.h"
+
+/*
+ * How long a worker waits for jobs between two polls of its sessions
+ * when the channel has no blocking Poll(), and how long it blocks in
+ * Poll() otherwise.
+ */
+#define SESSION_POLL_MS       1
+#define SESSION_IDLE_MS       100
+
+/*
+ * How long CloseSession() waits for the messages still in flight.
+ */
+#define SESSION_CLOSE_MS      (10 * 1000)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::RPCSessionManager --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCSessionManager::RPCSessionManager(const char* tokenName)   // IN
+   : RPCManager(tokenName),
+     m_interfacesReady(false)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::~RPCSessionManager --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCSessionManager::~RPCSessionManager()
+{
+   Stop();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::Start --
+ *
+ *    Starts <threadCount> workers, sessions can be opened afterwards.
+ *
+ * Results:
+ *    Returns true if everything went well.
+ *
+ * Side Effects:
+ *    Poll() and WaitForEvent() stop polling the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCSessionManager::Start(VdpServiceChannelType type,     // IN
+                         bool compressionEnabled,        // IN
+                         bool encryptionEnabled,         // IN
+                         int threadCount)                // IN
+{
+   FUNCTION_TRACE;
+
+   if (!AllowRunAsServer()) {
+      FUNCTION_EXIT_MSG("Running as server not allowed.");
+      return false;
+   }
+
+   if (!m_workers.empty() || m_initialized) {
+      FUNCTION_EXIT_MSG("Already initialized");
+      return false;
+   }
+
+   /*
+    * The sessions share one channel type, an automatic channel is
+    * measured for a single instance, see ServerInit2().
+    */
+   if (type == VDPSERVICE_AUTO_CHANNEL) {
+      FUNCTION_EXIT_MSG("VDPSERVICE_AUTO_CHANNEL needs ServerInit2()");
+      return false;
+   }
+
+   if (threadCount < 1) {
+      threadCount = 1;
+   }
+
+   m_channelType = type;
+   m_compressionEnabled = compressionEnabled;
+   m_encryptionEnabled = encryptionEnabled;
+   m_workersPoll = true;
+
+   for (int i = 0; i < threadCount; i++) {
+      Worker* worker = new Worker;
+      worker->sessions = 0;
+      worker->stop = false;
+      worker->dispatcher = 0;
+
+      try {
+         worker->thread = std::thread(&RPCSessionManager::WorkerMain, this, worker);
+      } catch (...) {
+         delete worker;
+         Stop();
+         FUNCTION_EXIT_MSG("Failed to create worker thread %d", i);
+         return false;
+      }
+
+      m_workers.push_back(worker);
+   }
+
+   OnServerInit();
+   FUNCTION_EXIT_MSG("%d workers started", threadCount);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::Stop --
+ *
+ *    Closes the sessions still open, their plugin instances are handed
+ *    to OnDestroyInstance(), and stops the workers.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCSessionManager::Stop()
+{
+   if (m_workers.empty()) {
+      return;
+   }
+
+   FUNCTION_TRACE;
+
+   std::vector<DWORD> sids;
+   {
+      std::lock_guard<std::mutex> lock(m_sessionMutex);
+      for (auto it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+         sids.push_back(it->first);
+      }
+   }
+
+   for (size_t i = 0; i < sids.size(); i++) {
+      RPCPluginInstance* rpcPlugin = CloseSession(sids[i]);
+      if (rpcPlugin != NULL) {
+         OnDestroyInstance(rpcPlugin);
+      }
+   }
+
+   StopPumpThread();
+
+   for (size_t i = 0; i < m_workers.size(); i++) {
+      Worker* worker = m_workers[i];
+      {
+         std::lock_guard<std::mutex> lock(worker->mutex);
+         worker->stop = true;
+      }
+      WakeWorker(worker);
+      worker->thread.join();
+      delete worker;
+   }
+
+   m_workers.clear();
+   m_workersPoll = false;
+
+   if (m_initialized) {
+      OnServerExit();
+   }
+   m_initialized = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::OpenSession --
+ *
+ *    Opens the channel of session <sid> for <rpcPlugin> on the least
+ *    loaded worker and optionally waits for it to become ready.  The
+ *    caller keeps owning <rpcPlugin>.  Must not be called from an RPC
+ *    callback.
+ *
+ * Results:
+ *    Returns true if everything went well.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCSessionManager::OpenSession(DWORD sid,                     // IN
+                               RPCPluginInstance* rpcPlugin,  // IN
+                               uint32 msTimeoutReady)         // IN
+{
+   int w = -1;
+
+   {
+      std::lock_guard<std::mutex> lock(m_sessionMutex);
+
+      if (m_workers.empty()) {
+         LOG("Session %u: not started", (uint32)sid);
+         return false;
+      }
+
+      if (!m_sessions.emplace(sid, rpcPlugin).second) {
+         LOG("Session %u: already open", (uint32)sid);
+         return false;
+      }
+
+      for (size_t i = 0; i < m_workers.size(); i++) {
+         if (w < 0 || m_workers[i]->sessions < m_workers[w]->sessions) {
+            w = (int)i;
+         }
+      }
+      m_workers[w]->sessions++;
+   }
+
+   rpcPlugin->m_sessionId = sid;
+   rpcPlugin->m_sessionWorker = w;
+
+   if (!RunJob(w, SESSION_JOB_OPEN, sid, rpcPlugin)) {
+      std::lock_guard<std::mutex> lock(m_sessionMutex);
+      m_sessions.erase(sid);
+      m_workers[w]->sessions--;
+      rpcPlugin->m_sessionId = (DWORD)VDP_CURRENT_SESSION;
+      rpcPlugin->m_sessionWorker = -1;
+      return false;
+   }
+
+   if (msTimeoutReady != 0 && !rpcPlugin->WaitUntilReady(msTimeoutReady)) {
+      LOG("Session %u: not ready after %ums", (uint32)sid, msTimeoutReady);
+      CloseSession(sid);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::CloseSession --
+ *
+ *    Waits for the messages of session <sid> to complete and closes its
+ *    channel.  Must not be called from an RPC callback.
+ *
+ * Results:
+ *    The plugin instance of the session, for the caller to delete, or
+ *    NULL if the session is not open.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCPluginInstance*
+RPCSessionManager::CloseSession(DWORD sid)      // IN
+{
+   RPCPluginInstance* rpcPlugin;
+
+   {
+      std::lock_guard<std::mutex> lock(m_sessionMutex);
+
+      auto it = m_sessions.find(sid);
+      if (it == m_sessions.end()) {
+         return NULL;
+      }
+
+      rpcPlugin = it->second;
+      m_sessions.erase(it);
+   }
+
+   /*
+    * The worker keeps polling while we wait.
+    */
+   rpcPlugin->WaitForPendingMessages(SESSION_CLOSE_MS);
+
+   int w = rpcPlugin->m_sessionWorker;
+   RunJob(w, SESSION_JOB_CLOSE, sid, rpcPlugin);
+
+   std::lock_guard<std::mutex> lock(m_sessionMutex);
+   m_workers[w]->sessions--;
+   return rpcPlugin;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::FindSession --
+ *
+ *    Looks up the plugin instance serving session <sid>.
+ *
+ * Results:
+ *    The plugin instance or NULL.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCPluginInstance*
+RPCSessionManager::FindSession(DWORD sid)       // IN
+{
+   std::lock_guard<std::mutex> lock(m_sessionMutex);
+
+   auto it = m_sessions.find(sid);
+   return it != m_sessions.end() ? it->second : NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::SessionCount --
+ *
+ *    Number of open sessions.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+size_t
+RPCSessionManager::SessionCount()
+{
+   std::lock_guard<std::mutex> lock(m_sessionMutex);
+   return m_sessions.size();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::RunJob --
+ *
+ *    Runs a job on worker <w> and waits for it.
+ *
+ * Results:
+ *    The result of the job.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCSessionManager::RunJob(int w,                         // IN
+                          SessionJobType type,           // IN
+                          DWORD sid,                     // IN
+                          RPCPluginInstance* rpcPlugin)  // IN
+{
+   Worker* worker = m_workers[w];
+   std::promise<bool> result;
+   std::future<bool> done = result.get_future();
+
+   SessionJob job;
+   job.type = type;
+   job.sid = sid;
+   job.plugin = rpcPlugin;
+   job.result = &result;
+
+   {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->jobs.push_back(job);
+   }
+   WakeWorker(worker);
+
+   return done.get();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::WakeWorker --
+ *
+ *    Wakes a worker up for its jobs, whether it waits for them or
+ *    blocks in Poll().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCSessionManager::WakeWorker(Worker* worker)   // IN
+{
+   VdpLocalJobDispatcher dispatcher;
+
+   {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      dispatcher = worker->dispatcher;
+   }
+   worker->cond.notify_one();
+
+   /*
+    * The job stays queued until the next Poll() if the worker is not
+    * in it yet, so that one returns at once.
+    */
+   if (dispatcher != 0) {
+      m_iLocalJob.v1.Request(dispatcher, WorkerWakeJob, worker);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::WorkerWakeJob --
+ *
+ *    Local job requested by WakeWorker().  Running it is enough to make
+ *    the blocking Poll() of the worker return.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+RPCSessionManager::WorkerWakeJob(void* userData)   // IN
+{
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::WorkerMain --
+ *
+ *    Body of a worker thread.  Runs the open and close jobs and polls
+ *    the sessions opened on this thread until Stop().
+ *
+ *    As the pump thread, a worker with sessions sleeps inside the
+ *    blocking v3 Poll() and is woken up with a local job when it gets
+ *    a job.  Without those it polls every SESSION_POLL_MS.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCSessionManager::WorkerMain(Worker* worker)   // IN
+{
+   LOG("Session worker 0x%x running", (uint32)(uintptr_t)GetCurrentThreadId());
+
+   int open = 0;
+   std::vector<SessionJob> jobs;
+
+   for (;;) {
+      {
+         std::unique_lock<std::mutex> lock(worker->mutex);
+         if (worker->jobs.empty() && !worker->stop) {
+            if (open == 0) {
+               worker->cond.wait(lock);
+            } else if (worker->dispatcher == 0) {
+               worker->cond.wait_for(lock, std::chrono::milliseconds(SESSION_POLL_MS));
+            }
+         }
+
+         jobs.swap(worker->jobs);
+         if (worker->stop && jobs.empty()) {
+            break;
+         }
+      }
+
+      for (size_t i = 0; i < jobs.size(); i++) {
+         SessionJob& job = jobs[i];
+         bool ok;
+
+         if (job.type == SESSION_JOB_OPEN) {
+            ok = WorkerOpen(job.sid, job.plugin);
+            open += ok ? 1 : 0;
+         } else {
+            ok = WorkerClose(job.sid, job.plugin);
+            open--;
+         }
+
+         /*
+          * The dispatcher of this thread comes with its first session,
+          * it is not used once the last one is closed.
+          */
+         if (job.type == SESSION_JOB_OPEN && ok && open == 1 &&
+             m_iChannel.version >= VDP_SERVICE_CHANNEL_INTERFACE_V4 &&
+             m_iChannel.v3.Poll != NULL &&
+             m_iChannel.v4.GetChannelLocalJobDispatcher != NULL &&
+             m_iLocalJob.v1.Request != NULL) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->dispatcher =
+               m_iChannel.v4.GetChannelLocalJobDispatcher(job.plugin->m_hChannel);
+         } else if (open == 0) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->dispatcher = 0;
+         }
+
+         job.result->set_value(ok);
+      }
+      jobs.clear();
+
+      /*
+       * One poll runs the pending callbacks of every session that was
+       * opened on this thread.
+       */
+      if (open > 0) {
+         if (worker->dispatcher != 0) {
+            m_iChannel.v3.Poll(SESSION_IDLE_MS);
+         } else {
+            m_iChannel.v1.Poll();
+         }
+      }
+   }
+
+   LOG("Session worker 0x%x exiting", (uint32)(uintptr_t)GetCurrentThreadId());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::WorkerOpen --
+ *
+ *    Opens the channel of a session, on its worker thread so that
+ *    vdpservice delivers the session's callbacks there.  The first
+ *    session also fetches the interfaces shared by all of them.
+ *
+ * Results:
+ *    Returns true if everything went well.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCSessionManager::WorkerOpen(DWORD sid,                     // IN
+                              RPCPluginInstance* rpcPlugin)  // IN
+{
+   void* hChannel = NULL;
+   VDP_SERVICE_QUERY_INTERFACE qi;
+
+   if (!s_serverEntryPoints->ServerInit2(sid, TokenName(), &qi, &hChannel)) {
+      LOG("Session %u: VDPService_ServerInit2() failed", (uint32)sid);
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_initMutex);
+      if (!m_interfacesReady) {
+         if (!Init(true, &qi)) {
+            LOG("Session %u: Init() failed", (uint32)sid);
+            s_serverEntryPoints->ServerExit2(sid);
+            return false;
+         }
+         m_interfacesReady = true;
+         m_initialized = true;
+      }
+   }
+
+   if (!rpcPlugin->RegisterChannelSink(hChannel)) {
+      LOG("Session %u: RegisterChannelSink() failed", (uint32)sid);
+      s_serverEntryPoints->ServerExit2(sid);
+      return false;
+   }
+
+   LOG("Session %u opened", (uint32)sid);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCSessionManager::WorkerClose --
+ *
+ *    Closes the channel of a session, on the worker that opened it.
+ *
+ * Results:
+ *    Returns true if everything went well.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCSessionManager::WorkerClose(DWORD sid,                     // IN
+                               RPCPluginInstance* rpcPlugin)  // IN
+{
+   bool ok = true;
+
+   /*
+    * Disconnect() acts on the thread's current channel, which is the
+    * one of the last session opened on this worker.
+    */
+   m_iChannel.v1.ThreadInitialize(rpcPlugin->m_hChannel, 0);
+
+   if (!rpcPlugin->ChannelDisconnect()) {
+      LOG("Session %u: ChannelDisconnect() failed", (uint32)sid);
+      ok = false;
+   }
+
+   if (!rpcPlugin->UnregisterChannelSink()) {
+      LOG("Session %u: UnregisterChannelSink() failed", (uint32)sid);
+      ok = false;
+   }
+
+   if (!s_serverEntryPoints->ServerExit2(sid)) {
+      LOG("Session %u: VDPService_ServerExit2() failed", (uint32)sid);
+      ok = false;
+   } else {
+      LOG("Session %u closed", (uint32)sid);
+   }
+
+   rpcPlugin->m_sessionId = (DWORD)VDP_CURRENT_SESSION;
+   rpcPlugin->m_sessionWorker = -1;
+   return ok;
+}
@@ -0,0 +1,109 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCSessionManager.h --
+ *
+ */
+
+#pragma once
+
+#include "RPCManager.h"
+
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCSessionManager
+ *
+ *    Server side RPCManager that serves any number of sessions from one
+ *    process.  Each session has its own RPCPluginInstance, all of them
+ *    share one set of vdpservice interfaces and a small pool of worker
+ *    threads.  A session is owned by the least loaded worker, which
+ *    calls VDPService_ServerInit2() for it, so vdpservice runs the
+ *    session's callbacks on that worker, and then polls all its sessions
+ *    in one loop.  The RPC callbacks already carry the RPCPluginInstance
+ *    as their userData, so finding the session of a callback costs
+ *    nothing, GetSessionId() tells which one it is.
+ *
+ *    Use it instead of ServerInit2()/ServerExit2():
+ *
+ *       RPCSessionManager mgr("MyToken");
+ *       mgr.Start(VDPSERVICE_MAIN_CHANNEL, false, false, 4);
+ *       mgr.OpenSession(sid, new MyPlugin(&mgr), 5000);
+ *       ...
+ *       mgr.CloseSession(sid);       // returns the plugin to delete
+ *       mgr.Stop();
+ *
+ *    Compression, encryption and the channel type are the same for all
+ *    sessions.  Poll() and WaitForEvent() never poll themselves while
+ *    the workers run, they can be called from any thread.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCSessionManager : public RPCManager
+{
+public:
+   RPCSessionManager(const char* tokenName);
+   virtual ~RPCSessionManager();
+
+   bool Start(VdpServiceChannelType type,
+              bool compressionEnabled, bool encryptionEnabled,
+              int threadCount);
+   void Stop();
+
+   bool OpenSession(DWORD sid, RPCPluginInstance* rpcPlugin,
+                    uint32 msTimeoutReady);
+   RPCPluginInstance* CloseSession(DWORD sid);
+
+   RPCPluginInstance* FindSession(DWORD sid);
+   size_t SessionCount();
+
+private:
+   typedef enum {
+      SESSION_JOB_OPEN,
+      SESSION_JOB_CLOSE,
+   } SessionJobType;
+
+   typedef struct {
+      SessionJobType                type;
+      DWORD                         sid;
+      RPCPluginInstance*            plugin;
+      std::promise<bool>*           result;
+   } SessionJob;
+
+   struct Worker {
+      std::thread                   thread;
+      std::mutex                    mutex;
+      std::condition_variable       cond;
+      std::vector<SessionJob>       jobs;
+      int                           sessions;
+      bool                          stop;
+      VdpLocalJobDispatcher         dispatcher;   /* wakes its Poll() */
+   };
+
+   std::mutex                       m_sessionMutex;
+   std::unordered_map<DWORD, RPCPluginInstance*> m_sessions;
+   std::vector<Worker*>             m_workers;
+   std::mutex                       m_initMutex;
+   bool                             m_interfacesReady;
+
+   bool RunJob(int worker, SessionJobType type, DWORD sid,
+               RPCPluginInstance* rpcPlugin);
+   void WakeWorker(Worker* worker);
+   void WorkerMain(Worker* worker);
+   bool WorkerOpen(DWORD sid, RPCPluginInstance* rpcPlugin);
+   bool WorkerClose(DWORD sid, RPCPluginInstance* rpcPlugin);
+   static Bool WorkerWakeJob(void* userData);
+
+   RPCSessionManager(const RPCSessionManager&);
+   RPCSessionManager& operator=(const RPCSessionManager&);
+};
@@ -0,0 +1,544 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamFramer.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCStreamFramer.h"
+
+#ifdef _WIN32
+#include "winsock2.h"
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <new>
+
+/*
+ * memfd_create() needs Linux 3.17 and glibc 2.27, without it the ring is
+ * a flat buffer.
+ */
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define RPC_FRAMER_MIRRORED_SUPPORTED
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::RPCStreamFramer --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamFramer::RPCStreamFramer()
+   : m_base(NULL),
+     m_capacity(0),
+     m_mirrored(false),
+     m_head(0),
+     m_tail(0),
+     m_headerBytes(0),
+     m_frameSize(NULL),
+     m_userData(NULL),
+     m_maxFrame(RPC_FRAMER_MAX_FRAME),
+     m_pending(0)
+{
+   memset(&m_stats, 0, sizeof m_stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::~RPCStreamFramer --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamFramer::~RPCStreamFramer()
+{
+   Free(m_base, m_capacity, m_mirrored);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Init --
+ *
+ *    Allocates the ring for frames of at least <headerBytes> whose size
+ *    <frameSize> reads from their header.  Frames up to <capacity> fit
+ *    without growing the ring, frames over <maxFrame> are refused.
+ *
+ * Results:
+ *    false if the ring cannot be allocated.
+ *
+ * Side Effects:
+ *    Drops what was buffered and resets the statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamFramer::Init(uint32 capacity,              // IN
+                      uint32 headerBytes,           // IN
+                      RPCFrameSizeFn frameSize,     // IN
+                      void* userData,               // IN
+                      uint32 maxFrame)              // IN
+{
+   if (headerBytes == 0 || frameSize == NULL) {
+      return false;
+   }
+
+   Free(m_base, m_capacity, m_mirrored);
+   m_base = NULL;
+   m_capacity = 0;
+   m_head = 0;
+   m_tail = 0;
+   m_pending = 0;
+   memset(&m_stats, 0, sizeof m_stats);
+
+   m_headerBytes = headerBytes;
+   m_frameSize = frameSize;
+   m_userData = userData;
+   m_maxFrame = maxFrame > headerBytes ? maxFrame : headerBytes;
+
+   if (capacity < headerBytes) {
+      capacity = headerBytes;
+   }
+   if (!Allocate(capacity, &m_base, &m_capacity, &m_mirrored)) {
+      LOG("Error: cannot allocate a %u byte ring.", capacity);
+      return false;
+   }
+
+   m_stats.capacity = m_capacity;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Receive --
+ *
+ *    Reads what <fd> has into the free space of the ring, growing it
+ *    first if the frame at its head does not fit.  Call it once the
+ *    frames Next() returned are consumed, it may move them.
+ *
+ * Results:
+ *    The bytes read, 0 if the peer closed the stream, -1 on an error,
+ *    see errno (WSAGetLastError() on Windows).  <flags> are those of
+ *    recv(), e.g. MSG_DONTWAIT.
+ *
+ * Side Effects:
+ *    The pointers Next() returned are no longer valid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamFramer::Receive(int fd,      // IN
+                         int flags)   // IN
+{
+   if (m_base == NULL) {
+      return -1;
+   }
+
+   uint32 need = m_pending > 0 ? (uint32)m_pending : m_headerBytes;
+   if (need > m_capacity || Buffered() == m_capacity) {
+      if (!Grow(need > m_capacity ? need : m_capacity + 1)) {
+#ifndef _WIN32
+         errno = ENOMEM;
+#endif
+         return -1;
+      }
+   }
+
+   uint32 len = need;
+   char* space = Space(&len);
+
+#ifdef _WIN32
+   int n = recv((SOCKET)fd, space, (int)len, flags);
+#else
+   ssize_t n;
+   do {
+      n = recv(fd, space, len, flags);
+   } while (n < 0 && errno == EINTR);
+#endif
+
+   if (n > 0) {
+      m_tail += n;
+      m_stats.bytes += n;
+      m_stats.reads++;
+   }
+   return (int)n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Append --
+ *
+ *    Copies <len> bytes of the stream that were read elsewhere, e.g. by
+ *    an io_uring receive, into the ring, growing it if they do not fit.
+ *    Same rule as Receive() for the frames Next() returned.
+ *
+ * Results:
+ *    false if the ring cannot grow.
+ *
+ * Side Effects:
+ *    The pointers Next() returned are no longer valid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamFramer::Append(const char* data,   // IN
+                        uint32 len)         // IN
+{
+   if (m_base == NULL) {
+      return false;
+   }
+
+   uint32 buffered = Buffered();
+   if (buffered + len > m_capacity && !Grow(buffered + len)) {
+      return false;
+   }
+
+   /* asking for room for all that is buffered makes a flat buffer move it */
+   uint32 space = buffered + len;
+   memcpy(Space(&space), data, len);
+
+   m_tail += len;
+   m_stats.bytes += len;
+   m_stats.reads++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Next --
+ *
+ *    Returns the frame at the head of the ring, if it was received
+ *    whole.  It stays there until Consume().
+ *
+ * Results:
+ *    The size of the frame, 0 if more bytes are needed, -1 if its
+ *    header gives a bad size.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamFramer::Next(const char** frame)   // OUT
+{
+   uint32 buffered = Buffered();
+
+   if (m_pending == 0) {
+      if (buffered < m_headerBytes) {
+         return 0;
+      }
+
+      int size = m_frameSize(m_userData, Data());
+      if (size < (int)m_headerBytes || (uint32)size > m_maxFrame) {
+         LOG("Error: bad frame size %d.", size);
+         return -1;
+      }
+      m_pending = size;
+   }
+
+   if (buffered < (uint32)m_pending) {
+      return 0;
+   }
+
+   *frame = Data();
+   return m_pending;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Consume --
+ *
+ *    Drops the <size> byte frame Next() returned.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamFramer::Consume(uint32 size)   // IN
+{
+   if (size > Buffered()) {
+      size = Buffered();
+   }
+
+   m_head += size;
+   m_pending = 0;
+   m_stats.frames++;
+   if (size > m_stats.maxFrame) {
+      m_stats.maxFrame = size;
+   }
+
+   if (m_head == m_tail) {
+      m_head = 0;
+      m_tail = 0;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::GetStats --
+ *
+ *    Returns the counters since Init().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamFramer::GetStats(RPCStreamFramerStats* stats) const   // OUT
+{
+   *stats = m_stats;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Data --
+ *
+ *    Returns the first buffered byte.  In the mirrored ring the bytes
+ *    after it are contiguous whatever the offset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+char*
+RPCStreamFramer::Data() const
+{
+   if (m_mirrored) {
+      return m_base + (m_head & (m_capacity - 1));
+   }
+   return m_base + m_head;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Space --
+ *
+ *    Returns the free space after the buffered bytes.  A flat buffer
+ *    moves them to the front first if the <len> bytes of the frame
+ *    being received would not fit before its end.
+ *
+ * Results:
+ *    The space, <len> is set to its size.
+ *
+ * Side Effects:
+ *    May move the buffered bytes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+char*
+RPCStreamFramer::Space(uint32* len)   // IN/OUT
+{
+   uint32 buffered = Buffered();
+
+   if (m_mirrored) {
+      *len = m_capacity - buffered;
+      return m_base + (m_tail & (m_capacity - 1));
+   }
+
+   if (m_head > 0 && m_head + *len > m_capacity) {
+      memmove(m_base, m_base + m_head, buffered);
+      m_stats.movedBytes += buffered;
+      m_head = 0;
+      m_tail = buffered;
+   }
+
+   *len = m_capacity - (uint32)m_tail;
+   return m_base + m_tail;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Grow --
+ *
+ *    Replaces the ring with one of at least <size> bytes, and at least
+ *    twice the current one so that a stream of growing frames does not
+ *    grow it each time.
+ *
+ * Results:
+ *    false if <size> is over the largest frame or cannot be allocated.
+ *
+ * Side Effects:
+ *    Copies the buffered bytes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamFramer::Grow(uint32 size)   // IN
+{
+   if (size > m_maxFrame) {
+      LOG("Error: %u byte frame over the %u byte limit.", size, m_maxFrame);
+      return false;
+   }
+
+   uint32 capacity = m_capacity <= m_maxFrame / 2 ? m_capacity * 2 : m_maxFrame;
+   if (capacity < size) {
+      capacity = size;
+   }
+
+   char* base = NULL;
+   uint32 actual = 0;
+   bool mirrored = false;
+   if (!Allocate(capacity, &base, &actual, &mirrored)) {
+      LOG("Error: cannot grow the ring to %u bytes.", capacity);
+      return false;
+   }
+
+   uint32 buffered = Buffered();
+   memcpy(base, Data(), buffered);
+   Free(m_base, m_capacity, m_mirrored);
+
+   m_base = base;
+   m_capacity = actual;
+   m_mirrored = mirrored;
+   m_head = 0;
+   m_tail = buffered;
+
+   m_stats.movedBytes += buffered;
+   m_stats.grows++;
+   m_stats.capacity = m_capacity;
+   LOG("Grew the ring to %u bytes.", m_capacity);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Allocate --
+ *
+ *    Allocates a ring of at least <capacity> bytes.  The mirrored one
+ *    reserves twice the size and maps the same memfd into both halves,
+ *    its size is a power of two so that offsets wrap with a mask.
+ *
+ * Results:
+ *    false if neither kind can be allocated.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamFramer::Allocate(uint32 capacity,   // IN
+                          char** base,       // OUT
+                          uint32* actual,    // OUT
+                          bool* mirrored)    // OUT
+{
+#ifdef RPC_FRAMER_MIRRORED_SUPPORTED
+   uint32 size = (uint32)sysconf(_SC_PAGESIZE);
+   while (size < capacity && size <= 0x40000000) {
+      size <<= 1;
+   }
+
+   int fd = size >= capacity ? memfd_create("RPCStreamFramer", MFD_CLOEXEC) : -1;
+   if (fd >= 0 && ftruncate(fd, size) == 0) {
+      char* ring = (char*)mmap(NULL, 2 * (size_t)size, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ring != MAP_FAILED) {
+         if (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                  fd, 0) != MAP_FAILED &&
+             mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                  fd, 0) != MAP_FAILED) {
+            close(fd);
+            *base = ring;
+            *actual = size;
+            *mirrored = true;
+            return true;
+         }
+         munmap(ring, 2 * (size_t)size);
+      }
+   }
+
+   LOG("No mirrored ring, errno %d, using a flat buffer.", errno);
+   if (fd >= 0) {
+      close(fd);
+   }
+#endif
+
+   *base = new (std::nothrow) char[capacity];
+   *actual = capacity;
+   *mirrored = false;
+   return *base != NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamFramer::Free --
+ *
+ *    Frees a ring Allocate() returned.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamFramer::Free(char* base,         // IN
+                      uint32 capacity,    // IN
+                      bool mirrored)      // IN
+{
+   if (base == NULL) {
+      return;
+   }
+
+#ifdef RPC_FRAMER_MIRRORED_SUPPORTED
+   if (mirrored) {
+      munmap(base, 2 * (size_t)capacity);
+      return;
+   }
+#endif
+
+   delete [] base;
+}
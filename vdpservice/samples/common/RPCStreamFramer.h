@@ -0,0 +1,110 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamFramer.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+// capacity the ring starts with unless Init() says otherwise.
+#define RPC_FRAMER_CAPACITY         (64 * 1024)
+
+// largest frame the ring grows for, a larger size is a broken stream.
+#define RPC_FRAMER_MAX_FRAME        (64 * 1024 * 1024)
+
+/*
+ * Returns the size of the frame that starts at <data>, header included.
+ * The header bytes given to RPCStreamFramer::Init() are there.
+ */
+typedef int (*RPCFrameSizeFn)(void* userData, const char* data);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCStreamFramerStats
+ *
+ *    Counters since Init().  Moved bytes were copied inside the framer,
+ *    by a grow or, without the mirrored ring, to the front of the
+ *    buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         frames;
+   uint64         bytes;            /* received */
+   uint64         reads;            /* recv() calls that returned data, or Append() calls */
+   uint64         movedBytes;
+   uint32         grows;
+   uint32         capacity;
+   uint32         maxFrame;         /* largest frame seen */
+} RPCStreamFramerStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCStreamFramer
+ *
+ *    Splits a stream into frames.  Receive() reads from a socket into a
+ *    ring buffer and Next() hands out the whole frame at its head, as a
+ *    pointer into the ring that stays valid until the next Receive().
+ *
+ *    On Linux the ring is one memfd mapped twice, back to back, so the
+ *    bytes from any offset are contiguous up to the capacity and a frame
+ *    that wraps around the end needs no copy.  Elsewhere, or if memfd
+ *    is not available, it is a flat buffer and the partial frame left at
+ *    its end is moved to the front before reading on.  A frame larger
+ *    than the capacity grows the ring to fit it.
+ *
+ *    Not thread safe, one thread reads a stream.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCStreamFramer
+{
+public:
+   RPCStreamFramer();
+   ~RPCStreamFramer();
+
+   bool Init(uint32 capacity, uint32 headerBytes, RPCFrameSizeFn frameSize,
+             void* userData, uint32 maxFrame = RPC_FRAMER_MAX_FRAME);
+   bool IsMirrored() const { return m_mirrored; }
+
+   int Receive(int fd, int flags);
+   bool Append(const char* data, uint32 len);
+   int Next(const char** frame);
+   void Consume(uint32 size);
+
+   uint32 Buffered() const { return (uint32)(m_tail - m_head); }
+   void GetStats(RPCStreamFramerStats* stats) const;
+
+private:
+   char*             m_base;
+   uint32            m_capacity;
+   bool              m_mirrored;
+   uint64            m_head;           /* offsets read and written */
+   uint64            m_tail;
+
+   uint32            m_headerBytes;
+   RPCFrameSizeFn    m_frameSize;
+   void*             m_userData;
+   uint32            m_maxFrame;
+   int               m_pending;        /* size of the frame at m_head, 0 unknown */
+
+   RPCStreamFramerStats m_stats;
+
+   char* Data() const;
+   char* Space(uint32* len);
+   bool Grow(uint32 size);
+   bool Allocate(uint32 capacity, char** base, uint32* actual, bool* mirrored);
+   void Free(char* base, uint32 capacity, bool mirrored);
+
+   RPCStreamFramer(const RPCStreamFramer&);
+   RPCStreamFramer& operator=(const RPCStreamFramer&);
+};
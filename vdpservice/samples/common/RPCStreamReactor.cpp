@@ -0,0 +1,1992 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamReactor.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCStreamReactor.h"
+
+#ifdef _WIN32
+#include "winsock2.h"
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define RPC_REACTOR_EPOLL
+#endif
+
+#include <chrono>
+
+// what PollSockets() reports for a socket.
+#define RPC_REACTOR_READ            0x1
+#define RPC_REACTOR_WRITE           0x2
+#define RPC_REACTOR_ERROR           0x4
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+#include <sys/mman.h>
+
+// what an io_uring completion is for, in bits 24-31 of its user_data.
+#define RPC_URING_RECV              1
+#define RPC_URING_SEND              2
+#define RPC_URING_CANCEL            3
+#define RPC_URING_WAKE              4
+
+// the buffer group of the receive buffers.
+#define RPC_URING_GROUP             0
+
+// how long Remove() waits for the completions of what it cancelled.
+#define RPC_URING_CANCEL_MS         1000
+
+#define RPC_URING_DATA(id, op, index) \
+   (((uint64)(id) << 32) | ((uint64)(op) << 24) | (uint64)(index))
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::RPCStreamReactor --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamReactor::RPCStreamReactor()
+   : m_pollFd(-1),
+     m_wakeFd(-1),
+     m_stop(false),
+     m_writeArms(0)
+#ifdef RPC_STREAM_URING_SUPPORTED
+     , m_useUring(false),
+     m_slots(NULL),
+     m_nextId(0)
+#endif
+{
+   memset(&m_stats, 0, sizeof m_stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::~RPCStreamReactor --
+ *
+ *    Destructor, removes the sockets still there.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamReactor::~RPCStreamReactor()
+{
+   Stop();
+
+   std::vector<int> fds;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto& it : m_sessions) {
+         fds.push_back(it.first);
+      }
+   }
+   for (size_t i = 0; i < fds.size(); i++) {
+      Remove(fds[i], 0);
+   }
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   UringExit();
+#endif
+
+#ifndef _WIN32
+   if (m_wakeFd >= 0) {
+      close(m_wakeFd);
+   }
+   if (m_pollFd >= 0) {
+      close(m_pollFd);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Init --
+ *
+ *    Sets up io_uring if <useUring> and the kernel supports it, else the
+ *    epoll instance, or the poll() backend where there is none.
+ *
+ * Results:
+ *    true, the poll() backend always works.
+ *
+ * Side Effects:
+ *    Resets the statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Init(bool useUring)   // IN
+{
+   FUNCTION_TRACE;
+
+   memset(&m_stats, 0, sizeof m_stats);
+   m_writeArms = 0;
+
+#ifdef RPC_REACTOR_EPOLL
+   if (m_pollFd < 0) {
+      m_pollFd = epoll_create1(EPOLL_CLOEXEC);
+      if (m_pollFd < 0) {
+         LOG("epoll_create1() failed, errno %d, using poll().", errno);
+      } else {
+         m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         if (m_wakeFd >= 0) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof ev);
+            ev.events = EPOLLIN;
+            ev.data.fd = m_wakeFd;
+            epoll_ctl(m_pollFd, EPOLL_CTL_ADD, m_wakeFd, &ev);
+         }
+      }
+   }
+#endif
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (useUring && !m_useUring && m_sessions.empty()) {
+      m_useUring = UringInit();
+      if (!m_useUring) {
+         LOG("io_uring is not available, using %s.", GetBackendName());
+      } else {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         if (!UringArmWake()) {
+            LOG("Warning: the io_uring reactor cannot be woken.");
+         }
+      }
+   }
+#endif
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::GetBackendName --
+ *
+ *    Returns how the reactor waits, "io_uring", "epoll" or "poll".
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCStreamReactor::GetBackendName() const
+{
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      return "io_uring";
+   }
+#endif
+   return m_pollFd >= 0 ? "epoll" : "poll";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Add --
+ *
+ *    Serves the stream data socket <fd>, with the context options the
+ *    channel negotiated.  Its frames go to <handler>.
+ *
+ * Results:
+ *    false if the socket cannot be watched or is already.
+ *
+ * Side Effects:
+ *    Makes the socket non-blocking.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Add(int fd,                                           // IN
+                      const VDPRPC_StreamDataInterface* iStreamData,    // IN
+                      uint32 ctxOptions,                                // IN
+                      RPCStreamHandler* handler)                        // IN
+{
+   if (fd < 0 || iStreamData == NULL || handler == NULL) {
+      return false;
+   }
+
+   SessionPtr session = std::make_shared<Session>();
+   session->fd = fd;
+   session->iStreamData = iStreamData;
+   session->handler = handler;
+
+   if (!session->framer.Init(RPC_FRAMER_CAPACITY,
+                             iStreamData->v1.GetMinimalStreamDataSize(fd),
+                             FrameSize, session.get())) {
+      return false;
+   }
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      return UringAdd(session, ctxOptions);
+   }
+#endif
+
+   if (!session->sender.Open(fd, iStreamData, ctxOptions)) {
+      return false;
+   }
+   session->sender.SetRelease(OnSent, session.get());
+   session->sender.SetQueueing(true);
+
+#ifdef _WIN32
+   u_long nonBlocking = 1;
+   ioctlsocket((SOCKET)fd, FIONBIO, &nonBlocking);
+#else
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_sessions.find(fd) != m_sessions.end()) {
+         LOG("Error: socket %d is already served.", fd);
+         return false;
+      }
+      m_sessions[fd] = session;
+      m_stats.sessions = (uint32)m_sessions.size();
+   }
+
+   if (!Watch(session.get(), false, true)) {
+      LOG("Error: cannot watch socket %d, errno %d.", fd, errno);
+      Remove(fd, 0);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Remove --
+ *
+ *    Stops serving <fd>, waiting up to <msTimeout> for its zero-copy
+ *    sends to complete.  The socket stays open.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Drops what is still queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Remove(int fd,             // IN
+                         uint32 msTimeout)   // IN
+{
+   SessionPtr session;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      auto it = m_sessions.find(fd);
+      if (it == m_sessions.end()) {
+         return;
+      }
+      session = it->second;
+      m_sessions.erase(it);
+      m_stats.sessions = (uint32)m_sessions.size();
+   }
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      UringRemove(session, msTimeout);
+      return;
+   }
+#endif
+
+#ifdef RPC_REACTOR_EPOLL
+   if (m_pollFd >= 0) {
+      epoll_ctl(m_pollFd, EPOLL_CTL_DEL, fd, NULL);
+   }
+#endif
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   session->closed = true;
+   session->sender.Close(msTimeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::EnableZeroCopy --
+ *
+ *    RPCStreamSender::EnableZeroCopy() for <fd>, the blobs sent with a
+ *    cookie come back through OnStreamSent() once the kernel is done.
+ *
+ * Results:
+ *    false if <fd> is not served or does not support it, or with
+ *    io_uring.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::EnableZeroCopy(int fd,              // IN
+                                 uint32 minBytes)     // IN
+{
+   SessionPtr session = Find(fd);
+   if (!session) {
+      return false;
+   }
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      return false;
+   }
+#endif
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   return session->sender.EnableZeroCopy(minBytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Send --
+ *
+ *    Sends <size> bytes of <data> as stream data command <reqCmd> on
+ *    <fd>, see RPCStreamSender::Send().  What the socket does not take
+ *    is queued, and write events are asked for until it is written.
+ *
+ * Results:
+ *    false on a socket error, or if <fd> is not served, the cookie is
+ *    not released then.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Send(int fd,               // IN
+                       int reqCmd,           // IN
+                       const char* data,     // IN
+                       uint32 size,          // IN
+                       void* cookie)         // IN
+{
+   SessionPtr session = Find(fd);
+   if (!session) {
+      return false;
+   }
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   int reqId = 0;
+
+   if (session->closed) {
+      return false;
+   }
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      return UringSend(session.get(), reqCmd, data, size, cookie);
+   }
+#endif
+
+   bool ok = session->sender.Send(reqCmd, data, size, cookie, &reqId);
+   if (ok && session->sender.HasQueued() && !session->writeArmed) {
+      session->writeArmed = true;
+      m_writeArms++;
+      ok = Watch(session.get(), true, false);
+   }
+
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Poll --
+ *
+ *    Waits up to <msTimeout> for socket events and serves them, then
+ *    goes on reading the sockets whose read budget ran out before.  Those
+ *    do not wait.
+ *
+ * Results:
+ *    The number of sockets served, 0 on timeout, -1 if the wait failed.
+ *
+ * Side Effects:
+ *    Calls the handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamReactor::Poll(int msTimeout)   // IN
+{
+#ifdef RPC_STREAM_URING_SUPPORTED
+   if (m_useUring) {
+      return UringPoll(msTimeout);
+   }
+#endif
+
+   std::vector<SessionPtr> yielded;
+   yielded.swap(m_yielded);
+   for (size_t i = 0; i < yielded.size(); i++) {
+      yielded[i]->yielded = false;
+   }
+
+   std::vector<SessionPtr> ready;
+   std::vector<int> events;
+   int n = PollSockets(yielded.empty() ? msTimeout : 0, &ready, &events);
+   if (n < 0) {
+      m_yielded.swap(yielded);
+      return -1;
+   }
+
+   for (size_t i = 0; i < ready.size(); i++) {
+      const SessionPtr& session = ready[i];
+
+      if ((events[i] & RPC_REACTOR_ERROR) != 0) {
+         /* zero-copy completions, a socket error shows in Read() */
+         std::lock_guard<std::recursive_mutex> lock(session->mutex);
+         session->sender.Reap();
+      }
+      if ((events[i] & (RPC_REACTOR_READ | RPC_REACTOR_ERROR)) != 0 &&
+          !session->closed) {
+         Read(session);
+      }
+      if ((events[i] & RPC_REACTOR_WRITE) != 0 && !session->closed) {
+         Write(session);
+      }
+   }
+
+   for (size_t i = 0; i < yielded.size(); i++) {
+      if (!yielded[i]->closed && !yielded[i]->yielded) {
+         Read(yielded[i]);
+      }
+   }
+
+   return (int)(ready.size() + yielded.size());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Start --
+ *
+ *    Starts a thread that polls until Stop().
+ *
+ * Results:
+ *    false if it runs already.
+ *
+ * Side Effects:
+ *    The handlers are called from that thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Start()
+{
+   if (m_thread.joinable()) {
+      return false;
+   }
+
+   m_stop = false;
+   m_thread = std::thread(&RPCStreamReactor::ThreadMain, this);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Stop --
+ *
+ *    Stops the thread Start() started.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Stop()
+{
+   if (!m_thread.joinable()) {
+      return;
+   }
+
+   m_stop = true;
+   Wake();
+   m_thread.join();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::GetStats --
+ *
+ *    Returns the counters since Init().  Call it from the polling
+ *    thread or once it stopped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::GetStats(RPCStreamReactorStats* stats) const   // OUT
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   *stats = m_stats;
+   stats->writeArms = m_writeArms;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::GetSessionStats --
+ *
+ *    Returns the sender and framer counters of <fd>, either may be
+ *    NULL.  Same caveat as GetStats() for the framer.
+ *
+ * Results:
+ *    false if <fd> is not served.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::GetSessionStats(int fd,                           // IN
+                                  RPCStreamSenderStats* sender,     // OUT
+                                  RPCStreamFramerStats* framer) const  // OUT
+{
+   SessionPtr session = Find(fd);
+   if (!session) {
+      return false;
+   }
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   if (sender != NULL) {
+#ifdef RPC_STREAM_URING_SUPPORTED
+      if (m_useUring) {
+         *sender = session->stats;
+      } else
+#endif
+      session->sender.GetStats(sender);
+   }
+   if (framer != NULL) {
+      session->framer.GetStats(framer);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Find --
+ *
+ *    Returns the session of <fd>, if it is served.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamReactor::SessionPtr
+RPCStreamReactor::Find(int fd) const   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   auto it = m_sessions.find(fd);
+   return it != m_sessions.end() ? it->second : SessionPtr();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Watch --
+ *
+ *    Adds the socket of <session> to the epoll set, or changes what it
+ *    is watched for: always reads, writes if <write>.  The poll()
+ *    backend reads Session::writeArmed instead.
+ *
+ * Results:
+ *    false if epoll_ctl() failed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Watch(Session* session,   // IN
+                        bool write,         // IN
+                        bool add)           // IN
+{
+#ifdef RPC_REACTOR_EPOLL
+   if (m_pollFd >= 0) {
+      struct epoll_event ev;
+
+      memset(&ev, 0, sizeof ev);
+      ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (write ? (uint32)EPOLLOUT : 0u);
+      ev.data.fd = session->fd;
+      return epoll_ctl(m_pollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                       session->fd, &ev) == 0;
+   }
+#endif
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::PollSockets --
+ *
+ *    Waits up to <msTimeout> for events on the sockets.
+ *
+ * Results:
+ *    The number of sockets with events, <ready> and <events> list them
+ *    and what happened (RPC_REACTOR_READ...), -1 on an error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamReactor::PollSockets(int msTimeout,                      // IN
+                              std::vector<SessionPtr>* ready,     // OUT
+                              std::vector<int>* events)           // OUT
+{
+   m_stats.waits++;
+
+#ifdef RPC_REACTOR_EPOLL
+   if (m_pollFd >= 0) {
+      struct epoll_event evs[RPC_REACTOR_MAX_EVENTS];
+
+      int n = epoll_wait(m_pollFd, evs, RPC_REACTOR_MAX_EVENTS, msTimeout);
+      if (n < 0) {
+         if (errno == EINTR) {
+            return 0;
+         }
+         LOG("Error: epoll_wait() failed, errno %d.", errno);
+         return -1;
+      }
+
+      for (int i = 0; i < n; i++) {
+         if (evs[i].data.fd == m_wakeFd) {
+            uint64_t count;
+            while (read(m_wakeFd, &count, sizeof count) > 0) {
+            }
+            continue;
+         }
+
+         SessionPtr session = Find(evs[i].data.fd);
+         if (!session) {
+            continue;
+         }
+
+         int what = 0;
+         if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) != 0) {
+            what |= RPC_REACTOR_READ;
+         }
+         if ((evs[i].events & EPOLLOUT) != 0) {
+            what |= RPC_REACTOR_WRITE;
+         }
+         if ((evs[i].events & EPOLLERR) != 0) {
+            what |= RPC_REACTOR_ERROR;
+         }
+         ready->push_back(session);
+         events->push_back(what);
+      }
+
+      m_stats.events += ready->size();
+      return (int)ready->size();
+   }
+#endif
+
+   /*
+    * poll() is level-triggered and sees no new socket or write interest
+    * while it waits, so it does not wait longer than RPC_REACTOR_WAIT_MS.
+    */
+   std::vector<SessionPtr> sessions;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto& it : m_sessions) {
+         sessions.push_back(it.second);
+      }
+   }
+
+   if (msTimeout < 0 || msTimeout > RPC_REACTOR_WAIT_MS) {
+      msTimeout = RPC_REACTOR_WAIT_MS;
+   }
+   if (sessions.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(msTimeout));
+      return 0;
+   }
+
+#ifdef _WIN32
+   std::vector<WSAPOLLFD> fds(sessions.size());
+#else
+   std::vector<struct pollfd> fds(sessions.size());
+#endif
+   for (size_t i = 0; i < sessions.size(); i++) {
+      fds[i].fd = sessions[i]->fd;
+      fds[i].events = POLLIN | (sessions[i]->writeArmed ? POLLOUT : 0);
+      fds[i].revents = 0;
+   }
+
+#ifdef _WIN32
+   int n = WSAPoll(fds.data(), (ULONG)fds.size(), msTimeout);
+#else
+   int n = poll(fds.data(), fds.size(), msTimeout);
+   if (n < 0 && errno == EINTR) {
+      return 0;
+   }
+#endif
+   if (n < 0) {
+      LOG("Error: poll() failed.");
+      return -1;
+   }
+
+   for (size_t i = 0; i < fds.size() && n > 0; i++) {
+      int what = 0;
+      if ((fds[i].revents & (POLLIN | POLLHUP)) != 0) {
+         what |= RPC_REACTOR_READ;
+      }
+      if ((fds[i].revents & POLLOUT) != 0) {
+         what |= RPC_REACTOR_WRITE;
+      }
+      if ((fds[i].revents & (POLLERR | POLLNVAL)) != 0) {
+         what |= RPC_REACTOR_ERROR;
+      }
+      if (what != 0) {
+         ready->push_back(sessions[i]);
+         events->push_back(what);
+      }
+   }
+
+   m_stats.events += ready->size();
+   return (int)ready->size();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Read --
+ *
+ *    Reads the socket of <session> until it has no more data, handing
+ *    each frame to its handler.  Once the read budget is used up the
+ *    session waits for the next turn, an edge-triggered socket would
+ *    not report the data left.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Closes the session if the socket is closed or failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Read(const SessionPtr& session)   // IN
+{
+   for (int i = 0; i < RPC_REACTOR_READ_BUDGET; i++) {
+      int n = session->framer.Receive(session->fd, 0);
+      if (n < 0) {
+#ifdef _WIN32
+         int err = WSAGetLastError();
+         bool wouldBlock = err == WSAEWOULDBLOCK;
+#else
+         int err = errno;
+         bool wouldBlock = err == EAGAIN || err == EWOULDBLOCK;
+#endif
+         if (wouldBlock) {
+            return;
+         }
+         LOG("Error: stream data socket %d failed, error %d.", session->fd, err);
+         Close(session);
+         return;
+      }
+      if (n == 0) {
+         LOG("Stream data socket %d closed.", session->fd);
+         Close(session);
+         return;
+      }
+      m_stats.reads++;
+
+      if (!Dispatch(session)) {
+         return;
+      }
+   }
+
+   session->yielded = true;
+   m_yielded.push_back(session);
+   m_stats.yields++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Dispatch --
+ *
+ *    Hands each whole frame in the framer of <session> to its handler.
+ *
+ * Results:
+ *    false if the session was closed meanwhile.
+ *
+ * Side Effects:
+ *    Closes the session on a broken frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::Dispatch(const SessionPtr& session)   // IN
+{
+   const VDPRPC_StreamDataInterface* iStreamData = session->iStreamData;
+   const char* frame;
+   int size;
+
+   while ((size = session->framer.Next(&frame)) > 0) {
+      int reqId, reqType, reqCmd;
+      Bool cleanup = FALSE;
+      VDP_RPC_BLOB blob = { 0, NULL };
+
+      if (!iStreamData->v2.GetStreamDataInfo(session->fd, frame, &reqId,
+                                             &reqType, &reqCmd, &cleanup,
+                                             &blob)) {
+         LOG("Error: GetStreamDataInfo(v2) failed on socket %d.", session->fd);
+         Close(session);
+         return false;
+      }
+
+      session->handler->OnStreamData(session->fd, reqId, reqCmd, &blob);
+      if (cleanup) {
+         iStreamData->v2.FreeStreamDataPayload(&blob);
+      }
+
+      session->framer.Consume(size);
+      m_stats.frames++;
+      if (session->closed) {
+         return false;
+      }
+   }
+
+   if (size < 0) {
+      Close(session);
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Write --
+ *
+ *    Writes what is queued for the now writable socket of <session>,
+ *    and stops asking for write events once all is written.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Closes the session if the socket failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Write(const SessionPtr& session)   // IN
+{
+   bool ok;
+   bool drained;
+
+   {
+      std::lock_guard<std::recursive_mutex> lock(session->mutex);
+
+      ok = session->sender.Flush();
+      drained = !session->sender.HasQueued();
+      if (ok && drained && session->writeArmed) {
+         session->writeArmed = false;
+         ok = Watch(session.get(), false, false);
+      }
+   }
+
+   if (!ok) {
+      Close(session);
+   } else if (drained) {
+      session->handler->OnStreamDrained(session->fd);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Close --
+ *
+ *    Removes a session whose socket was closed or failed and tells its
+ *    handler.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Close(const SessionPtr& session)   // IN
+{
+   if (session->closed) {
+      return;
+   }
+
+   Remove(session->fd, 0);
+   session->handler->OnStreamClosed(session->fd);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::Wake --
+ *
+ *    Ends the current wait of the epoll or io_uring backend early, the
+ *    poll() one ends within RPC_REACTOR_WAIT_MS anyway.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::Wake()
+{
+#ifdef __linux__
+   if (m_wakeFd >= 0) {
+      uint64_t one = 1;
+      if (write(m_wakeFd, &one, sizeof one) < 0) {
+         LOG("Warning: cannot wake the reactor, errno %d.", errno);
+      }
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::ThreadMain --
+ *
+ *    The thread Start() starts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::ThreadMain()
+{
+   while (!m_stop) {
+      if (Poll(RPC_REACTOR_WAIT_MS) < 0) {
+         break;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::FrameSize --
+ *
+ *    RPCStreamFramer callback, the size of the stream data packet at
+ *    <data>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamReactor::FrameSize(void* userData,     // IN
+                            const char* data)   // IN
+{
+   Session* session = static_cast<Session*>(userData);
+
+   return session->iStreamData->v1.GetStreamDataSize(session->fd, data);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::OnSent --
+ *
+ *    RPCStreamSender release callback.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::OnSent(void* userData,   // IN
+                         void* cookie)     // IN
+{
+   Session* session = static_cast<Session*>(userData);
+
+   session->handler->OnStreamSent(session->fd, cookie);
+}
+
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringInit --
+ *
+ *    Sets up the ring, the receive buffers and the registered slots.
+ *
+ * Results:
+ *    false if the kernel lacks something, the reactor uses epoll then.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringInit()
+{
+   size_t slotsSize = (size_t)RPC_REACTOR_URING_SLOTS * RPC_REACTOR_URING_SLOT_BYTES;
+
+   if (!m_uring.Init(RPC_URING_ENTRIES) ||
+       !m_uring.SetupBufferRing(RPC_URING_GROUP, RPC_URING_RECV_BUFS,
+                                RPC_URING_RECV_BUF_BYTES)) {
+      m_uring.Exit();
+      return false;
+   }
+
+   void* slots = mmap(NULL, slotsSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (slots == MAP_FAILED) {
+      m_uring.Exit();
+      return false;
+   }
+   m_slots = (char*)slots;
+
+   if (!m_uring.RegisterBuffers(m_slots, slotsSize)) {
+      UringExit();
+      return false;
+   }
+
+   m_freeSlots.clear();
+   for (int i = RPC_REACTOR_URING_SLOTS - 1; i >= 0; i--) {
+      m_freeSlots.push_back(i);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringExit --
+ *
+ *    Closes the ring, then frees the slots the kernel may have used.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringExit()
+{
+   m_uring.Exit();
+
+   if (m_slots != NULL) {
+      munmap(m_slots, (size_t)RPC_REACTOR_URING_SLOTS * RPC_REACTOR_URING_SLOT_BYTES);
+      m_slots = NULL;
+   }
+   m_useUring = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringAdd --
+ *
+ *    Add() with io_uring, arms the multishot receive of <session>.
+ *
+ * Results:
+ *    false if the socket is already served or the receive cannot be
+ *    submitted.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringAdd(const SessionPtr& session,   // IN
+                           uint32 ctxOptions)           // IN
+{
+   session->ctxOptions = ctxOptions;
+   fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_sessions.find(session->fd) != m_sessions.end()) {
+         LOG("Error: socket %d is already served.", session->fd);
+         return false;
+      }
+      session->id = ++m_nextId;
+      m_sessions[session->fd] = session;
+      m_uringSessions[session->id] = session;
+      m_stats.sessions = (uint32)m_sessions.size();
+   }
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   std::lock_guard<std::mutex> uringLock(m_uringMutex);
+
+   if (!UringArmRecv(session.get()) || m_uring.Submit(0, 0) < 0) {
+      LOG("Error: cannot receive on socket %d, errno %d.", session->fd, errno);
+      session->closed = true;
+
+      std::lock_guard<std::mutex> sessionsLock(m_mutex);
+      m_sessions.erase(session->fd);
+      if (session->inflight == 0) {
+         m_uringSessions.erase(session->id);
+      }
+      m_stats.sessions = (uint32)m_sessions.size();
+      return false;
+   }
+
+   m_stats.submits++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringRemove --
+ *
+ *    Remove() with io_uring.  Waits up to <msTimeout> for the queued
+ *    messages to go out and cancels what is left, then waits for the
+ *    cancelled operations to complete so that the kernel no longer uses
+ *    the buffers.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Reaps completions, of any socket.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringRemove(const SessionPtr& session,   // IN
+                              uint32 msTimeout)            // IN
+{
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+
+   if (session->closed) {
+      return;
+   }
+
+   /* what is received meanwhile is dropped */
+   session->draining = true;
+
+   auto deadline = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(msTimeout);
+   while (!session->queue.empty() && !session->closed &&
+          std::chrono::steady_clock::now() < deadline) {
+      {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         m_uring.Submit(0, 0);
+      }
+      m_uring.Wait(10);
+      UringReap();
+   }
+
+   if (session->closed) {
+      return;
+   }
+   session->closed = true;
+
+   if (!session->queue.empty()) {
+      LOG("Warning: %u messages dropped on socket %d.",
+          (uint32)session->queue.size(), session->fd);
+   }
+   if (session->chainLeft == 0) {
+      while (!session->queue.empty()) {
+         UringRelease(session.get(), &session->queue.front());
+         session->queue.pop_front();
+      }
+   }
+
+   {
+      std::lock_guard<std::mutex> uringLock(m_uringMutex);
+      struct io_uring_sqe* sqe = m_uring.GetSqe();
+      if (sqe != NULL) {
+         sqe->opcode = IORING_OP_ASYNC_CANCEL;
+         sqe->fd = session->fd;
+         sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+         sqe->user_data = RPC_URING_DATA(session->id, RPC_URING_CANCEL, 0);
+      }
+   }
+
+   deadline = std::chrono::steady_clock::now() +
+              std::chrono::milliseconds(RPC_URING_CANCEL_MS);
+   while (session->inflight > 0 && std::chrono::steady_clock::now() < deadline) {
+      {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         m_uring.Submit(0, 0);
+      }
+      m_uring.Wait(10);
+      UringReap();
+   }
+
+   if (session->inflight > 0) {
+      LOG("Warning: %u operations still in flight on socket %d.",
+          session->inflight, session->fd);
+   } else {
+      std::lock_guard<std::mutex> sessionsLock(m_mutex);
+      m_uringSessions.erase(session->id);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringSend --
+ *
+ *    Send() with io_uring.  A message that fits in a slot is copied
+ *    there and goes out with one operation on the registered buffer.  A
+ *    larger one has its header and tail written to a slot, and the blob
+ *    goes out from the caller's buffer if it came with a cookie, else
+ *    from a copy.  The message is sent at once if no send is in flight
+ *    on the socket, otherwise with the next chain.
+ *
+ * Results:
+ *    false on an error.
+ *
+ * Side Effects:
+ *    Releases the blob unless it goes out from the caller's buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringSend(Session* session,     // IN
+                            int reqCmd,           // IN
+                            const char* data,     // IN
+                            uint32 size,          // IN
+                            void* cookie)         // IN
+{
+   const VDPRPC_StreamDataInterface* iStreamData = session->iStreamData;
+   int reqId = 0;
+   int slot = -1;
+
+   {
+      std::lock_guard<std::mutex> uringLock(m_uringMutex);
+      if (!m_freeSlots.empty()) {
+         slot = m_freeSlots.back();
+         m_freeSlots.pop_back();
+      }
+   }
+
+   session->queue.emplace_back();
+   UringMsg& msg = session->queue.back();
+   char* slotData = slot >= 0 ? m_slots + (size_t)slot * RPC_REACTOR_URING_SLOT_BYTES
+                              : NULL;
+   bool ok = true;
+
+   msg.count = 0;
+   msg.cookie = NULL;
+   msg.slot = slot;
+
+   if (session->ctxOptions != 0) {
+      /* compressed or encrypted, GetStreamData() builds the whole message */
+      VDP_RPC_BLOB blob = { size, (char*)data };
+      VDP_RPC_BLOB payload = { 0, NULL };
+
+      ok = iStreamData->v2.GetStreamData(session->fd, session->ctxOptions, &reqId,
+                                         reqCmd, &blob, &payload) != FALSE;
+      if (ok) {
+         if (slotData != NULL && payload.size <= RPC_REACTOR_URING_SLOT_BYTES) {
+            memcpy(slotData, payload.blobData, payload.size);
+            msg.bufs[0] = slotData;
+            msg.fixed[0] = true;
+         } else {
+            msg.copy.assign(payload.blobData, payload.blobData + payload.size);
+            msg.bufs[0] = msg.copy.data();
+            msg.fixed[0] = false;
+         }
+         msg.lens[0] = payload.size;
+         msg.count = 1;
+         iStreamData->v2.FreeStreamDataPayload(&payload);
+         session->stats.copied++;
+      }
+   } else {
+      int headerLen = 0;
+      int tailLen = 0;
+      VDP_RPC_BLOB blob = { size, (char*)data };
+
+      ok = iStreamData->v1.GetStreamDataHeaderTailSize(session->fd, (int)size,
+                                                       &headerLen, &tailLen) != FALSE;
+      uint32 frameLen = (uint32)(headerLen + tailLen);
+      char* frame = NULL;
+
+      if (ok && slotData != NULL && frameLen + size <= RPC_REACTOR_URING_SLOT_BYTES) {
+         /* all of it in the slot, the blob between header and tail */
+         ok = iStreamData->v1.GetStreamDataHeaderTail(session->fd, &reqId, reqCmd,
+                                                      &blob, slotData, headerLen,
+                                                      slotData + headerLen + size,
+                                                      tailLen) != FALSE;
+         memcpy(slotData + headerLen, data, size);
+         msg.bufs[0] = slotData;
+         msg.lens[0] = frameLen + size;
+         msg.fixed[0] = true;
+         msg.count = 1;
+      } else if (ok) {
+         bool fixed = slotData != NULL && frameLen <= RPC_REACTOR_URING_SLOT_BYTES;
+         if (fixed) {
+            frame = slotData;
+         } else {
+            msg.frame.resize(frameLen);
+            frame = msg.frame.data();
+         }
+
+         ok = iStreamData->v1.GetStreamDataHeaderTail(session->fd, &reqId, reqCmd,
+                                                      &blob, frame, headerLen,
+                                                      frame + headerLen,
+                                                      tailLen) != FALSE;
+         if (cookie == NULL) {
+            msg.copy.assign(data, data + size);
+            data = msg.copy.data();
+         }
+
+         const char* bufs[RPC_STREAM_IOV_MAX] = { frame, data, frame + headerLen };
+         uint32 lens[RPC_STREAM_IOV_MAX] = { (uint32)headerLen, size, (uint32)tailLen };
+         bool fixeds[RPC_STREAM_IOV_MAX] = { fixed, false, fixed };
+
+         for (int i = 0; i < RPC_STREAM_IOV_MAX; i++) {
+            if (lens[i] > 0) {
+               msg.bufs[msg.count] = bufs[i];
+               msg.lens[msg.count] = lens[i];
+               msg.fixed[msg.count] = fixeds[i];
+               msg.count++;
+            }
+         }
+         if (cookie != NULL) {
+            msg.cookie = cookie;
+            cookie = NULL;
+         }
+      }
+   }
+
+   if (cookie != NULL) {
+      session->handler->OnStreamSent(session->fd, cookie);
+   }
+
+   if (!ok) {
+      LOG("Error: cannot frame stream data on socket %d.", session->fd);
+      UringRelease(session, &msg);
+      session->queue.pop_back();
+      return false;
+   }
+
+   session->stats.sent++;
+   for (int i = 0; i < msg.count; i++) {
+      session->stats.bytes += msg.lens[i];
+   }
+
+   if (session->chainLeft > 0) {
+      session->stats.queued++;
+      return true;
+   }
+   return UringSubmitChain(session, true);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringSubmitChain --
+ *
+ *    Links the queued messages of <session>, up to
+ *    RPC_REACTOR_URING_CHAIN parts, into one chain of operations: a
+ *    part in a slot is written from the registered buffer, the others
+ *    are sent with MSG_WAITALL.  Only one chain is in flight on a
+ *    socket, which keeps the messages in order.  It is submitted now if
+ *    <submit>, else with the next wait.
+ *
+ * Results:
+ *    false if the submission failed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringSubmitChain(Session* session,   // IN
+                                   bool submit)        // IN
+{
+   std::lock_guard<std::mutex> uringLock(m_uringMutex);
+
+   session->chain.clear();
+   for (uint32 m = 0; m < session->queue.size() &&
+                      session->chain.size() < RPC_REACTOR_URING_CHAIN; m++) {
+      const UringMsg& msg = session->queue[m];
+      for (int p = 0; p < msg.count &&
+                      session->chain.size() < RPC_REACTOR_URING_CHAIN; p++) {
+         if (msg.lens[p] > 0) {
+            UringPart part = { m, (uint32)p };
+            session->chain.push_back(part);
+         }
+      }
+   }
+
+   uint32 count = (uint32)session->chain.size();
+   if (count == 0) {
+      return true;
+   }
+
+   /* a chain split over two submissions would not stay linked */
+   if (m_uring.SqSpace() < count) {
+      m_uring.Submit(0, 0);
+      m_stats.submits++;
+   }
+
+   for (uint32 i = 0; i < count; i++) {
+      const UringMsg& msg = session->queue[session->chain[i].msg];
+      uint32 p = session->chain[i].part;
+      struct io_uring_sqe* sqe = m_uring.GetSqe();
+
+      if (sqe == NULL) {
+         LOG("Error: the io_uring submission queue is full.");
+         session->chain.resize(i);
+         session->chainFailed = true;
+         break;
+      }
+
+      if (msg.fixed[p]) {
+         sqe->opcode = IORING_OP_WRITE_FIXED;
+         sqe->off = (uint64)-1;
+         sqe->buf_index = 0;
+      } else {
+         sqe->opcode = IORING_OP_SEND;
+         sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      }
+      sqe->fd = session->fd;
+      sqe->addr = (uint64)(uintptr_t)msg.bufs[p];
+      sqe->len = msg.lens[p];
+      sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+      sqe->user_data = RPC_URING_DATA(session->id, RPC_URING_SEND, i);
+   }
+
+   session->chainLeft = (uint32)session->chain.size();
+   session->inflight += session->chainLeft;
+   session->stats.gatherCalls += session->chainLeft;
+   m_stats.sqes += session->chainLeft;
+
+   if (submit && m_uring.Submit(0, 0) < 0) {
+      LOG("Error: io_uring_enter() failed, errno %d.", errno);
+      return false;
+   }
+   if (submit) {
+      m_stats.submits++;
+   }
+   return session->chainLeft > 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringChainDone --
+ *
+ *    All the operations of the chain of <session> completed: releases
+ *    the messages that went out whole and links the next chain, which
+ *    also resumes one that a short write broke.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Closes the session if a send failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringChainDone(const SessionPtr& session)   // IN
+{
+   bool failed;
+   bool drained;
+
+   {
+      std::lock_guard<std::recursive_mutex> lock(session->mutex);
+
+      session->chain.clear();
+      while (!session->queue.empty()) {
+         UringMsg& msg = session->queue.front();
+         bool done = true;
+         for (int p = 0; p < msg.count; p++) {
+            done = done && msg.lens[p] == 0;
+         }
+         if (!done && !session->closed) {
+            break;
+         }
+         UringRelease(session.get(), &msg);
+         session->queue.pop_front();
+      }
+
+      failed = session->chainFailed;
+      session->chainFailed = false;
+      drained = session->queue.empty();
+
+      if (!failed && !drained && !session->closed) {
+         failed = !UringSubmitChain(session.get(), false);
+      }
+   }
+
+   if (session->closed) {
+      return;
+   }
+   if (failed) {
+      Close(session);
+   } else if (drained) {
+      session->handler->OnStreamDrained(session->fd);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringPoll --
+ *
+ *    Poll() with io_uring: submits what was queued, waits up to
+ *    <msTimeout> for completions and handles them.
+ *
+ * Results:
+ *    The completions handled, 0 on timeout, -1 if the wait failed.
+ *
+ * Side Effects:
+ *    Calls the handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamReactor::UringPoll(int msTimeout)   // IN
+{
+   int n;
+
+   m_stats.waits++;
+   {
+      std::lock_guard<std::mutex> uringLock(m_uringMutex);
+      n = m_uring.Submit(0, 0);
+   }
+   if (n > 0) {
+      m_stats.submits++;
+   }
+
+   /* without the lock, Send() queues and submits meanwhile */
+   if (n >= 0) {
+      n = m_uring.Wait(msTimeout);
+   }
+   if (n < 0) {
+      LOG("Error: io_uring_enter() failed, errno %d.", errno);
+      return -1;
+   }
+
+   n = UringReap();
+
+   /* the receives re-armed and the chains linked meanwhile */
+   std::lock_guard<std::mutex> uringLock(m_uringMutex);
+   if (m_uring.Submit(0, 0) > 0) {
+      m_stats.submits++;
+   }
+   return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringReap --
+ *
+ *    Handles the completions there are, one at a time so that a
+ *    handler that removes a socket may reap too.
+ *
+ * Results:
+ *    The completions handled.
+ *
+ * Side Effects:
+ *    Calls the handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamReactor::UringReap()
+{
+   struct io_uring_cqe cqe;
+   int n = 0;
+
+   for (;;) {
+      {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         if (!m_uring.PopCqe(&cqe)) {
+            break;
+         }
+      }
+      UringComplete(&cqe);
+      n++;
+   }
+
+   m_stats.events += n;
+   return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringComplete --
+ *
+ *    Handles one completion.  A session removed meanwhile is kept until
+ *    its last one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringComplete(const struct io_uring_cqe* cqe)   // IN
+{
+   uint32 id = (uint32)(cqe->user_data >> 32);
+   int op = (int)((cqe->user_data >> 24) & 0xff);
+
+   if (op == RPC_URING_WAKE) {
+      uint64_t count;
+      while (read(m_wakeFd, &count, sizeof count) > 0) {
+      }
+      if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         UringArmWake();
+      }
+      return;
+   }
+
+   SessionPtr session;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_uringSessions.find(id);
+      if (it != m_uringSessions.end()) {
+         session = it->second;
+      }
+   }
+
+   if (!session) {
+      if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         m_uring.RecycleBuffer((uint16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+      return;
+   }
+
+   if (op == RPC_URING_RECV) {
+      UringRecv(session, cqe);
+   } else if (op == RPC_URING_SEND) {
+      UringSent(session, cqe);
+   }
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   if (session->closed && session->inflight == 0) {
+      std::lock_guard<std::mutex> sessionsLock(m_mutex);
+      m_uringSessions.erase(id);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringRecv --
+ *
+ *    A completion of the multishot receive of <session>: appends the
+ *    buffer to the framer, hands out the frames and gives the buffer
+ *    back.  The receive is armed again if it ended, e.g. for lack of
+ *    buffers.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Closes the session if the socket is closed or failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringRecv(const SessionPtr& session,        // IN
+                            const struct io_uring_cqe* cqe)   // IN
+{
+   bool ok = true;
+
+   {
+      std::lock_guard<std::recursive_mutex> lock(session->mutex);
+
+      if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+         session->recvArmed = false;
+         session->inflight--;
+      }
+
+      if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+         uint16 bid = (uint16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+         if (cqe->res > 0 && !session->closed && !session->draining) {
+            ok = session->framer.Append(m_uring.GetBuffer(bid), (uint32)cqe->res);
+         }
+         std::lock_guard<std::mutex> uringLock(m_uringMutex);
+         m_uring.RecycleBuffer(bid);
+      }
+
+      if (session->closed || session->draining) {
+         return;
+      }
+   }
+
+   if (cqe->res > 0) {
+      m_stats.reads++;
+      if (!ok) {
+         Close(session);
+         return;
+      }
+      if (!Dispatch(session)) {
+         return;
+      }
+   } else if (cqe->res == -ENOBUFS) {
+      m_stats.starved++;
+   } else if (cqe->res == 0) {
+      LOG("Stream data socket %d closed.", session->fd);
+      Close(session);
+      return;
+   } else {
+      LOG("Error: stream data socket %d failed, error %d.", session->fd, -cqe->res);
+      Close(session);
+      return;
+   }
+
+   std::lock_guard<std::recursive_mutex> lock(session->mutex);
+   if (!session->recvArmed && !session->closed) {
+      std::lock_guard<std::mutex> uringLock(m_uringMutex);
+      if (!UringArmRecv(session.get())) {
+         LOG("Error: cannot receive on socket %d.", session->fd);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringSent --
+ *
+ *    A completion of the chain of <session>.  What was sent is taken
+ *    off its part; a short write cancels the rest of the chain, which
+ *    is sent again with the next one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringSent(const SessionPtr& session,        // IN
+                            const struct io_uring_cqe* cqe)   // IN
+{
+   uint32 index = (uint32)(cqe->user_data & 0xffffff);
+   bool chainDone;
+
+   {
+      std::lock_guard<std::recursive_mutex> lock(session->mutex);
+
+      session->inflight--;
+      if (index < session->chain.size()) {
+         const UringPart& part = session->chain[index];
+         UringMsg& msg = session->queue[part.msg];
+
+         if (cqe->res > 0) {
+            uint32 sent = (uint32)cqe->res;
+            if (sent > msg.lens[part.part]) {
+               sent = msg.lens[part.part];
+            }
+            msg.bufs[part.part] += sent;
+            msg.lens[part.part] -= sent;
+            if (msg.lens[part.part] > 0) {
+               session->stats.partialWrites++;
+            }
+         } else if (cqe->res != -ECANCELED || session->closed) {
+            if (!session->closed) {
+               LOG("Error: send on socket %d failed, error %d.", session->fd, -cqe->res);
+            }
+            session->chainFailed = true;
+         }
+      }
+
+      chainDone = session->chainLeft > 0 && --session->chainLeft == 0;
+   }
+
+   if (chainDone) {
+      UringChainDone(session);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringArmRecv --
+ *
+ *    Queues the multishot receive of <session>, into the provided
+ *    buffers.  The caller holds m_uringMutex.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringArmRecv(Session* session)   // IN
+{
+   struct io_uring_sqe* sqe = m_uring.GetSqe();
+   if (sqe == NULL) {
+      return false;
+   }
+
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = session->fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = RPC_URING_GROUP;
+   sqe->user_data = RPC_URING_DATA(session->id, RPC_URING_RECV, 0);
+
+   session->recvArmed = true;
+   session->inflight++;
+   m_stats.sqes++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringArmWake --
+ *
+ *    Queues a multishot poll of the wake eventfd, which Wake() writes.
+ *    The caller holds m_uringMutex.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamReactor::UringArmWake()
+{
+   struct io_uring_sqe* sqe = m_wakeFd >= 0 ? m_uring.GetSqe() : NULL;
+   if (sqe == NULL) {
+      return false;
+   }
+
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = m_wakeFd;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data = RPC_URING_DATA(0, RPC_URING_WAKE, 0);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamReactor::UringRelease --
+ *
+ *    Gives back the slot of <msg> and its blob to the handler.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamReactor::UringRelease(Session* session,   // IN
+                               UringMsg* msg)      // IN
+{
+   if (msg->slot >= 0) {
+      std::lock_guard<std::mutex> uringLock(m_uringMutex);
+      m_freeSlots.push_back(msg->slot);
+      msg->slot = -1;
+   }
+   if (msg->cookie != NULL) {
+      session->handler->OnStreamSent(session->fd, msg->cookie);
+      msg->cookie = NULL;
+   }
+}
+
+#endif
@@ -0,0 +1,280 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamReactor.h --
+ *
+ */
+
+#pragma once
+
+#include "vdprpc_interfaces.h"
+#include "RPCStreamFramer.h"
+#include "RPCStreamSender.h"
+#include "RPCStreamUring.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// reads a socket gets per turn, the others are served before it reads on.
+#define RPC_REACTOR_READ_BUDGET     16
+
+// events taken from the kernel per wait.
+#define RPC_REACTOR_MAX_EVENTS      256
+
+// longest wait of the reactor thread and of the poll() backend.
+#define RPC_REACTOR_WAIT_MS         100
+
+// registered send buffers of the io_uring backend, for the header and
+// tail of a message, or all of it if it fits.
+#define RPC_REACTOR_URING_SLOTS     1024
+#define RPC_REACTOR_URING_SLOT_BYTES 2048
+
+// sends linked in one io_uring submission per socket.
+#define RPC_REACTOR_URING_CHAIN     64
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCStreamHandler
+ *
+ *    What a reactor calls for a socket, from the thread that polls it.
+ *    OnStreamDrained() says the socket took all that was queued, the
+ *    blobs sent with a cookie come back through OnStreamSent() and a
+ *    socket the peer closed or that failed is removed before
+ *    OnStreamClosed().
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCStreamHandler
+{
+public:
+   virtual ~RPCStreamHandler() { }
+
+   virtual void OnStreamData(int fd, int reqId, int reqCmd,
+                             const VDP_RPC_BLOB* blob) = 0;
+   virtual void OnStreamDrained(int fd) { }
+   virtual void OnStreamSent(int fd, void* cookie) { }
+   virtual void OnStreamClosed(int fd) { }
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCStreamReactorStats
+ *
+ *    Counters since Init().  A yield is a socket that still had data
+ *    when its read budget ran out.  With io_uring an event is a
+ *    completion, submits count the io_uring_enter() calls that
+ *    submitted and starved the receives that found no free buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         waits;
+   uint64         events;
+   uint64         reads;
+   uint64         frames;
+   uint64         yields;
+   uint64         writeArms;        /* write interest set */
+   uint64         submits;
+   uint64         sqes;
+   uint64         starved;
+   uint32         sessions;
+} RPCStreamReactorStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCStreamReactor
+ *
+ *    Serves the stream data sockets of any number of side channels,
+ *    the fds GetTcpRawSocket() returns, from one thread.  Each socket
+ *    is made non-blocking, read into its own RPCStreamFramer and each
+ *    frame handed to the RPCStreamHandler it was added with.  Sends go
+ *    through its RPCStreamSender, what the socket does not take is
+ *    queued and written once it is writable: the reactor only asks for
+ *    write events while something is queued.
+ *
+ *    On Linux it waits with edge-triggered epoll.  A socket is read
+ *    until it has no more data, or for RPC_REACTOR_READ_BUDGET reads
+ *    after which it goes on at the next turn, so a busy socket cannot
+ *    starve the others.  Elsewhere it waits with poll() (WSAPoll() on
+ *    Windows).
+ *
+ *    Init(true) uses io_uring instead where the kernel supports it, see
+ *    RPCStreamUring, and epoll otherwise.  A multishot receive per socket
+ *    fills buffers of a ring shared by all of them, and their data is
+ *    appended to the framer.  A message goes out as linked operations:
+ *    the header and the tail from registered buffers, the blob from the
+ *    caller's buffer in between, or all of it from one registered
+ *    buffer if it is small.  The messages queued meanwhile are linked
+ *    into the next submission once the current one completes, so one
+ *    io_uring_enter() serves many sends and receives.
+ *
+ *    Poll() is called from one thread, or Start() runs a thread that
+ *    does.  Send() may be called from any thread.  With io_uring,
+ *    Remove() reaps completions itself, so it is called from the
+ *    polling thread or once it stopped.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCStreamReactor
+{
+public:
+   RPCStreamReactor();
+   ~RPCStreamReactor();
+
+   bool Init(bool useUring = false);
+   const char* GetBackendName() const;
+
+   bool Add(int fd, const VDPRPC_StreamDataInterface* iStreamData,
+            uint32 ctxOptions, RPCStreamHandler* handler);
+   void Remove(int fd, uint32 msTimeout);
+   bool EnableZeroCopy(int fd, uint32 minBytes);
+
+   bool Send(int fd, int reqCmd, const char* data, uint32 size, void* cookie);
+
+   int Poll(int msTimeout);
+   bool Start();
+   void Stop();
+
+   void GetStats(RPCStreamReactorStats* stats) const;
+   bool GetSessionStats(int fd, RPCStreamSenderStats* sender,
+                        RPCStreamFramerStats* framer) const;
+
+private:
+#ifdef RPC_STREAM_URING_SUPPORTED
+   /* a message for io_uring, what is left of its header, blob and tail */
+   typedef struct {
+      const char*       bufs[RPC_STREAM_IOV_MAX];
+      uint32            lens[RPC_STREAM_IOV_MAX];
+      bool              fixed[RPC_STREAM_IOV_MAX];    /* in a slot */
+      int               count;
+      void*             cookie;
+      int               slot;
+      std::vector<char> frame;      /* header and tail without a slot */
+      std::vector<char> copy;       /* blob without a cookie */
+   } UringMsg;
+
+   /* a send in flight, the message and the part */
+   typedef struct {
+      uint32            msg;
+      uint32            part;
+   } UringPart;
+#endif
+
+   /* one socket */
+   class Session
+   {
+   public:
+      int                                 fd;
+      const VDPRPC_StreamDataInterface*   iStreamData;
+      RPCStreamHandler*                   handler;
+
+      /* the sender, Send() comes from any thread */
+      std::recursive_mutex                mutex;
+      RPCStreamSender                     sender;
+      std::atomic<bool>                   writeArmed;
+      std::atomic<bool>                   closed;
+
+      /* the polling thread only */
+      RPCStreamFramer                     framer;
+      bool                                yielded;
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+      /* io_uring, under the mutex */
+      uint32                              id;
+      uint32                              ctxOptions;
+      bool                                recvArmed;
+      uint32                              inflight;   /* completions to come */
+      std::deque<UringMsg>                queue;      /* the chain first */
+      std::vector<UringPart>              chain;
+      uint32                              chainLeft;
+      bool                                chainFailed;
+      bool                                draining;   /* in Remove() */
+      RPCStreamSenderStats                stats;
+#endif
+
+      Session() : fd(-1), iStreamData(NULL), handler(NULL), writeArmed(false),
+                  closed(false), yielded(false)
+#ifdef RPC_STREAM_URING_SUPPORTED
+                  , id(0), ctxOptions(0), recvArmed(false), inflight(0),
+                  chainLeft(0), chainFailed(false), draining(false)
+#endif
+      {
+#ifdef RPC_STREAM_URING_SUPPORTED
+         memset(&stats, 0, sizeof stats);
+#endif
+      }
+   };
+
+   typedef std::shared_ptr<Session> SessionPtr;
+
+   mutable std::mutex                     m_mutex;
+   std::unordered_map<int, SessionPtr>    m_sessions;
+   std::vector<SessionPtr>                m_yielded;
+
+   int                                    m_pollFd;   /* epoll, -1 for poll() */
+   int                                    m_wakeFd;
+   std::thread                            m_thread;
+   std::atomic<bool>                      m_stop;
+   std::atomic<uint64>                    m_writeArms;
+   RPCStreamReactorStats                  m_stats;
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   /* io_uring, the mutex guards the submission queue and the slots */
+   bool                                   m_useUring;
+   std::mutex                             m_uringMutex;
+   RPCStreamUring                         m_uring;
+   char*                                  m_slots;
+   std::vector<int>                       m_freeSlots;
+   std::unordered_map<uint32, SessionPtr> m_uringSessions;   /* by id, under m_mutex */
+   uint32                                 m_nextId;
+#endif
+
+   SessionPtr Find(int fd) const;
+   bool Watch(Session* session, bool write, bool add);
+   void Read(const SessionPtr& session);
+   bool Dispatch(const SessionPtr& session);
+   void Write(const SessionPtr& session);
+   void Close(const SessionPtr& session);
+   void Wake();
+   void ThreadMain();
+   int PollSockets(int msTimeout, std::vector<SessionPtr>* ready,
+                   std::vector<int>* events);
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+   bool UringInit();
+   void UringExit();
+   bool UringAdd(const SessionPtr& session, uint32 ctxOptions);
+   void UringRemove(const SessionPtr& session, uint32 msTimeout);
+   bool UringSend(Session* session, int reqCmd, const char* data,
+                  uint32 size, void* cookie);
+   bool UringSubmitChain(Session* session, bool submit);
+   void UringChainDone(const SessionPtr& session);
+   int UringPoll(int msTimeout);
+   int UringReap();
+   void UringComplete(const struct io_uring_cqe* cqe);
+   void UringRecv(const SessionPtr& session, const struct io_uring_cqe* cqe);
+   void UringSent(const SessionPtr& session, const struct io_uring_cqe* cqe);
+   bool UringArmRecv(Session* session);
+   bool UringArmWake();
+   void UringRelease(Session* session, UringMsg* msg);
+#endif
+
+   static int FrameSize(void* userData, const char* data);
+   static void OnSent(void* userData, void* cookie);
+
+   RPCStreamReactor(const RPCStreamReactor&);
+   RPCStreamReactor& operator=(const RPCStreamReactor&);
+};
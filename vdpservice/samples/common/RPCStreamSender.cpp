@@ -0,0 +1,893 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamSender.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCStreamSender.h"
+
+#ifdef _WIN32
+#include "winsock2.h"
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#endif
+
+#include <chrono>
+
+/*
+ * MSG_ZEROCOPY needs Linux 4.14 and headers that know about it, without
+ * them the sender always copies.
+ */
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RPC_STREAM_ZEROCOPY_SUPPORTED
+#endif
+
+// control data of one error queue message.
+#define RPC_STREAM_CMSG_LEN         128
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::RPCStreamSender --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamSender::RPCStreamSender()
+   : m_fd(-1),
+     m_iStreamData(NULL),
+     m_ctxOptions(0),
+     m_release(NULL),
+     m_releaseData(NULL),
+     m_queueing(false),
+     m_zeroCopy(false),
+     m_zeroCopyMin(RPC_STREAM_ZEROCOPY_MIN),
+     m_zeroCopyNext(0),
+     m_zeroCopyDone(0)
+{
+   memset(&m_stats, 0, sizeof m_stats);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::~RPCStreamSender --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamSender::~RPCStreamSender()
+{
+   Close(0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Open --
+ *
+ *    Starts sending on the raw TCP socket <fd>, with the context options
+ *    the channel negotiated.
+ *
+ * Results:
+ *    false if the stream data interface cannot frame the data.
+ *
+ * Side Effects:
+ *    Resets the statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::Open(int fd,                                           // IN
+                      const VDPRPC_StreamDataInterface* iStreamData,    // IN
+                      uint32 ctxOptions)                                // IN
+{
+   FUNCTION_TRACE;
+
+   if (fd < 0 || iStreamData == NULL ||
+       iStreamData->v1.GetStreamDataHeaderTailSize == NULL ||
+       iStreamData->v1.GetStreamDataHeaderTail == NULL ||
+       iStreamData->v2.GetStreamData == NULL) {
+      LOG("Error: no raw TCP socket or stream data interface.");
+      return false;
+   }
+
+   Close(0);
+
+   m_fd = fd;
+   m_iStreamData = iStreamData;
+   m_ctxOptions = ctxOptions;
+   m_zeroCopy = false;
+   m_zeroCopyNext = 0;
+   m_zeroCopyDone = 0;
+   m_zeroCopyAhead.clear();
+   memset(&m_stats, 0, sizeof m_stats);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Close --
+ *
+ *    Stops sending, waiting up to <msTimeout> for the kernel to complete
+ *    the zero-copy sends.  The socket itself belongs to the channel and
+ *    stays open.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Releases all buffers, also those still pending after the timeout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::Close(uint32 msTimeout)   // IN
+{
+   if (m_fd < 0) {
+      return;
+   }
+
+#ifdef RPC_STREAM_ZEROCOPY_SUPPORTED
+   std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(msTimeout);
+
+   Reap();
+   while (!m_pending.empty()) {
+      int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                  deadline - std::chrono::steady_clock::now()).count();
+      if (ms <= 0) {
+         break;
+      }
+
+      /* a readable error queue polls as POLLERR */
+      struct pollfd pfd = { m_fd, 0, 0 };
+      if (poll(&pfd, 1, ms) < 0 && errno != EINTR) {
+         break;
+      }
+      Reap();
+   }
+#endif
+
+   if (!m_queue.empty()) {
+      LOG("Warning: dropping %u messages the socket did not take.",
+          (uint32)m_queue.size());
+      while (!m_queue.empty()) {
+         void* cookie = m_queue.front().cookie;
+         m_queue.pop_front();
+         Release(cookie);
+      }
+   }
+
+   if (!m_pending.empty()) {
+      LOG("Warning: releasing %u buffers the kernel did not complete.",
+          (uint32)m_pending.size());
+      while (!m_pending.empty()) {
+         void* cookie = m_pending.front().cookie;
+         m_pending.pop_front();
+         Release(cookie);
+      }
+   }
+
+   m_stats.pending = 0;
+   m_fd = -1;
+   m_iStreamData = NULL;
+   m_zeroCopy = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::SetRelease --
+ *
+ *    Sets the callback that gets back the data of a Send() with a
+ *    cookie.  It runs from Send(), Reap() or Close(), once the data is
+ *    on the wire or, for a zero-copy send, once the kernel completed it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::SetRelease(RPCStreamReleaseFn release,   // IN
+                            void* userData)               // IN
+{
+   m_release = release;
+   m_releaseData = userData;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::EnableZeroCopy --
+ *
+ *    Sends the blobs of at least <minBytes> with MSG_ZEROCOPY.  That
+ *    saves copying them into the socket buffer but costs a page pinning
+ *    and a completion each, so it only pays for large blobs.  Only
+ *    Send() calls with a cookie are sent so, the others need their data
+ *    back when Send() returns.
+ *
+ * Results:
+ *    false if the socket does not support it, e.g. on Windows or for a
+ *    Unix socket, the sender then copies.
+ *
+ * Side Effects:
+ *    Sets SO_ZEROCOPY on the socket.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::EnableZeroCopy(uint32 minBytes)   // IN
+{
+#ifdef RPC_STREAM_ZEROCOPY_SUPPORTED
+   int one = 1;
+
+   if (m_fd < 0) {
+      return false;
+   }
+   if (m_release == NULL) {
+      LOG("Error: zero-copy needs a release callback.");
+      return false;
+   }
+   if (setsockopt(m_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) != 0) {
+      LOG("Zero-copy is not supported on this socket, errno %d.", errno);
+      return false;
+   }
+
+   m_zeroCopy = true;
+   m_zeroCopyMin = minBytes;
+   LOG("Zero-copy on for blobs of %u bytes and more.", minBytes);
+   return true;
+#else
+   LOG("Zero-copy is not supported on this platform.");
+   return false;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::SetQueueing --
+ *
+ *    With <queueing>, a Send() the socket does not take whole queues
+ *    the rest instead of waiting, for a caller that polls the socket:
+ *    it writes the rest with Flush() once the socket is writable.  The
+ *    rest of a blob sent without a cookie is copied.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::SetQueueing(bool queueing)   // IN
+{
+   m_queueing = queueing;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Send --
+ *
+ *    Sends <size> bytes of <data> as stream data command <reqCmd>.  With
+ *    a <cookie>, the data is handed to the release callback once the
+ *    sender is done with it, else it must only stay valid during the
+ *    call.
+ *
+ * Results:
+ *    false on a socket error, the stream is then out of sync.
+ *
+ * Side Effects:
+ *    Completes earlier zero-copy sends.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::Send(int reqCmd,            // IN
+                      const char* data,      // IN
+                      uint32 size,           // IN
+                      void* cookie,          // IN
+                      int* reqId)            // OUT
+{
+   if (m_fd < 0) {
+      Release(cookie);
+      return false;
+   }
+
+   if (m_zeroCopy) {
+      Reap();
+   }
+
+   if (m_ctxOptions != 0) {
+      return SendCopy(reqCmd, data, size, cookie, reqId);
+   }
+
+   int headerLen = 0;
+   int tailLen = 0;
+   if (!m_iStreamData->v1.GetStreamDataHeaderTailSize(m_fd, (int)size,
+                                                      &headerLen, &tailLen)) {
+      LOG("Error: GetStreamDataHeaderTailSize failed.");
+      Release(cookie);
+      return false;
+   }
+
+   m_frame.resize(headerLen + tailLen);
+
+   VDP_RPC_BLOB blob = { size, (char*)data };
+   if (!m_iStreamData->v1.GetStreamDataHeaderTail(m_fd, reqId, reqCmd, &blob,
+                                                  m_frame.data(), headerLen,
+                                                  m_frame.data() + headerLen,
+                                                  tailLen)) {
+      LOG("Error: GetStreamDataHeaderTail failed.");
+      Release(cookie);
+      return false;
+   }
+
+   const char* bufs[RPC_STREAM_IOV_MAX];
+   uint32 lens[RPC_STREAM_IOV_MAX];
+
+   bufs[0] = m_frame.data();
+   lens[0] = headerLen;
+   bufs[1] = data;
+   lens[1] = size;
+   bufs[2] = m_frame.data() + headerLen;
+   lens[2] = tailLen;
+
+   bool zeroCopy = m_zeroCopy && cookie != NULL && size >= m_zeroCopyMin;
+   return Submit(bufs, lens, RPC_STREAM_IOV_MAX, 1, zeroCopy, cookie, &m_frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::SendCopy --
+ *
+ *    Send() of a compressed or encrypted stream, GetStreamData() builds
+ *    the whole message.
+ *
+ * Results:
+ *    false on an error.
+ *
+ * Side Effects:
+ *    Releases the data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::SendCopy(int reqCmd,            // IN
+                          const char* data,      // IN
+                          uint32 size,           // IN
+                          void* cookie,          // IN
+                          int* reqId)            // OUT
+{
+   VDP_RPC_BLOB blob = { size, (char*)data };
+   VDP_RPC_BLOB payload = { 0, NULL };
+
+   bool ok = m_iStreamData->v2.GetStreamData(m_fd, m_ctxOptions, reqId, reqCmd,
+                                             &blob, &payload) != FALSE;
+   Release(cookie);
+   if (!ok) {
+      LOG("Error: GetStreamData failed.");
+      return false;
+   }
+
+   const char* bufs[1] = { payload.blobData };
+   uint32 lens[1] = { payload.size };
+
+   /* a queued rest of the payload is copied, it is freed here */
+   ok = Submit(bufs, lens, 1, 0, false, NULL, NULL);
+   if (ok) {
+      m_stats.copied++;
+   }
+
+   m_iStreamData->v2.FreeStreamDataPayload(&payload);
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Submit --
+ *
+ *    Writes a framed message, or queues it behind those already queued.
+ *    <bufs>[<dataIndex>] is the blob, the others point into <frame>.
+ *
+ * Results:
+ *    false on a socket error.
+ *
+ * Side Effects:
+ *    A queued message takes over <frame>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::Submit(const char* bufs[],            // IN
+                        uint32 lens[],                 // IN
+                        int count,                     // IN
+                        int dataIndex,                 // IN
+                        bool zeroCopy,                 // IN
+                        void* cookie,                  // IN
+                        std::vector<char>* frame)      // IN/OUT
+{
+   uint32 firstId = m_zeroCopyNext;
+   int rv = 0;
+
+   m_stats.sent++;
+   for (int i = 0; i < count; i++) {
+      m_stats.bytes += lens[i];
+   }
+
+   if (m_queue.empty()) {
+      rv = Write(bufs, lens, count, &zeroCopy, !m_queueing);
+      if (rv > 0) {
+         Finish(firstId, cookie, frame);
+         return true;
+      }
+      if (rv < 0) {
+         Finish(firstId, cookie, frame);
+         return false;
+      }
+   }
+
+   m_queue.push_back(Queued());
+   Queued& q = m_queue.back();
+
+   for (int i = 0; i < count; i++) {
+      q.bufs[i] = bufs[i];
+      q.lens[i] = lens[i];
+   }
+   q.count = count;
+   q.zeroCopy = zeroCopy;
+   q.firstId = firstId;
+   q.cookie = cookie;
+
+   /* the buffer moves with the vector, the pointers stay valid */
+   if (frame != NULL) {
+      q.frame.swap(*frame);
+   }
+   if (cookie == NULL && q.lens[dataIndex] > 0) {
+      q.copy.assign(q.bufs[dataIndex], q.bufs[dataIndex] + q.lens[dataIndex]);
+      q.bufs[dataIndex] = q.copy.data();
+   }
+
+   m_stats.queued++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Flush --
+ *
+ *    Writes the queued messages, as much as the socket takes.
+ *
+ * Results:
+ *    false on a socket error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::Flush()
+{
+   while (!m_queue.empty()) {
+      Queued& q = m_queue.front();
+
+      int rv = Write(q.bufs, q.lens, q.count, &q.zeroCopy, !m_queueing);
+      if (rv < 0) {
+         return false;
+      }
+      if (rv == 0) {
+         return true;
+      }
+
+      Finish(q.firstId, q.cookie, &q.frame);
+      m_queue.pop_front();
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Finish --
+ *
+ *    Done writing a message.  If zero-copy calls since <firstId> sent
+ *    some of it, the kernel holds on to its data until it completes the
+ *    last one, else the data is released now.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::Finish(uint32 firstId,                // IN
+                        void* cookie,                  // IN
+                        std::vector<char>* frame)      // IN/OUT
+{
+   if (m_zeroCopyNext == firstId) {
+      Release(cookie);
+      return;
+   }
+
+   Pending pending;
+   pending.lastId = m_zeroCopyNext - 1;
+   pending.cookie = cookie;
+   if (frame != NULL) {
+      pending.frame.swap(*frame);
+   }
+   m_pending.push_back(std::move(pending));
+
+   m_stats.zeroCopy++;
+   m_stats.pending = (uint32)m_pending.size();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Write --
+ *
+ *    Writes the <count> buffers in order with gather calls, each one
+ *    going on from where a partial one stopped.  With <wait>, a full
+ *    socket is waited for, also a non-blocking one.
+ *
+ * Results:
+ *    1 once all is written, 0 if the socket is full, -1 on a socket
+ *    error or if the socket stays full.  <bufs> and <lens> are advanced
+ *    over what was written.
+ *
+ * Side Effects:
+ *    Advances m_zeroCopyNext for each zero-copy call the kernel took.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamSender::Write(const char* bufs[],   // IN/OUT
+                       uint32 lens[],        // IN/OUT
+                       int count,            // IN
+                       bool* zeroCopy,       // IN/OUT
+                       bool wait)            // IN
+{
+   uint64 left = 0;
+   int first = 0;
+
+   for (int i = 0; i < count; i++) {
+      left += lens[i];
+   }
+
+   while (left > 0) {
+      while (lens[first] == 0) {
+         first++;
+      }
+
+#ifdef _WIN32
+      WSABUF iov[RPC_STREAM_IOV_MAX];
+      int n = 0;
+      for (int i = first; i < count; i++) {
+         iov[n].buf = (char*)bufs[i];
+         iov[n++].len = lens[i];
+      }
+
+      DWORD sentBytes = 0;
+      int rv = WSASend((SOCKET)m_fd, iov, n, &sentBytes, 0, NULL, NULL);
+      long sent = rv == 0 ? (long)sentBytes : -1;
+      int err = rv == 0 ? 0 : WSAGetLastError();
+      bool wouldBlock = err == WSAEWOULDBLOCK;
+      bool interrupted = err == WSAEINTR;
+#else
+      struct iovec iov[RPC_STREAM_IOV_MAX];
+      int n = 0;
+      for (int i = first; i < count; i++) {
+         iov[n].iov_base = (void*)bufs[i];
+         iov[n++].iov_len = lens[i];
+      }
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n;
+
+      int flags = MSG_NOSIGNAL;
+#ifdef RPC_STREAM_ZEROCOPY_SUPPORTED
+      flags |= *zeroCopy ? MSG_ZEROCOPY : 0;
+#endif
+
+      ssize_t sent = sendmsg(m_fd, &msg, flags);
+      int err = sent < 0 ? errno : 0;
+      bool wouldBlock = err == EAGAIN || err == EWOULDBLOCK;
+      bool interrupted = err == EINTR;
+
+#ifdef RPC_STREAM_ZEROCOPY_SUPPORTED
+      if (*zeroCopy && err == ENOBUFS) {
+         /* too many pinned pages in flight, copy the rest */
+         Reap();
+         *zeroCopy = false;
+         continue;
+      }
+#endif
+#endif
+
+      if (sent < 0) {
+         if (interrupted) {
+            continue;
+         }
+         if (wouldBlock && !wait) {
+            return 0;
+         }
+         if (wouldBlock && WaitWritable()) {
+            continue;
+         }
+         LOG("Error: stream data send failed, error %d.", err);
+         return -1;
+      }
+
+      m_stats.gatherCalls++;
+      if ((uint64)sent < left) {
+         m_stats.partialWrites++;
+      }
+      if (*zeroCopy && sent > 0) {
+         m_zeroCopyNext++;
+      }
+
+      left -= sent;
+      for (uint64 done = sent; done > 0; first++) {
+         uint32 take = done < lens[first] ? (uint32)done : lens[first];
+         bufs[first] += take;
+         lens[first] -= take;
+         done -= take;
+         if (lens[first] > 0) {
+            break;
+         }
+      }
+   }
+
+   return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::WaitWritable --
+ *
+ *    Waits for a full socket to take data again.
+ *
+ * Results:
+ *    false if it did not within RPC_STREAM_SEND_TIMEOUT_MS.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamSender::WaitWritable()
+{
+#ifdef _WIN32
+   fd_set wfds;
+   struct timeval timeout = { RPC_STREAM_SEND_TIMEOUT_MS / 1000, 0 };
+
+   FD_ZERO(&wfds);
+   FD_SET((SOCKET)m_fd, &wfds);
+   return select(0, NULL, &wfds, NULL, &timeout) > 0;
+#else
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(RPC_STREAM_SEND_TIMEOUT_MS);
+
+   for (;;) {
+      int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                  deadline - std::chrono::steady_clock::now()).count();
+      if (ms <= 0) {
+         LOG("Error: socket full for %dms.", RPC_STREAM_SEND_TIMEOUT_MS);
+         return false;
+      }
+
+      struct pollfd pfd = { m_fd, POLLOUT, 0 };
+      int rv = poll(&pfd, 1, ms);
+      if (rv < 0 && errno != EINTR) {
+         return false;
+      }
+      if (rv <= 0) {
+         continue;
+      }
+      if ((pfd.revents & POLLOUT) != 0 || (pfd.revents & POLLHUP) != 0) {
+         /* a closed socket fails the next send */
+         return true;
+      }
+
+      /*
+       * POLLERR, zero-copy completions wait in the error queue.  A socket
+       * error proper fails the next send.
+       */
+      if (m_zeroCopyNext == m_zeroCopyDone || Reap() < 0) {
+         return true;
+      }
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Reap --
+ *
+ *    Reads the zero-copy completions from the socket error queue and
+ *    releases the buffers of the messages that are complete.  A
+ *    completion covers a range of calls, the ranges normally come in
+ *    order.  Call it when the socket polls POLLERR, Send() calls it too.
+ *
+ * Results:
+ *    The number of buffers released.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamSender::Reap()
+{
+   int released = 0;
+
+#ifdef RPC_STREAM_ZEROCOPY_SUPPORTED
+   /* also the calls of the message WriteAll() is sending */
+   if (m_fd < 0 || m_zeroCopyNext == m_zeroCopyDone) {
+      return 0;
+   }
+
+   for (;;) {
+      char control[RPC_STREAM_CMSG_LEN];
+      struct msghdr msg;
+
+      memset(&msg, 0, sizeof msg);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof control;
+
+      if (recvmsg(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         break;
+      }
+
+      for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+           cm = CMSG_NXTHDR(&msg, cm)) {
+         if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+             !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+            continue;
+         }
+
+         struct sock_extended_err serr;
+         memcpy(&serr, CMSG_DATA(cm), sizeof serr);
+         if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            continue;
+         }
+
+         /* calls ee_info to ee_data completed */
+         uint32 lo = serr.ee_info;
+         uint32 hi = serr.ee_data;
+         if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            m_stats.zeroCopyCopied += hi - lo + 1;
+         }
+
+         if (lo == m_zeroCopyDone) {
+            m_zeroCopyDone = hi + 1;
+         } else {
+            m_zeroCopyAhead[lo] = hi;
+         }
+
+         std::map<uint32, uint32>::iterator it;
+         while ((it = m_zeroCopyAhead.find(m_zeroCopyDone)) != m_zeroCopyAhead.end()) {
+            m_zeroCopyDone = it->second + 1;
+            m_zeroCopyAhead.erase(it);
+         }
+      }
+   }
+
+   while (!m_pending.empty() &&
+          (int32)(m_pending.front().lastId - m_zeroCopyDone) < 0) {
+      void* cookie = m_pending.front().cookie;
+      m_pending.pop_front();
+      Release(cookie);
+      released++;
+   }
+   m_stats.pending = (uint32)m_pending.size();
+#endif
+
+   return released;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::GetStats --
+ *
+ *    Returns the counters since Open().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::GetStats(RPCStreamSenderStats* stats) const   // OUT
+{
+   *stats = m_stats;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamSender::Release --
+ *
+ *    Hands the data of <cookie> back to its owner.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamSender::Release(void* cookie)   // IN
+{
+   if (cookie != NULL && m_release != NULL) {
+      m_release(m_releaseData, cookie);
+   }
+}
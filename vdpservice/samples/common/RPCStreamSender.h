@@ -0,0 +1,158 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamSender.h --
+ *
+ */
+
+#pragma once
+
+#include "vdprpc_interfaces.h"
+
+#include <deque>
+#include <map>
+#include <vector>
+
+// payloads from this size on go out with MSG_ZEROCOPY once enabled.
+#define RPC_STREAM_ZEROCOPY_MIN     (32 * 1024)
+
+// header, blob and tail.
+#define RPC_STREAM_IOV_MAX          3
+
+// how long a send waits for the socket to take more data.
+#define RPC_STREAM_SEND_TIMEOUT_MS  10000
+
+/*
+ * Called once the sender no longer needs the data given to Send() with
+ * <cookie>, see RPCStreamSender::SetRelease().
+ */
+typedef void (*RPCStreamReleaseFn)(void* userData, void* cookie);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct RPCStreamSenderStats
+ *
+ *    Counters since Open().  A gather call is one writev()/sendmsg()
+ *    (WSASend() on Windows), a partial one did not take all that was
+ *    left of the message.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         sent;             /* stream data messages */
+   uint64         bytes;            /* on the wire, framing included */
+   uint64         gatherCalls;
+   uint64         partialWrites;
+   uint64         queued;           /* waited for a full socket, see SetQueueing() */
+   uint64         copied;           /* framed by GetStreamData() */
+   uint64         zeroCopy;         /* sent with MSG_ZEROCOPY */
+   uint64         zeroCopyCopied;   /* calls the kernel copied anyway */
+   uint32         pending;          /* waiting for the kernel to let go */
+} RPCStreamSenderStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCStreamSender
+ *
+ *    Sends stream data on the raw TCP socket of a side channel without
+ *    copying the blob.  GetStreamDataHeaderTail() frames the caller's
+ *    buffer and the header, the buffer and the tail go out with one
+ *    gather call, the rest of a partial write with the next ones.  With
+ *    compression or encryption the blob is transformed, so those
+ *    messages are framed by GetStreamData() as before.
+ *
+ *    On Linux, EnableZeroCopy() sends large blobs with MSG_ZEROCOPY: the
+ *    kernel reads the pages of the buffer while it transmits them, so
+ *    the buffer is only released (see SetRelease()) once the completion
+ *    has been read from the socket error queue, by Reap() which Send()
+ *    also calls.
+ *
+ *    A Send() waits for the socket to take the whole message, unless
+ *    SetQueueing() has it queue the rest for Flush(), as RPCStreamReactor
+ *    does for the non-blocking sockets it polls.
+ *
+ *    Not thread safe, one thread sends on a socket.
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCStreamSender
+{
+public:
+   RPCStreamSender();
+   ~RPCStreamSender();
+
+   bool Open(int fd, const VDPRPC_StreamDataInterface* iStreamData,
+             uint32 ctxOptions);
+   bool IsOpen() const { return m_fd >= 0; }
+   void Close(uint32 msTimeout);
+
+   void SetRelease(RPCStreamReleaseFn release, void* userData);
+   bool EnableZeroCopy(uint32 minBytes);
+   void SetQueueing(bool queueing);
+
+   bool Send(int reqCmd, const char* data, uint32 size, void* cookie,
+             int* reqId);
+   bool Flush();
+   bool HasQueued() const { return !m_queue.empty(); }
+   int Reap();
+
+   void GetStats(RPCStreamSenderStats* stats) const;
+
+private:
+   /* a message whose data the kernel may still read */
+   typedef struct {
+      uint32            lastId;     /* of its MSG_ZEROCOPY calls */
+      void*             cookie;
+      std::vector<char> frame;      /* header and tail */
+   } Pending;
+
+   /* a message the socket did not take whole, see SetQueueing() */
+   typedef struct {
+      const char*       bufs[RPC_STREAM_IOV_MAX];   /* what is left */
+      uint32            lens[RPC_STREAM_IOV_MAX];
+      int               count;
+      bool              zeroCopy;
+      uint32            firstId;    /* of its MSG_ZEROCOPY calls */
+      void*             cookie;
+      std::vector<char> frame;      /* header and tail */
+      std::vector<char> copy;       /* the rest of a blob without a cookie */
+   } Queued;
+
+   int                                 m_fd;
+   const VDPRPC_StreamDataInterface*   m_iStreamData;
+   uint32                              m_ctxOptions;
+   RPCStreamReleaseFn                  m_release;
+   void*                               m_releaseData;
+   bool                                m_queueing;
+   std::deque<Queued>                  m_queue;
+
+   bool                                m_zeroCopy;
+   uint32                              m_zeroCopyMin;
+   uint32                              m_zeroCopyNext;   /* id of the next call */
+   uint32                              m_zeroCopyDone;   /* all below completed */
+   std::map<uint32, uint32>            m_zeroCopyAhead;  /* completed ranges above */
+   std::deque<Pending>                 m_pending;
+
+   std::vector<char>                   m_frame;
+   RPCStreamSenderStats                m_stats;
+
+   bool SendCopy(int reqCmd, const char* data, uint32 size, void* cookie,
+                 int* reqId);
+   bool Submit(const char* bufs[], uint32 lens[], int count, int dataIndex,
+               bool zeroCopy, void* cookie, std::vector<char>* frame);
+   void Finish(uint32 firstId, void* cookie, std::vector<char>* frame);
+   int Write(const char* bufs[], uint32 lens[], int count, bool* zeroCopy,
+             bool wait);
+   bool WaitWritable();
+   void Release(void* cookie);
+   void ReleaseCompleted();
+
+   RPCStreamSender(const RPCStreamSender&);
+   RPCStreamSender& operator=(const RPCStreamSender&);
+};
@@ -0,0 +1,583 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamUring.cpp --
+ *
+ */
+
+#include "stdafx.h"
+#include "RPCStreamUring.h"
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <vector>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::RPCStreamUring --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamUring::RPCStreamUring()
+   : m_fd(-1),
+     m_sqRing(NULL),
+     m_sqRingSize(0),
+     m_cqRing(NULL),
+     m_cqRingSize(0),
+     m_sqes(NULL),
+     m_sqesSize(0),
+     m_sqHead(NULL),
+     m_sqTail(NULL),
+     m_sqMask(0),
+     m_sqArray(NULL),
+     m_sqLocal(0),
+     m_cqHead(NULL),
+     m_cqTail(NULL),
+     m_cqMask(0),
+     m_cqes(NULL),
+     m_bufRing(NULL),
+     m_bufRingSize(0),
+     m_bufs(NULL),
+     m_bufCount(0),
+     m_bufSize(0),
+     m_bufTail(0)
+{
+   memset(&m_params, 0, sizeof m_params);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::~RPCStreamUring --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCStreamUring::~RPCStreamUring()
+{
+   Exit();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Init --
+ *
+ *    Sets up a ring of <entries> submission entries and maps it.
+ *
+ * Results:
+ *    false if io_uring is not there, disabled or too old.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamUring::Init(uint32 entries)   // IN
+{
+   FUNCTION_TRACE;
+
+   if (m_fd >= 0) {
+      return true;
+   }
+
+   memset(&m_params, 0, sizeof m_params);
+   m_params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                    IORING_SETUP_COOP_TASKRUN;
+   m_params.cq_entries = entries * 8;
+
+   m_fd = (int)syscall(__NR_io_uring_setup, entries, &m_params);
+   if (m_fd < 0) {
+      LOG("io_uring_setup() failed, errno %d.", errno);
+      return false;
+   }
+
+   const uint32 required = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+   if ((m_params.features & required) != required || !Probe()) {
+      LOG("io_uring lacks features, 0x%x.", m_params.features);
+      Exit();
+      return false;
+   }
+
+   m_sqRingSize = m_params.sq_off.array + m_params.sq_entries * sizeof(uint32);
+   m_cqRingSize = m_params.cq_off.cqes +
+                  m_params.cq_entries * sizeof(struct io_uring_cqe);
+   m_sqesSize = m_params.sq_entries * sizeof(struct io_uring_sqe);
+
+   m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+   m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+   void* sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+   if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+      LOG("Error: cannot map the io_uring rings, errno %d.", errno);
+      m_sqRing = m_sqRing == MAP_FAILED ? NULL : m_sqRing;
+      m_cqRing = m_cqRing == MAP_FAILED ? NULL : m_cqRing;
+      m_sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe*)sqes;
+      Exit();
+      return false;
+   }
+
+   char* sq = (char*)m_sqRing;
+   char* cq = (char*)m_cqRing;
+
+   m_sqes = (struct io_uring_sqe*)sqes;
+   m_sqHead = (uint32*)(sq + m_params.sq_off.head);
+   m_sqTail = (uint32*)(sq + m_params.sq_off.tail);
+   m_sqMask = *(uint32*)(sq + m_params.sq_off.ring_mask);
+   m_sqArray = (uint32*)(sq + m_params.sq_off.array);
+   m_sqLocal = *m_sqTail;
+   m_cqHead = (uint32*)(cq + m_params.cq_off.head);
+   m_cqTail = (uint32*)(cq + m_params.cq_off.tail);
+   m_cqMask = *(uint32*)(cq + m_params.cq_off.ring_mask);
+   m_cqes = (struct io_uring_cqe*)(cq + m_params.cq_off.cqes);
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Exit --
+ *
+ *    Closes the ring, the kernel cancels what is still in flight.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Unmaps the rings and the receive buffers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamUring::Exit()
+{
+   if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+   }
+   if (m_sqes != NULL) {
+      munmap(m_sqes, m_sqesSize);
+      m_sqes = NULL;
+   }
+   if (m_sqRing != NULL) {
+      munmap(m_sqRing, m_sqRingSize);
+      m_sqRing = NULL;
+   }
+   if (m_cqRing != NULL) {
+      munmap(m_cqRing, m_cqRingSize);
+      m_cqRing = NULL;
+   }
+   if (m_bufRing != NULL) {
+      munmap(m_bufRing, m_bufRingSize);
+      m_bufRing = NULL;
+   }
+   if (m_bufs != NULL) {
+      munmap(m_bufs, (size_t)m_bufCount * m_bufSize);
+      m_bufs = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::GetSqe --
+ *
+ *    Returns a cleared submission entry, submitting those before it if
+ *    the queue is full.
+ *
+ * Results:
+ *    NULL if the queue stays full.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+struct io_uring_sqe*
+RPCStreamUring::GetSqe()
+{
+   if (SqSpace() == 0 && (Submit(0, 0) < 0 || SqSpace() == 0)) {
+      return NULL;
+   }
+
+   uint32 index = m_sqLocal & m_sqMask;
+   struct io_uring_sqe* sqe = &m_sqes[index];
+
+   memset(sqe, 0, sizeof *sqe);
+   m_sqArray[index] = index;
+   m_sqLocal++;
+   return sqe;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::SqSpace --
+ *
+ *    Returns how many entries GetSqe() hands out before it submits,
+ *    so that a linked chain is not split.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+RPCStreamUring::SqSpace() const
+{
+   return m_params.sq_entries -
+          (m_sqLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Submit --
+ *
+ *    Submits the entries GetSqe() handed out, then waits up to
+ *    <msTimeout> (-1 forever) for <waitNr> completions.
+ *
+ * Results:
+ *    The entries submitted, -1 on an error, see errno.  A timeout or a
+ *    signal is not an error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamUring::Submit(uint32 waitNr,     // IN
+                       int msTimeout)     // IN
+{
+   __atomic_store_n(m_sqTail, m_sqLocal, __ATOMIC_RELEASE);
+
+   uint32 toSubmit = m_sqLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+   if (waitNr == 0 && toSubmit == 0) {
+      return 0;
+   }
+   return Enter(toSubmit, waitNr, msTimeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Wait --
+ *
+ *    Waits up to <msTimeout> (-1 forever) for a completion without
+ *    submitting, so unlike the other methods it may run while another
+ *    thread fills the submission queue.
+ *
+ * Results:
+ *    0, -1 on an error, see errno.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamUring::Wait(int msTimeout)    // IN
+{
+   if (__atomic_load_n(m_cqHead, __ATOMIC_RELAXED) !=
+       __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+      return 0;
+   }
+   return Enter(0, 1, msTimeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Enter --
+ *
+ *    io_uring_enter(), with a timeout if it waits.
+ *
+ * Results:
+ *    As Submit().
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+RPCStreamUring::Enter(uint32 toSubmit,    // IN
+                      uint32 waitNr,      // IN
+                      int msTimeout)      // IN
+{
+   uint32 flags = 0;
+   struct __kernel_timespec ts;
+   struct io_uring_getevents_arg arg;
+   void* argp = NULL;
+   size_t argSize = 0;
+
+   if (waitNr > 0) {
+      flags |= IORING_ENTER_GETEVENTS;
+      if (msTimeout >= 0) {
+         ts.tv_sec = msTimeout / 1000;
+         ts.tv_nsec = (msTimeout % 1000) * 1000000LL;
+         memset(&arg, 0, sizeof arg);
+         arg.sigmask_sz = _NSIG / 8;
+         arg.ts = (uint64)(uintptr_t)&ts;
+         flags |= IORING_ENTER_EXT_ARG;
+         argp = &arg;
+         argSize = sizeof arg;
+      }
+   }
+
+   int n = (int)syscall(__NR_io_uring_enter, m_fd, toSubmit, waitNr, flags,
+                        argp, argSize);
+   if (n < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY ||
+                 errno == EAGAIN)) {
+      return 0;
+   }
+   return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::PopCqe --
+ *
+ *    Takes the oldest completion.
+ *
+ * Results:
+ *    false if there is none.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamUring::PopCqe(struct io_uring_cqe* cqe)   // OUT
+{
+   uint32 head = *m_cqHead;
+
+   if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+      return false;
+   }
+
+   *cqe = m_cqes[head & m_cqMask];
+   __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::RegisterBuffers --
+ *
+ *    Registers <size> bytes at <base> as fixed buffer 0.  The kernel
+ *    pins the pages once, not for each operation.
+ *
+ * Results:
+ *    false on an error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamUring::RegisterBuffers(void* base,     // IN
+                                size_t size)    // IN
+{
+   struct iovec iov = { base, size };
+
+   if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+      LOG("Error: cannot register %zu bytes, errno %d.", size, errno);
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::SetupBufferRing --
+ *
+ *    Allocates <count> receive buffers of <size> bytes, <count> a power
+ *    of 2, and provides them to the kernel as buffer group <group>.  A
+ *    receive with IOSQE_BUFFER_SELECT takes one for each completion.
+ *
+ * Results:
+ *    false on an error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamUring::SetupBufferRing(uint16 group,    // IN
+                                uint32 count,    // IN
+                                uint32 size)     // IN
+{
+   m_bufRingSize = count * sizeof(struct io_uring_buf);
+   void* ring = mmap(NULL, m_bufRingSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   void* bufs = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (ring == MAP_FAILED || bufs == MAP_FAILED) {
+      LOG("Error: cannot allocate %u receive buffers.", count);
+      if (ring != MAP_FAILED) {
+         munmap(ring, m_bufRingSize);
+      }
+      if (bufs != MAP_FAILED) {
+         munmap(bufs, (size_t)count * size);
+      }
+      return false;
+   }
+
+   m_bufRing = (struct io_uring_buf_ring*)ring;
+   m_bufs = (char*)bufs;
+   m_bufCount = count;
+   m_bufSize = size;
+   m_bufTail = 0;
+
+   struct io_uring_buf_reg reg;
+   memset(&reg, 0, sizeof reg);
+   reg.ring_addr = (uint64)(uintptr_t)m_bufRing;
+   reg.ring_entries = count;
+   reg.bgid = group;
+
+   if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      LOG("Error: cannot register the buffer ring, errno %d.", errno);
+      return false;
+   }
+
+   for (uint32 i = 0; i < count; i++) {
+      RecycleBuffer((uint16)i);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::GetBuffer --
+ *
+ *    Returns the receive buffer a completion names.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+RPCStreamUring::GetBuffer(uint16 bid) const   // IN
+{
+   return m_bufs + (size_t)bid * m_bufSize;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::RecycleBuffer --
+ *
+ *    Gives receive buffer <bid> back to the kernel.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RPCStreamUring::RecycleBuffer(uint16 bid)   // IN
+{
+   /*
+    * Not m_bufRing->bufs: compiled as C++, the flexible array of the uapi
+    * header lands after an empty struct, 8 bytes off the kernel's layout.
+    */
+   struct io_uring_buf* buf = (struct io_uring_buf*)m_bufRing +
+                              (m_bufTail & (m_bufCount - 1));
+
+   buf->addr = (uint64)(uintptr_t)GetBuffer(bid);
+   buf->len = m_bufSize;
+   buf->bid = bid;
+   m_bufTail++;
+   __atomic_store_n(&m_bufRing->tail, m_bufTail, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RPCStreamUring::Probe --
+ *
+ *    Checks the kernel has the operations the reactor uses.  There is
+ *    no probe for multishot receive, it came with IORING_OP_SEND_ZC.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RPCStreamUring::Probe()
+{
+   static const uint8 ops[] = {
+      IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITE_FIXED,
+      IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC,
+   };
+   const uint32 nrOps = 256;
+   std::vector<char> mem(sizeof(struct io_uring_probe) +
+                         nrOps * sizeof(struct io_uring_probe_op), 0);
+   struct io_uring_probe* probe = (struct io_uring_probe*)mem.data();
+
+   if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, nrOps) < 0) {
+      return false;
+   }
+
+   for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++) {
+      if (ops[i] > probe->last_op ||
+          (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * RPCStreamUring.h --
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+/* multishot receive came with provided buffer rings, in the 6.0 headers */
+#ifdef IORING_RECV_MULTISHOT
+#define RPC_STREAM_URING_SUPPORTED
+#endif
+#endif
+
+// submission queue entries, the completion queue is 8 times larger.
+#define RPC_URING_ENTRIES           256
+
+// receive buffers in the provided buffer ring, shared by all sockets.
+#define RPC_URING_RECV_BUFS         256
+#define RPC_URING_RECV_BUF_BYTES    (16 * 1024)
+
+
+#ifdef RPC_STREAM_URING_SUPPORTED
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class RPCStreamUring
+ *
+ *    An io_uring instance driven with the raw system calls, there is no
+ *    liburing in the build.  Init() fails unless the kernel has what
+ *    RPCStreamReactor needs: multishot receive into a provided buffer
+ *    ring (Linux 6.0), MSG_WAITALL sends and timed waits.
+ *
+ *    GetSqe() hands out submission entries, Submit() passes them to the
+ *    kernel and may wait for completions, which PopCqe() takes one at a
+ *    time.  RegisterBuffers() registers the memory the *_FIXED
+ *    operations use, and the receive buffers are handed to the kernel
+ *    with SetupBufferRing() and given back with RecycleBuffer() once
+ *    their data is read.
+ *
+ *    Not thread safe, the caller locks, but for Wait().
+ *
+ *----------------------------------------------------------------------
+ */
+class RPCStreamUring
+{
+public:
+   RPCStreamUring();
+   ~RPCStreamUring();
+
+   bool Init(uint32 entries);
+   void Exit();
+   bool IsInit() const { return m_fd >= 0; }
+
+   struct io_uring_sqe* GetSqe();
+   uint32 SqSpace() const;
+   int Submit(uint32 waitNr, int msTimeout);
+   int Wait(int msTimeout);
+   bool PopCqe(struct io_uring_cqe* cqe);
+
+   bool RegisterBuffers(void* base, size_t size);
+   bool SetupBufferRing(uint16 group, uint32 count, uint32 size);
+   const char* GetBuffer(uint16 bid) const;
+   void RecycleBuffer(uint16 bid);
+
+private:
+   int                     m_fd;
+   struct io_uring_params  m_params;
+
+   void*                   m_sqRing;
+   size_t                  m_sqRingSize;
+   void*                   m_cqRing;
+   size_t                  m_cqRingSize;
+   struct io_uring_sqe*    m_sqes;
+   size_t                  m_sqesSize;
+
+   uint32*                 m_sqHead;
+   uint32*                 m_sqTail;
+   uint32                  m_sqMask;
+   uint32*                 m_sqArray;
+   uint32                  m_sqLocal;     /* tail of the entries not yet submitted */
+   uint32*                 m_cqHead;
+   uint32*                 m_cqTail;
+   uint32                  m_cqMask;
+   struct io_uring_cqe*    m_cqes;
+
+   /* the provided buffer ring */
+   struct io_uring_buf_ring* m_bufRing;
+   size_t                  m_bufRingSize;
+   char*                   m_bufs;
+   uint32                  m_bufCount;
+   uint32                  m_bufSize;
+   uint16                  m_bufTail;
+
+   bool Probe();
+   int Enter(uint32 toSubmit, uint32 waitNr, int msTimeout);
+
+   RPCStreamUring(const RPCStreamUring&);
+   RPCStreamUring& operator=(const RPCStreamUring&);
+};
+
+#endif
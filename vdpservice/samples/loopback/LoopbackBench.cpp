@@ -0,0 +1,574 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackBench.cpp --
+ *
+ *    Benchmark sweeps of LoopbackPing: one run per combination of
+ *    channel type, payload size, credit window, post mode, compression,
+ *    encryption and payload corpus, each on a new connection to the same
+ *    client plugin.
+ *    The results go to a table and, with -J, to a JSON file.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackPing.h"
+#include "RPCChannelSelector.h"
+
+#include <string>
+#include <vector>
+
+// the sweep of -B default.
+#define LOOPBACK_BENCH_DEFAULT \
+   "type=main,vchan,tcp,tcpRaw;size=64,1024,16384,262144;window=1,16;" \
+   "post=0,1;compress=0,1;encrypt=0,1"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackBench
+ *
+ *    The axes of a sweep, the options of the command line for those it
+ *    does not name.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackBench
+{
+public:
+   LoopbackBench(const LoopbackPingOptions& options);
+
+   bool Parse(const char* spec);
+   int Run();
+
+private:
+   typedef struct {
+      LoopbackPingOptions  options;
+      LoopbackPingResult   result;
+   } Run_;
+
+   LoopbackPingOptions     m_options;
+   std::vector<int>        m_types;
+   std::vector<int>        m_sizes;
+   std::vector<int>        m_windows;
+   std::vector<int>        m_posts;
+   std::vector<int>        m_compress;
+   std::vector<int>        m_encrypt;
+   std::vector<std::string> m_payloads;     /* "" is the pattern */
+
+   static bool ParseList(const std::string& values, bool channels,
+                         std::vector<int>* list);
+   static bool ParsePayloads(const std::string& values,
+                             std::vector<std::string>* list);
+   static bool IsValid(const LoopbackPingOptions& options);
+   static void Adjust(LoopbackPingOptions* options);
+   static void PrintRun(const LoopbackPingOptions& options,
+                        const LoopbackPingResult& result);
+   bool WriteJson(const std::vector<Run_*>& runs);
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::LoopbackBench --
+ *
+ *    Constructor, every axis has the one value of <options>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackBench::LoopbackBench(const LoopbackPingOptions& options)   // IN
+   : m_options(options)
+{
+   m_types.push_back(options.type);
+   m_sizes.push_back(options.size);
+   m_windows.push_back(options.window);
+   m_posts.push_back(options.postMode);
+   m_compress.push_back(options.compressEnabled);
+   m_encrypt.push_back(options.encryptionEnabled);
+   m_payloads.push_back(options.payload != NULL ? options.payload : "");
+
+   if (m_options.warmup < 0) {
+      m_options.warmup = options.n / 10 < LOOPBACK_BENCH_MAX_WARMUP ?
+                         options.n / 10 : LOOPBACK_BENCH_MAX_WARMUP;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::Parse --
+ *
+ *    Parses a sweep, "default" or axes separated by ';' each with a
+ *    list of values, e.g. "type=main,tcp;size=64,4096;window=1,16".
+ *    The axes are type, size, window, post, compress, encrypt and
+ *    payload.  post, compress and encrypt take 0 and 1, payload the
+ *    corpora of -P.
+ *
+ * Results:
+ *    false if it is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackBench::Parse(const char* spec)   // IN
+{
+   std::string rest = strcmp(spec, "default") == 0 ? LOOPBACK_BENCH_DEFAULT : spec;
+
+   while (!rest.empty()) {
+      size_t end = rest.find(';');
+      std::string axis = rest.substr(0, end);
+      rest = end == std::string::npos ? "" : rest.substr(end + 1);
+
+      size_t eq = axis.find('=');
+      if (eq == std::string::npos) {
+         return false;
+      }
+      std::string name = axis.substr(0, eq);
+      std::string values = axis.substr(eq + 1);
+      bool ok;
+
+      if (name == "type") {
+         ok = ParseList(values, true, &m_types);
+      } else if (name == "size") {
+         ok = ParseList(values, false, &m_sizes);
+      } else if (name == "window") {
+         ok = ParseList(values, false, &m_windows);
+      } else if (name == "post") {
+         ok = ParseList(values, false, &m_posts);
+      } else if (name == "compress") {
+         ok = ParseList(values, false, &m_compress);
+      } else if (name == "encrypt") {
+         ok = ParseList(values, false, &m_encrypt);
+      } else if (name == "payload") {
+         ok = ParsePayloads(values, &m_payloads);
+      } else {
+         ok = false;
+      }
+      if (!ok) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::ParseList --
+ *
+ *    Parses the comma separated values of an axis, channel names if
+ *    <channels>, numbers otherwise.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackBench::ParseList(const std::string& values,   // IN
+                         bool channels,               // IN
+                         std::vector<int>* list)      // OUT
+{
+   list->clear();
+
+   size_t start = 0;
+   while (start <= values.size()) {
+      size_t end = values.find(',', start);
+      std::string value = values.substr(start, end == std::string::npos ?
+                                               std::string::npos : end - start);
+      start = end == std::string::npos ? values.size() + 1 : end + 1;
+
+      if (value.empty()) {
+         return false;
+      }
+      if (!channels) {
+         char* endp;
+         long n = strtol(value.c_str(), &endp, 0);
+         if (*endp != '\0' || n < 0) {
+            return false;
+         }
+         list->push_back((int)n);
+         continue;
+      }
+
+      int type = VDPSERVICE_MAIN_CHANNEL;
+      while (type <= VDPSERVICE_TCPRAW_CHANNEL &&
+             _stricmp(value.c_str(), RPCChannelSelector::ChannelTypeToStr(type)) != 0) {
+         type++;
+      }
+      if (type > VDPSERVICE_TCPRAW_CHANNEL) {
+         return false;
+      }
+      list->push_back(type);
+   }
+
+   return !list->empty();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::ParsePayloads --
+ *
+ *    Parses the comma separated corpora of the payload axis, each as -P
+ *    takes it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackBench::ParsePayloads(const std::string& values,          // IN
+                             std::vector<std::string>* list)     // OUT
+{
+   list->clear();
+
+   size_t start = 0;
+   while (start <= values.size()) {
+      size_t end = values.find(',', start);
+      std::string value = values.substr(start, end == std::string::npos ?
+                                               std::string::npos : end - start);
+      start = end == std::string::npos ? values.size() + 1 : end + 1;
+
+      RPCPayloadClass payloadClass;
+      double entropy;
+      if (!RPCPayloadCorpus::Parse(value.c_str(), &payloadClass, &entropy)) {
+         return false;
+      }
+      list->push_back(value);
+   }
+
+   return !list->empty();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::IsValid --
+ *
+ *    Whether the channel supports the combination, as ParseOptions()
+ *    checks it for a single run.  Post mode does not apply to the raw
+ *    TCP pings.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackBench::IsValid(const LoopbackPingOptions& options)   // IN
+{
+   if (options.compressEnabled && options.type == VDPSERVICE_MAIN_CHANNEL) {
+      return false;
+   }
+   if (options.encryptionEnabled && options.type != VDPSERVICE_TCP_CHANNEL &&
+       options.type != VDPSERVICE_TCPRAW_CHANNEL &&
+       options.type != VDPSERVICE_AUTO_CHANNEL) {
+      return false;
+   }
+   if (options.postMode && options.type == VDPSERVICE_TCPRAW_CHANNEL) {
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::Adjust --
+ *
+ *    Keeps the options of the command line that are not axes to the
+ *    channels that have them: -Z and -U to tcpRaw, -R to the others.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackBench::Adjust(LoopbackPingOptions* options)   // IN/OUT
+{
+   if (options->type == VDPSERVICE_TCPRAW_CHANNEL) {
+      options->dropEvery = 0;
+   } else {
+      options->zeroCopyMin = 0;
+      options->useUring = false;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::Run --
+ *
+ *    Runs every valid combination of the axes, one connection each.
+ *
+ * Results:
+ *    0 if all the pings of all the runs came back, 1 otherwise.
+ *
+ * Side Effects:
+ *    Prints a line per run, writes the JSON file of -J.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackBench::Run()
+{
+   std::vector<Run_*> runs;
+   int rv = 0;
+
+   printf("%-6s %8s %6s %4s %4s %4s %-12s %8s %10s %9s %9s %9s %9s %9s "
+          "%7s %8s %9s %9s\n", "type", "size", "window", "post", "comp", "enc",
+          "payload", "pings", "msgs/s", "MB/s", "p50us", "p99us", "p99.9us",
+          "maxus", "ratio", "compus", "a2c50us", "c2a50us");
+
+   for (size_t t = 0; t < m_types.size(); t++) {
+      for (size_t s = 0; s < m_sizes.size(); s++) {
+         for (size_t w = 0; w < m_windows.size(); w++) {
+            for (size_t p = 0; p < m_posts.size(); p++) {
+               for (size_t c = 0; c < m_compress.size(); c++) {
+                  for (size_t e = 0; e < m_encrypt.size(); e++) {
+                     for (size_t l = 0; l < m_payloads.size(); l++) {
+                        Run_* run = new Run_;
+                        LoopbackPingOptions& options = run->options;
+
+                        options = m_options;
+                        options.type = (VdpServiceChannelType)m_types[t];
+                        options.size = m_sizes[s];
+                        options.window = m_windows[w];
+                        options.postMode = m_posts[p] != 0;
+                        options.compressEnabled = m_compress[c] != 0;
+                        options.encryptionEnabled = m_encrypt[e] != 0;
+                        options.payload = m_payloads[l].empty() ? NULL :
+                                          m_payloads[l].c_str();
+                        Adjust(&options);
+
+                        if (!IsValid(options)) {
+                           delete run;
+                           continue;
+                        }
+
+                        if (!LoopbackRunPing(options, &run->result, false) ||
+                            run->result.received != options.n) {
+                           rv = 1;
+                        }
+                        PrintRun(options, run->result);
+                        runs.push_back(run);
+                     }
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   if (m_options.json != NULL && !WriteJson(runs)) {
+      rv = 1;
+   }
+
+   for (size_t i = 0; i < runs.size(); i++) {
+      delete runs[i];
+   }
+   return rv;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::PrintRun --
+ *
+ *    Prints the line of a run.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackBench::PrintRun(const LoopbackPingOptions& options,   // IN
+                        const LoopbackPingResult& result)     // IN
+{
+   double seconds = result.elapsedUs / 1e6;
+   const LoopbackHistogram& latency = result.latency;
+   const LoopbackCompressionStats& comp = result.compression;
+   char toClient[16] = "n/a";
+   char toAgent[16] = "n/a";
+
+   if (LoopbackOneWayValid(result)) {
+      snprintf(toClient, sizeof toClient, "%.1f", result.toClient.GetPercentile(50) / 1e3);
+      snprintf(toAgent, sizeof toAgent, "%.1f", result.toAgent.GetPercentile(50) / 1e3);
+   }
+
+   printf("%-6s %8d %6d %4d %4d %4d %-12s %8d %10.0f %9.2f %9.1f %9.1f %9.1f "
+          "%9.1f %7.2f %8.1f %9s %9s%s\n",
+          RPCChannelSelector::ChannelTypeToStr(options.type), options.size,
+          options.window, options.postMode, options.compressEnabled,
+          options.encryptionEnabled,
+          options.payload != NULL ? options.payload : "pattern", result.received,
+          seconds > 0 ? result.received / seconds : 0,
+          seconds > 0 ? result.payloadBytes / seconds / 1e6 : 0,
+          latency.GetPercentile(50) / 1e3, latency.GetPercentile(99) / 1e3,
+          latency.GetPercentile(99.9) / 1e3, latency.GetMax() / 1e3,
+          comp.wireBytes > 0 ? (double)comp.rawBytes / comp.wireBytes : 1.0,
+          comp.frames > 0 ? comp.compressNs / 1e3 / comp.frames : 0,
+          toClient, toAgent,
+          !result.connected ? "  (no connection)" :
+          result.received != options.n ? "  (pings lost)" : "");
+   fflush(stdout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackBench::WriteJson --
+ *
+ *    Writes the runs to the file of -J, or to stdout for "-".  The
+ *    latencies are in nanoseconds, the rates per second.  The one-way
+ *    delays are only there for the runs whose pings were echoed and
+ *    split, see LoopbackOneWayValid().
+ *
+ * Results:
+ *    false if the file cannot be written.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackBench::WriteJson(const std::vector<Run_*>& runs)   // IN
+{
+   static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+   bool toStdout = strcmp(m_options.json, "-") == 0;
+   FILE* f = toStdout ? stdout : fopen(m_options.json, "w");
+
+   if (f == NULL) {
+      printf("Cannot write %s\n", m_options.json);
+      return false;
+   }
+
+   std::string link;
+   for (const char* c = m_options.link != NULL ? m_options.link : ""; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\') {
+         link += '\\';
+      }
+      link += *c;
+   }
+
+   fprintf(f, "{\n  \"pings\": %d,\n  \"warmup\": %d,\n  \"link\": \"%s\",\n"
+           "  \"seed\": %llu,\n  \"pumpThread\": %s,\n  \"runs\": [",
+           m_options.n, m_options.warmup, link.c_str(),
+           (unsigned long long)m_options.seed,
+           m_options.pumpThread ? "true" : "false");
+
+   for (size_t i = 0; i < runs.size(); i++) {
+      const LoopbackPingOptions& options = runs[i]->options;
+      const LoopbackPingResult& result = runs[i]->result;
+      const LoopbackHistogram& latency = result.latency;
+      const LoopbackCompressionStats& comp = result.compression;
+      double seconds = result.elapsedUs / 1e6;
+
+      fprintf(f, "%s\n    {\"type\": \"%s\", \"size\": %d, \"window\": %d, "
+              "\"post\": %s, \"compress\": %s, \"encrypt\": %s, "
+              "\"payload\": \"%s\",\n"
+              "     \"connected\": %s, \"sent\": %d, \"received\": %d, "
+              "\"seconds\": %.6f, \"msgsPerSec\": %.1f, \"bytesPerSec\": %.1f,\n"
+              "     \"latencyNs\": {\"count\": %llu, \"min\": %llu, \"mean\": %.1f",
+              i > 0 ? "," : "", RPCChannelSelector::ChannelTypeToStr(options.type),
+              options.size, options.window,
+              options.postMode ? "true" : "false",
+              options.compressEnabled ? "true" : "false",
+              options.encryptionEnabled ? "true" : "false",
+              options.payload != NULL ? options.payload : "pattern",
+              result.connected ? "true" : "false", result.sent, result.received,
+              seconds, seconds > 0 ? result.received / seconds : 0,
+              seconds > 0 ? result.payloadBytes / seconds : 0,
+              (unsigned long long)latency.GetCount(),
+              (unsigned long long)latency.GetMin(), latency.GetMean());
+
+      for (size_t p = 0; p < sizeof percentiles / sizeof percentiles[0]; p++) {
+         fprintf(f, ", \"p%g\": %llu", percentiles[p],
+                 (unsigned long long)latency.GetPercentile(percentiles[p]));
+      }
+      fprintf(f, ", \"max\": %llu},\n", (unsigned long long)latency.GetMax());
+      fprintf(f, "     \"compression\": {\"frames\": %llu, \"rawBytes\": %llu, "
+              "\"wireBytes\": %llu, \"ratio\": %.3f, \"compressNs\": %llu, "
+              "\"decompressNs\": %llu}",
+              (unsigned long long)comp.frames, (unsigned long long)comp.rawBytes,
+              (unsigned long long)comp.wireBytes,
+              comp.wireBytes > 0 ? (double)comp.rawBytes / comp.wireBytes : 1.0,
+              (unsigned long long)comp.compressNs,
+              (unsigned long long)comp.decompressNs);
+
+      if (LoopbackOneWayValid(result)) {
+         const LoopbackHistogram* oneWay[] = { &result.toClient, &result.toAgent };
+         static const char* names[] = { "toClient", "toAgent" };
+
+         fprintf(f, ",\n     \"oneWayNs\": {");
+         for (int d = 0; d < 2; d++) {
+            fprintf(f, "\"%s\": {\"min\": %llu", names[d],
+                    (unsigned long long)oneWay[d]->GetMin());
+            for (size_t p = 0; p < sizeof percentiles / sizeof percentiles[0]; p++) {
+               fprintf(f, ", \"p%g\": %llu", percentiles[p],
+                       (unsigned long long)oneWay[d]->GetPercentile(percentiles[p]));
+            }
+            fprintf(f, ", \"max\": %llu}, ", (unsigned long long)oneWay[d]->GetMax());
+         }
+         fprintf(f, "\"clockOffsetNs\": %lld, \"clockDriftPpm\": %.3f}",
+                 (long long)result.clock.offsetNs, result.clock.driftPpm);
+      }
+      fprintf(f, "}");
+   }
+
+   fprintf(f, "\n  ]\n}\n");
+
+   bool ok = !ferror(f);
+   if (!toStdout) {
+      ok = fclose(f) == 0 && ok;
+   }
+   if (!ok) {
+      printf("Cannot write %s\n", m_options.json);
+   }
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunBench --
+ *
+ *    Runs the sweep of -B.
+ *
+ * Results:
+ *    0 if all the pings came back, 1 if some did not, 2 if the sweep
+ *    is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackRunBench(const LoopbackPingOptions& options)   // IN
+{
+   LoopbackBench bench(options);
+
+   if (!bench.Parse(options.bench)) {
+      printf("Invalid sweep \"%s\"\n", options.bench);
+      return 2;
+   }
+   return bench.Run();
+}
@@ -0,0 +1,1133 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackContext.cpp --
+ *
+ *    The channel contexts, their wire format and the channel context
+ *    and variant interfaces.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackService.h"
+
+#include <algorithm>
+#include <chrono>
+#include <zlib.h>
+
+// string length that stands for a NULL string on the wire.
+#define LOOPBACK_NULL_STRING     0xFFFFFFFF
+
+// zlib level that stands in for Snappy, the fastest.
+#define LOOPBACK_SNAPPY_LEVEL    1
+
+/*
+ * What the compression of the frames cost and saved, process wide, see
+ * LoopbackGetCompressionStats().
+ */
+static struct {
+   std::atomic<uint64>  frames;
+   std::atomic<uint64>  rawBytes;
+   std::atomic<uint64>  wireBytes;
+   std::atomic<uint64>  compressNs;
+   std::atomic<uint64>  decompressNs;
+} s_compStats;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackReader
+ *
+ *    Reads the fields of a frame back.  Both ends are in the same
+ *    process, so integers travel in host byte order.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   const char*    pos;
+   size_t         left;
+} LoopbackReader;
+
+static bool
+ReadBytes(LoopbackReader* r,   // IN/OUT
+          void* buf,           // OUT
+          size_t size)         // IN
+{
+   if (r->left < size) {
+      return false;
+   }
+
+   memcpy(buf, r->pos, size);
+   r->pos += size;
+   r->left -= size;
+   return true;
+}
+
+static bool
+ReadString(LoopbackReader* r,  // IN/OUT
+           std::string* str,   // OUT
+           bool* isNull)       // OUT
+{
+   uint32 len;
+
+   if (!ReadBytes(r, &len, sizeof len)) {
+      return false;
+   }
+
+   *isNull = len == LOOPBACK_NULL_STRING;
+   if (*isNull) {
+      str->clear();
+      return true;
+   }
+
+   if (r->left < len) {
+      return false;
+   }
+
+   str->assign(r->pos, len);
+   r->pos += len;
+   r->left -= len;
+   return true;
+}
+
+static void
+WriteBytes(std::vector<char>* data,   // IN/OUT
+           const void* buf,           // IN
+           size_t size)               // IN
+{
+   const char* p = (const char*)buf;
+   data->insert(data->end(), p, p + size);
+}
+
+static void
+WriteString(std::vector<char>* data,  // IN/OUT
+            const char* str,          // IN
+            size_t len)               // IN
+{
+   uint32 n = str != NULL ? (uint32)len : LOOPBACK_NULL_STRING;
+
+   WriteBytes(data, &n, sizeof n);
+   if (str != NULL) {
+      WriteBytes(data, str, len);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VariantValueSize --
+ *
+ *    The size of the value of a fixed size variant type.
+ *
+ * Results:
+ *    The size, 0 for the empty types and -1 for the others.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VariantValueSize(VDP_RPC_VARTYPE vt)   // IN
+{
+   switch (vt) {
+   case VDP_RPC_VT_EMPTY:
+   case VDP_RPC_VT_NULL:
+      return 0;
+   case VDP_RPC_VT_I1:
+   case VDP_RPC_VT_UI1:
+      return 1;
+   case VDP_RPC_VT_I2:
+   case VDP_RPC_VT_UI2:
+      return 2;
+   case VDP_RPC_VT_I4:
+   case VDP_RPC_VT_UI4:
+   case VDP_RPC_VT_R4:
+      return 4;
+   case VDP_RPC_VT_I8:
+   case VDP_RPC_VT_UI8:
+   case VDP_RPC_VT_R8:
+      return 8;
+   default:
+      return -1;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackVariantCopy --
+ *
+ *    Deep copy of a variant, <target> is overwritten without being
+ *    cleared.
+ *
+ * Results:
+ *    false if the type is not supported or memory is short.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackVariantCopy(VDP_RPC_VARIANT* target,      // OUT
+                    const VDP_RPC_VARIANT* src)   // IN
+{
+   VDP_RPC_VARIANT v = *src;
+
+   if (src->vt == VDP_RPC_VT_LPSTR) {
+      if (src->strVal != NULL) {
+         v.strVal = strdup(src->strVal);
+         if (v.strVal == NULL) {
+            return false;
+         }
+      }
+   } else if (src->vt == VDP_RPC_VT_BLOB) {
+      v.blobVal.blobData = NULL;
+      if (src->blobVal.size > 0) {
+         v.blobVal.blobData = (char*)malloc(src->blobVal.size);
+         if (v.blobVal.blobData == NULL) {
+            return false;
+         }
+         memcpy(v.blobVal.blobData, src->blobVal.blobData, src->blobVal.size);
+      }
+   } else if (VariantValueSize(src->vt) < 0) {
+      LOG("Error: variant type %d is not supported.", src->vt);
+      return false;
+   }
+
+   *target = v;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackVariantClear --
+ *
+ *    Frees what a variant holds and makes it empty.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackVariantClear(VDP_RPC_VARIANT* v)   // IN/OUT
+{
+   if (v->vt == VDP_RPC_VT_LPSTR) {
+      free(v->strVal);
+   } else if (v->vt == VDP_RPC_VT_BLOB) {
+      free(v->blobVal.blobData);
+   }
+
+   memset(v, 0, sizeof *v);
+   v->vt = VDP_RPC_VT_EMPTY;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteParams --
+ *
+ *    Appends a parameter or return value list to a frame.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriteParams(std::vector<char>* data,                   // IN/OUT
+            const std::vector<LoopbackParam>& params)  // IN
+{
+   uint32 n = (uint32)params.size();
+   WriteBytes(data, &n, sizeof n);
+
+   for (size_t i = 0; i < params.size(); i++) {
+      const VDP_RPC_VARIANT& v = params[i].value;
+      uint16 vt = v.vt;
+
+      WriteString(data, params[i].name.c_str(), params[i].name.size());
+      WriteBytes(data, &vt, sizeof vt);
+
+      if (v.vt == VDP_RPC_VT_LPSTR) {
+         WriteString(data, v.strVal, v.strVal != NULL ? strlen(v.strVal) : 0);
+      } else if (v.vt == VDP_RPC_VT_BLOB) {
+         WriteBytes(data, &v.blobVal.size, sizeof v.blobVal.size);
+         WriteBytes(data, v.blobVal.blobData, v.blobVal.size);
+      } else {
+         // the union members all start at the same address.
+         WriteBytes(data, &v.ullVal, VariantValueSize(v.vt));
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadParams --
+ *
+ *    Reads back what WriteParams() wrote.
+ *
+ * Results:
+ *    false if the data is malformed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ReadParams(LoopbackReader* r,                    // IN/OUT
+           std::vector<LoopbackParam>* params)   // OUT
+{
+   uint32 n;
+
+   if (!ReadBytes(r, &n, sizeof n)) {
+      return false;
+   }
+
+   for (uint32 i = 0; i < n; i++) {
+      LoopbackParam param;
+      bool isNull;
+      uint16 vt;
+
+      memset(&param.value, 0, sizeof param.value);
+      if (!ReadString(r, &param.name, &isNull) || !ReadBytes(r, &vt, sizeof vt)) {
+         return false;
+      }
+      param.value.vt = vt;
+
+      if (vt == VDP_RPC_VT_LPSTR) {
+         std::string str;
+         if (!ReadString(r, &str, &isNull)) {
+            return false;
+         }
+         if (!isNull) {
+            param.value.strVal = strdup(str.c_str());
+         }
+      } else if (vt == VDP_RPC_VT_BLOB) {
+         uint32 size;
+         if (!ReadBytes(r, &size, sizeof size) || r->left < size) {
+            return false;
+         }
+         param.value.blobVal.size = size;
+         if (size > 0) {
+            param.value.blobVal.blobData = (char*)malloc(size);
+            ReadBytes(r, param.value.blobVal.blobData, size);
+         }
+      } else {
+         int size = VariantValueSize(vt);
+         if (size < 0 || !ReadBytes(r, &param.value.ullVal, size)) {
+            return false;
+         }
+      }
+
+      params->push_back(param);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ElapsedNs --
+ *
+ *    Nanoseconds since <start>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+ElapsedNs(std::chrono::steady_clock::time_point start)   // IN
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteCompressedParams --
+ *
+ *    Appends a parameter or return value list to a frame, compressed
+ *    if <options> ask for it: zlib for VDP_RPC_COMP_ZLIB, its fastest
+ *    level for VDP_RPC_COMP_SNAPPY.  The list is then
+ *       [u32 rawSize][u32 packedSize]{packed}
+ *    and a packedSize of 0 means it did not shrink and follows as is.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    Counts the compression.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriteCompressedParams(std::vector<char>* data,                   // IN/OUT
+                      const std::vector<LoopbackParam>& params,  // IN
+                      uint32 options)                            // IN
+{
+   if ((options & (VDP_RPC_COMP_ZLIB | VDP_RPC_COMP_SNAPPY)) == 0) {
+      WriteParams(data, params);
+      return;
+   }
+
+   std::vector<char> raw;
+   WriteParams(&raw, params);
+
+   auto start = std::chrono::steady_clock::now();
+   int level = (options & VDP_RPC_COMP_ZLIB) != 0 ? Z_DEFAULT_COMPRESSION
+                                                   : LOOPBACK_SNAPPY_LEVEL;
+   uint32 rawSize = (uint32)raw.size();
+   uLongf packedSize = compressBound(rawSize);
+   size_t header = data->size();
+
+   data->resize(header + 2 * sizeof(uint32) + packedSize);
+   char* packed = data->data() + header + 2 * sizeof(uint32);
+   if (compress2((Bytef*)packed, &packedSize, (const Bytef*)raw.data(),
+                 rawSize, level) != Z_OK || packedSize >= rawSize) {
+      memcpy(packed, raw.data(), rawSize);
+      packedSize = 0;
+   }
+
+   uint32 size = (uint32)packedSize;
+   memcpy(data->data() + header, &rawSize, sizeof rawSize);
+   memcpy(data->data() + header + sizeof rawSize, &size, sizeof size);
+   data->resize(header + 2 * sizeof(uint32) + (size > 0 ? size : rawSize));
+
+   s_compStats.compressNs += ElapsedNs(start);
+   s_compStats.frames++;
+   s_compStats.rawBytes += rawSize;
+   s_compStats.wireBytes += size > 0 ? size : rawSize;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadCompressedParams --
+ *
+ *    Reads back what WriteCompressedParams() wrote.
+ *
+ * Results:
+ *    false if the data is malformed.
+ *
+ * Side Effects:
+ *    Counts the decompression.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ReadCompressedParams(LoopbackReader* r,                    // IN/OUT
+                     std::vector<LoopbackParam>* params,   // OUT
+                     uint32 options)                       // IN
+{
+   uint32 rawSize;
+   uint32 packedSize;
+
+   if ((options & (VDP_RPC_COMP_ZLIB | VDP_RPC_COMP_SNAPPY)) == 0) {
+      return ReadParams(r, params);
+   }
+
+   if (!ReadBytes(r, &rawSize, sizeof rawSize) ||
+       !ReadBytes(r, &packedSize, sizeof packedSize)) {
+      return false;
+   }
+   if (packedSize == 0) {
+      return ReadParams(r, params);
+   }
+   if (r->left < packedSize) {
+      return false;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   std::vector<char> raw(rawSize);
+   uLongf size = rawSize;
+   int rc = uncompress((Bytef*)raw.data(), &size, (const Bytef*)r->pos, packedSize);
+   s_compStats.decompressNs += ElapsedNs(start);
+
+   r->pos += packedSize;
+   r->left -= packedSize;
+   if (rc != Z_OK || size != rawSize) {
+      return false;
+   }
+
+   LoopbackReader unpacked = { raw.data(), raw.size() };
+   return ReadParams(&unpacked, params);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackGetCompressionStats --
+ *
+ *    What the compression of the frames cost and saved so far.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackGetCompressionStats(LoopbackCompressionStats* stats)   // OUT
+{
+   stats->frames = s_compStats.frames;
+   stats->rawBytes = s_compStats.rawBytes;
+   stats->wireBytes = s_compStats.wireBytes;
+   stats->compressNs = s_compStats.compressNs;
+   stats->decompressNs = s_compStats.decompressNs;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ClearParams --
+ *
+ *    Frees a parameter or return value list.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ClearParams(std::vector<LoopbackParam>* params)   // IN/OUT
+{
+   for (size_t i = 0; i < params->size(); i++) {
+      LoopbackVariantClear(&(*params)[i].value);
+   }
+
+   params->clear();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::LoopbackContext --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackContext::LoopbackContext(LoopbackObject* object,   // IN
+                                 uint32 id,                // IN
+                                 uint32 options)           // IN
+   : m_object(object),
+     m_id(id),
+     m_options(options),
+     m_command(0),
+     m_named(false),
+     m_returnCode(0),
+     m_post(false),
+     m_received(false),
+     m_async(false)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::~LoopbackContext --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackContext::~LoopbackContext()
+{
+   ClearParams(&m_params);
+   ClearParams(&m_returnVals);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::NewId --
+ *
+ *    A process wide unique context id.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+LoopbackContext::NewId()
+{
+   static std::atomic<uint32> next(1);
+   return next++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::EncodeInvoke --
+ *
+ *    The data of the INVOKE frame of this context.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackContext::EncodeInvoke(std::vector<char>* data) const  // OUT
+{
+   uint8 post = m_post ? 1 : 0;
+
+   WriteBytes(data, &m_command, sizeof m_command);
+   WriteBytes(data, &m_options, sizeof m_options);
+   WriteBytes(data, &post, sizeof post);
+   WriteString(data, m_named ? m_name.c_str() : NULL, m_name.size());
+   WriteCompressedParams(data, m_params, m_options);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::DecodeInvoke --
+ *
+ *    Sets this context up from the data of an INVOKE frame.
+ *
+ * Results:
+ *    false if the data is malformed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackContext::DecodeInvoke(const std::vector<char>& data)  // IN
+{
+   LoopbackReader r = { data.data(), data.size() };
+   uint8 post;
+   bool isNull;
+
+   if (!ReadBytes(&r, &m_command, sizeof m_command) ||
+       !ReadBytes(&r, &m_options, sizeof m_options) ||
+       !ReadBytes(&r, &post, sizeof post) ||
+       !ReadString(&r, &m_name, &isNull) ||
+       !ReadCompressedParams(&r, &m_params, m_options)) {
+      LOG("Error: malformed invoke frame for context %u.", m_id);
+      return false;
+   }
+
+   m_post = post != 0;
+   m_named = !isNull;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::EncodeReply --
+ *
+ *    The data of the REPLY frame of this context.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackContext::EncodeReply(std::vector<char>* data) const   // OUT
+{
+   WriteBytes(data, &m_returnCode, sizeof m_returnCode);
+   WriteCompressedParams(data, m_returnVals, m_options);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContext::DecodeReply --
+ *
+ *    Takes the return code and values of a REPLY frame.
+ *
+ * Results:
+ *    false if the data is malformed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackContext::DecodeReply(const std::vector<char>& data)   // IN
+{
+   LoopbackReader r = { data.data(), data.size() };
+
+   ClearParams(&m_returnVals);
+
+   if (!ReadBytes(&r, &m_returnCode, sizeof m_returnCode) ||
+       !ReadCompressedParams(&r, &m_returnVals, m_options)) {
+      LOG("Error: malformed reply frame for context %u.", m_id);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ * The channel context interface.
+ */
+
+static uint32
+ContextGetId(void* contextHandle)   // IN
+{
+   return ((LoopbackContext*)contextHandle)->m_id;
+}
+
+static uint32
+ContextGetCommand(void* contextHandle)   // IN
+{
+   LoopbackContext* ctx = (LoopbackContext*)contextHandle;
+   return ctx->m_named ? 0 : ctx->m_command;
+}
+
+static Bool
+ContextSetCommand(void* contextHandle,   // IN
+                  uint32 command)        // IN
+{
+   LoopbackContext* ctx = (LoopbackContext*)contextHandle;
+
+   ctx->m_command = command;
+   ctx->m_name.clear();
+   ctx->m_named = false;
+   return TRUE;
+}
+
+static Bool
+ContextGetNamedCommand(void* contextHandle,   // IN
+                       char* buffer,          // OUT
+                       int bufferSize)        // IN
+{
+   LoopbackContext* ctx = (LoopbackContext*)contextHandle;
+
+   if (buffer == NULL || bufferSize <= 0) {
+      return FALSE;
+   }
+
+   // terminated even without a name, callers compare it right away.
+   size_t n = std::min(ctx->m_name.size(), (size_t)bufferSize - 1);
+   memcpy(buffer, ctx->m_name.data(), n);
+   buffer[n] = '\0';
+   return ctx->m_named;
+}
+
+static Bool
+ContextSetNamedCommand(void* contextHandle,   // IN
+                       const char* command)   // IN
+{
+   LoopbackContext* ctx = (LoopbackContext*)contextHandle;
+
+   if (command == NULL) {
+      return FALSE;
+   }
+
+   ctx->m_command = 0;
+   ctx->m_name = command;
+   ctx->m_named = true;
+   return TRUE;
+}
+
+static bool
+AppendTo(std::vector<LoopbackParam>* params,  // IN/OUT
+         const char* name,                    // IN/OPT
+         const VDP_RPC_VARIANT* v)            // IN
+{
+   LoopbackParam param;
+
+   if (v == NULL || !LoopbackVariantCopy(&param.value, v)) {
+      return false;
+   }
+
+   if (name != NULL) {
+      param.name = name;
+   }
+
+   params->push_back(param);
+   return true;
+}
+
+static bool
+GetFrom(const std::vector<LoopbackParam>& params,  // IN
+        int i,                                     // IN
+        char* name,                                // OUT/OPT
+        int nameSize,                              // IN
+        VDP_RPC_VARIANT* copy)                     // OUT
+{
+   if (i < 0 || i >= (int)params.size() || copy == NULL) {
+      return false;
+   }
+
+   if (name != NULL && nameSize > 0) {
+      size_t n = std::min(params[i].name.size(), (size_t)nameSize - 1);
+      memcpy(name, params[i].name.data(), n);
+      name[n] = '\0';
+   }
+
+   return LoopbackVariantCopy(copy, &params[i].value);
+}
+
+static int
+ContextGetParamCount(void* contextHandle)   // IN
+{
+   return (int)((LoopbackContext*)contextHandle)->m_params.size();
+}
+
+static Bool
+ContextAppendParam(void* contextHandle,          // IN
+                   const VDP_RPC_VARIANT* v)     // IN
+{
+   return AppendTo(&((LoopbackContext*)contextHandle)->m_params, NULL, v);
+}
+
+static Bool
+ContextGetParam(void* contextHandle,   // IN
+                int i,                 // IN
+                VDP_RPC_VARIANT* copy) // OUT
+{
+   return GetFrom(((LoopbackContext*)contextHandle)->m_params, i, NULL, 0, copy);
+}
+
+static Bool
+ContextAppendNamedParam(void* contextHandle,         // IN
+                        const char* name,            // IN
+                        const VDP_RPC_VARIANT* v)    // IN
+{
+   return AppendTo(&((LoopbackContext*)contextHandle)->m_params, name, v);
+}
+
+static Bool
+ContextGetNamedParam(void* contextHandle,     // IN
+                     int index,               // IN
+                     char* name,              // OUT
+                     int nameSize,            // IN
+                     VDP_RPC_VARIANT* copy)   // OUT
+{
+   return GetFrom(((LoopbackContext*)contextHandle)->m_params, index,
+                  name, nameSize, copy);
+}
+
+static uint32
+ContextGetReturnCode(void* contextHandle)   // IN
+{
+   return ((LoopbackContext*)contextHandle)->m_returnCode;
+}
+
+static Bool
+ContextSetReturnCode(void* contextHandle,   // IN
+                     uint32 code)           // IN
+{
+   ((LoopbackContext*)contextHandle)->m_returnCode = code;
+   return TRUE;
+}
+
+static int
+ContextGetReturnValCount(void* contextHandle)   // IN
+{
+   return (int)((LoopbackContext*)contextHandle)->m_returnVals.size();
+}
+
+static Bool
+ContextAppendReturnVal(void* contextHandle,        // IN
+                       const VDP_RPC_VARIANT* v)   // IN
+{
+   return AppendTo(&((LoopbackContext*)contextHandle)->m_returnVals, NULL, v);
+}
+
+static Bool
+ContextGetReturnVal(void* contextHandle,   // IN
+                    int i,                 // IN
+                    VDP_RPC_VARIANT* v)    // OUT
+{
+   return GetFrom(((LoopbackContext*)contextHandle)->m_returnVals, i, NULL, 0, v);
+}
+
+static Bool
+ContextAppendNamedReturnVal(void* contextHandle,         // IN
+                            const char* name,            // IN
+                            const VDP_RPC_VARIANT* v)    // IN
+{
+   return AppendTo(&((LoopbackContext*)contextHandle)->m_returnVals, name, v);
+}
+
+static Bool
+ContextGetNamedReturnVal(void* contextHandle,   // IN
+                         int index,             // IN
+                         char* name,            // OUT
+                         int nameSize,          // IN
+                         VDP_RPC_VARIANT* v)    // OUT
+{
+   return GetFrom(((LoopbackContext*)contextHandle)->m_returnVals, index,
+                  name, nameSize, v);
+}
+
+static bool
+VariantIsTrue(const VDP_RPC_VARIANT* v)   // IN
+{
+   if (v == NULL) {
+      return false;
+   }
+
+   switch (VariantValueSize(v->vt)) {
+   case 1:
+      return v->cVal != 0;
+   case 2:
+      return v->uiVal != 0;
+   case 4:
+      return v->ulVal != 0;
+   case 8:
+      return v->ullVal != 0;
+   default:
+      return false;
+   }
+}
+
+static Bool
+ContextSetOps(void* contextHandle,          // IN
+              VDPRPC_ChannelContextOps op,  // IN
+              const VDP_RPC_VARIANT* v)     // IN
+{
+   LoopbackContext* ctx = (LoopbackContext*)contextHandle;
+
+   switch (op) {
+   case VDP_RPC_CHANNEL_CONTEXT_OPT_POST:
+      ctx->m_post = VariantIsTrue(v);
+      return TRUE;
+
+   case VDP_RPC_CHANNEL_CONTEXT_OPT_BEGIN_ASYNC_RESULT:
+      if (!ctx->m_received || ctx->m_post) {
+         return FALSE;
+      }
+      ctx->m_async = true;
+      return TRUE;
+
+   case VDP_RPC_CHANNEL_CONTEXT_OPT_END_ASYNC_RESULT:
+      if (!ctx->m_async) {
+         return FALSE;
+      }
+      ctx->m_object->m_endpoint->Reply(ctx);
+      return TRUE;
+
+   default:
+      return FALSE;
+   }
+}
+
+
+/*
+ * The variant interface.
+ */
+
+static Bool
+VariantInit(VDP_RPC_VARIANT* v)   // OUT
+{
+   memset(v, 0, sizeof *v);
+   v->vt = VDP_RPC_VT_EMPTY;
+   return TRUE;
+}
+
+static Bool
+VariantCopy(VDP_RPC_VARIANT* target,       // OUT
+            const VDP_RPC_VARIANT* src)    // IN
+{
+   return LoopbackVariantCopy(target, src);
+}
+
+static Bool
+VariantClear(VDP_RPC_VARIANT* v)   // IN/OUT
+{
+   LoopbackVariantClear(v);
+   return TRUE;
+}
+
+#define LOOPBACK_VARIANT_FROM(_name, _type, _vt, _member)      \
+   static Bool                                                 \
+   VariantFrom##_name(VDP_RPC_VARIANT* v, _type value)         \
+   {                                                           \
+      VariantInit(v);                                          \
+      v->vt = _vt;                                             \
+      v->_member = value;                                      \
+      return TRUE;                                             \
+   }
+
+LOOPBACK_VARIANT_FROM(Char,   char,           VDP_RPC_VT_I1,  cVal)
+LOOPBACK_VARIANT_FROM(Short,  short,          VDP_RPC_VT_I2,  iVal)
+LOOPBACK_VARIANT_FROM(UShort, unsigned short, VDP_RPC_VT_UI2, uiVal)
+LOOPBACK_VARIANT_FROM(Int32,  int32,          VDP_RPC_VT_I4,  lVal)
+LOOPBACK_VARIANT_FROM(UInt32, uint32,         VDP_RPC_VT_UI4, ulVal)
+LOOPBACK_VARIANT_FROM(Int64,  int64,          VDP_RPC_VT_I8,  llVal)
+LOOPBACK_VARIANT_FROM(UInt64, uint64,         VDP_RPC_VT_UI8, ullVal)
+LOOPBACK_VARIANT_FROM(Float,  float,          VDP_RPC_VT_R4,  fVal)
+LOOPBACK_VARIANT_FROM(Double, double,         VDP_RPC_VT_R8,  dVal)
+
+static Bool
+VariantFromStr(VDP_RPC_VARIANT* v,   // OUT
+               const char* str)      // IN
+{
+   VDP_RPC_VARIANT src;
+
+   VariantInit(&src);
+   src.vt = VDP_RPC_VT_LPSTR;
+   src.strVal = (char*)str;
+   return LoopbackVariantCopy(v, &src);
+}
+
+static Bool
+VariantFromBlob(VDP_RPC_VARIANT* v,          // OUT
+                const VDP_RPC_BLOB* blob)    // IN
+{
+   VDP_RPC_VARIANT src;
+
+   if (blob == NULL) {
+      return FALSE;
+   }
+
+   VariantInit(&src);
+   src.vt = VDP_RPC_VT_BLOB;
+   src.blobVal = *blob;
+   return LoopbackVariantCopy(v, &src);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackContextQueryInterface --
+ *
+ *    Fills the channel context and variant interfaces.
+ *
+ * Results:
+ *    false if <iid> is none of them.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackContextQueryInterface(const GUID* iid,   // IN
+                              void* iface)       // OUT
+{
+   uint32 version = 0;
+
+   if (LoopbackIsGuid(iid, &GUID_VDPRPC_ChannelContextInterface_V1)) {
+      version = VDP_RPC_CHANNEL_CONTEXT_INTERFACE_V1;
+   } else if (LoopbackIsGuid(iid, &GUID_VDPRPC_ChannelContextInterface_V2)) {
+      version = VDP_RPC_CHANNEL_CONTEXT_INTERFACE_V2;
+   }
+
+   if (version != 0) {
+      VDPRPC_ChannelContextInterface* ctx = (VDPRPC_ChannelContextInterface*)iface;
+
+      memset(ctx, 0, sizeof *ctx);
+      ctx->version = version;
+      ctx->v1.GetId = ContextGetId;
+      ctx->v1.GetCommand = ContextGetCommand;
+      ctx->v1.SetCommand = ContextSetCommand;
+      ctx->v1.GetNamedCommand = ContextGetNamedCommand;
+      ctx->v1.SetNamedCommand = ContextSetNamedCommand;
+      ctx->v1.GetParamCount = ContextGetParamCount;
+      ctx->v1.AppendParam = ContextAppendParam;
+      ctx->v1.GetParam = ContextGetParam;
+      ctx->v1.AppendNamedParam = ContextAppendNamedParam;
+      ctx->v1.GetNamedParam = ContextGetNamedParam;
+      ctx->v1.GetReturnCode = ContextGetReturnCode;
+      ctx->v1.SetReturnCode = ContextSetReturnCode;
+      ctx->v1.GetReturnValCount = ContextGetReturnValCount;
+      ctx->v1.AppendReturnVal = ContextAppendReturnVal;
+      ctx->v1.GetReturnVal = ContextGetReturnVal;
+      ctx->v1.AppendNamedReturnVal = ContextAppendNamedReturnVal;
+      ctx->v1.GetNamedReturnVal = ContextGetNamedReturnVal;
+      ctx->v2.SetOps = ContextSetOps;
+      return true;
+   }
+
+   if (LoopbackIsGuid(iid, &GUID_VDPRPC_VariantInterface_V1)) {
+      VDPRPC_VariantInterface* variant = (VDPRPC_VariantInterface*)iface;
+
+      memset(variant, 0, sizeof *variant);
+      variant->version = VDP_RPC_VARIANT_INTERFACE_V1;
+      variant->v1.VariantInit = VariantInit;
+      variant->v1.VariantCopy = VariantCopy;
+      variant->v1.VariantClear = VariantClear;
+      variant->v1.VariantFromChar = VariantFromChar;
+      variant->v1.VariantFromShort = VariantFromShort;
+      variant->v1.VariantFromUShort = VariantFromUShort;
+      variant->v1.VariantFromInt32 = VariantFromInt32;
+      variant->v1.VariantFromUInt32 = VariantFromUInt32;
+      variant->v1.VariantFromInt64 = VariantFromInt64;
+      variant->v1.VariantFromUInt64 = VariantFromUInt64;
+      variant->v1.VariantFromFloat = VariantFromFloat;
+      variant->v1.VariantFromDouble = VariantFromDouble;
+      variant->v1.VariantFromStr = VariantFromStr;
+      variant->v1.VariantFromBlob = VariantFromBlob;
+      return true;
+   }
+
+   return false;
+}
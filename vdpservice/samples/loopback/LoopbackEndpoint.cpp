@@ -0,0 +1,2322 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackEndpoint.cpp --
+ *
+ *    The two ends of a connection, their channel objects and the
+ *    channel object interface.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackService.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackLink::Deliver --
+ *
+ *    Hands a frame to the endpoint it is for.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The endpoint owns the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackLink::Deliver(const std::shared_ptr<LoopbackEndpoint>& to,  // IN
+                      LoopbackFrame* frame)                         // IN
+{
+   to->Receive(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackObject::LoopbackObject --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackObject::LoopbackObject(LoopbackEndpoint* endpoint,            // IN
+                               const char* name,                      // IN
+                               const VDPRPC_ObjectNotifySink* sink,   // IN
+                               void* userData,                        // IN
+                               uint32 flags)                          // IN
+   : m_endpoint(endpoint),
+     m_name(name),
+     m_userData(userData),
+     m_flags(flags),
+     m_peerFlags(0),
+     m_state(VDP_RPC_OBJ_PENDING),
+     m_closed(false),
+     m_sideRequested(0),
+     m_peerSideRequested(0),
+     m_sideChannel(0)
+{
+   if (sink != NULL) {
+      m_sink = *sink;
+   } else {
+      memset(&m_sink, 0, sizeof m_sink);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackObject::~LoopbackObject --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackObject::~LoopbackObject()
+{
+   if (m_stream) {
+      m_stream->Close();
+   }
+
+   for (auto it = m_inFlight.begin(); it != m_inFlight.end(); ++it) {
+      delete it->second.ctx;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackObject::GetOptions --
+ *
+ *    The options both ends of the object support.  The payloads of
+ *    contexts that ask for compression are compressed, see
+ *    LoopbackContext, none are encrypted.
+ *
+ * Results:
+ *    VDP_RPC_COMP_* and VDP_RPC_CRYPTO_* bits.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+LoopbackObject::GetOptions() const
+{
+   uint32 common = m_flags & m_peerFlags;
+   uint32 options = 0;
+
+   if ((common & VDP_RPC_OBJ_SUPPORT_COMPRESSION) != 0) {
+      options |= VDP_RPC_COMP_SNAPPY | VDP_RPC_COMP_ZLIB;
+   }
+
+   if ((common & VDP_RPC_OBJ_SUPPORT_ENCRYPTION) != 0) {
+      options |= VDP_RPC_CRYPTO_AES;
+   }
+
+   return options;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::LoopbackEndpoint --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackEndpoint::LoopbackEndpoint(unsigned long sid,    // IN
+                                   const char* token,    // IN
+                                   bool isServer)        // IN
+   : m_sid(sid),
+     m_token(token),
+     m_isServer(isServer),
+     m_dispatching(false),
+     m_closed(false),
+     m_generation(0),
+     m_connectionState(VDP_SERVICE_CONN_CONNECTED),
+     m_connectRequested(false),
+     m_peerConnectRequested(false),
+     m_channelState(VDP_SERVICE_CHAN_DISCONNECTED),
+     m_streams(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::~LoopbackEndpoint --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackEndpoint::~LoopbackEndpoint()
+{
+   for (size_t i = 0; i < m_frames.size(); i++) {
+      delete m_frames[i];
+   }
+
+   for (size_t i = 0; i < m_objects.size(); i++) {
+      delete m_objects[i];
+   }
+
+   for (size_t i = 0; i < m_deadObjects.size(); i++) {
+      delete m_deadObjects[i];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::SetPeer --
+ *
+ *    Sets the other end of the connection and the link to it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::SetPeer(const std::shared_ptr<LoopbackEndpoint>& peer,  // IN
+                          const std::shared_ptr<LoopbackLink>& link)      // IN
+{
+   m_peer = peer;
+   m_link = link;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::RegisterSink --
+ *
+ *    Adds a channel notification sink.
+ *
+ * Results:
+ *    false if a parameter is missing or the endpoint is closed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::RegisterSink(const VDPService_ChannelNotifySink* sink,  // IN
+                               void* userData,                            // IN
+                               uint32* sinkHandle)                        // OUT
+{
+   if (sink == NULL || sinkHandle == NULL) {
+      return false;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if (m_closed) {
+      return false;
+   }
+
+   LoopbackSink s;
+   s.handle = LoopbackService::NewSinkHandle();
+   s.sink = *sink;
+   s.userData = userData;
+   m_sinks.push_back(s);
+
+   *sinkHandle = s.handle;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::UnregisterSink --
+ *
+ *    Removes a channel notification sink, it is not called any more
+ *    once this returns.
+ *
+ * Results:
+ *    false if the handle is not registered.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::UnregisterSink(uint32 sinkHandle)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   for (size_t i = 0; i < m_sinks.size(); i++) {
+      if (m_sinks[i].handle == sinkHandle) {
+         m_sinks.erase(m_sinks.begin() + i);
+         return true;
+      }
+   }
+
+   return false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Connect --
+ *
+ *    Asks for the channel, it is connected once both ends asked.
+ *
+ * Results:
+ *    false if the endpoint is closed.
+ *
+ * Side Effects:
+ *    OnChannelStateChanged() is fired from Poll() when connected.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::Connect()
+{
+   bool connected;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed) {
+         return false;
+      }
+
+      m_connectRequested = true;
+      connected = m_peerConnectRequested;
+   }
+
+   if (connected) {
+      LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_CHANNEL_STATE, "");
+      frame->value = VDP_SERVICE_CHAN_CONNECTED;
+      Queue(frame);
+   }
+
+   Send(NewFrame(LOOPBACK_FRAME_CONNECT, ""));
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Disconnect --
+ *
+ *    Drops the channel.  The objects are closed without further
+ *    callbacks, their outstanding requests are dropped.
+ *
+ * Results:
+ *    true.
+ *
+ * Side Effects:
+ *    OnChannelStateChanged() is fired from Poll() if it was connected.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::Disconnect()
+{
+   std::vector<LoopbackRequest> requests;
+   std::vector<std::shared_ptr<LoopbackStream> > streams;
+   std::vector<std::string> names;
+   bool wasConnected;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed || !m_connectRequested) {
+         return true;
+      }
+
+      m_connectRequested = false;
+      m_peerConnectRequested = false;
+      wasConnected = m_channelState == VDP_SERVICE_CHAN_CONNECTED;
+      m_channelState = VDP_SERVICE_CHAN_DISCONNECTED;
+
+      while (!m_objects.empty()) {
+         names.push_back(m_objects.front()->m_name);
+         CloseObject(m_objects.front(), &requests, &streams);
+      }
+      m_peerObjects.clear();
+   }
+
+   for (size_t i = 0; i < requests.size(); i++) {
+      delete requests[i].ctx;
+   }
+
+   for (size_t i = 0; i < streams.size(); i++) {
+      streams[i]->Close();
+   }
+
+   for (size_t i = 0; i < names.size(); i++) {
+      Send(NewFrame(LOOPBACK_FRAME_OBJECT_DESTROYED, names[i]));
+   }
+   Send(NewFrame(LOOPBACK_FRAME_DISCONNECT, ""));
+
+   if (wasConnected) {
+      LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_CHANNEL_STATE, "");
+      frame->value = VDP_SERVICE_CHAN_DISCONNECTED;
+      Queue(frame);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Drop --
+ *
+ *    Loses the connection as a network failure would: the objects are
+ *    closed without further callbacks, what is queued or still on the
+ *    link is lost and the channel is down.  Restore() brings the
+ *    connection back, the channel has to be connected again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    OnConnectionStateChanged() is fired from Poll().
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Drop()
+{
+   std::vector<LoopbackRequest> requests;
+   std::vector<std::shared_ptr<LoopbackStream> > streams;
+   std::deque<LoopbackFrame*> frames;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed) {
+         return;
+      }
+
+      m_generation++;
+      m_connectionState = VDP_SERVICE_CONN_DISCONNECTED;
+      m_connectRequested = false;
+      m_peerConnectRequested = false;
+      m_channelState = VDP_SERVICE_CHAN_DISCONNECTED;
+
+      while (!m_objects.empty()) {
+         CloseObject(m_objects.front(), &requests, &streams);
+      }
+      m_peerObjects.clear();
+      m_frames.swap(frames);
+   }
+
+   for (size_t i = 0; i < requests.size(); i++) {
+      delete requests[i].ctx;
+   }
+
+   for (size_t i = 0; i < streams.size(); i++) {
+      streams[i]->Close();
+   }
+
+   for (size_t i = 0; i < frames.size(); i++) {
+      delete frames[i];
+   }
+
+   LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_CONNECTION_STATE, "");
+   frame->value = VDP_SERVICE_CONN_DISCONNECTED;
+   Queue(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Restore --
+ *
+ *    Brings back the connection lost by Drop().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    OnConnectionStateChanged() is fired from Poll().
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Restore()
+{
+   LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_CONNECTION_STATE, "");
+   frame->value = VDP_SERVICE_CONN_CONNECTED;
+   Queue(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::GetConnectionState --
+ *
+ *    The peer is in the same process, the connection is there until the
+ *    session is closed or Drop() loses it.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VDPService_ConnectionState
+LoopbackEndpoint::GetConnectionState()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_closed ? VDP_SERVICE_CONN_DISCONNECTED : m_connectionState;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::GetChannelState --
+ *
+ *    The state of the channel.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VDPService_ChannelState
+LoopbackEndpoint::GetChannelState()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if (m_channelState != VDP_SERVICE_CHAN_CONNECTED && m_connectRequested) {
+      return VDP_SERVICE_CHAN_PENDING;
+   }
+
+   return m_channelState;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::SwitchToStreamDataMode --
+ *
+ *    Moves the object <objectName>, connected over a TCP side channel,
+ *    to stream data mode.
+ *
+ * Results:
+ *    false if the object is not on a TCP side channel.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::SwitchToStreamDataMode(const char* objectName,   // IN
+                                         int* fd)                  // OUT
+{
+   FUNCTION_TRACE;
+
+   if (objectName == NULL || fd == NULL) {
+      FUNCTION_EXIT_MSG("Invalid parameter");
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      LoopbackObject* object = FindObject(objectName);
+      if (object == NULL ||
+          object->m_state != VDP_RPC_OBJ_SIDE_CHANNEL_CONNECTED ||
+          object->m_sideChannel != VDP_RPC_SIDE_CHANNEL_TYPE_TCP) {
+         FUNCTION_EXIT_MSG("\"%s\" is not on a TCP side channel", objectName);
+         return false;
+      }
+
+      if (object->m_stream) {
+         *fd = object->m_stream->AppFd();
+         return true;
+      }
+   }
+
+   std::shared_ptr<LoopbackStream> stream =
+      std::make_shared<LoopbackStream>(shared_from_this(), objectName);
+
+   if (!stream->Open()) {
+      FUNCTION_EXIT_MSG("Cannot open the stream");
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      LoopbackObject* object = FindObject(objectName);
+      if (object == NULL || object->m_stream) {
+         stream->Close();
+         FUNCTION_EXIT_MSG("\"%s\" changed meanwhile", objectName);
+         return false;
+      }
+
+      object->m_stream = stream;
+      m_streams++;
+   }
+
+   LoopbackService::Get()->AddStream(stream->AppFd(), stream);
+   *fd = stream->AppFd();
+
+   FUNCTION_EXIT_MSG("\"%s\" fd %d", objectName, *fd);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::CreateObject --
+ *
+ *    Creates a channel object, it connects once the peer has one of
+ *    the same name.
+ *
+ * Results:
+ *    false if the channel is not connected or the object exists.
+ *
+ * Side Effects:
+ *    The peer is told about the object.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::CreateObject(const char* name,                       // IN
+                               const VDPRPC_ObjectNotifySink* sink,    // IN
+                               void* userData,                         // IN
+                               uint32 flags,                           // IN
+                               LoopbackObject** object)                // OUT
+{
+   LoopbackObject* created;
+   bool peerCreated;
+
+   if (name == NULL || object == NULL) {
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed || m_channelState != VDP_SERVICE_CHAN_CONNECTED) {
+         LOG("Error: cannot create \"%s\", the channel is not connected.", name);
+         return false;
+      }
+
+      if (FindObject(name) != NULL) {
+         LOG("Error: object \"%s\" already exists.", name);
+         return false;
+      }
+
+      created = new LoopbackObject(this, name, sink, userData, flags);
+      m_objects.push_back(created);
+      peerCreated = m_peerObjects.find(name) != m_peerObjects.end();
+   }
+
+   /*
+    * Our own CONNECTED goes first, the peer may answer OBJECT_CREATED
+    * with a request that must not overtake it.
+    */
+   LoopbackFrame* frame;
+   if (peerCreated) {
+      frame = NewFrame(LOOPBACK_FRAME_OBJECT_STATE, name);
+      frame->value = VDP_RPC_OBJ_CONNECTED;
+      Queue(frame);
+   }
+
+   frame = NewFrame(LOOPBACK_FRAME_OBJECT_CREATED, name);
+   frame->value = (int32)flags;
+   Send(frame);
+
+   *object = created;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::DestroyObject --
+ *
+ *    Destroys a channel object.  Its outstanding requests are dropped
+ *    without callbacks, the handle stays valid.
+ *
+ * Results:
+ *    true.
+ *
+ * Side Effects:
+ *    The peer object is disconnected.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::DestroyObject(LoopbackObject* object)  // IN
+{
+   std::vector<LoopbackRequest> requests;
+   std::vector<std::shared_ptr<LoopbackStream> > streams;
+   std::string name;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (object->m_closed) {
+         return true;
+      }
+
+      name = object->m_name;
+      CloseObject(object, &requests, &streams);
+   }
+
+   for (size_t i = 0; i < requests.size(); i++) {
+      delete requests[i].ctx;
+   }
+
+   for (size_t i = 0; i < streams.size(); i++) {
+      streams[i]->Close();
+   }
+
+   Send(NewFrame(LOOPBACK_FRAME_OBJECT_DESTROYED, name));
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::RequestSideChannel --
+ *
+ *    Moves a connected object to a side channel, which connects once
+ *    both ends asked for the same type.
+ *
+ * Results:
+ *    false if the object is not connected.
+ *
+ * Side Effects:
+ *    The object goes through SIDE_CHANNEL_PENDING.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::RequestSideChannel(LoopbackObject* object,        // IN
+                                     VDPRPC_SideChannelType type)   // IN
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (object->m_closed || object->m_state != VDP_RPC_OBJ_CONNECTED) {
+         LOG("Error: \"%s\" is not connected.", object->m_name.c_str());
+         return false;
+      }
+   }
+
+   LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_OBJECT_STATE, object->m_name);
+   frame->value = VDP_RPC_OBJ_SIDE_CHANNEL_PENDING;
+   frame->sideChannel = type;
+   Queue(frame);
+
+   frame = NewFrame(LOOPBACK_FRAME_SIDE_CHANNEL, object->m_name);
+   frame->value = type;
+   Send(frame);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Invoke --
+ *
+ *    Sends a request to the peer object.
+ *
+ * Results:
+ *    false if the object is not connected, the caller keeps <ctx>.
+ *
+ * Side Effects:
+ *    On success the endpoint owns <ctx>, OnDone() or OnAbort() of
+ *    <callback> is fired from Poll().
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::Invoke(LoopbackObject* object,                  // IN
+                         LoopbackContext* ctx,                    // IN
+                         const VDPRPC_RequestCallback* callback,  // IN
+                         void* userData)                          // IN
+{
+   LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_INVOKE, object->m_name);
+   frame->id = ctx->m_id;
+   ctx->EncodeInvoke(&frame->data);
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      int state = object->m_state;
+      if (object->m_closed ||
+          (state != VDP_RPC_OBJ_CONNECTED &&
+           state != VDP_RPC_OBJ_SIDE_CHANNEL_PENDING &&
+           state != VDP_RPC_OBJ_SIDE_CHANNEL_CONNECTED)) {
+         delete frame;
+         return false;
+      }
+
+      LoopbackRequest request;
+      request.ctx = ctx;
+      request.userData = userData;
+      if (callback != NULL) {
+         request.callback = *callback;
+      } else {
+         memset(&request.callback, 0, sizeof request.callback);
+      }
+
+      object->m_inFlight[ctx->m_id] = request;
+      frame->sideChannel = object->m_sideChannel;
+   }
+
+   bool post = ctx->m_post;
+   uint32 id = ctx->m_id;
+
+   Send(frame);
+
+   if (post) {
+      frame = NewFrame(LOOPBACK_FRAME_POSTED, object->m_name);
+      frame->id = id;
+      Queue(frame);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Reply --
+ *
+ *    Sends the return values of a request received from the peer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    <ctx> is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Reply(LoopbackContext* ctx)   // IN
+{
+   LoopbackFrame* frame = NewFrame(LOOPBACK_FRAME_REPLY, ctx->m_object->m_name);
+
+   frame->id = ctx->m_id;
+   frame->sideChannel = ctx->m_object->m_sideChannel;
+   ctx->EncodeReply(&frame->data);
+   delete ctx;
+
+   Send(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::GetObjectStateByName --
+ *
+ *    The state of an object of this endpoint.
+ *
+ * Results:
+ *    See above, VDP_RPC_OBJ_UNINITIALIZED if there is none.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VDPRPC_ObjectState
+LoopbackEndpoint::GetObjectStateByName(const char* name)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   LoopbackObject* object = FindObject(name);
+   return object != NULL ? (VDPRPC_ObjectState)(int)object->m_state :
+                           VDP_RPC_OBJ_UNINITIALIZED;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Send --
+ *
+ *    Sends a frame to the peer over the link.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The link owns the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Send(LoopbackFrame* frame)  // IN
+{
+   std::shared_ptr<LoopbackEndpoint> peer = m_peer.lock();
+
+   if (!peer || !m_link) {
+      delete frame;
+      return;
+   }
+
+   m_link->Send(peer, frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Receive --
+ *
+ *    Takes a frame from the link, callable from any thread.  Requests
+ *    for an object in stream data mode go to its stream right away,
+ *    the others wait for Poll().  A frame sent before the connection
+ *    dropped is lost.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The endpoint owns the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Receive(LoopbackFrame* frame)  // IN
+{
+   if (frame->generation != m_generation) {
+      delete frame;
+      return;
+   }
+
+   if (frame->type == LOOPBACK_FRAME_INVOKE && m_streams > 0 &&
+       ReceiveStream(frame)) {
+      return;
+   }
+
+   Queue(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::ReceiveStream --
+ *
+ *    Writes a request for an object in stream data mode to its stream,
+ *    as vdpService does not process them in that mode.
+ *
+ * Results:
+ *    false if the object is not in stream data mode.
+ *
+ * Side Effects:
+ *    The frame is consumed if true is returned.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::ReceiveStream(LoopbackFrame* frame)  // IN
+{
+   std::shared_ptr<LoopbackStream> stream;
+   LoopbackObject* object;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      object = FindObject(frame->object);
+      if (object == NULL || !object->m_stream) {
+         return false;
+      }
+      stream = object->m_stream;
+   }
+
+   LoopbackContext ctx(object, frame->id, 0);
+   if (ctx.DecodeInvoke(frame->data)) {
+      stream->Write(&ctx);
+
+      if (!ctx.m_post) {
+         LoopbackFrame* reply = NewFrame(LOOPBACK_FRAME_REPLY, frame->object);
+         reply->id = frame->id;
+         reply->sideChannel = frame->sideChannel;
+         ctx.EncodeReply(&reply->data);
+         Send(reply);
+      }
+   }
+
+   delete frame;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Dispatch --
+ *
+ *    Handles the frames received so far, firing the callbacks.  Only one
+ *    thread dispatches an endpoint at a time, a thread that finds it
+ *    busy leaves the frames to the one dispatching.
+ *
+ * Results:
+ *    true if any frame was handled.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackEndpoint::Dispatch()
+{
+   bool worked = false;
+
+   for (;;) {
+      if (m_dispatching.exchange(true)) {
+         return worked;
+      }
+
+      for (;;) {
+         LoopbackFrame* frame;
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_frames.empty()) {
+               break;
+            }
+            frame = m_frames.front();
+            m_frames.pop_front();
+         }
+
+         HandleFrame(frame);
+         worked = true;
+      }
+
+      m_dispatching = false;
+
+      /*
+       * A frame queued while the flag was being cleared was left to us.
+       */
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_frames.empty()) {
+         return worked;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Bind --
+ *
+ *    Remembers an apartment dispatching this endpoint, to wake it up.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Bind(const std::shared_ptr<LoopbackApartment>& apartment)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   for (size_t i = 0; i < m_apartments.size(); i++) {
+      if (m_apartments[i].lock() == apartment) {
+         return;
+      }
+   }
+
+   m_apartments.push_back(apartment);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Unbind --
+ *
+ *    Forgets an apartment.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Unbind(const LoopbackApartment* apartment)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   for (size_t i = 0; i < m_apartments.size(); ) {
+      std::shared_ptr<LoopbackApartment> a = m_apartments[i].lock();
+      if (!a || a.get() == apartment) {
+         m_apartments.erase(m_apartments.begin() + i);
+      } else {
+         i++;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::FirstApartment --
+ *
+ *    The apartment this endpoint was first bound to and still is.
+ *
+ * Results:
+ *    See above, empty if there is none.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::shared_ptr<LoopbackApartment>
+LoopbackEndpoint::FirstApartment()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   for (size_t i = 0; i < m_apartments.size(); i++) {
+      std::shared_ptr<LoopbackApartment> a = m_apartments[i].lock();
+      if (a) {
+         return a;
+      }
+   }
+
+   return std::shared_ptr<LoopbackApartment>();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Close --
+ *
+ *    Shuts the endpoint down when its session is closed.  No callback
+ *    is fired from it any more.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The endpoint is unbound from its apartments.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Close()
+{
+   std::vector<LoopbackRequest> requests;
+   std::vector<std::shared_ptr<LoopbackStream> > streams;
+   std::vector<std::weak_ptr<LoopbackApartment> > apartments;
+   std::deque<LoopbackFrame*> frames;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed) {
+         return;
+      }
+      m_closed = true;
+
+      while (!m_objects.empty()) {
+         CloseObject(m_objects.front(), &requests, &streams);
+      }
+
+      m_sinks.clear();
+      m_frames.swap(frames);
+      m_apartments.swap(apartments);
+   }
+
+   for (size_t i = 0; i < requests.size(); i++) {
+      delete requests[i].ctx;
+   }
+
+   for (size_t i = 0; i < streams.size(); i++) {
+      streams[i]->Close();
+   }
+
+   for (size_t i = 0; i < frames.size(); i++) {
+      delete frames[i];
+   }
+
+   for (size_t i = 0; i < apartments.size(); i++) {
+      std::shared_ptr<LoopbackApartment> apartment = apartments[i].lock();
+      if (apartment) {
+         apartment->Unbind(this);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::Queue --
+ *
+ *    Queues a frame for Poll().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The apartments of the endpoint are woken up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::Queue(LoopbackFrame* frame)  // IN
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_closed) {
+         delete frame;
+         return;
+      }
+      m_frames.push_back(frame);
+   }
+
+   WakeApartments();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::WakeApartments --
+ *
+ *    Wakes up the apartments dispatching this endpoint.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::WakeApartments()
+{
+   std::vector<std::shared_ptr<LoopbackApartment> > apartments;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (size_t i = 0; i < m_apartments.size(); i++) {
+         std::shared_ptr<LoopbackApartment> a = m_apartments[i].lock();
+         if (a) {
+            apartments.push_back(a);
+         }
+      }
+   }
+
+   for (size_t i = 0; i < apartments.size(); i++) {
+      apartments[i]->Wake();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::NewFrame --
+ *
+ *    Allocates a frame.
+ *
+ * Results:
+ *    The frame.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackFrame*
+LoopbackEndpoint::NewFrame(LoopbackFrameType type,       // IN
+                           const std::string& object)    // IN
+{
+   LoopbackFrame* frame = new LoopbackFrame();
+
+   frame->type = type;
+   frame->object = object;
+   frame->id = 0;
+   frame->value = 0;
+   frame->generation = m_generation;
+   frame->sideChannel = 0;
+   return frame;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::FindObject --
+ *
+ *    Looks up a live object by name, the lock must be held.
+ *
+ * Results:
+ *    The object or NULL.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackObject*
+LoopbackEndpoint::FindObject(const std::string& name)  // IN
+{
+   for (size_t i = 0; i < m_objects.size(); i++) {
+      if (m_objects[i]->m_name == name) {
+         return m_objects[i];
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::CloseObject --
+ *
+ *    Marks an object closed and takes what it holds, the lock must be
+ *    held.  The caller frees the requests and closes the streams once
+ *    the lock is released.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::CloseObject(LoopbackObject* object,                                 // IN
+                              std::vector<LoopbackRequest>* requests,                 // OUT
+                              std::vector<std::shared_ptr<LoopbackStream> >* streams) // OUT
+{
+   object->m_closed = true;
+   object->m_state = VDP_RPC_OBJ_DISCONNECTED;
+
+   for (auto it = object->m_inFlight.begin(); it != object->m_inFlight.end(); ++it) {
+      requests->push_back(it->second);
+   }
+   object->m_inFlight.clear();
+
+   if (object->m_stream) {
+      streams->push_back(object->m_stream);
+      object->m_stream.reset();
+      m_streams--;
+   }
+
+   for (size_t i = 0; i < m_objects.size(); i++) {
+      if (m_objects[i] == object) {
+         m_objects.erase(m_objects.begin() + i);
+         break;
+      }
+   }
+
+   m_deadObjects.push_back(object);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::HandleFrame --
+ *
+ *    Handles one frame.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The frame is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::HandleFrame(LoopbackFrame* frame)  // IN
+{
+   switch (frame->type) {
+   case LOOPBACK_FRAME_CONNECT:
+      OnConnect();
+      break;
+   case LOOPBACK_FRAME_DISCONNECT:
+      OnDisconnect();
+      break;
+   case LOOPBACK_FRAME_OBJECT_CREATED:
+      OnObjectCreated(frame);
+      break;
+   case LOOPBACK_FRAME_OBJECT_DESTROYED:
+      OnObjectDestroyed(frame);
+      break;
+   case LOOPBACK_FRAME_SIDE_CHANNEL:
+      OnSideChannel(frame);
+      break;
+   case LOOPBACK_FRAME_INVOKE:
+      OnInvoke(frame);
+      break;
+   case LOOPBACK_FRAME_REPLY:
+   case LOOPBACK_FRAME_ABORT:
+   case LOOPBACK_FRAME_POSTED:
+      OnReply(frame);
+      break;
+   case LOOPBACK_FRAME_CONNECTION_STATE:
+      OnConnectionState((VDPService_ConnectionState)frame->value);
+      break;
+   case LOOPBACK_FRAME_CHANNEL_STATE:
+      OnChannelState((VDPService_ChannelState)frame->value);
+      break;
+   case LOOPBACK_FRAME_OBJECT_STATE:
+      OnObjectState(frame);
+      break;
+   }
+
+   delete frame;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnConnect --
+ *
+ *    The peer asked for the channel.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnConnect()
+{
+   bool connected = false;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_peerConnectRequested = true;
+      if (m_connectRequested && m_channelState != VDP_SERVICE_CHAN_CONNECTED) {
+         m_channelState = VDP_SERVICE_CHAN_CONNECTED;
+         connected = true;
+      }
+   }
+
+   if (connected) {
+      NotifyChannelState(VDP_SERVICE_CHAN_CONNECTED);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnDisconnect --
+ *
+ *    The peer dropped the channel, its objects are already gone.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnDisconnect()
+{
+   bool wasConnected;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_connectRequested = false;
+      m_peerConnectRequested = false;
+      wasConnected = m_channelState == VDP_SERVICE_CHAN_CONNECTED;
+      m_channelState = VDP_SERVICE_CHAN_DISCONNECTED;
+      m_peerObjects.clear();
+   }
+
+   if (wasConnected) {
+      NotifyChannelState(VDP_SERVICE_CHAN_DISCONNECTED);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnConnectionState --
+ *
+ *    A connection state change of our own, see Drop() and Restore().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnConnectionState(VDPService_ConnectionState state)  // IN
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_connectionState = state;
+   }
+
+   NotifyConnectionState(state);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnChannelState --
+ *
+ *    A channel state change of our own, see Connect() and Disconnect().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnChannelState(VDPService_ChannelState state)  // IN
+{
+   if (state == VDP_SERVICE_CHAN_CONNECTED) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (!m_connectRequested || !m_peerConnectRequested ||
+          m_channelState == VDP_SERVICE_CHAN_CONNECTED) {
+         return;
+      }
+      m_channelState = VDP_SERVICE_CHAN_CONNECTED;
+   }
+
+   NotifyChannelState(state);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnObjectCreated --
+ *
+ *    The peer created an object, ours of the same name connects.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnObjectCreated(const LoopbackFrame* frame)  // IN
+{
+   LoopbackObject* object;
+   bool connected = false;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_peerObjects[frame->object] = (uint32)frame->value;
+      object = FindObject(frame->object);
+      if (object != NULL) {
+         object->m_peerFlags = (uint32)frame->value;
+         if (object->m_state == VDP_RPC_OBJ_PENDING) {
+            object->m_state = VDP_RPC_OBJ_CONNECTED;
+            connected = true;
+         }
+      }
+   }
+
+   if (connected) {
+      NotifyObjectState(object);
+   } else if (object == NULL) {
+      NotifyPeerObject(frame->object);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnObjectDestroyed --
+ *
+ *    The peer destroyed an object, ours of the same name disconnects
+ *    and its outstanding requests are aborted.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnObjectDestroyed(const LoopbackFrame* frame)  // IN
+{
+   std::unordered_map<uint32, LoopbackRequest> requests;
+   std::shared_ptr<LoopbackStream> stream;
+   LoopbackObject* object;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_peerObjects.erase(frame->object);
+      object = FindObject(frame->object);
+      if (object == NULL) {
+         return;
+      }
+
+      requests.swap(object->m_inFlight);
+      object->m_state = VDP_RPC_OBJ_DISCONNECTED;
+      object->m_peerFlags = 0;
+      object->m_sideRequested = 0;
+      object->m_peerSideRequested = 0;
+      object->m_sideChannel = 0;
+
+      if (object->m_stream) {
+         stream = object->m_stream;
+         object->m_stream.reset();
+         m_streams--;
+      }
+   }
+
+   for (auto it = requests.begin(); it != requests.end(); ++it) {
+      LoopbackRequest& request = it->second;
+
+      if (request.callback.v1.OnAbort != NULL) {
+         request.callback.v1.OnAbort(request.userData, request.ctx->m_id, FALSE,
+                                     VDP_RPC_E_OBJECT_NOT_CONNECTED);
+      }
+      delete request.ctx;
+   }
+
+   if (stream) {
+      stream->Close();
+   }
+
+   NotifyObjectState(object);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnObjectState --
+ *
+ *    An object state change of our own, see CreateObject() and
+ *    RequestSideChannel().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnObjectState(const LoopbackFrame* frame)  // IN
+{
+   LoopbackObject* object;
+   bool sideConnected = false;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      object = FindObject(frame->object);
+      if (object == NULL) {
+         return;
+      }
+
+      if (frame->value == VDP_RPC_OBJ_CONNECTED) {
+         auto it = m_peerObjects.find(frame->object);
+         if (object->m_state != VDP_RPC_OBJ_PENDING || it == m_peerObjects.end()) {
+            return;
+         }
+         object->m_peerFlags = it->second;
+         object->m_state = VDP_RPC_OBJ_CONNECTED;
+      } else if (frame->value == VDP_RPC_OBJ_SIDE_CHANNEL_PENDING) {
+         if (object->m_state != VDP_RPC_OBJ_CONNECTED) {
+            return;
+         }
+         object->m_sideRequested = frame->sideChannel;
+         object->m_state = VDP_RPC_OBJ_SIDE_CHANNEL_PENDING;
+         sideConnected = object->m_peerSideRequested == frame->sideChannel;
+      } else {
+         return;
+      }
+   }
+
+   NotifyObjectState(object);
+
+   if (sideConnected) {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+
+         if (object->m_closed ||
+             object->m_state != VDP_RPC_OBJ_SIDE_CHANNEL_PENDING) {
+            return;
+         }
+         object->m_state = VDP_RPC_OBJ_SIDE_CHANNEL_CONNECTED;
+         object->m_sideChannel = frame->sideChannel;
+      }
+
+      NotifyObjectState(object);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnSideChannel --
+ *
+ *    The peer asked for a side channel, ours connects if we asked for
+ *    the same type.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnSideChannel(const LoopbackFrame* frame)  // IN
+{
+   LoopbackObject* object;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      object = FindObject(frame->object);
+      if (object == NULL) {
+         return;
+      }
+
+      object->m_peerSideRequested = frame->value;
+      if (object->m_sideRequested != frame->value ||
+          object->m_state != VDP_RPC_OBJ_SIDE_CHANNEL_PENDING) {
+         return;
+      }
+      object->m_state = VDP_RPC_OBJ_SIDE_CHANNEL_CONNECTED;
+      object->m_sideChannel = frame->value;
+   }
+
+   NotifyObjectState(object);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnInvoke --
+ *
+ *    A request from the peer.  It is answered once the object's
+ *    OnInvoke() returns, unless it was posted or the answer was made
+ *    asynchronous.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnInvoke(LoopbackFrame* frame)  // IN
+{
+   LoopbackObject* object;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      object = FindObject(frame->object);
+   }
+
+   if (object == NULL) {
+      LoopbackFrame* abort = NewFrame(LOOPBACK_FRAME_ABORT, frame->object);
+      abort->id = frame->id;
+      abort->value = (int32)VDP_RPC_E_OBJECT_NOT_FOUND;
+      Send(abort);
+      return;
+   }
+
+   LoopbackContext* ctx = new LoopbackContext(object, frame->id, 0);
+   if (!ctx->DecodeInvoke(frame->data)) {
+      delete ctx;
+      return;
+   }
+   ctx->m_received = true;
+
+   if (object->m_sink.v1.OnInvoke != NULL) {
+      object->m_sink.v1.OnInvoke(object->m_userData, ctx, NULL);
+   }
+
+   if (ctx->m_async) {
+      return;
+   }
+
+   if (ctx->m_post) {
+      delete ctx;
+   } else {
+      Reply(ctx);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::OnReply --
+ *
+ *    Completes a request: answered (REPLY), refused (ABORT) or, for a
+ *    posted one, sent (POSTED).
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The context of the request is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::OnReply(LoopbackFrame* frame)  // IN
+{
+   LoopbackRequest request;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      LoopbackObject* object = FindObject(frame->object);
+      if (object == NULL) {
+         return;
+      }
+
+      auto it = object->m_inFlight.find(frame->id);
+      if (it == object->m_inFlight.end()) {
+         return;
+      }
+
+      request = it->second;
+      object->m_inFlight.erase(it);
+   }
+
+   if (frame->type == LOOPBACK_FRAME_ABORT) {
+      if (request.callback.v1.OnAbort != NULL) {
+         request.callback.v1.OnAbort(request.userData, request.ctx->m_id, FALSE,
+                                     (uint32)frame->value);
+      }
+   } else {
+      if (frame->type == LOOPBACK_FRAME_REPLY) {
+         request.ctx->DecodeReply(frame->data);
+      }
+
+      if (request.callback.v1.OnDone != NULL) {
+         request.callback.v1.OnDone(request.userData, request.ctx->m_id, request.ctx);
+      }
+   }
+
+   delete request.ctx;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::NotifyConnectionState --
+ *
+ *    Fires OnConnectionStateChanged() to the sinks still registered.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::NotifyConnectionState(VDPService_ConnectionState state)  // IN
+{
+   std::vector<LoopbackSink> sinks;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      sinks = m_sinks;
+   }
+
+   for (size_t i = 0; i < sinks.size(); i++) {
+      bool registered = false;
+
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         for (size_t k = 0; k < m_sinks.size() && !registered; k++) {
+            registered = m_sinks[k].handle == sinks[i].handle;
+         }
+      }
+
+      if (registered && sinks[i].sink.v1.OnConnectionStateChanged != NULL) {
+         sinks[i].sink.v1.OnConnectionStateChanged(sinks[i].userData, state, state, NULL);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::NotifyChannelState --
+ *
+ *    Fires OnChannelStateChanged() to the sinks still registered.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::NotifyChannelState(VDPService_ChannelState state)  // IN
+{
+   std::vector<LoopbackSink> sinks;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      sinks = m_sinks;
+   }
+
+   for (size_t i = 0; i < sinks.size(); i++) {
+      bool registered = false;
+
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         for (size_t k = 0; k < m_sinks.size() && !registered; k++) {
+            registered = m_sinks[k].handle == sinks[i].handle;
+         }
+      }
+
+      if (registered && sinks[i].sink.v1.OnChannelStateChanged != NULL) {
+         sinks[i].sink.v1.OnChannelStateChanged(sinks[i].userData, state, state, NULL);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::NotifyPeerObject --
+ *
+ *    Fires OnPeerObjectCreated() to the sinks still registered.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::NotifyPeerObject(const std::string& name)  // IN
+{
+   std::vector<LoopbackSink> sinks;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      sinks = m_sinks;
+   }
+
+   for (size_t i = 0; i < sinks.size(); i++) {
+      bool registered = false;
+
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         for (size_t k = 0; k < m_sinks.size() && !registered; k++) {
+            registered = m_sinks[k].handle == sinks[i].handle;
+         }
+      }
+
+      if (registered && sinks[i].sink.v1.OnPeerObjectCreated != NULL) {
+         sinks[i].sink.v1.OnPeerObjectCreated(sinks[i].userData, name.c_str(), NULL);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackEndpoint::NotifyObjectState --
+ *
+ *    Fires OnObjectStateChanged() unless the object was destroyed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackEndpoint::NotifyObjectState(LoopbackObject* object)  // IN
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (object->m_closed) {
+         return;
+      }
+   }
+
+   if (object->m_sink.v1.OnObjectStateChanged != NULL) {
+      object->m_sink.v1.OnObjectStateChanged(object->m_userData, NULL);
+   }
+}
+
+
+/*
+ * The channel object interface.  Object handles are LoopbackObject
+ * pointers, they stay valid until their session is closed.
+ */
+
+static Bool
+ObjectCreate(const char* name,                             // IN
+             const VDPRPC_ObjectNotifySink* sink,          // IN
+             void* userData,                               // IN
+             VDPRPC_ObjectConfigurationFlags configFlags,  // IN
+             void** objectHandle)                          // OUT
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+   LoopbackObject* object = NULL;
+
+   if (!endpoint) {
+      LOG("Error: ThreadInitialize() was not called on this thread.");
+      return FALSE;
+   }
+
+   if (objectHandle == NULL ||
+       !endpoint->CreateObject(name, sink, userData, configFlags, &object)) {
+      return FALSE;
+   }
+
+   *objectHandle = object;
+   return TRUE;
+}
+
+static Bool
+ObjectDestroy(void* objectHandle)   // IN
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+   return object != NULL && object->m_endpoint->DestroyObject(object);
+}
+
+static VDPRPC_ObjectState
+ObjectGetState(void* objectHandle)   // IN
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   return object != NULL ? (VDPRPC_ObjectState)(int)object->m_state :
+                           VDP_RPC_OBJ_UNINITIALIZED;
+}
+
+static Bool
+ObjectGetName(void* objectHandle,   // IN
+              char* buffer,         // OUT
+              uint32* bufferSize)   // IN/OUT
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   if (object == NULL || bufferSize == NULL) {
+      return FALSE;
+   }
+
+   uint32 needed = (uint32)object->m_name.size() + 1;
+   if (buffer == NULL || *bufferSize < needed) {
+      *bufferSize = needed;
+      return FALSE;
+   }
+
+   memcpy(buffer, object->m_name.c_str(), needed);
+   *bufferSize = needed;
+   return TRUE;
+}
+
+static Bool
+ObjectCreateContext(void* objectHandle,       // IN
+                    void** ppcontextHandle)   // OUT
+{
+   if (objectHandle == NULL || ppcontextHandle == NULL) {
+      return FALSE;
+   }
+
+   *ppcontextHandle = new LoopbackContext((LoopbackObject*)objectHandle,
+                                          LoopbackContext::NewId(), 0);
+   return TRUE;
+}
+
+static Bool
+ObjectDestroyContext(void* contextHandle)   // IN
+{
+   delete (LoopbackContext*)contextHandle;
+   return TRUE;
+}
+
+static Bool
+ObjectInvoke(void* objectHandle,                       // IN
+             void* contextHandle,                      // IN
+             const VDPRPC_RequestCallback* callback,   // IN
+             void* userData)                           // IN
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   if (object == NULL || contextHandle == NULL) {
+      return FALSE;
+   }
+
+   return object->m_endpoint->Invoke(object, (LoopbackContext*)contextHandle,
+                                     callback, userData);
+}
+
+static Bool
+ObjectIsSideChannelAvailable(VDPRPC_SideChannelType type)   // IN
+{
+   return type == VDP_RPC_SIDE_CHANNEL_TYPE_PCOIP ||
+          type == VDP_RPC_SIDE_CHANNEL_TYPE_TCP;
+}
+
+static Bool
+ObjectRequestSideChannel(void* objectHandle,            // IN
+                         VDPRPC_SideChannelType type,   // IN
+                         const char* token)             // IN/OPT
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   if (object == NULL || !ObjectIsSideChannelAvailable(type)) {
+      return FALSE;
+   }
+
+   return object->m_endpoint->RequestSideChannel(object, type);
+}
+
+static Bool
+ObjectGetOptions(void* objectHandle,   // IN
+                 uint32* options)      // OUT
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   if (object == NULL || options == NULL) {
+      return FALSE;
+   }
+
+   *options = object->GetOptions();
+   return TRUE;
+}
+
+static Bool
+ObjectCreateContext3(void* objectHandle,       // IN
+                     uint32 options,           // IN
+                     void** ppcontextHandle)   // OUT
+{
+   LoopbackObject* object = (LoopbackObject*)objectHandle;
+
+   if (object == NULL || ppcontextHandle == NULL) {
+      return FALSE;
+   }
+
+   *ppcontextHandle = new LoopbackContext(object, LoopbackContext::NewId(),
+                                          options & object->GetOptions());
+   return TRUE;
+}
+
+static VDPRPC_ObjectState
+ObjectGetStateByName(const char* name)   // IN
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   if (!endpoint || name == NULL) {
+      return VDP_RPC_OBJ_UNINITIALIZED;
+   }
+
+   return endpoint->GetObjectStateByName(name);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackChannelObjectQueryInterface --
+ *
+ *    Fills the channel object interface.
+ *
+ * Results:
+ *    false if <iid> is not one of its versions.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackChannelObjectQueryInterface(const GUID* iid,   // IN
+                                    void* iface)       // OUT
+{
+   static const struct {
+      const GUID* iid;
+      uint32 version;
+   } objects[] = {
+      { &GUID_VDPRPC_ChannelObjectInterface_V1, VDP_RPC_CHANNEL_OBJECT_INTERFACE_V1 },
+      { &GUID_VDPRPC_ChannelObjectInterface_V2, VDP_RPC_CHANNEL_OBJECT_INTERFACE_V2 },
+      { &GUID_VDPRPC_ChannelObjectInterface_V3, VDP_RPC_CHANNEL_OBJECT_INTERFACE_V3 },
+      { &GUID_VDPRPC_ChannelObjectInterface_V4, VDP_RPC_CHANNEL_OBJECT_INTERFACE_V4 },
+   };
+
+   for (size_t i = 0; i < ARRAYSIZE(objects); i++) {
+      if (LoopbackIsGuid(iid, objects[i].iid)) {
+         VDPRPC_ChannelObjectInterface* obj = (VDPRPC_ChannelObjectInterface*)iface;
+
+         memset(obj, 0, sizeof *obj);
+         obj->version = objects[i].version;
+         obj->v1.CreateChannelObject = ObjectCreate;
+         obj->v1.DestroyChannelObject = ObjectDestroy;
+         obj->v1.GetObjectState = ObjectGetState;
+         obj->v1.GetObjectName = ObjectGetName;
+         obj->v1.CreateContext = ObjectCreateContext;
+         obj->v1.DestroyContext = ObjectDestroyContext;
+         obj->v1.Invoke = ObjectInvoke;
+         obj->v2.IsSideChannelAvailable = ObjectIsSideChannelAvailable;
+         obj->v2.RequestSideChannel = ObjectRequestSideChannel;
+         obj->v3.GetObjectOptions = ObjectGetOptions;
+         obj->v3.CreateContext = ObjectCreateContext3;
+         obj->v4.GetObjectStateByName = ObjectGetStateByName;
+         return true;
+      }
+   }
+
+   return false;
+}
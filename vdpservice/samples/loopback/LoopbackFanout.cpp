@@ -0,0 +1,384 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackFanout.cpp --
+ *
+ *    Fan-out of LoopbackPing, see LoopbackFanout.h: the pingers ping
+ *    for a while and the throughput, its fairness among the instances,
+ *    the latency and how busy the client thread was are printed for
+ *    each number of them.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackFanout.h"
+#include "LoopbackPing.h"
+#include "RPCChannelSelector.h"
+
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the numbers of pingers of -F default.
+#define LOOPBACK_FANOUT_DEFAULT     "1,2,4,8,16,32,64,128,256"
+
+// how long each number of pingers pings.
+#define LOOPBACK_FANOUT_STEP_MS     1000
+
+// the credit window of each pinger without -w.
+#define LOOPBACK_FANOUT_WINDOW      4
+
+// the client thread is saturated this busy, or once twice the pingers
+// do not get LOOPBACK_FANOUT_MIN_GAIN more through.
+#define LOOPBACK_FANOUT_BUSY        0.9
+#define LOOPBACK_FANOUT_MIN_GAIN    1.1
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackFanoutGate::LoopbackFanoutGate --
+ *
+ *    Constructor, for <parties> that arrive.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackFanoutGate::LoopbackFanoutGate(int parties)   // IN
+   : m_parties(parties),
+     m_waiting(0),
+     m_generation(0),
+     m_stopped(false)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackFanoutGate::Arrive --
+ *
+ *    Waits for the other parties to arrive as well.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The last to arrive releases all of them, the gate can be used
+ *    again afterwards.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackFanoutGate::Arrive()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   uint32 generation = m_generation;
+
+   if (++m_waiting >= m_parties) {
+      Release();
+      return;
+   }
+   m_cond.wait(lock, [this, generation] { return m_generation != generation; });
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackFanoutGate::Leave --
+ *
+ *    Leaves the gate for good, the others no longer wait for the caller.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackFanoutGate::Leave()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_parties--;
+   if (m_waiting > 0 && m_waiting >= m_parties) {
+      Release();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackFanoutGate::Release --
+ *
+ *    Lets the parties waiting go, with m_mutex held.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackFanoutGate::Release()
+{
+   m_waiting = 0;
+   m_generation++;
+   m_cond.notify_all();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackParseFanout --
+ *
+ *    Parses the numbers of pingers of -F, "default" or a comma
+ *    separated list.
+ *
+ * Results:
+ *    false if it is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+LoopbackParseFanout(const char* spec,          // IN
+                    std::vector<int>* counts)  // OUT
+{
+   std::string list = strcmp(spec, "default") == 0 ? LOOPBACK_FANOUT_DEFAULT : spec;
+   const char* p = list.c_str();
+
+   counts->clear();
+   for (;;) {
+      char* end;
+      long n = strtol(p, &end, 10);
+
+      if (end == p || n < 1 || n > USHRT_MAX) {
+         return false;
+      }
+      counts->push_back((int)n);
+      if (*end == '\0') {
+         return true;
+      }
+      if (*end != ',') {
+         return false;
+      }
+      p = end + 1;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunFanoutStep --
+ *
+ *    Runs <count> pingers of <options> at once, on sessions 1 to <count>,
+ *    each on its own thread, for LOOPBACK_FANOUT_STEP_MS.
+ *
+ * Results:
+ *    false if a pinger did not connect or lost pings.
+ *
+ * Side Effects:
+ *    Prints a line, returns the throughput of all the pingers and how
+ *    busy the client thread was.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+LoopbackRunFanoutStep(const LoopbackPingOptions& options,   // IN
+                      int count,                            // IN
+                      double* throughput,                   // OUT
+                      double* busy)                         // OUT
+{
+   LoopbackFanoutGate gate(count + 1);
+   std::vector<LoopbackPingResult> results(count);
+   std::vector<std::thread> threads;
+
+   LoopbackPingOptions instanceOptions = options;
+   instanceOptions.n = INT_MAX;
+   if (instanceOptions.window == 0) {
+      instanceOptions.window = LOOPBACK_FANOUT_WINDOW;
+   }
+
+   for (int i = 0; i < count; i++) {
+      threads.push_back(std::thread([&instanceOptions, &results, &gate, i]() {
+         LoopbackPingOptions myOptions = instanceOptions;
+         myOptions.sid = (DWORD)(i + 1);
+         LoopbackRunPing(myOptions, &results[i], false, &gate);
+      }));
+   }
+
+   /* all connected, the pings start */
+   gate.Arrive();
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   uint64 busyStart = LoopbackService::Get()->GetClientBusyNs();
+
+   std::this_thread::sleep_for(std::chrono::milliseconds(LOOPBACK_FANOUT_STEP_MS));
+   gate.Stop();
+
+   /* all drained */
+   gate.Arrive();
+   uint64 busyNs = LoopbackService::Get()->GetClientBusyNs() - busyStart;
+   double elapsedUs = (double)std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start).count();
+
+   for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+
+   /*
+    * Jain's index of the throughputs of the instances: 1 if they all got
+    * the same, 1/count if one got all of it.
+    */
+   LoopbackHistogram latency;
+   double sum = 0;
+   double sumSquares = 0;
+   double minRate = 0;
+   double maxRate = 0;
+   int connected = 0;
+   int received = 0;
+   bool ok = true;
+
+   for (int i = 0; i < count; i++) {
+      const LoopbackPingResult& result = results[i];
+      double rate = result.elapsedUs > 0 ? result.received * 1e6 / result.elapsedUs : 0;
+
+      if (!result.connected) {
+         ok = false;
+         continue;
+      }
+      if (result.received != result.sent) {
+         ok = false;
+      }
+
+      minRate = connected == 0 || rate < minRate ? rate : minRate;
+      maxRate = connected == 0 || rate > maxRate ? rate : maxRate;
+      sum += rate;
+      sumSquares += rate * rate;
+      connected++;
+      received += result.received;
+      latency.Merge(result.latency);
+   }
+
+   *throughput = elapsedUs > 0 ? received * 1e6 / elapsedUs : 0;
+   *busy = elapsedUs > 0 ? busyNs / (elapsedUs * 1e3) : 0;
+   if (*busy > 1) {
+      /* a dispatch that began before the start counts whole */
+      *busy = 1;
+   }
+
+   printf("%9d %10.0f %9.2f %9.0f %9.0f %8.3f %9.1f %9.1f %9.1f %9.1f %6.0f%%%s\n",
+          count, *throughput, *throughput * options.size / 1e6, minRate, maxRate,
+          sumSquares > 0 ? sum * sum / (connected * sumSquares) : 0,
+          latency.GetPercentile(50) / 1e3, latency.GetPercentile(99) / 1e3,
+          latency.GetPercentile(99.9) / 1e3, latency.GetMax() / 1e3, *busy * 100,
+          connected < count ? "  (not all connected)" : !ok ? "  (pings lost)" : "");
+   fflush(stdout);
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunFanout --
+ *
+ *    Runs the fan-out of -F, each number of pingers in turn.
+ *
+ * Results:
+ *    0 if all the pings came back, 1 if some did not, 2 if the numbers
+ *    are invalid.
+ *
+ * Side Effects:
+ *    Prints a line per number of pingers, and the first at which the
+ *    dispatch of the client thread saturates, or the throughput stops
+ *    growing while the client thread still has time to spare.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackRunFanout(const LoopbackPingOptions& options)   // IN
+{
+   std::vector<int> counts;
+
+   if (!LoopbackParseFanout(options.fanout, &counts)) {
+      printf("Invalid numbers of pingers \"%s\"\n", options.fanout);
+      return 2;
+   }
+
+   printf("Fan-out on %s, %d byte pings, window %d per instance\n",
+          RPCChannelSelector::ChannelTypeToStr(options.type), options.size,
+          options.window > 0 ? options.window : LOOPBACK_FANOUT_WINDOW);
+   printf("%9s %10s %9s %9s %9s %8s %9s %9s %9s %9s %7s\n", "instances",
+          "msgs/s", "MB/s", "min/inst", "max/inst", "fairness", "p50us",
+          "p99us", "p99.9us", "maxus", "client");
+
+   /* the pingers all take their payloads from the one corpus */
+   LoopbackPingOptions fanoutOptions = options;
+   std::unique_ptr<RPCPayloadCorpus> corpus;
+   if (options.payload != NULL) {
+      corpus.reset(LoopbackNewCorpus(options));
+      fanoutOptions.corpus = corpus.get();
+   }
+
+   int rv = 0;
+   int saturated = 0;
+   double saturatedRate = 0;
+   double saturatedBusy = 0;
+   int previous = 0;
+   double previousRate = 0;
+   double previousBusy = 0;
+
+   for (size_t i = 0; i < counts.size(); i++) {
+      double rate;
+      double busy;
+
+      if (!LoopbackRunFanoutStep(fanoutOptions, counts[i], &rate, &busy)) {
+         rv = 1;
+      }
+
+      if (saturated == 0) {
+         if (busy >= LOOPBACK_FANOUT_BUSY) {
+            saturated = counts[i];
+            saturatedRate = rate;
+            saturatedBusy = busy;
+         } else if (previous > 0 && counts[i] > previous &&
+                    rate < previousRate * LOOPBACK_FANOUT_MIN_GAIN) {
+            saturated = previous;
+            saturatedRate = previousRate;
+            saturatedBusy = previousBusy;
+         }
+      }
+      previous = counts[i];
+      previousRate = rate;
+      previousBusy = busy;
+   }
+
+   /*
+    * The pingers run on the CPUs of the client thread too.  With few of
+    * them the throughput can stop growing before the client thread is
+    * busy, that is not its dispatch.
+    */
+   if (saturated > 0 && saturatedBusy >= LOOPBACK_FANOUT_BUSY) {
+      printf("OnMsgInvoke dispatch saturates at %d instances, %.0f msgs/s, "
+             "client thread %.0f%% busy\n", saturated, saturatedRate,
+             saturatedBusy * 100);
+   } else if (saturated > 0) {
+      printf("throughput stops growing at %d instances, %.0f msgs/s, "
+             "client thread %.0f%% busy: bound by the %u CPUs, not dispatch\n",
+             saturated, saturatedRate, saturatedBusy * 100,
+             std::thread::hardware_concurrency());
+   } else {
+      printf("OnMsgInvoke dispatch kept up with %d instances\n", previous);
+   }
+   return rv;
+}
@@ -0,0 +1,58 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackFanout.h --
+ *
+ *    Fan-out of LoopbackPing: many server side pingers, each with its own
+ *    RPCManager and session as if in its own process, against the one
+ *    client plugin, whose instances all run on the client thread.
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackFanoutGate
+ *
+ *    Lines the pingers of a fan-out up: they all connect before any
+ *    pings, ping until Stop(), and all drain before any disconnects.
+ *    Arrive() waits for every party of the gate to arrive, Leave() takes
+ *    a party that failed out of it for good.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackFanoutGate
+{
+public:
+   LoopbackFanoutGate(int parties);
+
+   void Arrive();
+   void Leave();
+
+   void Stop() { m_stopped = true; }
+   bool IsStopped() const { return m_stopped; }
+
+private:
+   std::mutex                 m_mutex;
+   std::condition_variable    m_cond;
+   int                        m_parties;
+   int                        m_waiting;
+   uint32                     m_generation;
+   std::atomic<bool>          m_stopped;
+
+   void Release();
+
+   LoopbackFanoutGate(const LoopbackFanoutGate&);
+   LoopbackFanoutGate& operator=(const LoopbackFanoutGate&);
+};
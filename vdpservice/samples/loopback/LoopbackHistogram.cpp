@@ -0,0 +1,242 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackHistogram.cpp --
+ *
+ *    Latency histogram of the loopback benchmarks, see LoopbackHistogram.h.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackHistogram.h"
+
+#include <algorithm>
+
+#define LOOPBACK_HIST_SUB_COUNT  (1U << LOOPBACK_HIST_SUB_BITS)
+#define LOOPBACK_HIST_HALF_COUNT (LOOPBACK_HIST_SUB_COUNT / 2)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::LoopbackHistogram --
+ *
+ *    Constructor, sized for the values up to <maxValue>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackHistogram::LoopbackHistogram(uint64 maxValue)   // IN
+   : m_maxValue(maxValue < LOOPBACK_HIST_SUB_COUNT ? LOOPBACK_HIST_SUB_COUNT : maxValue)
+{
+   m_counts.resize(IndexOf(m_maxValue) + 1);
+   Reset();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::Record --
+ *
+ *    Counts <value> <count> times.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    A value above the maximum counts as the maximum.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackHistogram::Record(uint64 value,   // IN
+                          uint64 count)   // IN
+{
+   if (count == 0) {
+      return;
+   }
+   if (value > m_maxValue) {
+      m_saturated += count;
+      value = m_maxValue;
+   }
+
+   m_counts[IndexOf(value)] += count;
+   m_count += count;
+   m_sum += (double)value * count;
+   if (value < m_min) {
+      m_min = value;
+   }
+   if (value > m_max) {
+      m_max = value;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::Merge --
+ *
+ *    Adds the values of <other>, for the totals over several runs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackHistogram::Merge(const LoopbackHistogram& other)   // IN
+{
+   if (other.m_count == 0) {
+      return;
+   }
+
+   /* the buckets line up, those above our maximum go to the last one */
+   for (size_t i = 0; i < other.m_counts.size(); i++) {
+      size_t index = i < m_counts.size() ? i : m_counts.size() - 1;
+      m_counts[index] += other.m_counts[i];
+   }
+
+   m_count += other.m_count;
+   m_sum += other.m_sum;
+   m_saturated += other.m_saturated;
+   if (other.m_min < m_min) {
+      m_min = other.m_min;
+   }
+   if (other.m_max > m_max) {
+      m_max = other.m_max < m_maxValue ? other.m_max : m_maxValue;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::Reset --
+ *
+ *    Forgets all the values, e.g. those of the warm-up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackHistogram::Reset()
+{
+   std::fill(m_counts.begin(), m_counts.end(), 0);
+   m_count = 0;
+   m_min = UINT64_MAX;
+   m_max = 0;
+   m_sum = 0;
+   m_saturated = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::GetMean --
+ *
+ *    Returns the mean of the values, exact rather than from the buckets.
+ *
+ *----------------------------------------------------------------------
+ */
+
+double
+LoopbackHistogram::GetMean() const
+{
+   return m_count > 0 ? m_sum / m_count : 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::GetPercentile --
+ *
+ *    Returns the value <percentile> (0 to 100) of the values are at or
+ *    below, within the precision of its bucket.
+ *
+ * Results:
+ *    The value, 0 if there is none.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackHistogram::GetPercentile(double percentile) const   // IN
+{
+   if (m_count == 0) {
+      return 0;
+   }
+   if (percentile >= 100) {
+      return m_max;
+   }
+
+   uint64 rank = (uint64)(percentile / 100 * m_count + 0.5);
+   if (rank == 0) {
+      rank = 1;
+   }
+
+   uint64 seen = 0;
+   for (size_t i = 0; i < m_counts.size(); i++) {
+      seen += m_counts[i];
+      if (seen >= rank) {
+         uint64 value = HighestOf((uint32)i);
+         return value < m_max ? value : m_max;
+      }
+   }
+   return m_max;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::IndexOf --
+ *
+ *    Returns the bucket of <value>.  The first LOOPBACK_HIST_SUB_COUNT
+ *    are one value wide, after that each LOOPBACK_HIST_HALF_COUNT
+ *    buckets are twice as wide as the ones before.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+LoopbackHistogram::IndexOf(uint64 value)   // IN
+{
+   if (value < LOOPBACK_HIST_SUB_COUNT) {
+      return (uint32)value;
+   }
+
+   int msb = 63 - __builtin_clzll(value);
+   int shift = msb - (LOOPBACK_HIST_SUB_BITS - 1);
+   return (uint32)(shift * LOOPBACK_HIST_HALF_COUNT + (value >> shift));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackHistogram::HighestOf --
+ *
+ *    Returns the highest value that falls in bucket <index>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackHistogram::HighestOf(uint32 index)   // IN
+{
+   if (index < LOOPBACK_HIST_SUB_COUNT) {
+      return index;
+   }
+
+   int shift = (int)(index / LOOPBACK_HIST_HALF_COUNT) - 1;
+   uint64 sub = index - (uint64)shift * LOOPBACK_HIST_HALF_COUNT;
+   return ((sub + 1) << shift) - 1;
+}
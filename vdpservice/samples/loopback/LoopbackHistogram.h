@@ -0,0 +1,68 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackHistogram.h --
+ *
+ *    Latency histogram of the loopback benchmarks, in the HDR layout:
+ *    exact below 2^LOOPBACK_HIST_SUB_BITS, then buckets that double in
+ *    width so every value keeps the same relative precision.
+ *
+ */
+
+#pragma once
+
+#include "vmware.h"
+
+#include <vector>
+
+// sub-bucket bits, 11 keeps 3 significant digits (1/1024 relative error).
+#define LOOPBACK_HIST_SUB_BITS   11
+
+// largest value tracked by default, longer ones count as this: 60s in ns.
+#define LOOPBACK_HIST_MAX_NS     (60ULL * 1000 * 1000 * 1000)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackHistogram
+ *
+ *    Counts values, nanoseconds for the benchmarks, in buckets of
+ *    constant relative width.  Percentiles come back as the highest
+ *    value of their bucket, as HdrHistogram reports them.  Record() is
+ *    O(1), so it goes on the path of every ping.
+ *
+ *    Not thread safe.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackHistogram
+{
+public:
+   LoopbackHistogram(uint64 maxValue = LOOPBACK_HIST_MAX_NS);
+
+   void Record(uint64 value, uint64 count = 1);
+   void Merge(const LoopbackHistogram& other);
+   void Reset();
+
+   uint64 GetCount() const { return m_count; }
+   uint64 GetMin() const { return m_count > 0 ? m_min : 0; }
+   uint64 GetMax() const { return m_max; }
+   double GetMean() const;
+   uint64 GetPercentile(double percentile) const;
+   uint64 GetSaturated() const { return m_saturated; }
+
+private:
+   uint64                  m_maxValue;
+   std::vector<uint64>     m_counts;
+   uint64                  m_count;
+   uint64                  m_min;
+   uint64                  m_max;
+   double                  m_sum;
+   uint64                  m_saturated;      /* values above m_maxValue */
+
+   static uint32 IndexOf(uint64 value);
+   static uint64 HighestOf(uint32 index);
+};
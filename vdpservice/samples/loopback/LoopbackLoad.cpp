@@ -0,0 +1,274 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackLoad.cpp --
+ *
+ *    Open-loop load of LoopbackPing, see LoopbackLoad.h, and the search
+ *    of -A for the highest rate a channel keeps up with.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackLoad.h"
+#include "LoopbackPing.h"
+#include "RPCChannelSelector.h"
+
+// the search of -A gives up above this rate, in pings per second.
+#define LOOPBACK_LOAD_MAX_RATE      (10 * 1000 * 1000)
+
+// each rate is held this long, after the warm-up pings.
+#define LOOPBACK_LOAD_STEP_MS       1000
+#define LOOPBACK_LOAD_WARMUP_PINGS  1000
+
+// the search of -A does not halve below this rate, in pings per second.
+#define LOOPBACK_LOAD_MIN_RATE      100
+
+// a rate is kept up with if this share of it comes back per second.
+#define LOOPBACK_LOAD_MIN_SHARE     0.95
+
+// the search stops when the highest rate kept up with is this close to
+// the lowest one that was not.
+#define LOOPBACK_LOAD_PRECISION     0.05
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPacer::LoopbackPacer --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackPacer::LoopbackPacer(double rate,      // IN
+                             double endRate,   // IN
+                             int n)            // IN
+   : m_rate(rate),
+     m_endRate(endRate > 0 ? endRate : rate),
+     m_n(n),
+     m_index(0),
+     m_startNs(0),
+     m_offsetNs(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPacer::Start --
+ *
+ *    Starts the schedule, the first ping is due at <nowNs>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPacer::Start(uint64 nowNs)   // IN
+{
+   m_index = 0;
+   m_startNs = nowNs;
+   m_offsetNs = 0;
+   m_lag.Reset();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPacer::GetWaitMs --
+ *
+ *    Returns how long the caller can sleep before the next ping is due.
+ *
+ * Results:
+ *    Milliseconds, rounded down and 0 within LOOPBACK_PACER_SPIN_NS of
+ *    its time, when the caller should poll without waiting.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+LoopbackPacer::GetWaitMs(uint64 nowNs) const   // IN
+{
+   uint64 due = GetDue();
+
+   if (nowNs + LOOPBACK_PACER_SPIN_NS >= due) {
+      return 0;
+   }
+   return (uint32)((due - nowNs - LOOPBACK_PACER_SPIN_NS) / (1000 * 1000));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPacer::Next --
+ *
+ *    Takes the ping due, sent at <nowNs>, and schedules the next one at
+ *    the rate of its place in the ramp.
+ *
+ * Results:
+ *    The intended send time of the ping, what its latency counts from.
+ *
+ * Side Effects:
+ *    Counts how late it is.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackPacer::Next(uint64 nowNs)   // IN
+{
+   uint64 due = GetDue();
+
+   m_lag.Record(nowNs > due ? nowNs - due : 0);
+
+   double rate = m_rate;
+   if (m_n > 1 && m_endRate != m_rate) {
+      rate += (m_endRate - m_rate) * m_index / (m_n - 1);
+   }
+   m_index++;
+   m_offsetNs += 1e9 / rate;
+   return due;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunStep --
+ *
+ *    Pings at <rate> for LOOPBACK_LOAD_STEP_MS, after warming up the
+ *    connection with -W or LOOPBACK_LOAD_WARMUP_PINGS pings.
+ *
+ * Results:
+ *    true if the channel kept up: the pings all came back at no less
+ *    than LOOPBACK_LOAD_MIN_SHARE of the rate, and within <sloUs> at
+ *    the 99th percentile if it is not 0.
+ *
+ * Side Effects:
+ *    Prints a line.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+LoopbackRunStep(const LoopbackPingOptions& options,   // IN
+                double rate,                          // IN
+                int sloUs)                            // IN
+{
+   LoopbackPingOptions stepOptions = options;
+   LoopbackPingResult result;
+
+   stepOptions.rate = rate;
+   stepOptions.endRate = rate;
+   stepOptions.n = (int)(rate * LOOPBACK_LOAD_STEP_MS / 1000);
+   if (stepOptions.warmup == 0) {
+      stepOptions.warmup = LOOPBACK_LOAD_WARMUP_PINGS;
+   }
+
+   bool connected = LoopbackRunPing(stepOptions, &result, false);
+   double achieved = result.elapsedUs > 0 ? result.received * 1e6 / result.elapsedUs : 0;
+   uint64 p99 = result.latency.GetPercentile(99);
+   const char* verdict = "ok";
+
+   if (!connected) {
+      verdict = "no connection";
+   } else if (result.received != stepOptions.n) {
+      verdict = "pings lost";
+   } else if (achieved < rate * LOOPBACK_LOAD_MIN_SHARE) {
+      verdict = "behind";
+   } else if (sloUs > 0 && p99 > (uint64)sloUs * 1000) {
+      verdict = "over p99";
+   }
+
+   printf("%10.0f %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f  %s\n", rate, achieved,
+          result.latency.GetPercentile(50) / 1e3, p99 / 1e3,
+          result.latency.GetPercentile(99.9) / 1e3, result.latency.GetMax() / 1e3,
+          result.sendLag.GetPercentile(99) / 1e3, verdict);
+   fflush(stdout);
+
+   return strcmp(verdict, "ok") == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunSaturation --
+ *
+ *    Finds the highest rate the channel of <options> keeps up with: the
+ *    rate doubles from -r, or LOOPBACK_LOAD_START_RATE, until it does not,
+ *    then the search halves the gap to within LOOPBACK_LOAD_PRECISION.
+ *    A rate it does not keep up with is halved, down to
+ *    LOOPBACK_LOAD_MIN_RATE.  Every rate runs on a new connection, which
+ *    is warmed up first.
+ *
+ * Results:
+ *    0 if a rate was found, 1 if the channel did not keep up with any.
+ *
+ * Side Effects:
+ *    Prints a line per rate and the result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackRunSaturation(const LoopbackPingOptions& options)   // IN
+{
+   double good = 0;
+   double bad = 0;
+   double rate = options.rate > 0 ? options.rate : LOOPBACK_LOAD_START_RATE;
+
+   printf("Saturation of %s, %d byte pings",
+          RPCChannelSelector::ChannelTypeToStr(options.type), options.size);
+   if (options.sloUs > 0) {
+      printf(", p99 within %dus", options.sloUs);
+   }
+   printf("\n%10s %10s %9s %9s %9s %9s %9s\n", "rate", "pings/s", "p50us",
+          "p99us", "p99.9us", "maxus", "lag99us");
+
+   /* double until it does not keep up, or halve until it does */
+   while (good == 0 || bad == 0) {
+      if (LoopbackRunStep(options, rate, options.sloUs)) {
+         good = rate;
+         if (bad == 0 && rate * 2 > LOOPBACK_LOAD_MAX_RATE) {
+            break;
+         }
+         rate *= 2;
+      } else {
+         bad = rate;
+         if (good == 0 && rate / 2 < LOOPBACK_LOAD_MIN_RATE) {
+            break;
+         }
+         rate /= 2;
+      }
+   }
+
+   while (good > 0 && bad > 0 && (bad - good) / good > LOOPBACK_LOAD_PRECISION) {
+      rate = (good + bad) / 2;
+      if (LoopbackRunStep(options, rate, options.sloUs)) {
+         good = rate;
+      } else {
+         bad = rate;
+      }
+   }
+
+   if (good == 0) {
+      printf("saturated below %.0f pings/s\n", rate);
+      return 1;
+   }
+   if (bad == 0) {
+      printf("kept up with %.0f pings/s, the highest rate tried\n", good);
+   } else {
+      printf("saturation: %.0f pings/s, %.2f MB/s\n", good,
+             good * options.size / 1e6);
+   }
+   return 0;
+}
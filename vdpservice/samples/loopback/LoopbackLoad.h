@@ -0,0 +1,64 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackLoad.h --
+ *
+ *    Open-loop load of LoopbackPing: the pings go out on a schedule of
+ *    their own, not when the previous ones come back, so a channel that
+ *    falls behind shows up in their latency.
+ *
+ */
+
+#pragma once
+
+#include "LoopbackHistogram.h"
+
+// within this of its time a ping is waited for by polling, not sleeping.
+#define LOOPBACK_PACER_SPIN_NS   (1000 * 1000)
+
+// the search of -A starts here without -r, in pings per second.
+#define LOOPBACK_LOAD_START_RATE 1000
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackPacer
+ *
+ *    The intended send times of <n> pings at a rate that goes from
+ *    <rate> to <endRate> in a straight line, a constant rate if they are
+ *    the same.  The latency of a ping counts from its intended time, so
+ *    the time it waited behind a slow sender is not left out, and how
+ *    late it actually went out is counted as the lag.
+ *
+ *    Not thread safe.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackPacer
+{
+public:
+   LoopbackPacer(double rate, double endRate, int n);
+
+   void Start(uint64 nowNs);
+   bool IsDue(uint64 nowNs) const { return nowNs >= GetDue(); }
+   uint64 GetDue() const { return m_startNs + (uint64)m_offsetNs; }
+   uint32 GetWaitMs(uint64 nowNs) const;
+   uint64 Next(uint64 nowNs);
+
+   const LoopbackHistogram& GetLag() const { return m_lag; }
+
+private:
+   double                  m_rate;
+   double                  m_endRate;
+   int                     m_n;
+   int                     m_index;
+   uint64                  m_startNs;
+   double                  m_offsetNs;       /* of the next ping from m_startNs */
+   LoopbackHistogram       m_lag;
+
+   LoopbackPacer(const LoopbackPacer&);
+   LoopbackPacer& operator=(const LoopbackPacer&);
+};
@@ -0,0 +1,923 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackNetwork.cpp --
+ *
+ *    Link model for the loopback emulator, see LoopbackNetwork.h.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackNetwork.h"
+
+#include <algorithm>
+#include <math.h>
+
+// shape of the pareto jitter, the tail gets heavier as it gets closer to 1.
+#define LOOPBACK_NET_PARETO_SHAPE   3.0
+
+// resends of a lost frame before it is let through anyway.
+#define LOOPBACK_NET_MAX_RESENDS    6
+
+// the frames of a direction that is down for good.
+#define LOOPBACK_NET_NEVER          UINT64_MAX
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetLink::LoopbackNetLink --
+ *
+ *    Constructor.  The random draws of each direction come from their
+ *    own generator, seeded from the network seed and the session, so
+ *    they do not depend on how the two directions interleave.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackNetLink::LoopbackNetLink(LoopbackNetwork* network,   // IN
+                                 unsigned long sid)          // IN
+   : m_network(network),
+     m_startUs(LoopbackNetwork::NowUs()),
+     m_closed(false)
+{
+   for (int d = 0; d < LOOPBACK_NET_DIRECTIONS; d++) {
+      std::seed_seq seq = { (uint32)network->m_seed,
+                            (uint32)(network->m_seed >> 32),
+                            (uint32)sid, (uint32)d };
+      m_dir[d].rng.seed(seq);
+      m_dir[d].wireFreeUs = 0;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetLink::Send --
+ *
+ *    Sends a frame over the modeled link.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The network owns the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetLink::Send(const std::shared_ptr<LoopbackEndpoint>& to,  // IN
+                      LoopbackFrame* frame)                         // IN
+{
+   m_network->Send(this, to, frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetLink::Close --
+ *
+ *    Drops the frames still on the link.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetLink::Close()
+{
+   m_network->Close(this);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::LoopbackNetwork --
+ *
+ *    Constructor, an ideal link until steps are added.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackNetwork::LoopbackNetwork(uint64 seed)   // IN
+   : m_seed(seed),
+     m_seq(0),
+     m_stop(false)
+{
+   LoopbackNetStep step;
+
+   step.atUs = 0;
+   for (int d = 0; d < LOOPBACK_NET_DIRECTIONS; d++) {
+      DefaultParams(&step.dir[d]);
+   }
+   m_steps.push_back(step);
+
+   memset(m_stats, 0, sizeof m_stats);
+   m_thread = std::thread(&LoopbackNetwork::SchedulerMain, this);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::~LoopbackNetwork --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackNetwork::~LoopbackNetwork()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+   }
+   m_cond.notify_all();
+   m_thread.join();
+
+   for (size_t i = 0; i < m_pending.size(); i++) {
+      delete m_pending[i].frame;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::DefaultParams --
+ *
+ *    An ideal direction: no delay, no limit, no loss.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::DefaultParams(LoopbackNetParams* params)   // OUT
+{
+   params->latencyUs = 0;
+   params->jitterUs = 0;
+   params->jitter = LOOPBACK_JITTER_UNIFORM;
+   params->bitsPerSec = 0;
+   params->loss = 0;
+   params->reorder = 0;
+   params->rtoUs = LOOPBACK_NET_RTO_US;
+   params->reorderUs = 1000;
+   params->down = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::AddStep --
+ *
+ *    Adds or replaces the step starting at <step.atUs>.  Only affects
+ *    the connections opened afterwards.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::AddStep(const LoopbackNetStep& step)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   auto it = std::lower_bound(m_steps.begin(), m_steps.end(), step.atUs,
+                              [](const LoopbackNetStep& s, uint64 atUs) {
+                                 return s.atUs < atUs;
+                              });
+   if (it != m_steps.end() && it->atUs == step.atUs) {
+      *it = step;
+   } else {
+      m_steps.insert(it, step);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseTime --
+ *
+ *    Parses "<number>[us|ms|s]", milliseconds by default.
+ *
+ * Results:
+ *    false if it is not a valid time.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseTime(const std::string& str,   // IN
+          uint64* us)               // OUT
+{
+   char* end;
+   double value = strtod(str.c_str(), &end);
+   double scale;
+
+   if (end == str.c_str() || value < 0) {
+      return false;
+   }
+
+   if (*end == '\0' || _stricmp(end, "ms") == 0) {
+      scale = 1000;
+   } else if (_stricmp(end, "us") == 0) {
+      scale = 1;
+   } else if (_stricmp(end, "s") == 0) {
+      scale = 1000000;
+   } else {
+      return false;
+   }
+
+   *us = (uint64)(value * scale + 0.5);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseRate --
+ *
+ *    Parses "<number>[k|m|g][bit|bps]", bits per second.
+ *
+ * Results:
+ *    false if it is not a valid rate.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseRate(const std::string& str,   // IN
+          uint64* bitsPerSec)       // OUT
+{
+   char* end;
+   double value = strtod(str.c_str(), &end);
+   double scale = 1;
+
+   if (end == str.c_str() || value < 0) {
+      return false;
+   }
+
+   switch (*end) {
+   case 'k': case 'K': scale = 1e3; end++; break;
+   case 'm': case 'M': scale = 1e6; end++; break;
+   case 'g': case 'G': scale = 1e9; end++; break;
+   }
+
+   if (*end != '\0' && _stricmp(end, "bit") != 0 && _stricmp(end, "bps") != 0) {
+      return false;
+   }
+
+   *bitsPerSec = (uint64)(value * scale + 0.5);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseRatio --
+ *
+ *    Parses a probability, "0.01" or "1%".
+ *
+ * Results:
+ *    false if it is not between 0 and 1.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseRatio(const std::string& str,   // IN
+           double* ratio)            // OUT
+{
+   char* end;
+   double value = strtod(str.c_str(), &end);
+
+   if (end == str.c_str()) {
+      return false;
+   }
+   if (*end == '%') {
+      value /= 100;
+      end++;
+   }
+
+   if (*end != '\0' || value < 0 || value > 1) {
+      return false;
+   }
+
+   *ratio = value;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseParam --
+ *
+ *    Applies one "<key>=<value>", "down" or "up" to <params>.
+ *
+ * Results:
+ *    false if it is not valid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseParam(const std::string& key,       // IN
+           const std::string& value,     // IN
+           bool hasValue,                // IN
+           LoopbackNetParams* params)    // IN/OUT
+{
+   uint64 us;
+
+   if (!hasValue) {
+      if (key == "down" || key == "up") {
+         params->down = key == "down";
+         return true;
+      }
+      return false;
+   }
+
+   if (key == "lat") {
+      if (!ParseTime(value, &us)) return false;
+      params->latencyUs = (uint32)us;
+   } else if (key == "jitter") {
+      if (!ParseTime(value, &us)) return false;
+      params->jitterUs = (uint32)us;
+   } else if (key == "dist") {
+      if (value == "uniform") {
+         params->jitter = LOOPBACK_JITTER_UNIFORM;
+      } else if (value == "normal") {
+         params->jitter = LOOPBACK_JITTER_NORMAL;
+      } else if (value == "pareto") {
+         params->jitter = LOOPBACK_JITTER_PARETO;
+      } else {
+         return false;
+      }
+   } else if (key == "bw") {
+      return ParseRate(value, &params->bitsPerSec);
+   } else if (key == "loss") {
+      return ParseRatio(value, &params->loss);
+   } else if (key == "reorder") {
+      return ParseRatio(value, &params->reorder);
+   } else if (key == "rto") {
+      if (!ParseTime(value, &us) || us == 0) return false;
+      params->rtoUs = (uint32)us;
+   } else if (key == "gap") {
+      if (!ParseTime(value, &us)) return false;
+      params->reorderUs = (uint32)us;
+   } else {
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::Parse --
+ *
+ *    Replaces the steps with those of <spec>, steps separated by ';',
+ *    settings by ',':
+ *
+ *       lat=30ms,jitter=5ms,bw=20mbit;@10s,loss=1%;@20s,down;@21s,up
+ *
+ *    Each step starts from the one before, "@<time>" is when it starts.
+ *    Settings are lat, jitter, dist (uniform, normal or pareto), bw,
+ *    loss, reorder, rto, gap (the reorder delay), down and up.  They
+ *    apply to both directions unless prefixed with "a2c." (agent to
+ *    client) or "c2a.".
+ *
+ * Results:
+ *    false if <spec> is not valid, the steps are left unchanged.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackNetwork::Parse(const char* spec)   // IN
+{
+   std::vector<LoopbackNetStep> steps;
+   LoopbackNetStep step;
+   std::string str(spec != NULL ? spec : "");
+   size_t pos = 0;
+
+   step.atUs = 0;
+   for (int d = 0; d < LOOPBACK_NET_DIRECTIONS; d++) {
+      DefaultParams(&step.dir[d]);
+   }
+
+   while (pos <= str.size()) {
+      size_t stepEnd = str.find(';', pos);
+      if (stepEnd == std::string::npos) {
+         stepEnd = str.size();
+      }
+
+      std::string stepStr = str.substr(pos, stepEnd - pos);
+      size_t itemPos = 0;
+      bool first = true;
+
+      while (itemPos <= stepStr.size()) {
+         size_t itemEnd = stepStr.find(',', itemPos);
+         if (itemEnd == std::string::npos) {
+            itemEnd = stepStr.size();
+         }
+
+         std::string item = stepStr.substr(itemPos, itemEnd - itemPos);
+         itemPos = itemEnd + 1;
+
+         item.erase(0, item.find_first_not_of(" \t"));
+         item.erase(item.find_last_not_of(" \t") + 1);
+         if (item.empty()) {
+            continue;
+         }
+
+         if (item[0] == '@') {
+            uint64 atUs;
+            if (!first || !ParseTime(item.substr(1), &atUs) ||
+                (!steps.empty() && atUs <= steps.back().atUs)) {
+               LOG("Error: invalid step time \"%s\".", item.c_str());
+               return false;
+            }
+            step.atUs = atUs;
+            first = false;
+            continue;
+         }
+         first = false;
+
+         int from = 0;
+         int to = LOOPBACK_NET_DIRECTIONS;
+         if (item.compare(0, 4, "a2c.") == 0) {
+            to = LOOPBACK_NET_TO_CLIENT + 1;
+            item.erase(0, 4);
+         } else if (item.compare(0, 4, "c2a.") == 0) {
+            from = LOOPBACK_NET_TO_SERVER;
+            item.erase(0, 4);
+         }
+
+         size_t eq = item.find('=');
+         std::string key = item.substr(0, eq);
+         std::string value = eq != std::string::npos ? item.substr(eq + 1) : "";
+
+         for (int d = from; d < to; d++) {
+            if (!ParseParam(key, value, eq != std::string::npos, &step.dir[d])) {
+               LOG("Error: invalid link setting \"%s\".", item.c_str());
+               return false;
+            }
+         }
+      }
+
+      if (steps.empty() && step.atUs != 0) {
+         LoopbackNetStep ideal;
+         ideal.atUs = 0;
+         for (int d = 0; d < LOOPBACK_NET_DIRECTIONS; d++) {
+            DefaultParams(&ideal.dir[d]);
+         }
+         steps.push_back(ideal);
+      }
+      steps.push_back(step);
+
+      pos = stepEnd + 1;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_steps.swap(steps);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::GetStats --
+ *
+ *    Counters of <direction> since the network was created.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::GetStats(LoopbackNetDirection direction,   // IN
+                          LoopbackNetStats* stats)          // OUT
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   *stats = m_stats[direction];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::CreateLink --
+ *
+ *    LoopbackLinkFactory, <userData> is the network.
+ *
+ * Results:
+ *    The link of session <sid>.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackLink*
+LoopbackNetwork::CreateLink(unsigned long sid,   // IN
+                            void* userData)      // IN
+{
+   return new LoopbackNetLink(reinterpret_cast<LoopbackNetwork*>(userData), sid);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::NowUs --
+ *
+ *    Microseconds of the clock the frames are scheduled on.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackNetwork::NowUs()
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::StepAt --
+ *
+ *    The step in effect <elapsedUs> after a link was created.
+ *
+ * Results:
+ *    The step, and in <nextUs> when the next one starts.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const LoopbackNetStep*
+LoopbackNetwork::StepAt(uint64 elapsedUs,   // IN
+                        uint64* nextUs)     // OUT
+{
+   size_t i = 0;
+
+   while (i + 1 < m_steps.size() && m_steps[i + 1].atUs <= elapsedUs) {
+      i++;
+   }
+
+   *nextUs = i + 1 < m_steps.size() ? m_steps[i + 1].atUs : LOOPBACK_NET_NEVER;
+   return &m_steps[i];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::UpAt --
+ *
+ *    When <direction> of a link is up at or after <elapsedUs>.
+ *
+ * Results:
+ *    The time since the link was created, LOOPBACK_NET_NEVER if it
+ *    stays down.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackNetwork::UpAt(LoopbackNetDirection direction,   // IN
+                      uint64 elapsedUs)                 // IN
+{
+   uint64 atUs = elapsedUs;
+   uint64 nextUs;
+
+   while (StepAt(atUs, &nextUs)->dir[direction].down) {
+      if (nextUs == LOOPBACK_NET_NEVER) {
+         return LOOPBACK_NET_NEVER;
+      }
+      atUs = nextUs;
+   }
+
+   return atUs;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::DrawUnit --
+ *
+ *    Uniform draw in [0, 1).  Not std::uniform_real_distribution, its
+ *    algorithm is up to the library and the runs must repeat anywhere.
+ *
+ *----------------------------------------------------------------------
+ */
+
+double
+LoopbackNetwork::DrawUnit(std::mt19937_64& rng)   // IN/OUT
+{
+   return (double)(rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::DrawJitter --
+ *
+ *    Draws the jitter of one frame.
+ *
+ * Results:
+ *    Microseconds to add to the latency, may be negative.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int64
+LoopbackNetwork::DrawJitter(const LoopbackNetParams& params,   // IN
+                            std::mt19937_64& rng)              // IN/OUT
+{
+   double j = params.jitterUs;
+   double u = DrawUnit(rng);
+
+   if (params.jitterUs == 0) {
+      return 0;
+   }
+
+   switch (params.jitter) {
+   case LOOPBACK_JITTER_NORMAL: {
+      // Box-Muller, 1 - u is never 0.
+      double v = DrawUnit(rng);
+      return (int64)(j * sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v));
+   }
+   case LOOPBACK_JITTER_PARETO: {
+      // Lomax with mean j.
+      double scale = j * (LOOPBACK_NET_PARETO_SHAPE - 1.0);
+      return (int64)(scale * (pow(1.0 - u, -1.0 / LOOPBACK_NET_PARETO_SHAPE) - 1.0));
+   }
+   case LOOPBACK_JITTER_UNIFORM:
+   default:
+      return (int64)(j * (2.0 * u - 1.0));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::Send --
+ *
+ *    Works out when <frame> arrives and schedules its delivery.  It
+ *    waits for the direction to be up and for the wire to be free,
+ *    takes its serialization time, the latency plus jitter, the
+ *    resends and the reordering of the TCP side channel, and never
+ *    arrives before the frame sent before it on the same channel.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The network owns the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::Send(LoopbackNetLink* link,                          // IN
+                      const std::shared_ptr<LoopbackEndpoint>& to,    // IN
+                      LoopbackFrame* frame)                           // IN
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+
+   if (link->m_closed) {
+      delete frame;
+      return;
+   }
+
+   LoopbackNetDirection d = to->IsServer() ? LOOPBACK_NET_TO_SERVER :
+                                             LOOPBACK_NET_TO_CLIENT;
+   LoopbackNetLink::Direction& dir = link->m_dir[d];
+   LoopbackNetStats& stats = m_stats[d];
+   uint64 bytes = frame->data.size() + LOOPBACK_FRAME_HEADER_BYTES;
+   uint64 nowUs = NowUs();
+   uint64 upUs = UpAt(d, nowUs - link->m_startUs);
+   uint64 arrivalUs = LOOPBACK_NET_NEVER;
+
+   stats.frames++;
+   stats.bytes += bytes;
+
+   if (upUs != LOOPBACK_NET_NEVER) {
+      uint64 nextUs;
+      const LoopbackNetParams& params = StepAt(upUs, &nextUs)->dir[d];
+      uint64 startUs = std::max(link->m_startUs + upUs, dir.wireFreeUs);
+      uint64 txUs = params.bitsPerSec != 0 ? bytes * 8 * 1000000 / params.bitsPerSec : 0;
+      int64 delayUs = (int64)params.latencyUs + DrawJitter(params, dir.rng);
+
+      dir.wireFreeUs = startUs + txUs;
+      arrivalUs = dir.wireFreeUs + (delayUs > 0 ? delayUs : 0);
+
+      if (frame->sideChannel == VDP_RPC_SIDE_CHANNEL_TYPE_TCP) {
+         if (params.loss > 0) {
+            uint64 segments = (bytes + LOOPBACK_NET_MSS - 1) / LOOPBACK_NET_MSS;
+            double frameLoss = 1.0 - pow(1.0 - params.loss, (double)segments);
+            uint64 rtoUs = params.rtoUs;
+
+            for (int i = 0; i < LOOPBACK_NET_MAX_RESENDS &&
+                            DrawUnit(dir.rng) < frameLoss; i++) {
+               stats.lost += i == 0 ? 1 : 0;
+               arrivalUs += rtoUs;
+               rtoUs *= 2;
+            }
+         }
+         if (params.reorder > 0 && DrawUnit(dir.rng) < params.reorder) {
+            stats.reordered++;
+            arrivalUs += params.reorderUs;
+         }
+      }
+
+      uint64 queueUs = startUs - nowUs;
+      stats.queueUs += queueUs;
+      stats.maxQueueUs = std::max(stats.maxQueueUs, queueUs);
+   }
+
+   uint64& lastUs = dir.lastArrivalUs[frame->sideChannel];
+   arrivalUs = std::max(arrivalUs, lastUs);
+   lastUs = arrivalUs;
+
+   if (arrivalUs != LOOPBACK_NET_NEVER) {
+      stats.delayUs += arrivalUs - nowUs;
+      stats.maxDelayUs = std::max(stats.maxDelayUs, arrivalUs - nowUs);
+   }
+
+   Pending pending = { arrivalUs, m_seq++, link, to, frame };
+   m_pending.push_back(pending);
+   std::push_heap(m_pending.begin(), m_pending.end(), PendingLater());
+
+   bool first = m_pending.front().frame == frame;
+   lock.unlock();
+
+   if (first) {
+      m_cond.notify_all();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::Close --
+ *
+ *    Drops the frames of <link> not delivered yet.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::Close(LoopbackNetLink* link)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if (link->m_closed) {
+      return;
+   }
+   link->m_closed = true;
+
+   auto end = std::remove_if(m_pending.begin(), m_pending.end(),
+                             [link](const Pending& p) {
+                                if (p.link != link) {
+                                   return false;
+                                }
+                                delete p.frame;
+                                return true;
+                             });
+   m_pending.erase(end, m_pending.end());
+   std::make_heap(m_pending.begin(), m_pending.end(), PendingLater());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNetwork::SchedulerMain --
+ *
+ *    Delivers the frames when they are due.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackNetwork::SchedulerMain()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   std::vector<Pending> due;
+
+   while (!m_stop) {
+      if (m_pending.empty() || m_pending.front().dueUs == LOOPBACK_NET_NEVER) {
+         m_cond.wait(lock);
+         continue;
+      }
+
+      uint64 nowUs = NowUs();
+      uint64 dueUs = m_pending.front().dueUs;
+      if (dueUs > nowUs) {
+         m_cond.wait_until(lock, std::chrono::steady_clock::time_point(
+                                    std::chrono::microseconds(dueUs)));
+         continue;
+      }
+
+      while (!m_pending.empty() && m_pending.front().dueUs <= nowUs) {
+         std::pop_heap(m_pending.begin(), m_pending.end(), PendingLater());
+         due.push_back(m_pending.back());
+         m_pending.pop_back();
+      }
+
+      lock.unlock();
+
+      for (size_t i = 0; i < due.size(); i++) {
+         std::shared_ptr<LoopbackEndpoint> to = due[i].to.lock();
+         if (to) {
+            LoopbackLink::Deliver(to, due[i].frame);
+         } else {
+            delete due[i].frame;
+         }
+      }
+      due.clear();
+
+      lock.lock();
+   }
+}
@@ -0,0 +1,208 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackNetwork.h --
+ *
+ *    Link model for the loopback emulator: latency, jitter, bandwidth,
+ *    TCP loss and reordering, per direction and scripted over time.
+ *    All the random draws come from a seed, so a run can be repeated.
+ *
+ */
+
+#pragma once
+
+#include "LoopbackService.h"
+
+#include <random>
+
+// default retransmission timeout of a lost TCP segment, Linux's minimum.
+#define LOOPBACK_NET_RTO_US      200000
+
+// payload bytes of a TCP segment, for the loss of multi-segment frames.
+#define LOOPBACK_NET_MSS         1448
+
+typedef enum {
+   LOOPBACK_NET_TO_CLIENT,           /* agent to client */
+   LOOPBACK_NET_TO_SERVER,           /* client to agent */
+   LOOPBACK_NET_DIRECTIONS
+} LoopbackNetDirection;
+
+typedef enum {
+   LOOPBACK_JITTER_UNIFORM,          /* +/- jitterUs */
+   LOOPBACK_JITTER_NORMAL,           /* standard deviation jitterUs */
+   LOOPBACK_JITTER_PARETO            /* heavy tail, mean jitterUs */
+} LoopbackJitter;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackNetParams
+ *
+ *    One direction of the link.  Every transport stays in order, so a
+ *    frame that is late for any reason holds back the ones behind it on
+ *    the same channel.  Loss and reordering only apply to the TCP side
+ *    channel: a lost segment arrives one RTO later (doubling on every
+ *    new loss), a reordered frame <reorderUs> later.  While <down> the
+ *    frames wait for the link to come back up.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint32                  latencyUs;
+   uint32                  jitterUs;
+   LoopbackJitter          jitter;
+   uint64                  bitsPerSec;       /* 0 for no limit */
+   double                  loss;             /* per segment */
+   double                  reorder;          /* per frame */
+   uint32                  rtoUs;
+   uint32                  reorderUs;
+   bool                    down;
+} LoopbackNetParams;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackNetStep
+ *
+ *    The link from <atUs> after the connection is opened, until the
+ *    next step.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64                  atUs;
+   LoopbackNetParams       dir[LOOPBACK_NET_DIRECTIONS];
+} LoopbackNetStep;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackNetStats
+ *
+ *    Counters of one direction, over all the links of a network.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64                  frames;
+   uint64                  bytes;
+   uint64                  lost;             /* frames that needed a resend */
+   uint64                  reordered;
+   uint64                  queueUs;          /* total time waiting for the wire */
+   uint64                  maxQueueUs;
+   uint64                  delayUs;          /* total send to delivery time */
+   uint64                  maxDelayUs;
+} LoopbackNetStats;
+
+class LoopbackNetwork;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackNetLink
+ *
+ *    The link of one connection.  It computes when each frame arrives
+ *    and leaves the waiting to the scheduler of its network.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackNetLink : public LoopbackLink
+{
+public:
+   LoopbackNetLink(LoopbackNetwork* network, unsigned long sid);
+   virtual ~LoopbackNetLink() { Close(); }
+
+   virtual void Send(const std::shared_ptr<LoopbackEndpoint>& to,
+                     LoopbackFrame* frame);
+   virtual void Close();
+
+private:
+   typedef struct {
+      std::mt19937_64               rng;
+      uint64                        wireFreeUs;
+      std::map<int32, uint64>       lastArrivalUs;    /* by channel */
+   } Direction;
+
+   friend class LoopbackNetwork;
+
+   LoopbackNetwork*        m_network;
+   uint64                  m_startUs;
+   Direction               m_dir[LOOPBACK_NET_DIRECTIONS];
+   bool                    m_closed;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackNetwork
+ *
+ *    Creates the links, see LoopbackService::SetLinkFactory(), and
+ *    delivers their frames when they are due from its own thread.  It
+ *    must outlive the connections that use it.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackNetwork
+{
+public:
+   LoopbackNetwork(uint64 seed);
+   ~LoopbackNetwork();
+
+   static void DefaultParams(LoopbackNetParams* params);
+
+   void AddStep(const LoopbackNetStep& step);
+   bool Parse(const char* spec);
+
+   void GetStats(LoopbackNetDirection direction, LoopbackNetStats* stats);
+
+   static LoopbackLink* CreateLink(unsigned long sid, void* userData);
+
+   static uint64 NowUs();
+
+private:
+   typedef struct {
+      uint64                           dueUs;
+      uint64                           seq;
+      LoopbackNetLink*                 link;
+      std::weak_ptr<LoopbackEndpoint>  to;
+      LoopbackFrame*                   frame;
+   } Pending;
+
+   struct PendingLater
+   {
+      bool operator()(const Pending& a, const Pending& b) const
+      {
+         return a.dueUs != b.dueUs ? a.dueUs > b.dueUs : a.seq > b.seq;
+      }
+   };
+
+   friend class LoopbackNetLink;
+
+   void Send(LoopbackNetLink* link, const std::shared_ptr<LoopbackEndpoint>& to,
+             LoopbackFrame* frame);
+   void Close(LoopbackNetLink* link);
+   const LoopbackNetStep* StepAt(uint64 elapsedUs, uint64* nextUs);
+   uint64 UpAt(LoopbackNetDirection direction, uint64 elapsedUs);
+   int64 DrawJitter(const LoopbackNetParams& params, std::mt19937_64& rng);
+   static double DrawUnit(std::mt19937_64& rng);
+   void SchedulerMain();
+
+   uint64                                 m_seed;
+   std::vector<LoopbackNetStep>           m_steps;
+
+   std::mutex                             m_mutex;
+   std::condition_variable                m_cond;
+   std::vector<Pending>                   m_pending;      /* heap, PendingLater */
+   uint64                                 m_seq;
+   bool                                   m_stop;
+   std::thread                            m_thread;
+
+   LoopbackNetStats                       m_stats[LOOPBACK_NET_DIRECTIONS];
+};
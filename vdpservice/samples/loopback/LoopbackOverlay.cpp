@@ -0,0 +1,1473 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackOverlay.cpp --
+ *
+ *    The overlay guest and client interfaces.  Nothing is drawn: the hub
+ *    keeps the state of every overlay, copies the images it is given and
+ *    forwards the notifications between the guest and the clients, so
+ *    the overlay paths of a plugin can run and be measured.
+ *
+ *    Guest windows and local overlays share one id space.  Callbacks are
+ *    posted to the apartment of the thread that called Init(), they are
+ *    fired from its Poll().
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackService.h"
+
+// the single desktop of the topology.
+#define LOOPBACK_DESKTOP_WIDTH   1920
+#define LOOPBACK_DESKTOP_HEIGHT  1080
+
+typedef std::weak_ptr<LoopbackApartment> LoopbackApartmentRef;
+
+typedef struct {
+   VDPOverlayClient_Sink   sink;
+   void*                   userData;
+   LoopbackApartmentRef    apartment;
+   bool                    local;
+} LoopbackOverlayClient;
+
+typedef struct {
+   VDPOverlay_WindowId                    id;
+   bool                                   local;
+
+   /* client context that accepted the window or created the overlay */
+   VDPOverlayClient_ContextId             owner;
+
+   VDPOverlay_UserArgs                    userArgs;
+   VDPOverlay_HWND                        hWnd;
+   bool                                   ready;
+   bool                                   enabled;
+   VDPOverlay_LayoutMode                  layoutMode;
+   uint32                                 colorkey;
+   uint32                                 layer;
+   uint32                                 bgColor;
+   bool                                   areaEnabled;
+   bool                                   clipToWindow;
+   VMRect                                 rect;
+   std::vector<VMRect>                    clipRects;
+   std::string                            infoStr;
+   VDPOverlayClient_InfoStringProperties  infoProps;
+
+   VDPOverlay_ImageFormat                 format;
+   int32                                  imageWidth;
+   int32                                  imageHeight;
+   int32                                  imagePitch;
+   std::vector<char>                      image;
+} LoopbackOverlay;
+
+static std::mutex s_mutex;
+static bool s_guestInit = false;
+static VDPOverlayGuest_Sink s_guestSink;
+static void* s_guestUserData = NULL;
+static LoopbackApartmentRef s_guestApartment;
+static std::map<VDPOverlayClient_ContextId, LoopbackOverlayClient> s_clients;
+static std::map<VDPOverlay_WindowId, LoopbackOverlay> s_overlays;
+static uint32 s_nextId = 1;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PostTo --
+ *
+ *    Runs <job> on the thread of an apartment.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The job is dropped if the thread is gone.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PostTo(const LoopbackApartmentRef& ref,        // IN
+       const std::function<void()>& job)       // IN
+{
+   std::shared_ptr<LoopbackApartment> apartment = ref.lock();
+
+   if (apartment) {
+      apartment->Post(job);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewOverlay --
+ *
+ *    Adds an overlay with the default settings, the lock must be held.
+ *
+ * Results:
+ *    The overlay.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LoopbackOverlay*
+NewOverlay(VDPOverlay_WindowId id,   // IN
+           bool local)               // IN
+{
+   LoopbackOverlay& o = s_overlays[id];
+
+   o.id = id;
+   o.local = local;
+   o.owner = VDP_OVERLAY_CLIENT_CONTEXT_ID_NONE;
+   o.userArgs = 0;
+   o.hWnd = NULL;
+   o.ready = local;
+   o.enabled = false;
+   o.layoutMode = VDP_OVERLAY_LAYOUT_CENTER;
+   o.colorkey = local ? VDP_OVERLAY_COLORKEY_NONE : (0x00010001 * (id & 0xFF)) | 0x0100;
+   o.layer = VDP_OVERLAY_LAYER_DEFAULT;
+   o.bgColor = 0;
+   o.areaEnabled = false;
+   o.clipToWindow = false;
+   memset(&o.rect, 0, sizeof o.rect);
+   memset(&o.infoProps, 0, sizeof o.infoProps);
+   o.infoProps.version = VDP_OVERLAY_INFO_STRING_PROPERTIES_V4;
+   o.format = VDP_OVERLAY_BGRX;
+   o.imageWidth = 0;
+   o.imageHeight = 0;
+   o.imagePitch = 0;
+   return &o;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindOverlay --
+ *
+ *    Looks up an overlay, the lock must be held.
+ *
+ * Results:
+ *    The overlay or NULL.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LoopbackOverlay*
+FindOverlay(VDPOverlay_WindowId id)   // IN
+{
+   auto it = s_overlays.find(id);
+   return it != s_overlays.end() ? &it->second : NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindClientOverlay --
+ *
+ *    Looks up an overlay on behalf of a client context, the lock must
+ *    be held.  Guest windows are only visible to the context that
+ *    accepted them and local overlays to the one that created them.
+ *
+ * Results:
+ *    VDP_OVERLAY_ERROR_SUCCESS and the overlay, or the error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VDPOverlay_Error
+FindClientOverlay(VDPOverlayClient_ContextId contextId,   // IN
+                  VDPOverlay_WindowId id,                  // IN
+                  bool localOnly,                          // IN
+                  LoopbackOverlay** overlay)               // OUT
+{
+   if (s_clients.find(contextId) == s_clients.end()) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   LoopbackOverlay* o = FindOverlay(id);
+   if (o == NULL || o->owner != contextId) {
+      return VDP_OVERLAY_ERROR_WINDOW_NOT_REGISTERED;
+   }
+
+   if (localOnly && !o->local) {
+      return VDP_OVERLAY_ERROR_NOT_LOCAL_OVERLAY;
+   }
+
+   *overlay = o;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NotifyOwner --
+ *
+ *    Posts a client sink callback to the context owning a guest window,
+ *    the lock must be held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+NotifyOwner(const LoopbackOverlay* o,                                      // IN
+            const std::function<void(const LoopbackOverlayClient&,
+                                     VDPOverlayClient_ContextId)>& call)   // IN
+{
+   auto it = s_clients.find(o->owner);
+   if (o->local || it == s_clients.end()) {
+      return;
+   }
+
+   LoopbackOverlayClient client = it->second;
+   VDPOverlayClient_ContextId contextId = o->owner;
+   PostTo(client.apartment, [client, contextId, call]() { call(client, contextId); });
+}
+
+
+/*
+ * The guest interface.
+ */
+
+static VDPOverlay_Error
+GuestInit(const VDPOverlayGuest_Sink* sink,   // IN
+          void* userData)                     // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (sink == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   if (s_guestInit) {
+      return VDP_OVERLAY_ERROR_ALREADY_INITIALIZED;
+   }
+
+   s_guestSink = *sink;
+   s_guestUserData = userData;
+   s_guestApartment = LoopbackApartment::Current();
+   s_guestInit = true;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestExit(void)
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   for (auto it = s_overlays.begin(); it != s_overlays.end(); ) {
+      if (it->second.local) {
+         ++it;
+         continue;
+      }
+
+      VDPOverlay_WindowId id = it->first;
+      VDPOverlay_UserArgs userArgs = it->second.userArgs;
+      NotifyOwner(&it->second, [id, userArgs](const LoopbackOverlayClient& c,
+                                              VDPOverlayClient_ContextId ctx) {
+         if (c.sink.v1.OnWindowUnregistered != NULL) {
+            c.sink.v1.OnWindowUnregistered(c.userData, ctx, id, userArgs);
+         }
+      });
+      it = s_overlays.erase(it);
+   }
+
+   s_guestInit = false;
+   s_guestApartment.reset();
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RegisterGuestWindow --
+ *
+ *    Offers a guest window to the first remote client, which accepts or
+ *    rejects it from its OnWindowRegistered().  The lock must be held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The guest gets OnOverlayReady(), OnOverlayRejected() or, without a
+ *    client, OnOverlayCreateError().
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RegisterGuestWindow(LoopbackOverlay* o)   // IN
+{
+   VDPOverlayGuest_Sink guestSink = s_guestSink;
+   void* guestUserData = s_guestUserData;
+   LoopbackApartmentRef guestApartment = s_guestApartment;
+   VDPOverlay_WindowId id = o->id;
+   VDPOverlay_UserArgs userArgs = o->userArgs;
+
+   auto it = s_clients.begin();
+   while (it != s_clients.end() && it->second.local) {
+      ++it;
+   }
+
+   if (it == s_clients.end()) {
+      PostTo(guestApartment, [guestSink, guestUserData, id]() {
+         if (guestSink.v1.OnOverlayCreateError != NULL) {
+            guestSink.v1.OnOverlayCreateError(guestUserData, id,
+                                              VDP_OVERLAY_ERROR_NOT_SUPPORTED_BY_CLIENT);
+         }
+      });
+      return;
+   }
+
+   LoopbackOverlayClient client = it->second;
+   VDPOverlayClient_ContextId contextId = it->first;
+   o->owner = contextId;
+
+   PostTo(client.apartment, [=]() {
+      Bool reject = FALSE;
+      uint32 response = 0;
+
+      if (client.sink.v1.OnWindowRegistered != NULL) {
+         client.sink.v1.OnWindowRegistered(client.userData, contextId, id, userArgs,
+                                           &reject, &response);
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(s_mutex);
+
+         LoopbackOverlay* window = FindOverlay(id);
+         if (window == NULL || window->owner != contextId) {
+            return;
+         }
+         window->ready = !reject;
+         if (reject) {
+            window->owner = VDP_OVERLAY_CLIENT_CONTEXT_ID_NONE;
+         }
+      }
+
+      PostTo(guestApartment, [=]() {
+         if (reject) {
+            if (guestSink.v1.OnOverlayRejected != NULL) {
+               guestSink.v1.OnOverlayRejected(guestUserData, id, response);
+            }
+         } else if (guestSink.v1.OnOverlayReady != NULL) {
+            guestSink.v1.OnOverlayReady(guestUserData, id, response);
+         }
+      });
+   });
+}
+
+static VDPOverlay_Error
+GuestRegisterWindow(VDPOverlay_WindowId windowId,   // IN
+                    VDPOverlay_UserArgs userArgs)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if (windowId == VDP_OVERLAY_WINDOW_ID_NONE) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   if (FindOverlay(windowId) != NULL) {
+      return VDP_OVERLAY_ERROR_WINDOW_ALREADY_REGISTERED;
+   }
+
+   LoopbackOverlay* o = NewOverlay(windowId, false);
+   o->userArgs = userArgs;
+   RegisterGuestWindow(o);
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestRegisterWindow3(VDPOverlay_HWND hWnd,              // IN
+                     VDPOverlay_UserArgs userArgs,      // IN
+                     VDPOverlay_WindowId* pWindowId)    // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if (pWindowId == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   for (auto it = s_overlays.begin(); it != s_overlays.end(); ++it) {
+      if (!it->second.local && hWnd != NULL && it->second.hWnd == hWnd) {
+         return VDP_OVERLAY_ERROR_WINDOW_ALREADY_REGISTERED;
+      }
+   }
+
+   while (FindOverlay(s_nextId) != NULL || s_nextId == VDP_OVERLAY_WINDOW_ID_NONE) {
+      s_nextId++;
+   }
+
+   LoopbackOverlay* o = NewOverlay(s_nextId++, false);
+   o->userArgs = userArgs;
+   o->hWnd = hWnd;
+   *pWindowId = o->id;
+   RegisterGuestWindow(o);
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestFindWindow(VDPOverlay_WindowId windowId,   // IN
+                LoopbackOverlay** overlay)      // OUT
+{
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   LoopbackOverlay* o = FindOverlay(windowId);
+   if (o == NULL || o->local) {
+      return VDP_OVERLAY_ERROR_WINDOW_NOT_REGISTERED;
+   }
+
+   *overlay = o;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestUnregisterWindow(VDPOverlay_WindowId windowId,   // IN
+                      VDPOverlay_UserArgs userArgs)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   NotifyOwner(o, [windowId, userArgs](const LoopbackOverlayClient& c,
+                                       VDPOverlayClient_ContextId ctx) {
+      if (c.sink.v1.OnWindowUnregistered != NULL) {
+         c.sink.v1.OnWindowUnregistered(c.userData, ctx, windowId, userArgs);
+      }
+   });
+   s_overlays.erase(windowId);
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static Bool
+GuestIsWindowRegistered(VDPOverlay_WindowId windowId)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   return GuestFindWindow(windowId, &o) == VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestSetEnabled(VDPOverlay_WindowId windowId,   // IN
+                VDPOverlay_UserArgs userArgs,   // IN
+                bool enabled)                   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   if (!o->ready) {
+      return VDP_OVERLAY_ERROR_OVERLAY_NOT_READY;
+   }
+
+   o->enabled = enabled;
+   NotifyOwner(o, [windowId, userArgs, enabled](const LoopbackOverlayClient& c,
+                                                VDPOverlayClient_ContextId ctx) {
+      if (enabled && c.sink.v1.OnOverlayEnabled != NULL) {
+         c.sink.v1.OnOverlayEnabled(c.userData, ctx, windowId, userArgs);
+      } else if (!enabled && c.sink.v1.OnOverlayDisabled != NULL) {
+         c.sink.v1.OnOverlayDisabled(c.userData, ctx, windowId, userArgs);
+      }
+   });
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestEnableOverlay(VDPOverlay_WindowId windowId,   // IN
+                   VDPOverlay_UserArgs userArgs)   // IN
+{
+   return GuestSetEnabled(windowId, userArgs, true);
+}
+
+static VDPOverlay_Error
+GuestDisableOverlay(VDPOverlay_WindowId windowId,   // IN
+                    VDPOverlay_UserArgs userArgs)   // IN
+{
+   return GuestSetEnabled(windowId, userArgs, false);
+}
+
+static Bool
+GuestIsOverlayEnabled(VDPOverlay_WindowId windowId)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   return GuestFindWindow(windowId, &o) == VDP_OVERLAY_ERROR_SUCCESS && o->enabled;
+}
+
+static VDPOverlay_Error
+GuestSetLayoutMode(VDPOverlay_WindowId windowId,       // IN
+                   VDPOverlay_LayoutMode layoutMode)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   o->layoutMode = layoutMode;
+   NotifyOwner(o, [windowId, layoutMode](const LoopbackOverlayClient& c,
+                                         VDPOverlayClient_ContextId ctx) {
+      if (c.sink.v1.OnLayoutModeChanged != NULL) {
+         c.sink.v1.OnLayoutModeChanged(c.userData, ctx, windowId, layoutMode);
+      }
+   });
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestGetLayoutMode(VDPOverlay_WindowId windowId,          // IN
+                   VDPOverlay_LayoutMode* pLayoutMode)    // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pLayoutMode == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pLayoutMode = o->layoutMode;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+GuestSendMsg(VDPOverlay_WindowId windowId,   // IN
+             void* msg,                      // IN
+             uint32 msgLen)                  // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if ((msg == NULL && msgLen > 0) || msgLen > VDP_OVERLAY_USER_MSG_MAX_LEN) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   std::vector<char> data((char*)msg, (char*)msg + msgLen);
+   auto deliver = [windowId, data](const LoopbackOverlayClient& c,
+                                   VDPOverlayClient_ContextId ctx) {
+      if (c.sink.v1.OnUserMsg != NULL) {
+         std::vector<char> copy = data;
+         c.sink.v1.OnUserMsg(c.userData, ctx, windowId, copy.data(),
+                             (uint32)copy.size());
+      }
+   };
+
+   if (windowId != VDP_OVERLAY_WINDOW_ID_NONE) {
+      LoopbackOverlay* o;
+      VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+      if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+         return err;
+      }
+      NotifyOwner(o, deliver);
+      return VDP_OVERLAY_ERROR_SUCCESS;
+   }
+
+   for (auto it = s_clients.begin(); it != s_clients.end(); ++it) {
+      if (!it->second.local) {
+         LoopbackOverlayClient client = it->second;
+         VDPOverlayClient_ContextId ctx = it->first;
+         PostTo(client.apartment, [client, ctx, deliver]() { deliver(client, ctx); });
+      }
+   }
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestGetColorkey(VDPOverlay_WindowId windowId,   // IN
+                 uint32* pColorkey)              // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pColorkey == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pColorkey = o->colorkey;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+GuestSetArea(VDPOverlay_WindowId windowId,   // IN
+             Bool enabled,                   // IN
+             Bool clipToWindow,              // IN
+             VDPOverlay_Rect* pRect)         // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pRect == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   bool moved = o->rect.left != pRect->left || o->rect.top != pRect->top;
+   bool resized = o->rect.right - o->rect.left != pRect->right - pRect->left ||
+                  o->rect.bottom - o->rect.top != pRect->bottom - pRect->top;
+
+   o->areaEnabled = enabled != FALSE;
+   o->clipToWindow = clipToWindow != FALSE;
+   o->rect = *pRect;
+
+   VMRect rect = *pRect;
+   NotifyOwner(o, [windowId, rect, moved, resized](const LoopbackOverlayClient& c,
+                                                   VDPOverlayClient_ContextId ctx) {
+      if (moved && c.sink.v1.OnWindowPositionChanged != NULL) {
+         c.sink.v1.OnWindowPositionChanged(c.userData, ctx, windowId, rect.left, rect.top);
+      }
+      if (resized && c.sink.v1.OnWindowSizeChanged != NULL) {
+         c.sink.v1.OnWindowSizeChanged(c.userData, ctx, windowId,
+                                       rect.right - rect.left, rect.bottom - rect.top);
+      }
+   });
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestGetArea(VDPOverlay_WindowId windowId,   // IN
+             Bool* pEnabled,                 // OUT
+             Bool* pClipToWindow,            // OUT
+             VDPOverlay_Rect* pRect)         // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pRect == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   if (pEnabled != NULL) {
+      *pEnabled = o->areaEnabled;
+   }
+   if (pClipToWindow != NULL) {
+      *pClipToWindow = o->clipToWindow;
+   }
+   *pRect = o->rect;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestSetAreaRect3(VDPOverlay_WindowId windowId,   // IN
+                  VDPOverlay_Rect* pRect)         // IN
+{
+   return GuestSetArea(windowId, TRUE, FALSE, pRect);
+}
+
+static VDPOverlay_Error
+GuestGetAreaRect3(VDPOverlay_WindowId windowId,   // IN
+                  VDPOverlay_Rect* pRect)         // OUT
+{
+   return GuestGetArea(windowId, NULL, NULL, pRect);
+}
+
+static VDPOverlay_Error
+GuestSetLayer(VDPOverlay_WindowId windowId,   // IN
+              uint32 layer)                   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   o->layer = layer;
+   NotifyOwner(o, [windowId, layer](const LoopbackOverlayClient& c,
+                                    VDPOverlayClient_ContextId ctx) {
+      if (c.sink.version >= VDP_OVERLAY_CLIENT_SINK_V3 &&
+          c.sink.v3.OnLayerChanged != NULL) {
+         c.sink.v3.OnLayerChanged(c.userData, ctx, windowId, layer);
+      }
+   });
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestGetLayer(VDPOverlay_WindowId windowId,   // IN
+              uint32* pLayer)                 // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pLayer == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pLayer = o->layer;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+GuestGetHWnd(VDPOverlay_WindowId windowId,   // IN
+             VDPOverlay_HWND* pHWnd)         // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pHWnd == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pHWnd = o->hWnd;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+GuestSetBackgroundColor(VDPOverlay_WindowId windowId,   // IN
+                        uint32 bgColor)                 // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->bgColor = bgColor;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+GuestGetBackgroundColor(VDPOverlay_WindowId windowId,   // IN
+                        uint32* pBackgroundColor)       // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pBackgroundColor == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pBackgroundColor = o->bgColor;
+   }
+   return err;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetInfoString / GetInfoString --
+ *
+ *    The information string of an overlay, the lock must be held.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VDPOverlay_Error
+SetInfoString(LoopbackOverlay* o,     // IN
+              const char* infoStr)    // IN
+{
+   if (infoStr != NULL && strlen(infoStr) > VDP_OVERLAY_INFO_STR_MAX_LEN) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   o->infoStr = infoStr != NULL ? infoStr : "";
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GetInfoString(const LoopbackOverlay* o,   // IN
+              char* infoStr,              // OUT
+              int32 infoStrSize)          // IN
+{
+   if (infoStr == NULL || infoStrSize <= (int32)o->infoStr.size()) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   memcpy(infoStr, o->infoStr.c_str(), o->infoStr.size() + 1);
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+GuestSetInfoString(VDPOverlay_WindowId windowId,   // IN
+                   const char* infoStr)            // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   return err == VDP_OVERLAY_ERROR_SUCCESS ? SetInfoString(o, infoStr) : err;
+}
+
+static VDPOverlay_Error
+GuestGetInfoString(VDPOverlay_WindowId windowId,   // IN
+                   char* infoStr,                  // OUT
+                   int32 infoStrSize)              // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = GuestFindWindow(windowId, &o);
+   return err == VDP_OVERLAY_ERROR_SUCCESS ? GetInfoString(o, infoStr, infoStrSize) : err;
+}
+
+
+/*
+ * The client interface.
+ */
+
+static VDPOverlay_Error
+ClientInitCommon(const VDPOverlayClient_Sink* sink,        // IN
+                 void* userData,                           // IN
+                 VDPOverlayClient_ContextId* pContextId,   // OUT
+                 bool local)                               // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (sink == NULL || pContextId == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   static VDPOverlayClient_ContextId nextContextId = 1;
+   VDPOverlayClient_ContextId contextId = nextContextId++;
+
+   LoopbackOverlayClient& client = s_clients[contextId];
+   client.sink = *sink;
+   client.userData = userData;
+   client.apartment = LoopbackApartment::Current();
+   client.local = local;
+
+   if (sink->version >= VDP_OVERLAY_CLIENT_SINK_V3 && sink->v3.OnTopologyChanged != NULL) {
+      LoopbackOverlayClient c = client;
+      PostTo(c.apartment, [c, contextId]() {
+         VMRect desktop = { 0, 0, LOOPBACK_DESKTOP_WIDTH, LOOPBACK_DESKTOP_HEIGHT };
+         c.sink.v3.OnTopologyChanged(c.userData, contextId, &desktop, 1, &desktop);
+      });
+   }
+
+   *pContextId = contextId;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientInit(const VDPOverlayClient_Sink* sink,        // IN
+           void* userData,                           // IN
+           VDPOverlayClient_ContextId* pContextId)   // OUT
+{
+   return ClientInitCommon(sink, userData, pContextId, false);
+}
+
+static VDPOverlay_Error
+ClientInitLocal(const VDPOverlayClient_Sink* sink,        // IN
+                void* userData,                           // IN
+                VDPOverlayClient_ContextId* pContextId)   // OUT
+{
+   return ClientInitCommon(sink, userData, pContextId, true);
+}
+
+static VDPOverlay_Error
+ClientExit(VDPOverlayClient_ContextId contextId)   // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (s_clients.erase(contextId) == 0) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   for (auto it = s_overlays.begin(); it != s_overlays.end(); ) {
+      if (it->second.owner != contextId) {
+         ++it;
+      } else if (it->second.local) {
+         it = s_overlays.erase(it);
+      } else {
+         it->second.owner = VDP_OVERLAY_CLIENT_CONTEXT_ID_NONE;
+         it->second.ready = false;
+         ++it;
+      }
+   }
+
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientUpdate2(VDPOverlayClient_ContextId contextId,   // IN
+              VDPOverlay_WindowId windowId,           // IN
+              void* pImage,                           // IN
+              int32 width,                            // IN
+              int32 height,                           // IN
+              int32 pitch,                            // IN
+              VDPOverlay_ImageFormat format,          // IN
+              uint32 flags)                           // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   if (!o->ready) {
+      return VDP_OVERLAY_ERROR_OVERLAY_NOT_READY;
+   }
+
+   if (pImage == NULL || width <= 0 || height <= 0 || pitch == 0) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   o->format = format;
+   o->imageWidth = width;
+   o->imageHeight = height;
+   o->imagePitch = pitch;
+
+   if ((flags & VDP_OVERLAY_UPDATE_FLAG_COPY_IMAGE) != 0) {
+      size_t rowBytes = (size_t)(pitch < 0 ? -pitch : pitch);
+      o->image.resize(rowBytes * height);
+
+      /*
+       * A negative pitch is a bottom-up image, pImage is its first row
+       * in memory order.
+       */
+      memcpy(o->image.data(), pImage, o->image.size());
+   } else {
+      o->image.clear();
+   }
+
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientUpdate(VDPOverlayClient_ContextId contextId,   // IN
+             VDPOverlay_WindowId windowId,           // IN
+             void* pImage,                           // IN
+             int32 width,                            // IN
+             int32 height,                           // IN
+             int32 pitch,                            // IN
+             Bool copyImage)                         // IN
+{
+   return ClientUpdate2(contextId, windowId, pImage, width, height, pitch,
+                        VDP_OVERLAY_BGRX,
+                        copyImage ? VDP_OVERLAY_UPDATE_FLAG_COPY_IMAGE :
+                                    VDP_OVERLAY_UPDATE_FLAG_NONE);
+}
+
+static VDPOverlay_Error
+ClientGetInfoCommon(VDPOverlayClient_ContextId contextId,          // IN
+                    VDPOverlay_WindowId windowId,                  // IN
+                    VDPOverlayClient_OverlayInfo* pOverlayInfo,    // OUT
+                    uint32 version)                                // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pOverlayInfo == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   if (err != VDP_OVERLAY_ERROR_SUCCESS) {
+      return err;
+   }
+
+   pOverlayInfo->version = version;
+   pOverlayInfo->v1.windowId = windowId;
+   pOverlayInfo->v1.xUI = o->rect.left;
+   pOverlayInfo->v1.yUI = o->rect.top;
+   pOverlayInfo->v1.width = o->rect.right - o->rect.left;
+   pOverlayInfo->v1.height = o->rect.bottom - o->rect.top;
+   pOverlayInfo->v1.enabled = o->enabled;
+   pOverlayInfo->v1.visible = o->enabled;
+   pOverlayInfo->v1.layoutMode = o->layoutMode;
+
+   if (version >= VDP_OVERLAY_INFO_V2) {
+      pOverlayInfo->v2.imageFormat = o->format;
+      pOverlayInfo->v2.colorkey = o->colorkey;
+      pOverlayInfo->v2.layer = o->layer;
+      pOverlayInfo->v2.hasClipRegion = !o->clipRects.empty();
+   }
+
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientGetInfo(VDPOverlayClient_ContextId contextId,          // IN
+              VDPOverlay_WindowId windowId,                  // IN
+              VDPOverlayClient_OverlayInfo* pOverlayInfo)    // OUT
+{
+   return ClientGetInfoCommon(contextId, windowId, pOverlayInfo, VDP_OVERLAY_INFO_V1);
+}
+
+static VDPOverlay_Error
+ClientGetInfo2(VDPOverlayClient_ContextId contextId,          // IN
+               VDPOverlay_WindowId windowId,                  // IN
+               VDPOverlayClient_OverlayInfo* pOverlayInfo)    // OUT
+{
+   return ClientGetInfoCommon(contextId, windowId, pOverlayInfo, VDP_OVERLAY_INFO_V2);
+}
+
+static VDPOverlay_Error
+ClientSendMsg(VDPOverlayClient_ContextId contextId,   // IN
+              VDPOverlay_WindowId windowId,           // IN
+              void* msg,                              // IN
+              uint32 msgLen)                          // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (s_clients.find(contextId) == s_clients.end()) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if ((msg == NULL && msgLen > 0) || msgLen > VDP_OVERLAY_USER_MSG_MAX_LEN) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   if (!s_guestInit) {
+      return VDP_OVERLAY_ERROR_OVERLAY_NOT_READY;
+   }
+
+   VDPOverlayGuest_Sink sink = s_guestSink;
+   void* userData = s_guestUserData;
+   std::vector<char> data((char*)msg, (char*)msg + msgLen);
+
+   PostTo(s_guestApartment, [sink, userData, windowId, data]() {
+      if (sink.v1.OnUserMsg != NULL) {
+         std::vector<char> copy = data;
+         sink.v1.OnUserMsg(userData, windowId, copy.data(), (uint32)copy.size());
+      }
+   });
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientCreateOverlay(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_OverlayId* pOverlayId)       // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+
+   if (s_clients.find(contextId) == s_clients.end()) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if (pOverlayId == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   while (FindOverlay(s_nextId) != NULL || s_nextId == VDP_OVERLAY_WINDOW_ID_NONE) {
+      s_nextId++;
+   }
+
+   LoopbackOverlay* o = NewOverlay(s_nextId++, true);
+   o->owner = contextId;
+   *pOverlayId = o->id;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientDestroyOverlay(VDPOverlayClient_ContextId contextId,   // IN
+                     VDPOverlay_OverlayId overlayId)         // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      s_overlays.erase(overlayId);
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetPosition(VDPOverlayClient_ContextId contextId,   // IN
+                  VDPOverlay_OverlayId overlayId,         // IN
+                  int32 x,                                // IN
+                  int32 y)                                // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->rect.right += x - o->rect.left;
+      o->rect.bottom += y - o->rect.top;
+      o->rect.left = x;
+      o->rect.top = y;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetSize(VDPOverlayClient_ContextId contextId,   // IN
+              VDPOverlay_OverlayId overlayId,         // IN
+              int32 width,                            // IN
+              int32 height)                           // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (width < 0 || height < 0) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->rect.right = o->rect.left + width;
+      o->rect.bottom = o->rect.top + height;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetClipRegion(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_OverlayId overlayId,         // IN
+                    VMRect* pClipRects,                     // IN
+                    int32 nClipRects)                       // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (nClipRects < 0 || (nClipRects > 0 && pClipRects == NULL)) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->clipRects.assign(pClipRects, pClipRects + nClipRects);
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetLayer(VDPOverlayClient_ContextId contextId,   // IN
+               VDPOverlay_OverlayId overlayId,         // IN
+               uint32 layer)                           // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->layer = layer;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetColorkey(VDPOverlayClient_ContextId contextId,   // IN
+                  VDPOverlay_OverlayId overlayId,         // IN
+                  uint32 colorkey)                        // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, overlayId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->colorkey = colorkey;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientSetEnabled(VDPOverlayClient_ContextId contextId,   // IN
+                 VDPOverlay_WindowId windowId,           // IN
+                 bool enabled)                           // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->enabled = enabled;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientEnableOverlay(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_WindowId windowId)           // IN
+{
+   return ClientSetEnabled(contextId, windowId, true);
+}
+
+static VDPOverlay_Error
+ClientDisableOverlay(VDPOverlayClient_ContextId contextId,   // IN
+                     VDPOverlay_WindowId windowId)           // IN
+{
+   return ClientSetEnabled(contextId, windowId, false);
+}
+
+static VDPOverlay_Error
+ClientSetLayoutMode(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_WindowId windowId,           // IN
+                    VDPOverlay_LayoutMode layoutMode)       // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, true, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->layoutMode = layoutMode;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientGetTopology(VDPOverlayClient_ContextId contextId,   // IN
+                  VDPOverlay_Rect* desktopBounds,         // OUT
+                  int32* pszDesktopTopology,              // IN/OUT
+                  VDPOverlay_Rect* desktopTopology)       // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   VMRect desktop = { 0, 0, LOOPBACK_DESKTOP_WIDTH, LOOPBACK_DESKTOP_HEIGHT };
+
+   if (s_clients.find(contextId) == s_clients.end()) {
+      return VDP_OVERLAY_ERROR_NOT_INITIALIZED;
+   }
+
+   if (desktopBounds != NULL) {
+      *desktopBounds = desktop;
+   }
+
+   if (pszDesktopTopology == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   if (desktopTopology == NULL || *pszDesktopTopology < 1) {
+      *pszDesktopTopology = 1;
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   desktopTopology[0] = desktop;
+   *pszDesktopTopology = 1;
+   return VDP_OVERLAY_ERROR_SUCCESS;
+}
+
+static VDPOverlay_Error
+ClientSetInfoString(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_WindowId windowId,           // IN
+                    const char* infoStr)                    // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   return err == VDP_OVERLAY_ERROR_SUCCESS ? SetInfoString(o, infoStr) : err;
+}
+
+static VDPOverlay_Error
+ClientGetInfoString(VDPOverlayClient_ContextId contextId,   // IN
+                    VDPOverlay_WindowId windowId,           // IN
+                    char* infoStr,                          // OUT
+                    int32 infoStrSize)                      // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   return err == VDP_OVERLAY_ERROR_SUCCESS ? GetInfoString(o, infoStr, infoStrSize) : err;
+}
+
+static VDPOverlay_Error
+ClientSetInfoStringProperties(VDPOverlayClient_ContextId contextId,                // IN
+                              VDPOverlay_WindowId windowId,                        // IN
+                              VDPOverlayClient_InfoStringProperties* pProperties)  // IN
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pProperties == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      o->infoProps = *pProperties;
+   }
+   return err;
+}
+
+static VDPOverlay_Error
+ClientGetInfoStringProperties(VDPOverlayClient_ContextId contextId,                // IN
+                              VDPOverlay_WindowId windowId,                        // IN
+                              VDPOverlayClient_InfoStringProperties* pProperties)  // OUT
+{
+   std::lock_guard<std::mutex> lock(s_mutex);
+   LoopbackOverlay* o;
+
+   if (pProperties == NULL) {
+      return VDP_OVERLAY_ERROR_INVALID_PARAMETER;
+   }
+
+   VDPOverlay_Error err = FindClientOverlay(contextId, windowId, false, &o);
+   if (err == VDP_OVERLAY_ERROR_SUCCESS) {
+      *pProperties = o->infoProps;
+   }
+   return err;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackOverlayQueryInterface --
+ *
+ *    Fills the overlay guest or client interface.
+ *
+ * Results:
+ *    false if <iid> is not one of their versions.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackOverlayQueryInterface(const GUID* iid,   // IN
+                              void* iface)       // OUT
+{
+   static const struct {
+      const GUID* iid;
+      uint32 version;
+   } guests[] = {
+      { &GUID_VDPOverlay_GuestInterface_V1, VDP_OVERLAY_GUEST_INTERFACE_V1 },
+      { &GUID_VDPOverlay_GuestInterface_V2, VDP_OVERLAY_GUEST_INTERFACE_V2 },
+      { &GUID_VDPOverlay_GuestInterface_V3, VDP_OVERLAY_GUEST_INTERFACE_V3 },
+      { &GUID_VDPOverlay_GuestInterface_V4, VDP_OVERLAY_GUEST_INTERFACE_V4 },
+   }, clients[] = {
+      { &GUID_VDPOverlay_ClientInterface_V1, VDP_OVERLAY_CLIENT_INTERFACE_V1 },
+      { &GUID_VDPOverlay_ClientInterface_V2, VDP_OVERLAY_CLIENT_INTERFACE_V2 },
+      { &GUID_VDPOverlay_ClientInterface_V3, VDP_OVERLAY_CLIENT_INTERFACE_V3 },
+      { &GUID_VDPOverlay_ClientInterface_V4, VDP_OVERLAY_CLIENT_INTERFACE_V4 },
+   };
+
+   for (size_t i = 0; i < ARRAYSIZE(guests); i++) {
+      if (LoopbackIsGuid(iid, guests[i].iid)) {
+         VDPOverlayGuest_Interface* guest = (VDPOverlayGuest_Interface*)iface;
+
+         memset(guest, 0, sizeof *guest);
+         guest->version = guests[i].version;
+         guest->v1.Init = GuestInit;
+         guest->v1.Exit = GuestExit;
+         guest->v1.RegisterWindow = GuestRegisterWindow;
+         guest->v1.UnregisterWindow = GuestUnregisterWindow;
+         guest->v1.IsWindowRegistered = GuestIsWindowRegistered;
+         guest->v1.EnableOverlay = GuestEnableOverlay;
+         guest->v1.DisableOverlay = GuestDisableOverlay;
+         guest->v1.IsOverlayEnabled = GuestIsOverlayEnabled;
+         guest->v1.SetLayoutMode = GuestSetLayoutMode;
+         guest->v1.GetLayoutMode = GuestGetLayoutMode;
+         guest->v1.SendMsg = GuestSendMsg;
+         guest->v2.GetColorkey = GuestGetColorkey;
+         guest->v3.RegisterWindow = GuestRegisterWindow3;
+         guest->v3.SetAreaRect = GuestSetAreaRect3;
+         guest->v3.GetAreaRect = GuestGetAreaRect3;
+         guest->v3.SetLayer = GuestSetLayer;
+         guest->v3.GetLayer = GuestGetLayer;
+         guest->v4.GetHWnd = GuestGetHWnd;
+         guest->v4.SetBackgroundColor = GuestSetBackgroundColor;
+         guest->v4.GetBackgroundColor = GuestGetBackgroundColor;
+         guest->v4.SetAreaRect = GuestSetArea;
+         guest->v4.GetAreaRect = GuestGetArea;
+         guest->v4.SetInfoString = GuestSetInfoString;
+         guest->v4.GetInfoString = GuestGetInfoString;
+         return true;
+      }
+   }
+
+   for (size_t i = 0; i < ARRAYSIZE(clients); i++) {
+      if (LoopbackIsGuid(iid, clients[i].iid)) {
+         VDPOverlayClient_Interface* client = (VDPOverlayClient_Interface*)iface;
+
+         memset(client, 0, sizeof *client);
+         client->version = clients[i].version;
+         client->v1.Init = ClientInit;
+         client->v1.Exit = ClientExit;
+         client->v1.Update = ClientUpdate;
+         client->v1.GetInfo = ClientGetInfo;
+         client->v1.SendMsg = ClientSendMsg;
+         client->v2.InitLocal = ClientInitLocal;
+         client->v2.CreateOverlay = ClientCreateOverlay;
+         client->v2.DestroyOverlay = ClientDestroyOverlay;
+         client->v2.SetPosition = ClientSetPosition;
+         client->v2.SetSize = ClientSetSize;
+         client->v2.SetClipRegion = ClientSetClipRegion;
+         client->v2.SetLayer = ClientSetLayer;
+         client->v2.SetColorkey = ClientSetColorkey;
+         client->v2.EnableOverlay = ClientEnableOverlay;
+         client->v2.DisableOverlay = ClientDisableOverlay;
+         client->v2.SetLayoutMode = ClientSetLayoutMode;
+         client->v2.Update = ClientUpdate2;
+         client->v2.GetInfo = ClientGetInfo2;
+         client->v3.GetTopology = ClientGetTopology;
+         client->v4.SetInfoString = ClientSetInfoString;
+         client->v4.GetInfoString = ClientGetInfoString;
+         client->v4.SetInfoStringProperties = ClientSetInfoStringProperties;
+         client->v4.GetInfoStringProperties = ClientGetInfoStringProperties;
+         return true;
+      }
+   }
+
+   return false;
+}
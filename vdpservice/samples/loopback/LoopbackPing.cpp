@@ -0,0 +1,1894 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackPing.cpp --
+ *
+ *    The agent side of PingRPC run against the loopback emulator.  The
+ *    client plugin (libPingRPC.so) is loaded in the same process, so a
+ *    ping goes through both RPCManagers and the emulated vdpService on
+ *    every channel type and can be timed without any network.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackPing.h"
+#include "LoopbackNetwork.h"
+#include "LoopbackLoad.h"
+#include "LoopbackFanout.h"
+#include "RPCStreamReactor.h"
+#include "RPCSessionManager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <sched.h>
+#include <unordered_map>
+#include <unistd.h>
+
+#define LOOPBACK_PING_PLUGIN      "../pingrpc/PingRPCDll/libPingRPC.so"
+#define LOOPBACK_PING_BATCH_BYTES (16 * 1024)
+#define LOOPBACK_PING_LANE_WINDOW (64 * 1024)
+#define LOOPBACK_PING_CHUNK_BYTES (16 * 1024)
+#define LOOPBACK_PING_TCP_WINDOW  32
+#define LOOPBACK_PING_TIMEOUT_SEC 10
+#define LOOPBACK_PING_JOURNAL     65536
+#define LOOPBACK_PING_CREDIT_MS   100
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingTickCount --
+ *
+ *    Milliseconds of a monotonic clock, the ping timestamp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+PingTickCount()
+{
+   return (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingNowNs --
+ *
+ *    Nanoseconds of the same clock, what the latencies are measured in.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+PingNowNs()
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackPinger
+ *
+ *    The agent side plugin instance, it sends the pings.  Same messages
+ *    as PingRPCExe, the raw TCP pings go over the stream data socket.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackPinger : public RPCPluginInstance,
+                       public RPCStreamHandler
+{
+public:
+   LoopbackPinger(bool postMode, RPCManager* rpcManagerPtr);
+   virtual ~LoopbackPinger() { }
+
+   bool Ping(int size, uint64 dueNs = 0);
+   bool BulkPing(int size);
+   bool TcpPing(int n, int size, int window, uint32 zeroCopyMin,
+                bool useUring, LoopbackPacer* pacer = NULL);
+   void GetTcpStats(RPCStreamSenderStats* stats) const { *stats = m_tcpStats; }
+   void GetFramerStats(RPCStreamFramerStats* stats) const { *stats = m_framerStats; }
+   void GetReactorStats(RPCStreamReactorStats* stats) const { *stats = m_reactorStats; }
+   const char* GetReactorBackend() const { return m_reactor.GetBackendName(); }
+   void GetLatency(LoopbackHistogram* latency);
+   void GetOneWay(LoopbackHistogram* toClient, LoopbackHistogram* toAgent,
+                  uint64* rejected);
+   void GetClockStats(RPCClockSyncStats* stats) { m_clock.GetStats(stats); }
+   void ResetCounters();
+   void SetCorpus(RPCPayloadCorpus* corpus) { m_corpus = corpus; }
+
+   int cntSent;
+   int cntRecv;
+   int cntBulkSent;
+   int cntBulkRecv;
+   std::atomic<int> cntNotReady;
+
+private:
+   enum {
+      PING_COMMAND
+   };
+
+   virtual void OnDone(uint32 requestCtxId, void *returnCtx);
+   virtual void OnNotReady() { cntNotReady++; }
+
+   bool TcpSend(int fd, int size, uint64 stampNs);
+   void RecordLatency(uint64 sentNs);
+   void RecordClock(const RPCClockStamp& stamp, uint64 rxNs);
+
+   virtual void OnStreamData(int fd, int reqId, int reqCmd,
+                             const VDP_RPC_BLOB* blob);
+   virtual void OnStreamSent(int fd, void* cookie);
+   virtual void OnStreamClosed(int fd);
+
+   static Bool OnTcpEcho(void *context, const char *sourceToken,
+                         const void *cookie, const void *data);
+
+   bool m_postMode;
+   RPCPayloadCorpus* m_corpus;
+   std::vector<char> m_payload;
+   RPCStreamReactor m_reactor;
+   RPCStreamSenderStats m_tcpStats;
+   RPCStreamFramerStats m_framerStats;
+   RPCStreamReactorStats m_reactorStats;
+   bool m_tcpZeroCopy;
+   bool m_tcpClosed;
+   std::vector<std::vector<char> > m_tcpBufs;   /* for zero-copy pings */
+   std::vector<int> m_tcpFree;
+   std::vector<char> m_bulkPayload;
+
+   /* send times of the pings in flight by request id, and the latencies */
+   std::mutex m_latencyMutex;
+   std::unordered_map<uint32, uint64> m_sentNs;
+   LoopbackHistogram m_latency;
+   LoopbackHistogram m_toClient;
+   LoopbackHistogram m_toAgent;
+   uint64 m_oneWayRejected;          /* round trips GetOneWay() of m_clock refused */
+
+   /* the clock of the client, from the stamps of the pings */
+   RPCClockSync m_clock;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::LoopbackPinger --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackPinger::LoopbackPinger(bool postMode,               // IN
+                               RPCManager* rpcManagerPtr)   // IN
+   : RPCPluginInstance(rpcManagerPtr),
+     cntSent(0),
+     cntRecv(0),
+     cntBulkSent(0),
+     cntBulkRecv(0),
+     cntNotReady(0),
+     m_postMode(postMode),
+     m_corpus(NULL),
+     m_tcpZeroCopy(false),
+     m_tcpClosed(false),
+     m_oneWayRejected(0)
+{
+   memset(&m_tcpStats, 0, sizeof m_tcpStats);
+   memset(&m_framerStats, 0, sizeof m_framerStats);
+   memset(&m_reactorStats, 0, sizeof m_reactorStats);
+
+   static const RPCCommandEntry commands[] = {
+      RPC_SEND_COMMAND(PINGRPC_MESSAGE),        // PING_COMMAND
+   };
+
+   RegisterCommands(commands, sizeof commands / sizeof commands[0]);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::Ping --
+ *
+ *    Sends one ping, a timestamp and <size> bytes of payload, waiting
+ *    while the credit window is full.  Its latency counts from here, or
+ *    from <dueNs> if the ping was due then.  The payload is the pattern
+ *    text, or a blob from the corpus if there is one.  Unless it is
+ *    posted a clock stamp follows, for the client to fill in.
+ *
+ * Results:
+ *    false if the ping could not be sent.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackPinger::Ping(int size,      // IN
+                     uint64 dueNs)  // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   RPCManager* rpcManagerPtr = GetRPCManager();
+
+   RPCBuffer* buffer = NULL;
+   const char* payload = NULL;
+   if (size > 0 && m_corpus != NULL) {
+      payload = m_corpus->Next(size);
+   } else if (size > 0) {
+      buffer = AcquireBuffer(size + 1);
+      for (int i = 0; i < size; i++) {
+         buffer->data[i] = (char)(((cntSent + i) % 64) + '0');
+      }
+      buffer->data[size] = '\0';
+      payload = buffer->data;
+   }
+
+   void* messageCtx = NULL;
+   if (!CreateMessage(&messageCtx, 0, payload, payload != NULL ? (uint32)size : 0)) {
+      ReleaseBuffer(buffer);
+      return false;
+   }
+
+   SetCommand(messageCtx, PING_COMMAND);
+
+   RPCScratchVariant var;
+   var.SetUInt32(PingTickCount());
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
+   uint32 requestId = iChannelCtx->v1.GetId(messageCtx);
+   {
+      std::lock_guard<std::mutex> lock(m_latencyMutex);
+      m_sentNs[requestId] = dueNs != 0 ? dueNs : PingNowNs();
+   }
+
+   if (buffer != NULL) {
+      var.SetStr(buffer->data);
+      iChannelCtx->v1.AppendParam(messageCtx, &var);
+      AttachBuffer(messageCtx, buffer);
+   } else if (payload != NULL) {
+      var.SetBlob(payload, (uint32)size);
+      iChannelCtx->v1.AppendParam(messageCtx, &var);
+   }
+
+   if (m_postMode) {
+      SetPostMode(messageCtx, true);
+   } else {
+      RPCClockStamp stamp;
+      RPCClockSync::InitStamp(&stamp);
+      var.SetBlob((const char*)&stamp, sizeof stamp);
+      iChannelCtx->v1.AppendNamedParam(messageCtx, RPC_CLOCK_STAMP_NAME, &var);
+   }
+
+   RPCInvokeResult res;
+   while ((res = TryInvokeMessage(messageCtx, size)) == RPC_INVOKE_WOULD_BLOCK) {
+      WaitForCredit(LOOPBACK_PING_CREDIT_MS);
+   }
+
+   if (res != RPC_INVOKE_OK) {
+      std::lock_guard<std::mutex> lock(m_latencyMutex);
+      m_sentNs.erase(requestId);
+      DestroyMessage(messageCtx);
+      return false;
+   }
+
+   /*
+    * Picks up the echoes that are already in without waiting, a wait
+    * here would cap the pings at one per poll.
+    */
+   rpcManagerPtr->Poll(0);
+   cntSent++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::BulkPing --
+ *
+ *    Sends a ping with a blob of <size> bytes on the bulk lane, the
+ *    traffic the interactive pings have to get past.
+ *
+ * Results:
+ *    false if the ping could not be sent.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackPinger::BulkPing(int size)   // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+
+   if (m_bulkPayload.size() != (size_t)size && m_corpus != NULL) {
+      const char* payload = m_corpus->Next(size);
+      m_bulkPayload.assign(payload, payload + size);
+   } else if (m_bulkPayload.size() != (size_t)size) {
+      m_bulkPayload.assign(size, 'b');
+   }
+
+   void* messageCtx = NULL;
+   if (!CreateMessage(&messageCtx, 0, m_bulkPayload.data(), (uint32)size)) {
+      return false;
+   }
+
+   SetCommand(messageCtx, PING_COMMAND);
+
+   RPCScratchVariant var;
+   var.SetUInt32(PingTickCount());
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+   var.SetBlob(m_bulkPayload.data(), (uint32)size);
+   iChannelCtx->v1.AppendParam(messageCtx, &var);
+
+   if (!InvokeMessage(messageCtx, RPC_TRAFFIC_BULK)) {
+      DestroyMessage(messageCtx);
+      return false;
+   }
+
+   cntBulkSent++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::OnDone --
+ *
+ *    A ping was answered, or sent in post mode.  The clock stamp the
+ *    client filled in is the last return value of an answer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::OnDone(uint32 requestCtxId,   // IN
+                       void *returnCtx)       // IN
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+   uint64 rxNs = PingNowNs();
+
+   if (!IsCommand(returnCtx, PING_COMMAND)) {
+      LOG("Unknown command [%d]", iChannelCtx->v1.GetCommand(returnCtx));
+      return;
+   }
+
+   RPCVariant var(this);
+   RPCClockStamp stamp;
+   int nReturns = iChannelCtx->v1.GetReturnValCount(returnCtx);
+   if (nReturns > 0 && iChannelCtx->v1.GetReturnVal(returnCtx, nReturns - 1, &var) &&
+       var.vt == VDP_RPC_VT_BLOB &&
+       RPCClockSync::ReadStamp(var.blobVal.blobData, var.blobVal.size, &stamp)) {
+      RecordClock(stamp, rxNs);
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_latencyMutex);
+      auto it = m_sentNs.find(requestCtxId);
+      if (it != m_sentNs.end()) {
+         m_latency.Record(rxNs - it->second);
+         m_sentNs.erase(it);
+         cntRecv++;
+         return;
+      }
+   }
+
+   /*
+    * A bulk ping carries a blob, and is not timed.  Its echo does too,
+    * but a replayed ping the client had already answered completes with
+    * no return values.  The blob of a ping without payload is its stamp.
+    */
+   RPCVariant param(this);
+   if (iChannelCtx->v1.GetParam(returnCtx, 1, &param) &&
+       param.vt == VDP_RPC_VT_BLOB &&
+       !RPCClockSync::IsStamp(param.blobVal.blobData, param.blobVal.size)) {
+      cntBulkRecv++;
+      return;
+   }
+
+   cntRecv++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::TcpPing --
+ *
+ *    Sends <n> pings of <size> bytes over the raw TCP socket, at most
+ *    <window> of them without an echo, the client echoes them back as
+ *    messages that come out of the same socket.  The socket is served
+ *    by an RPCStreamReactor polled from this thread.  Pings of at least
+ *    <zeroCopyMin> bytes go out with MSG_ZEROCOPY if the socket supports
+ *    it, 0 turns that off.  <useUring> has the reactor use io_uring
+ *    where the kernel supports it.  With a <pacer> each ping waits for
+ *    its time as well, and its latency counts from then.
+ *
+ * Results:
+ *    false on a socket error or if the echoes stop.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackPinger::TcpPing(int n,                  // IN
+                        int size,               // IN
+                        int window,             // IN
+                        uint32 zeroCopyMin,     // IN
+                        bool useUring,          // IN
+                        LoopbackPacer* pacer)   // IN/OPT
+{
+   const VDPService_ObserverInterface* iObserver = VdpObserverInterface();
+   int fd = GetTcpRawSocket();
+
+   if (fd < 0) {
+      LOG("Error: no raw TCP socket.");
+      return false;
+   }
+
+   VDPService_ObserverId observerId =
+      iObserver->v1.RegisterObserver(VDP_TCP_ECHO, this, OnTcpEcho);
+   if (observerId == VDPOBSERVER_INVALID_ID) {
+      return false;
+   }
+
+   if (size < RPC_CLOCK_PING_OFFSET + (int)sizeof(RPCClockStamp)) {
+      size = RPC_CLOCK_PING_OFFSET + sizeof(RPCClockStamp);
+   }
+   if (window <= 0) {
+      window = LOOPBACK_PING_TCP_WINDOW;
+   }
+   if (m_corpus != NULL) {
+      const char* payload = m_corpus->Next(size);
+      m_payload.assign(payload, payload + size);
+   } else {
+      m_payload.assign(size, 'x');
+   }
+   m_tcpClosed = false;
+
+   if (!m_reactor.Init(useUring) ||
+       !m_reactor.Add(fd, StreamDataInterface(), 0, this)) {
+      iObserver->v1.UnregisterObserver(observerId);
+      return false;
+   }
+   m_tcpZeroCopy = zeroCopyMin > 0 && m_reactor.EnableZeroCopy(fd, zeroCopyMin);
+
+   auto lastEcho = std::chrono::steady_clock::now();
+   bool ok = true;
+
+   while (cntRecv < n && ok) {
+      while (ok && cntSent < n && cntSent - cntRecv < window) {
+         uint64 stampNs = PingNowNs();
+         if (pacer != NULL) {
+            if (!pacer->IsDue(stampNs)) {
+               break;
+            }
+            stampNs = pacer->Next(stampNs);
+         }
+         if (cntSent == cntRecv) {
+            lastEcho = std::chrono::steady_clock::now();
+         }
+         ok = TcpSend(fd, size, stampNs);
+         cntSent += ok ? 1 : 0;
+      }
+
+      /* the echoes wake the poll up, or the next ping is due */
+      int msTimeout = LOOPBACK_PING_TIMEOUT_SEC * 1000;
+      if (pacer != NULL && cntSent < n && cntSent - cntRecv < window) {
+         msTimeout = (int)pacer->GetWaitMs(PingNowNs());
+      }
+
+      int recved = cntRecv;
+      if (ok && m_reactor.Poll(msTimeout) < 0) {
+         ok = false;
+      }
+      if (m_tcpClosed) {
+         ok = false;
+      } else if (cntRecv > recved) {
+         lastEcho = std::chrono::steady_clock::now();
+      } else if (std::chrono::steady_clock::now() - lastEcho >
+                 std::chrono::seconds(LOOPBACK_PING_TIMEOUT_SEC)) {
+         LOG("Error: no echo for %ds, %d of %d received.",
+             LOOPBACK_PING_TIMEOUT_SEC, cntRecv, n);
+         ok = false;
+      }
+   }
+
+   m_reactor.GetSessionStats(fd, &m_tcpStats, &m_framerStats);
+   m_reactor.Remove(fd, LOOPBACK_PING_TIMEOUT_SEC * 1000);
+   m_reactor.GetStats(&m_reactorStats);
+   iObserver->v1.UnregisterObserver(observerId);
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::TcpSend --
+ *
+ *    Sends one ping over the raw TCP socket, its first bytes <stampNs>,
+ *    the time its latency counts from, then a clock stamp of now.  The
+ *    payload goes out from m_payload, or for a zero-copy ping from a
+ *    copy of it the kernel holds on to until OnStreamSent() gets it
+ *    back.
+ *
+ * Results:
+ *    false on a socket error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackPinger::TcpSend(int fd,           // IN
+                        int size,         // IN
+                        uint64 stampNs)   // IN
+{
+   char* data = m_payload.data();
+   void* cookie = NULL;
+
+   if (m_tcpZeroCopy) {
+      if (m_tcpFree.empty()) {
+         m_tcpFree.push_back((int)m_tcpBufs.size());
+         m_tcpBufs.push_back(m_payload);
+      }
+      int index = m_tcpFree.back();
+      m_tcpFree.pop_back();
+      data = m_tcpBufs[index].data();
+      cookie = (void*)(intptr_t)(index + 1);
+   }
+
+   RPCClockStamp stamp;
+   RPCClockSync::InitStamp(&stamp);
+
+   memcpy(data, &stampNs, sizeof stampNs);
+   memcpy(data + RPC_CLOCK_PING_OFFSET, &stamp, sizeof stamp);
+   return m_reactor.Send(fd, VDP_PING_CMD, data, (uint32)size, cookie);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::OnStreamData --
+ *
+ *    An echo came out of the raw TCP socket, it goes to the VDP_TCP_ECHO
+ *    observers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::OnStreamData(int fd,                      // IN
+                             int reqId,                   // IN
+                             int reqCmd,                  // IN
+                             const VDP_RPC_BLOB* blob)    // IN
+{
+   VdpObserverInterface()->v1.Broadcast(VDP_TCP_ECHO, (void*)(intptr_t)cntRecv,
+                                        blob->blobData);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::OnStreamSent --
+ *
+ *    The zero-copy buffer of a ping can be used again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::OnStreamSent(int fd,         // IN
+                             void* cookie)   // IN
+{
+   m_tcpFree.push_back((int)(intptr_t)cookie - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::OnStreamClosed --
+ *
+ *    The raw TCP socket was closed or failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::OnStreamClosed(int fd)   // IN
+{
+   m_tcpClosed = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::OnTcpEcho --
+ *
+ *    VDP_TCP_ECHO observer, counts the echoes and times them, each way
+ *    as well by the clock stamp the client filled in.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+LoopbackPinger::OnTcpEcho(void *context,             // IN
+                          const char *sourceToken,   // IN
+                          const void *cookie,        // IN
+                          const void *data)          // IN
+{
+   LoopbackPinger* pinger = reinterpret_cast<LoopbackPinger*>(context);
+   uint64 rxNs = PingNowNs();
+   uint64 sentNs;
+   RPCClockStamp stamp;
+
+   memcpy(&sentNs, data, sizeof sentNs);
+   if (RPCClockSync::ReadStamp((const char*)data + RPC_CLOCK_PING_OFFSET,
+                               (uint32)pinger->m_payload.size() - RPC_CLOCK_PING_OFFSET,
+                               &stamp)) {
+      pinger->RecordClock(stamp, rxNs);
+   }
+   pinger->cntRecv++;
+   pinger->RecordLatency(sentNs);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::RecordLatency --
+ *
+ *    Counts the latency of a ping sent at <sentNs>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::RecordLatency(uint64 sentNs)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_latencyMutex);
+   m_latency.Record(PingNowNs() - sentNs);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::RecordClock --
+ *
+ *    Adds the round trip of a clock stamp answered at <rxNs> to the
+ *    estimate of the client's clock, and counts its delay each way, or
+ *    that the estimate could not split it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::RecordClock(const RPCClockStamp& stamp,   // IN
+                            uint64 rxNs)                  // IN
+{
+   uint64 toClientNs;
+   uint64 toAgentNs;
+
+   if (!m_clock.AddSample(stamp, rxNs)) {
+      return;
+   }
+
+   bool split = m_clock.GetOneWay(stamp, rxNs, &toClientNs, &toAgentNs);
+   std::lock_guard<std::mutex> lock(m_latencyMutex);
+
+   if (split) {
+      m_toClient.Record(toClientNs);
+      m_toAgent.Record(toAgentNs);
+   } else {
+      m_oneWayRejected++;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::GetLatency --
+ *
+ *    Returns the latencies of the pings answered since the last
+ *    ResetCounters().
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::GetLatency(LoopbackHistogram* latency)   // OUT
+{
+   std::lock_guard<std::mutex> lock(m_latencyMutex);
+   *latency = m_latency;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::GetOneWay --
+ *
+ *    Returns the delays to the client and back of the pings answered
+ *    since the last ResetCounters(), and how many of them the estimate
+ *    of the clock could not split.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::GetOneWay(LoopbackHistogram* toClient,   // OUT
+                          LoopbackHistogram* toAgent,    // OUT
+                          uint64* rejected)              // OUT
+{
+   std::lock_guard<std::mutex> lock(m_latencyMutex);
+   *toClient = m_toClient;
+   *toAgent = m_toAgent;
+   *rejected = m_oneWayRejected;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackPinger::ResetCounters --
+ *
+ *    Starts counting afresh, after the warm-up.  The pings must all be
+ *    answered.  The estimate of the client's clock is kept.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackPinger::ResetCounters()
+{
+   std::lock_guard<std::mutex> lock(m_latencyMutex);
+   cntSent = 0;
+   cntRecv = 0;
+   cntBulkSent = 0;
+   cntBulkRecv = 0;
+   m_sentNs.clear();
+   m_latency.Reset();
+   m_toClient.Reset();
+   m_toAgent.Reset();
+   m_oneWayRejected = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Usage --
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Usage()
+{
+   printf("Usage: LoopbackPing [-t type] [-s size] [-n number] [-w window]\n");
+   printf("                    [-b usec] [-L size] [-c] [-e] [-p] [-u] [-l plugin]\n");
+   printf("                    [-N link] [-S seed] [-R pings] [-Z size] [-U]\n");
+   printf("                    [-W pings] [-B sweep] [-J file] [-r rate] [-A usec]\n");
+   printf("                    [-F pingers] [-P class[:entropy]]\n");
+   printf("                    [-M sessions[:threads]]\n");
+   printf("    -t       main (default), vchan, tcp, tcpRaw, auto or autoBulk.\n");
+   printf("             auto picks the fastest round trip, autoBulk the\n");
+   printf("             highest throughput, out of main, vchan and tcp.\n");
+   printf("    -s       Ping packet size.\n");
+   printf("    -n       Number of pings. (default 1)\n");
+   printf("    -w       Max number of pings in flight. (default 0, unlimited,\n");
+   printf("             %d on tcpRaw)\n", LOOPBACK_PING_TCP_WINDOW);
+   printf("    -b       Coalesce pings sent within usec microseconds.\n");
+   printf("    -L       Send a size byte blob on the bulk lane with each ping,\n");
+   printf("             through priority lanes with %d byte chunks.\n",
+          LOOPBACK_PING_CHUNK_BYTES);
+   printf("    -c       Negotiate compression, not on main.\n");
+   printf("    -e       Negotiate encryption, tcp and tcpRaw only.\n");
+   printf("    -p       Post mode.\n");
+   printf("    -u       Send and poll from the RPCManager pump thread.\n");
+   printf("    -l       Client plugin. (default %s)\n", LOOPBACK_PING_PLUGIN);
+   printf("    -N       Link model, e.g. \"lat=20ms,jitter=2ms,bw=50mbit;@2s,loss=1%%\".\n");
+   printf("             See LoopbackNetwork::Parse().\n");
+   printf("    -S       Seed of the link model. (default 1)\n");
+   printf("    -R       Drop the connection after every so many pings, the\n");
+   printf("             journal sends what was lost again.  Not on tcpRaw.\n");
+   printf("    -Z       tcpRaw pings of at least size bytes use MSG_ZEROCOPY\n");
+   printf("             where the socket supports it.\n");
+   printf("    -U       tcpRaw sockets use io_uring where the kernel supports\n");
+   printf("             it, epoll otherwise.\n");
+   printf("    -W       Pings sent before the measured ones. (default 0, a\n");
+   printf("             tenth of -n up to %d with -B)\n", LOOPBACK_BENCH_MAX_WARMUP);
+   printf("    -B       Run a sweep, \"default\" or e.g.\n");
+   printf("             \"type=main,tcp;size=64,4096;window=1,16;post=0,1\"\n");
+   printf("             with compress, encrypt and payload as well.  The axes it\n");
+   printf("             does not name take the values of the other options.\n");
+   printf("    -J       Write the results of -B as JSON to file, - for stdout.\n");
+   printf("    -r       Send rate pings per second whether the echoes come\n");
+   printf("             back or not, or from:to for a ramp over the -n pings.\n");
+   printf("             The latency counts from the time each was due.\n");
+   printf("    -A       Search the highest rate the channel keeps up with,\n");
+   printf("             from -r or %d, with a p99 within usec, 0 for any.\n",
+          LOOPBACK_LOAD_START_RATE);
+   printf("    -F       Ping from that many connections at once, each on its\n");
+   printf("             own session and thread, for a second, e.g. \"1,10,100\"\n");
+   printf("             or \"default\" for 1 to 256.  -w is per connection,\n");
+   printf("             4 by default, -r as well.  Not on tcpRaw.\n");
+   printf("    -P       Payloads from a corpus instead of the pattern: zeros,\n");
+   printf("             pattern, pixels, json or random, with that share of\n");
+   printf("             the bytes random, e.g. \"json:0.1\".\n");
+   printf("    -M       Open that many sessions on one RPCSessionManager with\n");
+   printf("             that many worker threads (default 1) and send the -n\n");
+   printf("             pings round robin over them.  -w is per session.\n");
+   printf("             Not on tcpRaw or auto, nor with -u, -L, -R, -r, -A,\n");
+   printf("             -F or -B.\n");
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseOptions --
+ *
+ *    Parses the command line.
+ *
+ * Results:
+ *    false if it is invalid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseOptions(int argc,                        // IN
+             char* argv[],                    // IN
+             LoopbackPingOptions* options)    // OUT
+{
+   int opt;
+
+   options->type = VDPSERVICE_MAIN_CHANNEL;
+   options->trafficClass = RPC_TRAFFIC_INTERACTIVE;
+   options->size = 0;
+   options->n = 1;
+   options->compressEnabled = false;
+   options->encryptionEnabled = false;
+   options->postMode = false;
+   options->pumpThread = false;
+   options->window = 0;
+   options->batchUs = 0;
+   options->bulkSize = 0;
+   options->dropEvery = 0;
+   options->zeroCopyMin = 0;
+   options->useUring = false;
+   options->plugin = LOOPBACK_PING_PLUGIN;
+   options->link = NULL;
+   options->seed = 1;
+   options->warmup = -1;
+   options->bench = NULL;
+   options->json = NULL;
+   options->rate = 0;
+   options->endRate = 0;
+   options->sloUs = 0;
+   options->saturate = false;
+   options->fanout = NULL;
+   options->sessions = 0;
+   options->sessionThreads = 1;
+   options->sid = (DWORD)LOOPBACK_CURRENT_SESSION;
+   options->payload = NULL;
+   options->corpus = NULL;
+
+   while ((opt = getopt(argc, argv, "t:s:n:w:b:L:l:N:S:R:Z:W:B:J:r:A:F:P:M:cepuUh")) != -1) {
+      switch (opt) {
+      case 't':
+         if (_stricmp(optarg, "main") == 0) {
+            options->type = VDPSERVICE_MAIN_CHANNEL;
+         } else if (_stricmp(optarg, "vchan") == 0) {
+            options->type = VDPSERVICE_VCHAN_CHANNEL;
+         } else if (_stricmp(optarg, "tcp") == 0) {
+            options->type = VDPSERVICE_TCP_CHANNEL;
+         } else if (_stricmp(optarg, "tcpRaw") == 0) {
+            options->type = VDPSERVICE_TCPRAW_CHANNEL;
+         } else if (_stricmp(optarg, "auto") == 0) {
+            options->type = VDPSERVICE_AUTO_CHANNEL;
+         } else if (_stricmp(optarg, "autoBulk") == 0) {
+            options->type = VDPSERVICE_AUTO_CHANNEL;
+            options->trafficClass = RPC_TRAFFIC_BULK;
+         } else {
+            return false;
+         }
+         break;
+      case 's':
+         options->size = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'n':
+         options->n = atoi(optarg) < 1 ? 1 : atoi(optarg);
+         break;
+      case 'w':
+         options->window = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'b':
+         options->batchUs = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'L':
+         options->bulkSize = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'l':
+         options->plugin = optarg;
+         break;
+      case 'N':
+         options->link = optarg;
+         break;
+      case 'S':
+         options->seed = strtoull(optarg, NULL, 0);
+         break;
+      case 'R':
+         options->dropEvery = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'Z':
+         options->zeroCopyMin = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'W':
+         options->warmup = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'B':
+         options->bench = optarg;
+         break;
+      case 'J':
+         options->json = optarg;
+         break;
+      case 'r': {
+         char* end;
+         options->rate = strtod(optarg, &end);
+         options->endRate = *end == ':' ? strtod(end + 1, &end) : options->rate;
+         if (*end != '\0' || options->rate <= 0 || options->endRate <= 0) {
+            return false;
+         }
+         break;
+      }
+      case 'A':
+         options->saturate = true;
+         options->sloUs = atoi(optarg) < 0 ? 0 : atoi(optarg);
+         break;
+      case 'F':
+         options->fanout = optarg;
+         break;
+      case 'M': {
+         char* end;
+         long sessions = strtol(optarg, &end, 10);
+         long threads = *end == ':' ? strtol(end + 1, &end, 10) : 1;
+         if (*end != '\0' || sessions < 1 || sessions > USHRT_MAX ||
+             threads < 1 || threads > sessions) {
+            return false;
+         }
+         options->sessions = (int)sessions;
+         options->sessionThreads = (int)threads;
+         break;
+      }
+      case 'P': {
+         RPCPayloadClass payloadClass;
+         double entropy;
+         if (!RPCPayloadCorpus::Parse(optarg, &payloadClass, &entropy)) {
+            return false;
+         }
+         options->payload = optarg;
+         break;
+      }
+      case 'c':
+         options->compressEnabled = true;
+         break;
+      case 'e':
+         options->encryptionEnabled = true;
+         break;
+      case 'p':
+         options->postMode = true;
+         break;
+      case 'u':
+         options->pumpThread = true;
+         break;
+      case 'U':
+         options->useUring = true;
+         break;
+      default:
+         return false;
+      }
+   }
+
+   /*
+    * A sweep picks its own warm-up, see LoopbackBench, and checks each
+    * combination of its axes.  It does not search the rates of -A.
+    */
+   if (options->bench != NULL) {
+      return !options->saturate && options->fanout == NULL &&
+             options->sessions == 0;
+   }
+   if (options->warmup < 0) {
+      options->warmup = 0;
+   }
+
+   /*
+    * RPCManager only negotiates compression on side channels, and
+    * encryption on the TCP ones.  An automatic channel only picks
+    * among those then.
+    */
+   if (options->compressEnabled && options->type == VDPSERVICE_MAIN_CHANNEL) {
+      return false;
+   }
+   if (options->encryptionEnabled && options->type != VDPSERVICE_TCP_CHANNEL &&
+       options->type != VDPSERVICE_TCPRAW_CHANNEL &&
+       options->type != VDPSERVICE_AUTO_CHANNEL) {
+      return false;
+   }
+
+   /*
+    * The raw TCP pings do not go through RPCManager.
+    */
+   if (options->dropEvery > 0 && options->type == VDPSERVICE_TCPRAW_CHANNEL) {
+      return false;
+   }
+   if ((options->zeroCopyMin > 0 || options->useUring) &&
+       options->type != VDPSERVICE_TCPRAW_CHANNEL) {
+      return false;
+   }
+
+   /*
+    * The raw TCP echoes are broadcast to every pinger, and the pingers
+    * of a fan-out do not drop their connections.
+    */
+   if (options->fanout != NULL &&
+       (options->saturate || options->dropEvery > 0 ||
+        options->type == VDPSERVICE_TCPRAW_CHANNEL)) {
+      return false;
+   }
+
+   /*
+    * The sessions share one channel type, which RPCSessionManager does
+    * not pick, and are polled by its workers rather than the pump.
+    */
+   if (options->sessions > 0 &&
+       (options->saturate || options->fanout != NULL ||
+        options->dropEvery > 0 || options->bulkSize > 0 ||
+        options->rate > 0 || options->pumpThread ||
+        options->type == VDPSERVICE_TCPRAW_CHANNEL ||
+        options->type == VDPSERVICE_AUTO_CHANNEL)) {
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintLinkStats --
+ *
+ *    Prints what the link model did in each direction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintLinkStats(LoopbackNetwork* network)   // IN
+{
+   static const char* names[LOOPBACK_NET_DIRECTIONS] = { "agent->client",
+                                                          "client->agent" };
+
+   for (int d = 0; d < LOOPBACK_NET_DIRECTIONS; d++) {
+      LoopbackNetStats stats;
+      network->GetStats((LoopbackNetDirection)d, &stats);
+
+      if (stats.frames == 0) {
+         continue;
+      }
+
+      printf("%s: %llu frames, %llu bytes, %llu lost, %llu reordered, "
+             "delay avg %lluus max %lluus, queue avg %lluus max %lluus\n",
+             names[d], (unsigned long long)stats.frames,
+             (unsigned long long)stats.bytes, (unsigned long long)stats.lost,
+             (unsigned long long)stats.reordered,
+             (unsigned long long)(stats.delayUs / stats.frames),
+             (unsigned long long)stats.maxDelayUs,
+             (unsigned long long)(stats.queueUs / stats.frames),
+             (unsigned long long)stats.maxQueueUs);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintChannelSelection --
+ *
+ *    Prints what the automatic channel selection measured and picked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintChannelSelection(LoopbackPinger* pinger)   // IN
+{
+   for (int type = VDPSERVICE_MAIN_CHANNEL; type <= VDPSERVICE_TCPRAW_CHANNEL; type++) {
+      RPCChannelProbeResult result;
+
+      if (pinger->GetProbeResult((VdpServiceChannelType)type, &result)) {
+         printf("probe %-6s: rtt %uus (min %uus), %.1f MB/s\n",
+                RPCChannelSelector::ChannelTypeToStr(type), result.rttUs,
+                result.minRttUs, result.bytesPerSec / 1e6);
+      }
+   }
+
+   printf("channel: %s (interactive %s, bulk %s)\n",
+          RPCChannelSelector::ChannelTypeToStr(pinger->GetChannelType()),
+          RPCChannelSelector::ChannelTypeToStr(
+             pinger->GetChannelChoice(RPC_TRAFFIC_INTERACTIVE)),
+          RPCChannelSelector::ChannelTypeToStr(
+             pinger->GetChannelChoice(RPC_TRAFFIC_BULK)));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintLaneStats --
+ *
+ *    Prints how long messages and chunks waited in each priority lane.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintLaneStats(LoopbackPinger* pinger)   // IN
+{
+   static const char* names[RPC_TRAFFIC_CLASSES] = { "interactive", "bulk" };
+
+   for (int lane = 0; lane < RPC_TRAFFIC_CLASSES; lane++) {
+      RPCLaneStats stats;
+      pinger->GetLaneStats((RPCTrafficClass)lane, &stats);
+
+      if (stats.dequeued == 0) {
+         continue;
+      }
+
+      printf("lane %s: %llu items, %llu bytes, queue avg %lluus max %lluus\n",
+             names[lane], (unsigned long long)stats.dequeued,
+             (unsigned long long)stats.bytes,
+             (unsigned long long)(stats.queueUs / stats.dequeued),
+             (unsigned long long)stats.maxQueueUs);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintJournalStats --
+ *
+ *    Prints what the journal kept and sent again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintJournalStats(LoopbackPinger* pinger,   // IN
+                  int drops)                // IN
+{
+   RPCJournalStats stats;
+   pinger->GetJournalStats(&stats);
+
+   printf("journal: %d drops, %llu journaled, %llu acked, %llu replayed, "
+          "%u left\n", drops, (unsigned long long)stats.journaled,
+          (unsigned long long)stats.acked, (unsigned long long)stats.replayed,
+          stats.depth);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintTcpStats --
+ *
+ *    Prints how the raw TCP pings were written and the echoes read.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintTcpStats(LoopbackPinger* pinger)   // IN
+{
+   RPCStreamSenderStats stats;
+   pinger->GetTcpStats(&stats);
+
+   printf("tcpRaw: %llu sent, %llu bytes, %llu writes, %llu partial, "
+          "%llu zero-copy (%llu calls copied by the kernel)\n",
+          (unsigned long long)stats.sent, (unsigned long long)stats.bytes,
+          (unsigned long long)stats.gatherCalls,
+          (unsigned long long)stats.partialWrites,
+          (unsigned long long)stats.zeroCopy,
+          (unsigned long long)stats.zeroCopyCopied);
+
+   RPCStreamFramerStats framer;
+   pinger->GetFramerStats(&framer);
+
+   printf("echoes: %llu frames in %llu reads, %uKB ring, %u grows, "
+          "%llu bytes moved\n", (unsigned long long)framer.frames,
+          (unsigned long long)framer.reads, framer.capacity / 1024,
+          framer.grows, (unsigned long long)framer.movedBytes);
+
+   RPCStreamReactorStats reactor;
+   pinger->GetReactorStats(&reactor);
+
+   printf("reactor: %s, %llu waits, %llu events, %llu yields, "
+          "%llu write arms, %llu queued\n", pinger->GetReactorBackend(),
+          (unsigned long long)reactor.waits, (unsigned long long)reactor.events,
+          (unsigned long long)reactor.yields,
+          (unsigned long long)reactor.writeArms,
+          (unsigned long long)stats.queued);
+
+   if (reactor.submits > 0) {
+      printf("io_uring: %llu submits, %llu sqes, %llu starved receives\n",
+             (unsigned long long)reactor.submits, (unsigned long long)reactor.sqes,
+             (unsigned long long)reactor.starved);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintCompressionStats --
+ *
+ *    Prints what the compression policy chose for the pings and what
+ *    compressing the frames of the measured ones saved and cost.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintCompressionStats(LoopbackPinger* pinger,                  // IN
+                      const LoopbackPingOptions& options,      // IN
+                      const LoopbackCompressionStats& comp)    // IN
+{
+   RPCCompressionStats policy;
+   pinger->GetCompressionStats(&policy);
+
+   printf("compression of %s payloads: %llu none, %llu snappy, %llu zlib\n",
+          options.payload != NULL ? options.payload : "pattern",
+          (unsigned long long)policy.none, (unsigned long long)policy.snappy,
+          (unsigned long long)policy.zlib);
+
+   if (comp.frames > 0) {
+      printf("frames: %llu compressed, %llu to %llu bytes, ratio %.2f, "
+             "compress %.1fus/frame, decompress %.1fus/frame\n",
+             (unsigned long long)comp.frames, (unsigned long long)comp.rawBytes,
+             (unsigned long long)comp.wireBytes,
+             comp.wireBytes > 0 ? (double)comp.rawBytes / comp.wireBytes : 0,
+             comp.compressNs / 1e3 / comp.frames,
+             comp.decompressNs / 1e3 / comp.frames);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackOneWayValid --
+ *
+ *    Whether the one-way delays of <result> tell anything.  A round
+ *    trip the estimate of the clock splits into a delay below 0 is left
+ *    out, when more than LOOPBACK_ONEWAY_MAX_REJECTED_PCT of them are,
+ *    the estimate is off and the rest are skewed by it as well.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackOneWayValid(const LoopbackPingResult& result)   // IN
+{
+   uint64 splits = result.toClient.GetCount() + result.oneWayRejected;
+
+   return result.toClient.GetCount() > 0 &&
+          result.oneWayRejected * 100 <= splits * LOOPBACK_ONEWAY_MAX_REJECTED_PCT;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintOneWay --
+ *
+ *    Prints the delays of the pings each way and the estimate of the
+ *    client's clock they were split by, or "n/a" for the delays when
+ *    the estimate could not split the round trips.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintOneWay(const LoopbackPingResult& result)   // IN
+{
+   const LoopbackHistogram* oneWay[] = { &result.toClient, &result.toAgent };
+   static const char* names[] = { "agent->client", "client->agent" };
+
+   if (LoopbackOneWayValid(result)) {
+      for (int d = 0; d < 2; d++) {
+         printf("%s: p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n", names[d],
+                oneWay[d]->GetPercentile(50) / 1e3, oneWay[d]->GetPercentile(99) / 1e3,
+                oneWay[d]->GetPercentile(99.9) / 1e3, oneWay[d]->GetMax() / 1e3);
+      }
+   } else {
+      printf("%s, %s: n/a, %llu of %llu round trips split below 0\n", names[0],
+             names[1], (unsigned long long)result.oneWayRejected,
+             (unsigned long long)(result.toClient.GetCount() + result.oneWayRejected));
+   }
+
+   printf("clock: offset %+.1fus, drift %+.2fppm, %llu samples in %u intervals, "
+          "min rtt %.1fus, %llu split below 0\n", result.clock.offsetNs / 1e3,
+          result.clock.driftPpm, (unsigned long long)result.clock.samples,
+          result.clock.intervals, result.clock.minDelayNs / 1e3,
+          (unsigned long long)result.clock.rejected);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackNewCorpus --
+ *
+ *    The corpus of the payloads of -P, for the pings and the blobs of
+ *    the bulk lane.
+ *
+ * Results:
+ *    The corpus, the caller deletes it.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+RPCPayloadCorpus*
+LoopbackNewCorpus(const LoopbackPingOptions& options)   // IN
+{
+   RPCPayloadClass payloadClass = RPC_PAYLOAD_PATTERN;
+   double entropy = 0;
+
+   RPCPayloadCorpus::Parse(options.payload, &payloadClass, &entropy);
+   return new RPCPayloadCorpus(payloadClass, entropy,
+                               (uint32)std::max(options.size, options.bulkSize),
+                               options.seed);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WaitForJournal --
+ *
+ *    Waits until the pinger is ready and the client takes journaled
+ *    messages, once it went through <notReady> disconnects.
+ *
+ * Results:
+ *    false on timeout.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+WaitForJournal(RPCManager* rpcManagerPtr,   // IN
+               LoopbackPinger* pinger,      // IN
+               int notReady)                // IN
+{
+   std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(LOOPBACK_PING_TIMEOUT_SEC);
+
+   while (std::chrono::steady_clock::now() < deadline) {
+      if (pinger->cntNotReady >= notReady && pinger->IsReady() &&
+          (pinger->GetPeerCaps() & VDP_RPC_CAP_JOURNAL) != 0) {
+         return true;
+      }
+
+      if (rpcManagerPtr->IsPumpRunning()) {
+         usleep(100);
+      } else {
+         rpcManagerPtr->Poll(1);
+      }
+   }
+
+   LOG("Error: not reconnected within %ds.", LOOPBACK_PING_TIMEOUT_SEC);
+   return false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WaitForDue --
+ *
+ *    Waits for the next ping of <pacer> to be due, polling RPC for the
+ *    echoes meanwhile unless the pump thread does.  The last
+ *    LOOPBACK_PACER_SPIN_NS are spent polling without waiting.
+ *
+ * Results:
+ *    The time the ping is sent at.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+WaitForDue(RPCManager* rpcManagerPtr,   // IN
+           LoopbackPacer* pacer)        // IN
+{
+   uint64 nowNs;
+
+   while (!pacer->IsDue(nowNs = PingNowNs())) {
+      uint32 msWait = pacer->GetWaitMs(nowNs);
+
+      if (!rpcManagerPtr->IsPumpRunning()) {
+         rpcManagerPtr->Poll(msWait);
+      } else if (msWait > 0) {
+         usleep(msWait * 1000);
+      }
+
+      /*
+       * The agent side may be waiting for a CPU to send the echoes,
+       * the spin gives it the one it is on.
+       */
+      if (msWait == 0) {
+         sched_yield();
+      }
+   }
+   return nowNs;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunPing --
+ *
+ *    Connects to the client plugin with a new RPCManager, sends the
+ *    warm-up pings then the measured ones and disconnects.  The measured
+ *    ones go out as fast as the channel takes them, or at the rate of
+ *    options.rate.
+ *
+ * Results:
+ *    false if the connection failed, <result> says how many pings came
+ *    back otherwise.
+ *
+ * Side Effects:
+ *    Prints the statistics of the channel if <verbose>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackRunPing(const LoopbackPingOptions& options,   // IN
+                LoopbackPingResult* result,           // OUT
+                bool verbose,                         // IN
+                LoopbackFanoutGate* gate)             // IN/OPT
+{
+   std::unique_ptr<RPCPayloadCorpus> corpus;
+   RPCPayloadCorpus* corpusPtr = options.corpus;
+   if (corpusPtr == NULL && options.payload != NULL) {
+      corpus.reset(LoopbackNewCorpus(options));
+      corpusPtr = corpus.get();
+   }
+
+   RPCManager pingRPCManager(PINGRPC_TOKEN_NAME);
+   LoopbackPinger pinger(options.postMode, &pingRPCManager);
+   pinger.SetTrafficClass(options.trafficClass);
+   pinger.SetCorpus(corpusPtr);
+
+   result->connected = false;
+   result->sent = 0;
+   result->received = 0;
+   result->bulkSent = 0;
+   result->bulkReceived = 0;
+   result->elapsedUs = 0;
+   result->payloadBytes = 0;
+   result->latency.Reset();
+   result->sendLag.Reset();
+   result->toClient.Reset();
+   result->toAgent.Reset();
+   result->oneWayRejected = 0;
+   memset(&result->compression, 0, sizeof result->compression);
+   memset(&result->clock, 0, sizeof result->clock);
+
+   if (!pingRPCManager.ServerInit2(options.sid, options.type,
+                                   options.compressEnabled,
+                                   options.encryptionEnabled,
+                                   &pinger, 5000)) {
+      printf("ServerInit2() failed\n");
+      if (gate != NULL) {
+         gate->Leave();
+      }
+      return false;
+   }
+   result->connected = true;
+
+   if (verbose && options.type == VDPSERVICE_AUTO_CHANNEL) {
+      PrintChannelSelection(&pinger);
+   }
+
+   if (options.pumpThread && options.type != VDPSERVICE_TCPRAW_CHANNEL &&
+       !pingRPCManager.StartPumpThread(&pinger)) {
+      printf("Warning: StartPumpThread() failed, polling from main thread\n");
+   }
+
+   pinger.SetCreditWindow(options.window, 0);
+   if (options.batchUs > 0) {
+      pinger.SetBatching(options.batchUs, LOOPBACK_PING_BATCH_BYTES);
+   }
+   if (options.bulkSize > 0) {
+      pinger.SetPriorityLanes(LOOPBACK_PING_LANE_WINDOW, LOOPBACK_PING_CHUNK_BYTES);
+   }
+
+   int drops = 0;
+   if (options.dropEvery > 0) {
+      pinger.SetJournal(LOOPBACK_PING_JOURNAL, 0);
+      WaitForJournal(&pingRPCManager, &pinger, 0);
+   }
+
+   if (options.warmup > 0) {
+      if (options.type != VDPSERVICE_TCPRAW_CHANNEL) {
+         for (int i = 0; i < options.warmup && pinger.Ping(options.size); ++i) {
+         }
+         pinger.FlushBatch();
+         pinger.WaitForPendingMessages(LOOPBACK_PING_TIMEOUT_SEC * 1000);
+      } else {
+         pinger.TcpPing(options.warmup, options.size, options.window,
+                        options.zeroCopyMin, options.useUring);
+      }
+      pinger.ResetCounters();
+   }
+
+   LoopbackPacer pacer(options.rate, options.endRate, options.n);
+   LoopbackPacer* pacerPtr = options.rate > 0 ? &pacer : NULL;
+
+   if (gate != NULL) {
+      gate->Arrive();
+   }
+
+   LoopbackCompressionStats compStart;
+   LoopbackGetCompressionStats(&compStart);
+
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   pacer.Start(PingNowNs());
+
+   if (options.type != VDPSERVICE_TCPRAW_CHANNEL) {
+      for (int i = 0; i < options.n && (gate == NULL || !gate->IsStopped()); ++i) {
+         uint64 dueNs = 0;
+         if (pacerPtr != NULL) {
+            dueNs = pacer.Next(WaitForDue(&pingRPCManager, &pacer));
+         }
+         if (options.dropEvery > 0 && i > 0 && i % options.dropEvery == 0) {
+            LoopbackService::Get()->DropConnection(options.sid);
+            drops++;
+            if (!WaitForJournal(&pingRPCManager, &pinger, drops)) {
+               break;
+            }
+         }
+         if (options.bulkSize > 0 && !pinger.BulkPing(options.bulkSize)) {
+            break;
+         }
+         if (!pinger.Ping(options.size, dueNs)) {
+            break;
+         }
+      }
+      pinger.FlushBatch();
+      pinger.WaitForPendingMessages(LOOPBACK_PING_TIMEOUT_SEC * 1000);
+   } else {
+      pinger.TcpPing(options.n, options.size, options.window,
+                     options.zeroCopyMin, options.useUring, pacerPtr);
+   }
+
+   result->elapsedUs = (double)std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start).count();
+
+   LoopbackCompressionStats& comp = result->compression;
+   LoopbackGetCompressionStats(&comp);
+   comp.frames -= compStart.frames;
+   comp.rawBytes -= compStart.rawBytes;
+   comp.wireBytes -= compStart.wireBytes;
+   comp.compressNs -= compStart.compressNs;
+   comp.decompressNs -= compStart.decompressNs;
+
+   if (gate != NULL) {
+      gate->Arrive();
+   }
+
+   pingRPCManager.ServerExit2(options.sid, &pinger);
+
+   result->sent = pinger.cntSent;
+   result->received = pinger.cntRecv;
+   result->bulkSent = pinger.cntBulkSent;
+   result->bulkReceived = pinger.cntBulkRecv;
+   result->payloadBytes = (uint64)options.size * pinger.cntRecv;
+   pinger.GetLatency(&result->latency);
+   pinger.GetOneWay(&result->toClient, &result->toAgent, &result->oneWayRejected);
+   pinger.GetClockStats(&result->clock);
+   if (pacerPtr != NULL) {
+      result->sendLag = pacer.GetLag();
+   }
+
+   if (verbose) {
+      double us = result->elapsedUs;
+
+      printf("%d pings sent, %d received\n", result->sent, result->received);
+      if (result->received > 0) {
+         printf("%.0fus total, %.2fus/ping, %.0f pings/s\n", us,
+                us / result->received, result->received * 1e6 / us);
+         printf("latency: p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+                result->latency.GetPercentile(50) / 1e3,
+                result->latency.GetPercentile(99) / 1e3,
+                result->latency.GetPercentile(99.9) / 1e3,
+                result->latency.GetMax() / 1e3);
+      }
+      if (result->toClient.GetCount() > 0 || result->oneWayRejected > 0) {
+         PrintOneWay(*result);
+      }
+      if (pacerPtr != NULL) {
+         const LoopbackHistogram& lag = result->sendLag;
+
+         if (options.endRate > 0 && options.endRate != options.rate) {
+            printf("open loop, %.0f to %.0f pings/s, ", options.rate, options.endRate);
+         } else {
+            printf("open loop, %.0f pings/s, ", options.rate);
+         }
+         printf("sent late: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+                lag.GetPercentile(50) / 1e3, lag.GetPercentile(99) / 1e3,
+                lag.GetMax() / 1e3);
+      }
+      if (options.bulkSize > 0) {
+         printf("%d bulk pings sent, %d received\n", pinger.cntBulkSent,
+                pinger.cntBulkRecv);
+         PrintLaneStats(&pinger);
+      }
+      if (options.dropEvery > 0) {
+         PrintJournalStats(&pinger, drops);
+      }
+      if (options.type == VDPSERVICE_TCPRAW_CHANNEL) {
+         PrintTcpStats(&pinger);
+      }
+      if (options.compressEnabled) {
+         PrintCompressionStats(&pinger, options, result->compression);
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackRunSessions --
+ *
+ *    Opens sessions 1 to options.sessions on one RPCSessionManager with
+ *    options.sessionThreads workers, one pinger each, sends the warm-up
+ *    pings then the measured ones round robin over them from this
+ *    thread, and closes them.
+ *
+ * Results:
+ *    0 if all the pings came back, 1 otherwise.
+ *
+ * Side Effects:
+ *    Prints what the sessions got through together, and how evenly.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackRunSessions(const LoopbackPingOptions& options)   // IN
+{
+   std::unique_ptr<RPCPayloadCorpus> corpus;
+   if (options.payload != NULL) {
+      corpus.reset(LoopbackNewCorpus(options));
+   }
+
+   RPCSessionManager sessionManager(PINGRPC_TOKEN_NAME);
+   if (!sessionManager.Start(options.type, options.compressEnabled,
+                             options.encryptionEnabled,
+                             options.sessionThreads)) {
+      printf("Start() failed\n");
+      return 1;
+   }
+
+   /* the pingers outlive their sessions, CloseSession() hands them back */
+   std::vector<std::unique_ptr<LoopbackPinger> > pingers;
+   int rv = 0;
+
+   for (int i = 0; i < options.sessions; i++) {
+      std::unique_ptr<LoopbackPinger> pinger(
+         new LoopbackPinger(options.postMode, &sessionManager));
+      pinger->SetTrafficClass(options.trafficClass);
+      pinger->SetCorpus(corpus.get());
+
+      if (!sessionManager.OpenSession((DWORD)(i + 1), pinger.get(), 5000)) {
+         printf("OpenSession() of session %d failed\n", i + 1);
+         rv = 1;
+         break;
+      }
+
+      pinger->SetCreditWindow(options.window, 0);
+      if (options.batchUs > 0) {
+         pinger->SetBatching(options.batchUs, LOOPBACK_PING_BATCH_BYTES);
+      }
+      pingers.push_back(std::move(pinger));
+   }
+
+   double elapsedUs = 0;
+   if (rv == 0) {
+      for (int i = 0; i < options.warmup &&
+                      pingers[i % pingers.size()]->Ping(options.size); ++i) {
+      }
+      for (size_t i = 0; i < pingers.size(); i++) {
+         pingers[i]->FlushBatch();
+         pingers[i]->WaitForPendingMessages(LOOPBACK_PING_TIMEOUT_SEC * 1000);
+         pingers[i]->ResetCounters();
+      }
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      for (int i = 0; i < options.n; ++i) {
+         if (!pingers[i % pingers.size()]->Ping(options.size)) {
+            break;
+         }
+      }
+      for (size_t i = 0; i < pingers.size(); i++) {
+         pingers[i]->FlushBatch();
+         pingers[i]->WaitForPendingMessages(LOOPBACK_PING_TIMEOUT_SEC * 1000);
+      }
+
+      elapsedUs = (double)std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start).count();
+   }
+
+   for (size_t i = 0; i < pingers.size(); i++) {
+      sessionManager.CloseSession((DWORD)(i + 1));
+   }
+   sessionManager.Stop();
+
+   LoopbackHistogram latency;
+   int sent = 0;
+   int received = 0;
+   int minReceived = INT_MAX;
+   int maxReceived = 0;
+
+   for (size_t i = 0; i < pingers.size(); i++) {
+      LoopbackHistogram sessionLatency;
+
+      pingers[i]->GetLatency(&sessionLatency);
+      latency.Merge(sessionLatency);
+      sent += pingers[i]->cntSent;
+      received += pingers[i]->cntRecv;
+      minReceived = std::min(minReceived, pingers[i]->cntRecv);
+      maxReceived = std::max(maxReceived, pingers[i]->cntRecv);
+   }
+
+   printf("%d sessions on %d workers, %d pings sent, %d received\n",
+          (int)pingers.size(), options.sessionThreads, sent, received);
+   if (received > 0 && elapsedUs > 0) {
+      printf("%.0fus total, %.0f pings/s, %d to %d per session\n", elapsedUs,
+             received * 1e6 / elapsedUs, minReceived, maxReceived);
+      printf("latency: p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+             latency.GetPercentile(50) / 1e3, latency.GetPercentile(99) / 1e3,
+             latency.GetPercentile(99.9) / 1e3, latency.GetMax() / 1e3);
+   }
+
+   return rv == 0 && received == options.n ? 0 : 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * main --
+ *
+ *     Loads the client plugin, connects to it and pings it, or runs the
+ *     sweep of -B.  RPCManager opens the agent side through the exports
+ *     of the emulator, it is built as for a plugin otherwise.
+ *
+ * Results:
+ *     0 if all the pings came back.
+ *
+ * Side Effects:
+ *     None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+main(int argc, char* argv[])
+{
+   LoopbackPingOptions options;
+
+   if (!ParseOptions(argc, argv, &options)) {
+      Usage();
+      return 2;
+   }
+
+   LogUtils::LogInit("LoopbackPing", true);
+
+   static const RPCServerEntryPoints serverEntryPoints = {
+      VDPService_ServerInit2,
+      VDPService_ServerExit2
+   };
+   RPCManager::SetServerEntryPoints(&serverEntryPoints);
+
+   LoopbackNetwork network(options.seed);
+   if (options.link != NULL) {
+      if (!network.Parse(options.link)) {
+         printf("Invalid link model \"%s\"\n", options.link);
+         return 2;
+      }
+      LoopbackService::Get()->SetLinkFactory(LoopbackNetwork::CreateLink, &network);
+   }
+
+   if (!LoopbackService::Get()->LoadClientPlugin(options.plugin)) {
+      printf("Cannot load the client plugin %s\n", options.plugin);
+      return 1;
+   }
+
+   int rv = 1;
+   if (options.bench != NULL) {
+      rv = LoopbackRunBench(options);
+   } else if (options.saturate) {
+      rv = LoopbackRunSaturation(options);
+   } else if (options.fanout != NULL) {
+      rv = LoopbackRunFanout(options);
+   } else if (options.sessions > 0) {
+      rv = LoopbackRunSessions(options);
+   } else {
+      LoopbackPingResult result;
+
+      if (LoopbackRunPing(options, &result, true)) {
+         rv = result.received == options.n &&
+              result.bulkReceived == result.bulkSent ? 0 : 1;
+      }
+   }
+
+   LoopbackService::Get()->UnloadClientPlugin();
+   LoopbackService::Get()->SetLinkFactory(NULL, NULL);
+   RPCManager::SetServerEntryPoints(NULL);
+
+   if (options.link != NULL) {
+      PrintLinkStats(&network);
+   }
+
+   return rv;
+}
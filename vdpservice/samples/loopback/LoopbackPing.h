@@ -0,0 +1,120 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackPing.h --
+ *
+ *    What a LoopbackPing run is given and what it measures, shared by
+ *    the single run of main() and the sweeps of LoopbackBench.
+ *
+ */
+
+#pragma once
+
+#include "LoopbackService.h"
+#include "LoopbackHistogram.h"
+#include "RPCManager.h"
+#include "RPCPayloadCorpus.h"
+#include "RPCClockSync.h"
+
+// warm-up pings of a sweep run without -W, a tenth of -n up to this.
+#define LOOPBACK_BENCH_MAX_WARMUP   1000
+
+// percent of the round trips split below 0 up to which the one-way delays hold.
+#define LOOPBACK_ONEWAY_MAX_REJECTED_PCT 1
+
+typedef struct {
+   VdpServiceChannelType type;
+   RPCTrafficClass trafficClass;
+   int size;
+   int n;
+   int warmup;                       /* pings before the measured ones */
+   bool compressEnabled;
+   bool encryptionEnabled;
+   bool postMode;
+   bool pumpThread;
+   int window;
+   int batchUs;
+   int bulkSize;
+   int dropEvery;
+   int zeroCopyMin;
+   bool useUring;
+   const char* plugin;
+   const char* link;
+   uint64 seed;
+   const char* bench;                /* sweep spec, see LoopbackBench::Parse() */
+   const char* json;                 /* where the sweep results go */
+   double rate;                      /* open loop pings/s, 0 is closed loop */
+   double endRate;                   /* ramps from rate to this */
+   int sloUs;                        /* p99 bound of -A, 0 is none */
+   bool saturate;                    /* search the highest rate, -A */
+   const char* fanout;               /* numbers of pingers, -F */
+   int sessions;                     /* of one RPCSessionManager, -M, 0 is none */
+   int sessionThreads;               /* its workers */
+   DWORD sid;                        /* session of the connection */
+   const char* payload;              /* corpus class[:entropy], -P, NULL is the pattern */
+   RPCPayloadCorpus* corpus;         /* of payload, shared by the pingers of a fan-out */
+} LoopbackPingOptions;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackPingResult
+ *
+ *    What one run measured, the warm-up left out.  The latency of a
+ *    ping runs from the call that sends it to its echo, or to its
+ *    delivery in post mode, in nanoseconds.  In open loop it runs from
+ *    the time the ping was due, and how late it went out is the lag.
+ *    The compression counts the frames of every connection meanwhile.
+ *    The one-way delays split the round trips of the pings by the
+ *    clock offset the pinger estimated, see RPCClockSync, and do not
+ *    hold when it split too many below 0, see LoopbackOneWayValid().
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   bool                    connected;
+   int                     sent;
+   int                     received;
+   int                     bulkSent;
+   int                     bulkReceived;
+   double                  elapsedUs;
+   uint64                  payloadBytes;     /* of the pings answered */
+   LoopbackHistogram       latency;
+   LoopbackHistogram       sendLag;          /* open loop only */
+   LoopbackCompressionStats compression;
+   LoopbackHistogram       toClient;         /* one way, of the pings echoed */
+   LoopbackHistogram       toAgent;
+   uint64                  oneWayRejected;   /* echoed, but split below 0 */
+   RPCClockSyncStats       clock;
+} LoopbackPingResult;
+
+
+class LoopbackFanoutGate;
+
+/*
+ * Runs the pings of <options> against the client plugin already loaded,
+ * over a new connection.  <verbose> prints the statistics of the
+ * channel as main() always did.  The pingers of a fan-out start and
+ * stop at their <gate>.
+ */
+bool LoopbackRunPing(const LoopbackPingOptions& options,
+                     LoopbackPingResult* result, bool verbose,
+                     LoopbackFanoutGate* gate = NULL);
+
+/*
+ * Whether the one-way delays of <result> are a measurement, "n/a" if not.
+ */
+bool LoopbackOneWayValid(const LoopbackPingResult& result);
+
+/*
+ * The corpus of the payloads of options.payload, the caller deletes it.
+ */
+RPCPayloadCorpus* LoopbackNewCorpus(const LoopbackPingOptions& options);
+
+int LoopbackRunBench(const LoopbackPingOptions& options);
+int LoopbackRunSaturation(const LoopbackPingOptions& options);
+int LoopbackRunFanout(const LoopbackPingOptions& options);
+int LoopbackRunSessions(const LoopbackPingOptions& options);
@@ -0,0 +1,1692 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackService.cpp --
+ *
+ *    The vdpService exports, the client plugin host, the per thread
+ *    apartments and the channel, observer and local job interfaces.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackService.h"
+
+#include <chrono>
+#include <dlfcn.h>
+
+static thread_local std::shared_ptr<LoopbackApartment> t_apartment;
+
+static Bool LoopbackQueryInterface(const GUID* iid, void* iface);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackIsGuid --
+ *
+ *    Compares two interface ids.
+ *
+ * Results:
+ *    true if they are the same.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackIsGuid(const GUID* iid,     // IN
+               const GUID* guid)    // IN
+{
+   return memcmp(iid, guid, sizeof *guid) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::LoopbackApartment --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackApartment::LoopbackApartment()
+   : m_signaled(false),
+     m_busyNs(0),
+     m_dispatcher(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::~LoopbackApartment --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackApartment::~LoopbackApartment()
+{
+   if (m_dispatcher != 0) {
+      LoopbackService::Get()->RemoveApartment(m_dispatcher);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Current --
+ *
+ *    The apartment of the calling thread, created on first use.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::shared_ptr<LoopbackApartment>
+LoopbackApartment::Current()
+{
+   if (!t_apartment) {
+      t_apartment = std::make_shared<LoopbackApartment>();
+      t_apartment->m_dispatcher = LoopbackService::Get()->AddApartment(t_apartment);
+   }
+
+   return t_apartment;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Bind --
+ *
+ *    Dispatches the callbacks of <endpoint> on this thread.  An endpoint
+ *    can be bound to several threads, only one dispatches at a time.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The thread is woken up for the callbacks already queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackApartment::Bind(const std::shared_ptr<LoopbackEndpoint>& endpoint)  // IN
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (size_t i = 0; i < m_endpoints.size(); i++) {
+         if (m_endpoints[i] == endpoint) {
+            return;
+         }
+      }
+      m_endpoints.push_back(endpoint);
+   }
+
+   endpoint->Bind(shared_from_this());
+   Wake();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Unbind --
+ *
+ *    Stops dispatching the callbacks of <endpoint> on this thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackApartment::Unbind(const LoopbackEndpoint* endpoint)  // IN
+{
+   std::shared_ptr<LoopbackEndpoint> found;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (size_t i = 0; i < m_endpoints.size(); i++) {
+         if (m_endpoints[i].get() == endpoint) {
+            found = m_endpoints[i];
+            m_endpoints.erase(m_endpoints.begin() + i);
+            break;
+         }
+      }
+   }
+
+   if (found) {
+      found->Unbind(this);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::UnbindAll --
+ *
+ *    Stops dispatching the callbacks of all endpoints on this thread,
+ *    what ThreadUninitialize() does.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackApartment::UnbindAll()
+{
+   std::vector<std::shared_ptr<LoopbackEndpoint> > endpoints;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      endpoints.swap(m_endpoints);
+   }
+
+   for (size_t i = 0; i < endpoints.size(); i++) {
+      endpoints[i]->Unbind(this);
+   }
+
+   m_current.reset();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Post --
+ *
+ *    Runs <job> on this thread from its next Poll().
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackApartment::Post(const std::function<void()>& job)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_jobs.push_back(job);
+   m_signaled = true;
+   m_cond.notify_one();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Wake --
+ *
+ *    Ends the wait of Poll(), callable from any thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackApartment::Wake()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_signaled = true;
+   m_cond.notify_one();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::Poll --
+ *
+ *    Runs the jobs and callbacks pending for this thread, waiting up to
+ *    <msTimeout> for some if there are none.  A negative timeout waits
+ *    until woken up.
+ *
+ * Results:
+ *    true if anything was run.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackApartment::Poll(int msTimeout)   // IN
+{
+   bool worked = RunOnce();
+   if (worked || msTimeout == 0) {
+      return worked;
+   }
+
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (msTimeout < 0) {
+         m_cond.wait(lock, [this] { return m_signaled; });
+      } else {
+         m_cond.wait_for(lock, std::chrono::milliseconds(msTimeout),
+                         [this] { return m_signaled; });
+      }
+   }
+
+   return RunOnce();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackApartment::RunOnce --
+ *
+ *    Runs the jobs and callbacks pending for this thread.
+ *
+ * Results:
+ *    true if anything was run.
+ *
+ * Side Effects:
+ *    Adds the time it took to the busy time if anything was run.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackApartment::RunOnce()
+{
+   std::deque<std::function<void()> > jobs;
+   std::vector<std::shared_ptr<LoopbackEndpoint> > endpoints;
+   std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      jobs.swap(m_jobs);
+      endpoints = m_endpoints;
+      m_signaled = false;
+   }
+
+   bool worked = !jobs.empty();
+
+   for (size_t i = 0; i < jobs.size(); i++) {
+      jobs[i]();
+   }
+
+   for (size_t i = 0; i < endpoints.size(); i++) {
+      std::weak_ptr<LoopbackEndpoint> saved = m_current;
+
+      m_current = endpoints[i];
+      if (endpoints[i]->Dispatch()) {
+         worked = true;
+      }
+      m_current = saved;
+   }
+
+   if (worked) {
+      m_busyNs += (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - begin).count();
+   }
+   return worked;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::LoopbackService --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackService::LoopbackService()
+   : m_linkFactory(NULL),
+     m_linkUserData(NULL),
+     m_pluginModule(NULL),
+     m_hasPlugin(false),
+     m_clientStop(false),
+     m_nextDispatcher(1),
+     m_nextObserver(1)
+{
+   memset(&m_plugin, 0, sizeof m_plugin);
+   m_pluginToken[0] = '\0';
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::~LoopbackService --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackService::~LoopbackService()
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::Get --
+ *
+ *    The service of the process.  It is never destroyed, the thread
+ *    apartments may go after static destructors have run.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackService*
+LoopbackService::Get()
+{
+   static LoopbackService* service = new LoopbackService();
+   return service;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::ServerInit --
+ *
+ *    Opens the connection of session <sid>.  The server end is bound to
+ *    the calling thread, the client end is handed to the instance the
+ *    client plugin creates if its token matches.
+ *
+ * Results:
+ *    false if the session already has a connection.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::ServerInit(unsigned long sid,                 // IN
+                            const char* token,                 // IN
+                            VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                            void** channelHandle)              // OUT
+{
+   FUNCTION_TRACE;
+
+   if (token == NULL || qi == NULL || channelHandle == NULL) {
+      FUNCTION_EXIT_MSG("Invalid parameter");
+      return false;
+   }
+
+   sid &= LOOPBACK_CURRENT_SESSION;
+
+   std::shared_ptr<Connection> conn = std::make_shared<Connection>();
+   bool hostClient = false;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_connections.find(sid) != m_connections.end()) {
+         FUNCTION_EXIT_MSG("Session %lu already initialized", sid);
+         return false;
+      }
+
+      LoopbackLink* link = NULL;
+      if (m_linkFactory != NULL) {
+         link = m_linkFactory(sid, m_linkUserData);
+      }
+      if (link == NULL) {
+         link = new LoopbackLink();
+      }
+
+      conn->server = std::make_shared<LoopbackEndpoint>(sid, token, true);
+      conn->client = std::make_shared<LoopbackEndpoint>(sid, token, false);
+      conn->link.reset(link);
+      conn->instance = NULL;
+      conn->hasInstance = false;
+
+      conn->server->SetPeer(conn->client, conn->link);
+      conn->client->SetPeer(conn->server, conn->link);
+
+      m_connections[sid] = conn;
+      m_endpoints[conn->server.get()] = conn->server;
+      m_endpoints[conn->client.get()] = conn->client;
+
+      hostClient = m_hasPlugin && strcmp(m_pluginToken, token) == 0;
+   }
+
+   std::shared_ptr<LoopbackApartment> apartment = LoopbackApartment::Current();
+   apartment->Bind(conn->server);
+   apartment->SetCurrentEndpoint(conn->server);
+
+   if (hostClient) {
+      m_clientApartment->Post([this, conn]() {
+         m_clientApartment->Bind(conn->client);
+         m_clientApartment->SetCurrentEndpoint(conn->client);
+
+         if (m_plugin.createInstance(conn->client.get(), &conn->instance)) {
+            conn->hasInstance = true;
+         } else {
+            LOG("Error: plugin failed to create an instance for session %lu.",
+                conn->client->Sid());
+         }
+      });
+   } else {
+      LOG("No client plugin for \"%s\", session %lu stays pending.", token, sid);
+   }
+
+   GetQueryInterface(qi);
+   *channelHandle = conn->server.get();
+
+   FUNCTION_EXIT_MSG("Session %lu \"%s\" [OK]", sid, token);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::ServerExit --
+ *
+ *    Closes the connection of session <sid>, the client plugin instance
+ *    is destroyed before this returns.
+ *
+ * Results:
+ *    false if the session has no connection.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::ServerExit(unsigned long sid)  // IN
+{
+   FUNCTION_TRACE;
+   std::shared_ptr<Connection> conn;
+
+   sid &= LOOPBACK_CURRENT_SESSION;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      auto it = m_connections.find(sid);
+      if (it == m_connections.end()) {
+         FUNCTION_EXIT_MSG("Session %lu not initialized", sid);
+         return false;
+      }
+
+      conn = it->second;
+      m_connections.erase(it);
+      m_endpoints.erase(conn->server.get());
+      m_endpoints.erase(conn->client.get());
+   }
+
+   /*
+    * What the server did last reaches the client before the instance
+    * goes, as it would over a real connection.
+    */
+   RunOnClient([this, conn]() {
+      std::shared_ptr<LoopbackApartment> apartment = LoopbackApartment::Current();
+      std::shared_ptr<LoopbackEndpoint> saved = apartment->CurrentEndpoint();
+
+      apartment->SetCurrentEndpoint(conn->client);
+      conn->client->Dispatch();
+
+      if (conn->hasInstance) {
+         m_plugin.destroyInstance(conn->instance);
+         conn->hasInstance = false;
+      }
+
+      apartment->Unbind(conn->client.get());
+      apartment->SetCurrentEndpoint(saved);
+   });
+
+   conn->link->Close();
+   conn->server->Close();
+   conn->client->Close();
+
+   FUNCTION_EXIT_MSG("Session %lu [OK]", sid);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::DropConnection --
+ *
+ *    Drops the connection of session <sid> and brings it back, see
+ *    LoopbackEndpoint::Drop().  Both ends see it go down and come up
+ *    again and have to connect their channel and objects anew.
+ *
+ * Results:
+ *    false if the session has no connection.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::DropConnection(unsigned long sid)  // IN
+{
+   FUNCTION_TRACE;
+   std::shared_ptr<Connection> conn;
+
+   sid &= LOOPBACK_CURRENT_SESSION;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      auto it = m_connections.find(sid);
+      if (it == m_connections.end()) {
+         FUNCTION_EXIT_MSG("Session %lu not initialized", sid);
+         return false;
+      }
+      conn = it->second;
+   }
+
+   conn->server->Drop();
+   conn->client->Drop();
+   conn->server->Restore();
+   conn->client->Restore();
+
+   FUNCTION_EXIT_MSG("Session %lu [OK]", sid);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::GetQueryInterface --
+ *
+ *    Fills the entry point to the interfaces.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::GetQueryInterface(VDP_SERVICE_QUERY_INTERFACE* qi)  // OUT
+{
+   qi->Version = VDP_SERVICE_VERSION;
+   qi->QueryInterface = LoopbackQueryInterface;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::SetLinkFactory --
+ *
+ *    Sets what creates the link of the connections opened from now on,
+ *    NULL for the default one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::SetLinkFactory(LoopbackLinkFactory factory,  // IN
+                                void* userData)               // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_linkFactory = factory;
+   m_linkUserData = userData;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::LoadClientPlugin --
+ *
+ *    Loads a client plugin, e.g. libPingRPC.so, and starts hosting it.
+ *
+ * Results:
+ *    false if it cannot be loaded or initialized.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::LoadClientPlugin(const char* path)   // IN
+{
+   FUNCTION_TRACE;
+
+   void* module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+   if (module == NULL) {
+      FUNCTION_EXIT_MSG("dlopen(\"%s\") failed: %s", path, dlerror());
+      return false;
+   }
+
+   LoopbackClientPlugin plugin;
+   plugin.getTokenName = (VDPService_PluginGetTokenNameFn)
+      dlsym(module, VDP_SERVICE_PLUGIN_GET_TOKEN_NAME_FN);
+   plugin.init = (VDPService_PluginInitFn)
+      dlsym(module, VDP_SERVICE_PLUGIN_INIT_FN);
+   plugin.exit = (VDPService_PluginExitFn)
+      dlsym(module, VDP_SERVICE_PLUGIN_EXIT_FN);
+   plugin.createInstance = (VDPService_PluginCreateInstanceFn)
+      dlsym(module, VDP_SERVICE_PLUGIN_CREATE_INSTANCE_FN);
+   plugin.destroyInstance = (VDPService_PluginDestroyInstanceFn)
+      dlsym(module, VDP_SERVICE_PLUGIN_DESTROY_INSTANCE_FN);
+
+   if (!SetClientPlugin(&plugin)) {
+      dlclose(module);
+      FUNCTION_EXIT_MSG("\"%s\" is not a usable plugin", path);
+      return false;
+   }
+
+   m_pluginModule = module;
+   FUNCTION_EXIT_MSG("\"%s\" [OK]", path);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::SetClientPlugin --
+ *
+ *    Starts hosting a client plugin given by its exports, which lets a
+ *    plugin linked into the program be used.  Its callbacks all run on
+ *    a thread of its own, like on a real client.
+ *
+ * Results:
+ *    false if a plugin is already hosted or the plugin fails to init.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::SetClientPlugin(const LoopbackClientPlugin* plugin)  // IN
+{
+   FUNCTION_TRACE;
+
+   if (m_hasPlugin) {
+      FUNCTION_EXIT_MSG("A client plugin is already loaded");
+      return false;
+   }
+
+   if (plugin->getTokenName == NULL || plugin->createInstance == NULL ||
+       plugin->destroyInstance == NULL) {
+      FUNCTION_EXIT_MSG("Missing plugin exports");
+      return false;
+   }
+
+   m_plugin = *plugin;
+   if (!m_plugin.getTokenName(m_pluginToken, sizeof m_pluginToken)) {
+      FUNCTION_EXIT_MSG("GetTokenName() failed");
+      return false;
+   }
+   m_pluginToken[sizeof m_pluginToken - 1] = '\0';
+
+   std::promise<bool> started;
+   std::future<bool> ok = started.get_future();
+
+   m_clientStop = false;
+   m_clientThread = std::thread(&LoopbackService::ClientThreadMain, this, &started);
+
+   if (!ok.get()) {
+      m_clientThread.join();
+      FUNCTION_EXIT_MSG("PluginInit() failed");
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_hasPlugin = true;
+   }
+
+   FUNCTION_EXIT_MSG("Hosting \"%s\"", m_pluginToken);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::UnloadClientPlugin --
+ *
+ *    Stops hosting the client plugin.  The sessions must be closed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::UnloadClientPlugin()
+{
+   FUNCTION_TRACE;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_hasPlugin) {
+         return;
+      }
+      m_hasPlugin = false;
+   }
+
+   m_clientStop = true;
+   m_clientApartment->Wake();
+   m_clientThread.join();
+   m_clientApartment.reset();
+
+   if (m_pluginModule != NULL) {
+      dlclose(m_pluginModule);
+      m_pluginModule = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::ClientThreadMain --
+ *
+ *    The thread the client plugin runs on.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::ClientThreadMain(std::promise<bool>* started)  // IN
+{
+   m_clientApartment = LoopbackApartment::Current();
+
+   VDP_SERVICE_QUERY_INTERFACE qi;
+   GetQueryInterface(&qi);
+
+   if (m_plugin.init != NULL && !m_plugin.init(qi)) {
+      m_clientApartment.reset();
+      started->set_value(false);
+      return;
+   }
+   started->set_value(true);
+
+   while (!m_clientStop) {
+      m_clientApartment->Poll(100);
+   }
+
+   if (m_plugin.exit != NULL) {
+      m_plugin.exit();
+   }
+
+   m_clientApartment->UnbindAll();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::RunOnClient --
+ *
+ *    Runs <job> on the client plugin thread and waits for it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::RunOnClient(const std::function<void()>& job)  // IN
+{
+   if (!m_hasPlugin || std::this_thread::get_id() == m_clientThread.get_id()) {
+      job();
+      return;
+   }
+
+   std::promise<void> done;
+   std::future<void> finished = done.get_future();
+
+   m_clientApartment->Post([&job, &done]() {
+      job();
+      done.set_value();
+   });
+
+   finished.wait();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::GetClientBusyNs --
+ *
+ *    Returns how long the client plugin thread has spent running jobs
+ *    and callbacks, those of all the client instances.  Sampled twice,
+ *    it tells how busy the thread was in between.
+ *
+ * Results:
+ *    Nanoseconds, 0 without a client plugin.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LoopbackService::GetClientBusyNs()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_hasPlugin ? m_clientApartment->GetBusyNs() : 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::FindEndpoint --
+ *
+ *    Resolves a channel handle.
+ *
+ * Results:
+ *    The endpoint, empty if the handle is not valid.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::shared_ptr<LoopbackEndpoint>
+LoopbackService::FindEndpoint(void* channelHandle)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   auto it = m_endpoints.find(channelHandle);
+   return it != m_endpoints.end() ? it->second.lock() :
+                                    std::shared_ptr<LoopbackEndpoint>();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::CurrentEndpoint --
+ *
+ *    The endpoint the channel calls of this thread act on.
+ *
+ * Results:
+ *    See above, empty if the thread has none.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::shared_ptr<LoopbackEndpoint>
+LoopbackService::CurrentEndpoint()
+{
+   return LoopbackApartment::Current()->CurrentEndpoint();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::AddApartment --
+ *
+ *    Registers the apartment of a thread as a local job dispatcher.
+ *
+ * Results:
+ *    The dispatcher id.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VdpLocalJobDispatcher
+LoopbackService::AddApartment(const std::shared_ptr<LoopbackApartment>& apartment)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   VdpLocalJobDispatcher dispatcher = m_nextDispatcher++;
+   m_apartments[dispatcher] = apartment;
+   return dispatcher;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::RemoveApartment --
+ *
+ *    Forgets a dispatcher, its thread is gone.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::RemoveApartment(VdpLocalJobDispatcher dispatcher)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_apartments.erase(dispatcher);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::RequestJob --
+ *
+ *    Runs <job> on the thread of <dispatcher>.
+ *
+ * Results:
+ *    false if the dispatcher is not valid.
+ *
+ * Side Effects:
+ *    The thread is woken up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::RequestJob(VdpLocalJobDispatcher dispatcher,  // IN
+                            VdpServiceLocalJob job,            // IN
+                            void* userData)                    // IN
+{
+   std::shared_ptr<LoopbackApartment> apartment;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_apartments.find(dispatcher);
+      if (it != m_apartments.end()) {
+         apartment = it->second.lock();
+      }
+   }
+
+   if (!apartment || job == NULL) {
+      return false;
+   }
+
+   apartment->Post([job, userData]() { job(userData); });
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::RegisterObserver --
+ *
+ *    Adds an observer of <name>.
+ *
+ * Results:
+ *    The observer id, VDPOBSERVER_INVALID_ID on error.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VDPService_ObserverId
+LoopbackService::RegisterObserver(const char* name,                 // IN
+                                  void* context,                    // IN
+                                  VdpServiceObserverCallback cb)    // IN
+{
+   if (name == NULL || cb == NULL) {
+      return VDPOBSERVER_INVALID_ID;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   Observer observer;
+   observer.name = name;
+   observer.context = context;
+   observer.cb = cb;
+
+   VDPService_ObserverId id = m_nextObserver++;
+   m_observers[id] = observer;
+   return id;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::UnregisterObserver --
+ *
+ *    Removes an observer.
+ *
+ * Results:
+ *    false if <id> is not registered.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::UnregisterObserver(VDPService_ObserverId id)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_observers.erase(id) != 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::Broadcast --
+ *
+ *    Calls the observers of <name> on this thread.  The source token is
+ *    the one of the channel the thread acts on.
+ *
+ * Results:
+ *    true.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::Broadcast(const char* name,      // IN
+                           const void* cookie,    // IN
+                           const void* data)      // IN
+{
+   std::vector<Observer> observers;
+
+   if (name == NULL) {
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto it = m_observers.begin(); it != m_observers.end(); ++it) {
+         if (it->second.name == name) {
+            observers.push_back(it->second);
+         }
+      }
+   }
+
+   std::shared_ptr<LoopbackEndpoint> endpoint = CurrentEndpoint();
+   const char* sourceToken = endpoint ? endpoint->Token() : "";
+
+   for (size_t i = 0; i < observers.size(); i++) {
+      observers[i].cb(observers[i].context, sourceToken, cookie, data);
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::AddStream --
+ *
+ *    Registers the application end of a stream, see GetStreamData().
+ *
+ * Results:
+ *    false if <fd> is already registered.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::AddStream(int fd,                                         // IN
+                           const std::shared_ptr<LoopbackStream>& stream)  // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_streams.insert(std::make_pair(fd, stream)).second;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::RemoveStream --
+ *
+ *    Forgets the application end of a stream.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackService::RemoveStream(int fd)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_streams.erase(fd);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::IsStream --
+ *
+ *    Checks whether <fd> is the application end of an open stream.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackService::IsStream(int fd)   // IN
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   auto it = m_streams.find(fd);
+   return it != m_streams.end() && !it->second.expired();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackService::NewSinkHandle --
+ *
+ *    A process wide unique channel sink handle.
+ *
+ * Results:
+ *    See above.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+LoopbackService::NewSinkHandle()
+{
+   static std::atomic<uint32> next(1);
+   return next++;
+}
+
+
+/*
+ * The channel interface.  The calls without a channel handle act on
+ * the current endpoint of the calling thread.
+ */
+
+static Bool
+ChannelThreadInitialize(void* channelHandle,   // IN
+                        uint32 unusedFlag)     // IN
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->FindEndpoint(channelHandle);
+
+   if (!endpoint) {
+      LOG("Error: invalid channel handle %p.", channelHandle);
+      return FALSE;
+   }
+
+   std::shared_ptr<LoopbackApartment> apartment = LoopbackApartment::Current();
+   apartment->Bind(endpoint);
+   apartment->SetCurrentEndpoint(endpoint);
+   return TRUE;
+}
+
+static Bool
+ChannelThreadUninitialize()
+{
+   LoopbackApartment::Current()->UnbindAll();
+   return TRUE;
+}
+
+static void
+ChannelPoll()
+{
+   LoopbackApartment::Current()->Poll(0);
+}
+
+static Bool
+ChannelRegisterSink(const VDPService_ChannelNotifySink* sink,   // IN
+                    void* userData,                             // IN
+                    uint32* sinkHandle)                         // OUT
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   if (!endpoint) {
+      LOG("Error: ThreadInitialize() was not called on this thread.");
+      return FALSE;
+   }
+
+   return endpoint->RegisterSink(sink, userData, sinkHandle);
+}
+
+static Bool
+ChannelUnregisterSink(uint32 sinkHandle)   // IN
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   return endpoint && endpoint->UnregisterSink(sinkHandle);
+}
+
+static Bool
+ChannelConnect()
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   return endpoint && endpoint->Connect();
+}
+
+static Bool
+ChannelDisconnect()
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   return endpoint && endpoint->Disconnect();
+}
+
+static VDPService_ConnectionState
+ChannelGetConnectionState()
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   return endpoint ? endpoint->GetConnectionState() :
+                     VDP_SERVICE_CONN_UNINITIALIZED;
+}
+
+static VDPService_ChannelState
+ChannelGetChannelState()
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->CurrentEndpoint();
+
+   return endpoint ? endpoint->GetChannelState() :
+                     VDP_SERVICE_CHAN_UNINITIALIZED;
+}
+
+static Bool
+ChannelSwitchToStreamDataMode(const char* tcpObjName,   // IN
+                              void* channelHandle,      // IN
+                              int* fd)                  // OUT
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->FindEndpoint(channelHandle);
+
+   return endpoint && endpoint->SwitchToStreamDataMode(tcpObjName, fd);
+}
+
+static VDPService_SessionType
+ChannelGetSessionType()
+{
+   return VDP_SERVICE_BLAST_SESSION;
+}
+
+static void
+ChannelPoll3(int timeout)   // IN
+{
+   LoopbackApartment::Current()->Poll(timeout);
+}
+
+static VdpLocalJobDispatcher
+ChannelThreadInitialize4(void* channelHandle,   // IN
+                         uint32 unusedFlag)     // IN
+{
+   if (!ChannelThreadInitialize(channelHandle, unusedFlag)) {
+      return 0;
+   }
+
+   return LoopbackApartment::Current()->Dispatcher();
+}
+
+static VdpLocalJobDispatcher
+ChannelGetLocalJobDispatcher(void* channelHandle)   // IN
+{
+   std::shared_ptr<LoopbackEndpoint> endpoint =
+      LoopbackService::Get()->FindEndpoint(channelHandle);
+   std::shared_ptr<LoopbackApartment> apartment;
+
+   if (endpoint) {
+      apartment = endpoint->FirstApartment();
+   }
+
+   return apartment ? apartment->Dispatcher() : 0;
+}
+
+
+/*
+ * The observer and local job interfaces.
+ */
+
+static VDPService_ObserverId
+ObserverRegister(const char* name,                 // IN
+                 void* context,                    // IN
+                 VdpServiceObserverCallback cb)    // IN
+{
+   return LoopbackService::Get()->RegisterObserver(name, context, cb);
+}
+
+static Bool
+ObserverUnregister(VDPService_ObserverId id)   // IN
+{
+   return LoopbackService::Get()->UnregisterObserver(id);
+}
+
+static Bool
+ObserverBroadcast(const char* name,     // IN
+                  const void* cookie,   // IN
+                  const void* data)     // IN
+{
+   return LoopbackService::Get()->Broadcast(name, cookie, data);
+}
+
+static Bool
+LocalJobRequest(VdpLocalJobDispatcher hDispatcher,   // IN
+                const VdpServiceLocalJob job,        // IN
+                void* userData)                      // IN
+{
+   return LoopbackService::Get()->RequestJob(hDispatcher, job, userData);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackServiceQueryInterface --
+ *
+ *    Fills the channel, observer and local job interfaces.
+ *
+ * Results:
+ *    false if <iid> is none of them.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackServiceQueryInterface(const GUID* iid,   // IN
+                              void* iface)       // OUT
+{
+   static const struct {
+      const GUID* iid;
+      uint32 version;
+   } channels[] = {
+      { &GUID_VDPService_ChannelInterface_V1, VDP_SERVICE_CHANNEL_INTERFACE_V1 },
+      { &GUID_VDPService_ChannelInterface_V2, VDP_SERVICE_CHANNEL_INTERFACE_V2 },
+      { &GUID_VDPService_ChannelInterface_V3, VDP_SERVICE_CHANNEL_INTERFACE_V3 },
+      { &GUID_VDPService_ChannelInterface_V4, VDP_SERVICE_CHANNEL_INTERFACE_V4 },
+   };
+
+   for (size_t i = 0; i < ARRAYSIZE(channels); i++) {
+      if (LoopbackIsGuid(iid, channels[i].iid)) {
+         VDPService_ChannelInterface* channel = (VDPService_ChannelInterface*)iface;
+
+         memset(channel, 0, sizeof *channel);
+         channel->version = channels[i].version;
+         channel->v1.ThreadInitialize = ChannelThreadInitialize;
+         channel->v1.ThreadUninitialize = ChannelThreadUninitialize;
+         channel->v1.Poll = ChannelPoll;
+         channel->v1.RegisterChannelNotifySink = ChannelRegisterSink;
+         channel->v1.UnregisterChannelNotifySink = ChannelUnregisterSink;
+         channel->v1.Connect = ChannelConnect;
+         channel->v1.Disconnect = ChannelDisconnect;
+         channel->v1.GetConnectionState = ChannelGetConnectionState;
+         channel->v1.GetChannelState = ChannelGetChannelState;
+         channel->v2.SwitchToStreamDataMode = ChannelSwitchToStreamDataMode;
+         channel->v2.GetSessionType = ChannelGetSessionType;
+         channel->v3.Poll = ChannelPoll3;
+         channel->v4.ThreadInitialize = ChannelThreadInitialize4;
+         channel->v4.GetChannelLocalJobDispatcher = ChannelGetLocalJobDispatcher;
+         return true;
+      }
+   }
+
+   if (LoopbackIsGuid(iid, &GUID_VDPService_ObserverInterface_V1)) {
+      VDPService_ObserverInterface* observer = (VDPService_ObserverInterface*)iface;
+
+      memset(observer, 0, sizeof *observer);
+      observer->version = VDPSERVICE_OBSERVER_INTERFACE_V1;
+      observer->v1.RegisterObserver = ObserverRegister;
+      observer->v1.UnregisterObserver = ObserverUnregister;
+      observer->v1.Broadcast = ObserverBroadcast;
+      return true;
+   }
+
+   if (LoopbackIsGuid(iid, &GUID_VDPService_LocalJobInterface_V1)) {
+      VDPService_LocalJobInterface* localJob = (VDPService_LocalJobInterface*)iface;
+
+      memset(localJob, 0, sizeof *localJob);
+      localJob->version = VDP_SERVICE_LOCAL_JOB_INTERFACE_V1;
+      localJob->v1.Request = LocalJobRequest;
+      return true;
+   }
+
+   return false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackQueryInterface --
+ *
+ *    VDP_SERVICE_QUERY_INTERFACE::QueryInterface.
+ *
+ * Results:
+ *    FALSE if the interface is not implemented.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+LoopbackQueryInterface(const GUID* iid,   // IN
+                       void* iface)       // OUT
+{
+   if (iid == NULL || iface == NULL) {
+      return FALSE;
+   }
+
+   if (LoopbackServiceQueryInterface(iid, iface) ||
+       LoopbackChannelObjectQueryInterface(iid, iface) ||
+       LoopbackContextQueryInterface(iid, iface) ||
+       LoopbackStreamQueryInterface(iid, iface) ||
+       LoopbackOverlayQueryInterface(iid, iface)) {
+      return TRUE;
+   }
+
+   LOG("Interface {%08x-%04x} not implemented.", iid->field1, iid->field2);
+   return FALSE;
+}
+
+
+/*
+ * The vdpService exports, see vdpService.h.
+ */
+
+Bool
+VDPService_ServerInit(const char* token,                 // IN
+                      VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                      void** channelHandle)              // OUT
+{
+   return LoopbackService::Get()->ServerInit(LOOPBACK_CURRENT_SESSION, token,
+                                             qi, channelHandle);
+}
+
+Bool
+VDPService_ServerInit2(unsigned long sessionId,           // IN
+                       const char* token,                 // IN
+                       VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                       void** channelHandle)              // OUT
+{
+   return LoopbackService::Get()->ServerInit(sessionId, token, qi, channelHandle);
+}
+
+Bool
+VDPService_ServerInitEx(const char* token,                 // IN
+                        const char* params,                // IN
+                        VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                        void** channelHandle)              // OUT
+{
+   return LoopbackService::Get()->ServerInit(LOOPBACK_CURRENT_SESSION, token,
+                                             qi, channelHandle);
+}
+
+Bool
+VDPService_ServerInitEx2(unsigned long sessionId,           // IN
+                         const char* token,                 // IN
+                         const char* params,                // IN
+                         VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                         void** channelHandle)              // OUT
+{
+   return LoopbackService::Get()->ServerInit(sessionId, token, qi, channelHandle);
+}
+
+Bool
+VDPService_ServerInitLP(const char* token,                 // IN
+                        const char* params,                // IN
+                        VDP_SERVICE_QUERY_INTERFACE* qi,   // OUT
+                        void** channelHandle)              // OUT
+{
+   return LoopbackService::Get()->ServerInit(LOOPBACK_CURRENT_SESSION, token,
+                                             qi, channelHandle);
+}
+
+Bool
+VDPService_MultiServerInit(unsigned long sessionId,            // IN
+                           const char* token,                  // IN
+                           const char* params,                 // IN
+                           VDP_SERVICE_QUERY_INTERFACE* qi,    // OUT
+                           VdpMultiServerID* phMultiServerId)  // OUT
+{
+   LOG("Error: multi server mode is not emulated.");
+   return FALSE;
+}
+
+Bool
+VDPService_MultiServerExit(VdpMultiServerID hMultiServerId,   // IN
+                           void* reserved)                    // IN
+{
+   return FALSE;
+}
+
+Bool
+VDPService_ServerExit()
+{
+   return LoopbackService::Get()->ServerExit(LOOPBACK_CURRENT_SESSION);
+}
+
+Bool
+VDPService_ServerExit2(unsigned long sessionId)   // IN
+{
+   return LoopbackService::Get()->ServerExit(sessionId);
+}
+
+Bool
+VDPService_GetQueryInterface(const char* token,                 // IN
+                             VDP_SERVICE_QUERY_INTERFACE* api)  // OUT
+{
+   if (api == NULL) {
+      return FALSE;
+   }
+
+   LoopbackService::Get()->GetQueryInterface(api);
+   return TRUE;
+}
@@ -0,0 +1,609 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackService.h --
+ *
+ *    In-process stand-in for the vdpService runtime.  The server side
+ *    (VDPService_ServerInit2() and friends) and the client plugin host
+ *    live in the same process and talk over a loopback link, so the
+ *    unmodified RPCManager and the sample plugins can run, and be
+ *    measured, on Linux.
+ *
+ */
+
+#pragma once
+
+#include "vdpService.h"
+#include "vdpService_guids.h"
+#include "vdpService_interfaces.h"
+#include "vdprpc_interfaces.h"
+#include "vdpOverlay.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// session id used by VDPService_ServerInit(), VDP_CURRENT_SESSION.
+#define LOOPBACK_CURRENT_SESSION     0xFFFFFFFFUL
+
+// what a frame costs on the wire besides its data, for link models.
+#define LOOPBACK_FRAME_HEADER_BYTES  16
+
+// size of the header GetStreamData() puts in front of a blob.
+#define LOOPBACK_STREAM_HEADER_BYTES 16
+
+class LoopbackApartment;
+class LoopbackContext;
+class LoopbackEndpoint;
+class LoopbackObject;
+class LoopbackStream;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackFrame
+ *
+ *    Unit exchanged by the two endpoints of a connection.  The frames
+ *    from CONNECT to ABORT cross the link, the others are events an
+ *    endpoint queues for itself so that every callback is fired from
+ *    Poll() and never from inside the API call that caused it.
+ *
+ *    A frame carries the generation of the connection it was sent on,
+ *    one still on the link when the connection drops is lost with it.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef enum {
+   LOOPBACK_FRAME_CONNECT,
+   LOOPBACK_FRAME_DISCONNECT,
+   LOOPBACK_FRAME_OBJECT_CREATED,    /* value: configuration flags */
+   LOOPBACK_FRAME_OBJECT_DESTROYED,
+   LOOPBACK_FRAME_SIDE_CHANNEL,      /* value: side channel type */
+   LOOPBACK_FRAME_INVOKE,            /* data: see LoopbackContext */
+   LOOPBACK_FRAME_REPLY,
+   LOOPBACK_FRAME_ABORT,             /* value: reason */
+
+   LOOPBACK_FRAME_CHANNEL_STATE,     /* value: VDPService_ChannelState */
+   LOOPBACK_FRAME_CONNECTION_STATE,  /* value: VDPService_ConnectionState */
+   LOOPBACK_FRAME_OBJECT_STATE,      /* value: VDPRPC_ObjectState */
+   LOOPBACK_FRAME_POSTED
+} LoopbackFrameType;
+
+typedef struct {
+   LoopbackFrameType       type;
+   std::string             object;
+   uint32                  id;
+   int32                   value;
+   uint32                  generation;
+
+   /* side channel the frame travels on, 0 for the main channel */
+   int32                   sideChannel;
+   std::vector<char>       data;
+} LoopbackFrame;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackLink
+ *
+ *    Carries the frames of one connection.  The default delivers them
+ *    right away, a subclass can delay, reorder or drop them to model a
+ *    network and must hand each frame it keeps to Deliver() exactly
+ *    once, or delete it.  Close() is called before the endpoints go.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackLink
+{
+public:
+   virtual ~LoopbackLink() { }
+
+   virtual void Send(const std::shared_ptr<LoopbackEndpoint>& to,
+                     LoopbackFrame* frame) { Deliver(to, frame); }
+   virtual void Close() { }
+
+   static void Deliver(const std::shared_ptr<LoopbackEndpoint>& to,
+                       LoopbackFrame* frame);
+};
+
+typedef LoopbackLink* (*LoopbackLinkFactory)(unsigned long sid, void* userData);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackApartment
+ *
+ *    Per thread dispatcher, the thread's "VDP apartment".  Poll() runs
+ *    the local jobs requested for the thread and the callbacks of the
+ *    endpoints bound to it.  The channel interface calls that take no
+ *    channel handle act on the current endpoint of the thread, the one
+ *    last given to ThreadInitialize() or being dispatched.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackApartment : public std::enable_shared_from_this<LoopbackApartment>
+{
+public:
+   LoopbackApartment();
+   ~LoopbackApartment();
+
+   static std::shared_ptr<LoopbackApartment> Current();
+
+   VdpLocalJobDispatcher Dispatcher() const { return m_dispatcher; }
+
+   void Bind(const std::shared_ptr<LoopbackEndpoint>& endpoint);
+   void Unbind(const LoopbackEndpoint* endpoint);
+   void UnbindAll();
+
+   std::shared_ptr<LoopbackEndpoint> CurrentEndpoint() { return m_current.lock(); }
+   void SetCurrentEndpoint(const std::shared_ptr<LoopbackEndpoint>& endpoint)
+   {
+      m_current = endpoint;
+   }
+
+   void Post(const std::function<void()>& job);
+   void Wake();
+   bool Poll(int msTimeout);
+
+   uint64 GetBusyNs() const { return m_busyNs; }
+
+private:
+   std::mutex                                       m_mutex;
+   std::condition_variable                          m_cond;
+   bool                                             m_signaled;
+   std::vector<std::shared_ptr<LoopbackEndpoint> >  m_endpoints;
+   std::deque<std::function<void()> >               m_jobs;
+   std::atomic<uint64>                              m_busyNs;   /* running jobs and callbacks */
+
+   /* owner thread only */
+   std::weak_ptr<LoopbackEndpoint>                  m_current;
+   VdpLocalJobDispatcher                            m_dispatcher;
+
+   bool RunOnce();
+
+   LoopbackApartment(const LoopbackApartment&);
+   LoopbackApartment& operator=(const LoopbackApartment&);
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackContext
+ *
+ *    A channel context: command, parameters and return values of one
+ *    request.  The variants it holds are deep copies owned by it.
+ *
+ *    On the wire an INVOKE frame carries
+ *       [u32 command][u32 options][u8 post][str name][u32 n]{param}
+ *    and a REPLY frame
+ *       [u32 returnCode][u32 n]{param}
+ *    where a param is [str name][u16 vt][value] and str is [u32 len][bytes].
+ *    With a compression option the [u32 n]{param} of both are really
+ *    compressed, with zlib, so that the ratio and the CPU time are those
+ *    of the payload.  Snappy is not available, the fastest zlib level
+ *    stands in for it.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   std::string       name;
+   VDP_RPC_VARIANT   value;
+} LoopbackParam;
+
+class LoopbackContext
+{
+public:
+   LoopbackContext(LoopbackObject* object, uint32 id, uint32 options);
+   ~LoopbackContext();
+
+   LoopbackObject*               m_object;
+   uint32                        m_id;
+   uint32                        m_options;
+   uint32                        m_command;
+   std::string                   m_name;
+   bool                          m_named;
+   uint32                        m_returnCode;
+   std::vector<LoopbackParam>    m_params;
+   std::vector<LoopbackParam>    m_returnVals;
+
+   bool                          m_post;
+
+   /* received from the peer, the reply is sent by END_ASYNC_RESULT */
+   bool                          m_received;
+   bool                          m_async;
+
+   void EncodeInvoke(std::vector<char>* data) const;
+   bool DecodeInvoke(const std::vector<char>& data);
+   void EncodeReply(std::vector<char>* data) const;
+   bool DecodeReply(const std::vector<char>& data);
+
+   static uint32 NewId();
+
+private:
+   LoopbackContext(const LoopbackContext&);
+   LoopbackContext& operator=(const LoopbackContext&);
+};
+
+bool LoopbackVariantCopy(VDP_RPC_VARIANT* target, const VDP_RPC_VARIANT* src);
+void LoopbackVariantClear(VDP_RPC_VARIANT* v);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackCompressionStats
+ *
+ *    The compressed frames of all the connections: the size of their
+ *    parameters or return values before and after, and the time spent
+ *    compressing and decompressing them.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint64         frames;
+   uint64         rawBytes;
+   uint64         wireBytes;
+   uint64         compressNs;
+   uint64         decompressNs;
+} LoopbackCompressionStats;
+
+void LoopbackGetCompressionStats(LoopbackCompressionStats* stats);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackObject
+ *
+ *    A channel object.  Its handle stays valid until the endpoint goes
+ *    away, a destroyed object is only marked closed.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   LoopbackContext*        ctx;
+   VDPRPC_RequestCallback  callback;
+   void*                   userData;
+} LoopbackRequest;
+
+class LoopbackObject
+{
+public:
+   LoopbackObject(LoopbackEndpoint* endpoint, const char* name,
+                  const VDPRPC_ObjectNotifySink* sink, void* userData,
+                  uint32 flags);
+   ~LoopbackObject();
+
+   LoopbackEndpoint*                            m_endpoint;
+   std::string                                  m_name;
+   VDPRPC_ObjectNotifySink                      m_sink;
+   void*                                        m_userData;
+   uint32                                       m_flags;
+   uint32                                       m_peerFlags;
+   std::atomic<int>                             m_state;
+   bool                                         m_closed;
+
+   /* side channel asked for by either end and the one in use */
+   int32                                        m_sideRequested;
+   int32                                        m_peerSideRequested;
+   std::atomic<int32>                           m_sideChannel;
+
+   std::unordered_map<uint32, LoopbackRequest>  m_inFlight;
+   std::shared_ptr<LoopbackStream>              m_stream;
+
+   uint32 GetOptions() const;
+
+private:
+   LoopbackObject(const LoopbackObject&);
+   LoopbackObject& operator=(const LoopbackObject&);
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackStream
+ *
+ *    Stream data mode of a TCP side channel, see SwitchToStreamDataMode().
+ *    The application gets one end of a socketpair.  What it writes there
+ *    is framed back into INVOKE frames for the peer by a reader thread,
+ *    what the peer invokes on the object is written to it as stream data.
+ *
+ *    A stream frame is [u32 size][i32 reqId][i32 reqType][i32 reqCmd]
+ *    followed by the blob, size counts the header too.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackStream
+{
+public:
+   LoopbackStream(const std::shared_ptr<LoopbackEndpoint>& endpoint,
+                  const char* objectName);
+   ~LoopbackStream();
+
+   bool Open();
+   void Close();
+
+   int AppFd() const { return m_fds[0]; }
+   bool Write(const LoopbackContext* ctx);
+
+   static void PutHeader(char* header, uint32 size, int32 reqId,
+                         int32 reqType, int32 reqCmd);
+
+private:
+   std::weak_ptr<LoopbackEndpoint>  m_endpoint;
+   std::string                      m_objectName;
+   int                              m_fds[2];
+   std::mutex                       m_writeMutex;
+   std::thread                      m_reader;
+   bool                             m_closed;
+
+   void ReaderMain();
+   static int FrameSize(void* userData, const char* data);
+
+   LoopbackStream(const LoopbackStream&);
+   LoopbackStream& operator=(const LoopbackStream&);
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackEndpoint
+ *
+ *    One end of a connection, what the channel handle points to.  The
+ *    server end belongs to the thread that called VDPService_ServerInit2(),
+ *    the client end to the client plugin host thread.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   uint32                        handle;
+   VDPService_ChannelNotifySink  sink;
+   void*                         userData;
+} LoopbackSink;
+
+class LoopbackEndpoint : public std::enable_shared_from_this<LoopbackEndpoint>
+{
+public:
+   LoopbackEndpoint(unsigned long sid, const char* token, bool isServer);
+   ~LoopbackEndpoint();
+
+   void SetPeer(const std::shared_ptr<LoopbackEndpoint>& peer,
+                const std::shared_ptr<LoopbackLink>& link);
+
+   unsigned long Sid() const { return m_sid; }
+   const char* Token() const { return m_token.c_str(); }
+   bool IsServer() const { return m_isServer; }
+
+   /* channel */
+   bool RegisterSink(const VDPService_ChannelNotifySink* sink, void* userData,
+                     uint32* sinkHandle);
+   bool UnregisterSink(uint32 sinkHandle);
+   bool Connect();
+   bool Disconnect();
+   void Drop();
+   void Restore();
+   VDPService_ConnectionState GetConnectionState();
+   VDPService_ChannelState GetChannelState();
+   bool SwitchToStreamDataMode(const char* objectName, int* fd);
+
+   /* channel objects */
+   bool CreateObject(const char* name, const VDPRPC_ObjectNotifySink* sink,
+                     void* userData, uint32 flags, LoopbackObject** object);
+   bool DestroyObject(LoopbackObject* object);
+   bool RequestSideChannel(LoopbackObject* object, VDPRPC_SideChannelType type);
+   bool Invoke(LoopbackObject* object, LoopbackContext* ctx,
+               const VDPRPC_RequestCallback* callback, void* userData);
+   void Reply(LoopbackContext* ctx);
+   VDPRPC_ObjectState GetObjectStateByName(const char* name);
+
+   /* transport */
+   void Send(LoopbackFrame* frame);
+   void Receive(LoopbackFrame* frame);
+   bool Dispatch();
+
+   void Bind(const std::shared_ptr<LoopbackApartment>& apartment);
+   void Unbind(const LoopbackApartment* apartment);
+   std::shared_ptr<LoopbackApartment> FirstApartment();
+   void Close();
+
+private:
+   unsigned long                                   m_sid;
+   std::string                                     m_token;
+   bool                                            m_isServer;
+
+   std::mutex                                      m_mutex;
+   std::deque<LoopbackFrame*>                      m_frames;
+   std::vector<std::weak_ptr<LoopbackApartment> >  m_apartments;
+   std::atomic<bool>                               m_dispatching;
+   bool                                            m_closed;
+   std::atomic<uint32>                             m_generation;
+
+   std::vector<LoopbackSink>                       m_sinks;
+   VDPService_ConnectionState                      m_connectionState;
+   bool                                            m_connectRequested;
+   bool                                            m_peerConnectRequested;
+   VDPService_ChannelState                         m_channelState;
+
+   std::map<std::string, uint32>                   m_peerObjects;
+   std::vector<LoopbackObject*>                    m_objects;
+   std::vector<LoopbackObject*>                    m_deadObjects;
+   std::atomic<int>                                m_streams;
+
+   std::weak_ptr<LoopbackEndpoint>                 m_peer;
+   std::shared_ptr<LoopbackLink>                   m_link;
+
+   void Queue(LoopbackFrame* frame);
+   void WakeApartments();
+   LoopbackFrame* NewFrame(LoopbackFrameType type, const std::string& object);
+   LoopbackObject* FindObject(const std::string& name);
+   void CloseObject(LoopbackObject* object, std::vector<LoopbackRequest>* requests,
+                    std::vector<std::shared_ptr<LoopbackStream> >* streams);
+   bool ReceiveStream(LoopbackFrame* frame);
+
+   void HandleFrame(LoopbackFrame* frame);
+   void OnConnect();
+   void OnDisconnect();
+   void OnConnectionState(VDPService_ConnectionState state);
+   void OnChannelState(VDPService_ChannelState state);
+   void OnObjectCreated(const LoopbackFrame* frame);
+   void OnObjectDestroyed(const LoopbackFrame* frame);
+   void OnObjectState(const LoopbackFrame* frame);
+   void OnSideChannel(const LoopbackFrame* frame);
+   void OnInvoke(LoopbackFrame* frame);
+   void OnReply(LoopbackFrame* frame);
+
+   void NotifyConnectionState(VDPService_ConnectionState state);
+   void NotifyChannelState(VDPService_ChannelState state);
+   void NotifyPeerObject(const std::string& name);
+   void NotifyObjectState(LoopbackObject* object);
+
+   LoopbackEndpoint(const LoopbackEndpoint&);
+   LoopbackEndpoint& operator=(const LoopbackEndpoint&);
+
+   friend class LoopbackStream;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Struct LoopbackClientPlugin
+ *
+ *    The exports of a client plugin, see vdpService.h.
+ *
+ *----------------------------------------------------------------------
+ */
+typedef struct {
+   VDPService_PluginGetTokenNameFn     getTokenName;
+   VDPService_PluginInitFn             init;
+   VDPService_PluginExitFn             exit;
+   VDPService_PluginCreateInstanceFn   createInstance;
+   VDPService_PluginDestroyInstanceFn  destroyInstance;
+} LoopbackClientPlugin;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Class LoopbackService
+ *
+ *    The process wide state: connections by session id, the client
+ *    plugin and the thread it runs on, the local job dispatchers and
+ *    the observers.
+ *
+ *----------------------------------------------------------------------
+ */
+class LoopbackService
+{
+public:
+   static LoopbackService* Get();
+
+   bool ServerInit(unsigned long sid, const char* token,
+                   VDP_SERVICE_QUERY_INTERFACE* qi, void** channelHandle);
+   bool ServerExit(unsigned long sid);
+   bool DropConnection(unsigned long sid);
+   void GetQueryInterface(VDP_SERVICE_QUERY_INTERFACE* qi);
+
+   void SetLinkFactory(LoopbackLinkFactory factory, void* userData);
+
+   bool LoadClientPlugin(const char* path);
+   bool SetClientPlugin(const LoopbackClientPlugin* plugin);
+   void UnloadClientPlugin();
+
+   uint64 GetClientBusyNs();
+
+   std::shared_ptr<LoopbackEndpoint> FindEndpoint(void* channelHandle);
+   std::shared_ptr<LoopbackEndpoint> CurrentEndpoint();
+
+   VdpLocalJobDispatcher AddApartment(const std::shared_ptr<LoopbackApartment>& apartment);
+   void RemoveApartment(VdpLocalJobDispatcher dispatcher);
+   bool RequestJob(VdpLocalJobDispatcher dispatcher, VdpServiceLocalJob job,
+                   void* userData);
+
+   VDPService_ObserverId RegisterObserver(const char* name, void* context,
+                                          VdpServiceObserverCallback cb);
+   bool UnregisterObserver(VDPService_ObserverId id);
+   bool Broadcast(const char* name, const void* cookie, const void* data);
+
+   bool AddStream(int fd, const std::shared_ptr<LoopbackStream>& stream);
+   void RemoveStream(int fd);
+   bool IsStream(int fd);
+
+   static uint32 NewSinkHandle();
+
+private:
+   LoopbackService();
+   ~LoopbackService();
+
+   typedef struct {
+      std::shared_ptr<LoopbackEndpoint>   server;
+      std::shared_ptr<LoopbackEndpoint>   client;
+      std::shared_ptr<LoopbackLink>       link;
+      void*                               instance;
+      bool                                hasInstance;
+   } Connection;
+
+   typedef struct {
+      std::string                   name;
+      void*                         context;
+      VdpServiceObserverCallback    cb;
+   } Observer;
+
+   std::mutex                                               m_mutex;
+   std::map<unsigned long, std::shared_ptr<Connection> >    m_connections;
+   std::unordered_map<void*, std::weak_ptr<LoopbackEndpoint> > m_endpoints;
+   LoopbackLinkFactory                                      m_linkFactory;
+   void*                                                    m_linkUserData;
+
+   /* client plugin host */
+   LoopbackClientPlugin                                     m_plugin;
+   void*                                                    m_pluginModule;
+   char                                                     m_pluginToken[VDP_SERVICE_MAX_TOKEN_LENGTH + 1];
+   bool                                                     m_hasPlugin;
+   std::thread                                              m_clientThread;
+   std::atomic<bool>                                        m_clientStop;
+   std::shared_ptr<LoopbackApartment>                       m_clientApartment;
+
+   std::unordered_map<VdpLocalJobDispatcher, std::weak_ptr<LoopbackApartment> > m_apartments;
+   VdpLocalJobDispatcher                                    m_nextDispatcher;
+
+   std::map<VDPService_ObserverId, Observer>                m_observers;
+   VDPService_ObserverId                                    m_nextObserver;
+
+   std::unordered_map<int, std::weak_ptr<LoopbackStream> >  m_streams;
+
+   void ClientThreadMain(std::promise<bool>* started);
+   void RunOnClient(const std::function<void()>& job);
+
+   LoopbackService(const LoopbackService&);
+   LoopbackService& operator=(const LoopbackService&);
+};
+
+
+/*
+ * The interface tables, one QueryInterface per source file.
+ */
+bool LoopbackServiceQueryInterface(const GUID* iid, void* iface);
+bool LoopbackChannelObjectQueryInterface(const GUID* iid, void* iface);
+bool LoopbackContextQueryInterface(const GUID* iid, void* iface);
+bool LoopbackStreamQueryInterface(const GUID* iid, void* iface);
+bool LoopbackOverlayQueryInterface(const GUID* iid, void* iface);
+
+bool LoopbackIsGuid(const GUID* iid, const GUID* guid);
@@ -0,0 +1,537 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * LoopbackStream.cpp --
+ *
+ *    Stream data mode of a TCP side channel and the stream data
+ *    interface.
+ *
+ */
+
+#include "stdafx.h"
+#include "LoopbackService.h"
+#include "RPCStreamFramer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// reqType of the stream frames, every one is a request.
+#define LOOPBACK_STREAM_REQUEST   0
+
+#define LOOPBACK_STREAM_READ_SIZE (64 * 1024)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::LoopbackStream --
+ *
+ *    Constructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackStream::LoopbackStream(const std::shared_ptr<LoopbackEndpoint>& endpoint,  // IN
+                               const char* objectName)                             // IN
+   : m_endpoint(endpoint),
+     m_objectName(objectName),
+     m_closed(false)
+{
+   m_fds[0] = -1;
+   m_fds[1] = -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::~LoopbackStream --
+ *
+ *    Destructor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LoopbackStream::~LoopbackStream()
+{
+   Close();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::Open --
+ *
+ *    Creates the socketpair and starts the reader thread.
+ *
+ * Results:
+ *    false if the socketpair cannot be created.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackStream::Open()
+{
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, m_fds) != 0) {
+      LOG("Error: socketpair() failed, errno %d.", errno);
+      m_fds[0] = -1;
+      m_fds[1] = -1;
+      return false;
+   }
+
+   m_reader = std::thread(&LoopbackStream::ReaderMain, this);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::Close --
+ *
+ *    Stops the reader thread and closes both ends of the socketpair.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    The application end is no longer a stream data fd.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackStream::Close()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_writeMutex);
+
+      if (m_closed) {
+         return;
+      }
+      m_closed = true;
+   }
+
+   if (m_fds[1] != -1) {
+      shutdown(m_fds[1], SHUT_RDWR);
+   }
+
+   if (m_reader.joinable() && m_reader.get_id() != std::this_thread::get_id()) {
+      m_reader.join();
+   } else if (m_reader.joinable()) {
+      m_reader.detach();
+   }
+
+   if (m_fds[0] != -1) {
+      LoopbackService::Get()->RemoveStream(m_fds[0]);
+      close(m_fds[0]);
+      m_fds[0] = -1;
+   }
+
+   if (m_fds[1] != -1) {
+      close(m_fds[1]);
+      m_fds[1] = -1;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::PutHeader --
+ *
+ *    Writes a stream frame header.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackStream::PutHeader(char* header,    // OUT
+                          uint32 size,     // IN
+                          int32 reqId,     // IN
+                          int32 reqType,   // IN
+                          int32 reqCmd)    // IN
+{
+   memcpy(header, &size, 4);
+   memcpy(header + 4, &reqId, 4);
+   memcpy(header + 8, &reqType, 4);
+   memcpy(header + 12, &reqCmd, 4);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::Write --
+ *
+ *    Writes a request of the peer to the application end as a stream
+ *    frame carrying its first parameter.
+ *
+ * Results:
+ *    false if the stream is closed or the write failed.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackStream::Write(const LoopbackContext* ctx)  // IN
+{
+   const char* data = NULL;
+   uint32 dataSize = 0;
+
+   if (!ctx->m_params.empty()) {
+      const VDP_RPC_VARIANT& v = ctx->m_params[0].value;
+      if (v.vt == VDP_RPC_VT_BLOB) {
+         data = v.blobVal.blobData;
+         dataSize = v.blobVal.size;
+      } else if (v.vt == VDP_RPC_VT_LPSTR && v.strVal != NULL) {
+         data = v.strVal;
+         dataSize = (uint32)strlen(v.strVal) + 1;
+      }
+   }
+
+   std::vector<char> frame(LOOPBACK_STREAM_HEADER_BYTES + dataSize);
+   PutHeader(frame.data(), (uint32)frame.size(), (int32)ctx->m_id,
+             LOOPBACK_STREAM_REQUEST, (int32)ctx->m_command);
+   if (dataSize > 0) {
+      memcpy(frame.data() + LOOPBACK_STREAM_HEADER_BYTES, data, dataSize);
+   }
+
+   std::lock_guard<std::mutex> lock(m_writeMutex);
+
+   if (m_closed) {
+      return false;
+   }
+
+   size_t pos = 0;
+   while (pos < frame.size()) {
+      ssize_t sent = send(m_fds[1], frame.data() + pos, frame.size() - pos,
+                          MSG_NOSIGNAL);
+      if (sent > 0) {
+         pos += sent;
+      } else if (sent < 0 && errno == EINTR) {
+         continue;
+      } else {
+         LOG("Error: stream write failed, errno %d.", errno);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::ReaderMain --
+ *
+ *    Reads the stream frames the application writes and posts each one
+ *    to the peer object as a request with one blob parameter.  The
+ *    frames are encoded from where the framer received them.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LoopbackStream::ReaderMain()
+{
+   RPCStreamFramer framer;
+
+   if (!framer.Init(LOOPBACK_STREAM_READ_SIZE, LOOPBACK_STREAM_HEADER_BYTES,
+                    FrameSize, NULL)) {
+      return;
+   }
+
+   for (;;) {
+      int len = framer.Receive(m_fds[1], 0);
+      if (len <= 0) {
+         break;
+      }
+
+      const char* data;
+      int size;
+      while ((size = framer.Next(&data)) > 0) {
+         int32 reqId, reqType, reqCmd;
+
+         memcpy(&reqId, data + 4, 4);
+         memcpy(&reqType, data + 8, 4);
+         memcpy(&reqCmd, data + 12, 4);
+
+         LoopbackContext ctx(NULL, (uint32)reqId, 0);
+         LoopbackParam param;
+         VDP_RPC_VARIANT blob;
+
+         ctx.m_command = (uint32)reqCmd;
+         ctx.m_post = true;
+         blob.vt = VDP_RPC_VT_BLOB;
+         blob.blobVal.size = size - LOOPBACK_STREAM_HEADER_BYTES;
+         blob.blobVal.blobData = (char*)data + LOOPBACK_STREAM_HEADER_BYTES;
+         LoopbackVariantCopy(&param.value, &blob);
+         ctx.m_params.push_back(param);
+
+         std::shared_ptr<LoopbackEndpoint> endpoint = m_endpoint.lock();
+         if (!endpoint) {
+            return;
+         }
+
+         LoopbackFrame* frame = endpoint->NewFrame(LOOPBACK_FRAME_INVOKE, m_objectName);
+         frame->id = ctx.m_id;
+         frame->sideChannel = VDP_RPC_SIDE_CHANNEL_TYPE_TCP;
+         ctx.EncodeInvoke(&frame->data);
+         endpoint->Send(frame);
+
+         framer.Consume(size);
+      }
+
+      if (size < 0) {
+         LOG("Error: bad stream frame on \"%s\".", m_objectName.c_str());
+         return;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStream::FrameSize --
+ *
+ *    RPCStreamFramer callback, the size of the stream frame at <data>.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LoopbackStream::FrameSize(void* userData,     // IN
+                          const char* data)   // IN
+{
+   uint32 size;
+
+   memcpy(&size, data, sizeof size);
+   return size > INT_MAX ? -1 : (int)size;
+}
+
+
+/*
+ * The stream data interface.  The stream frames carry no integrity
+ * check and are neither compressed nor encrypted, the options are
+ * accepted and ignored.
+ */
+
+static Bool
+StreamGetHeaderTailSize(int fd,           // IN
+                        int dataSize,     // IN
+                        int* headerLen,   // OUT
+                        int* tailLen)     // OUT
+{
+   if (!LoopbackService::Get()->IsStream(fd) || headerLen == NULL || tailLen == NULL) {
+      return FALSE;
+   }
+
+   *headerLen = LOOPBACK_STREAM_HEADER_BYTES;
+   *tailLen = 0;
+   return TRUE;
+}
+
+static Bool
+StreamGetHeaderTail(int fd,              // IN
+                    int* reqId,          // OUT
+                    int reqCmd,          // IN
+                    VDP_RPC_BLOB* blob,  // IN
+                    char* header,        // OUT
+                    int headerBufLen,    // IN
+                    char* tail,          // OUT
+                    int tailBufLen)      // IN
+{
+   if (!LoopbackService::Get()->IsStream(fd) || reqId == NULL || blob == NULL ||
+       header == NULL || headerBufLen < LOOPBACK_STREAM_HEADER_BYTES) {
+      return FALSE;
+   }
+
+   *reqId = (int)LoopbackContext::NewId();
+   LoopbackStream::PutHeader(header, LOOPBACK_STREAM_HEADER_BYTES + blob->size,
+                             *reqId, LOOPBACK_STREAM_REQUEST, reqCmd);
+   return TRUE;
+}
+
+static int
+StreamGetMinimalSize(int fd)   // IN
+{
+   return LoopbackService::Get()->IsStream(fd) ? LOOPBACK_STREAM_HEADER_BYTES : -1;
+}
+
+static int
+StreamGetSize(int fd,                 // IN
+              const char* recvData)   // IN
+{
+   uint32 size;
+
+   if (recvData == NULL) {
+      return -1;
+   }
+
+   memcpy(&size, recvData, sizeof size);
+   return (int)size;
+}
+
+static Bool
+StreamGetInfo(int fd,                 // IN
+              const char* recvData,   // IN
+              int* reqId,             // OUT
+              int* reqType,           // OUT
+              int* reqCmd,            // OUT
+              VDP_RPC_BLOB* blob)     // OUT
+{
+   uint32 size;
+
+   if (recvData == NULL || reqId == NULL || reqType == NULL || reqCmd == NULL ||
+       blob == NULL) {
+      return FALSE;
+   }
+
+   memcpy(&size, recvData, 4);
+   memcpy(reqId, recvData + 4, 4);
+   memcpy(reqType, recvData + 8, 4);
+   memcpy(reqCmd, recvData + 12, 4);
+
+   if (size < LOOPBACK_STREAM_HEADER_BYTES) {
+      return FALSE;
+   }
+
+   blob->size = size - LOOPBACK_STREAM_HEADER_BYTES;
+   blob->blobData = (char*)recvData + LOOPBACK_STREAM_HEADER_BYTES;
+   return TRUE;
+}
+
+static Bool
+StreamGetData(int fd,                 // IN
+              uint32 ctxOptions,      // IN
+              int* reqId,             // OUT
+              int reqCmd,             // IN
+              VDP_RPC_BLOB* blob,     // IN
+              VDP_RPC_BLOB* payload)  // OUT
+{
+   if (!LoopbackService::Get()->IsStream(fd) || reqId == NULL || blob == NULL ||
+       payload == NULL) {
+      return FALSE;
+   }
+
+   uint32 size = LOOPBACK_STREAM_HEADER_BYTES + blob->size;
+   char* data = (char*)malloc(size);
+   if (data == NULL) {
+      return FALSE;
+   }
+
+   *reqId = (int)LoopbackContext::NewId();
+   LoopbackStream::PutHeader(data, size, *reqId, LOOPBACK_STREAM_REQUEST, reqCmd);
+   if (blob->size > 0) {
+      memcpy(data + LOOPBACK_STREAM_HEADER_BYTES, blob->blobData, blob->size);
+   }
+
+   payload->size = size;
+   payload->blobData = data;
+   return TRUE;
+}
+
+static Bool
+StreamFreePayload(VDP_RPC_BLOB* payload)   // IN/OUT
+{
+   if (payload == NULL) {
+      return FALSE;
+   }
+
+   free(payload->blobData);
+   payload->blobData = NULL;
+   payload->size = 0;
+   return TRUE;
+}
+
+static Bool
+StreamGetInfo2(int fd,                 // IN
+               const char* recvData,   // IN
+               int* reqId,             // OUT
+               int* reqType,           // OUT
+               int* reqCmd,            // OUT
+               Bool* bNeedCleanup,     // OUT
+               VDP_RPC_BLOB* blob)     // OUT
+{
+   if (bNeedCleanup == NULL ||
+       !StreamGetInfo(fd, recvData, reqId, reqType, reqCmd, blob)) {
+      return FALSE;
+   }
+
+   // the blob points into recvData.
+   *bNeedCleanup = FALSE;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoopbackStreamQueryInterface --
+ *
+ *    Fills the stream data interface.
+ *
+ * Results:
+ *    false if <iid> is not one of its versions.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+LoopbackStreamQueryInterface(const GUID* iid,   // IN
+                             void* iface)       // OUT
+{
+   uint32 version;
+
+   if (LoopbackIsGuid(iid, &GUID_VDPRPC_StreamDataInterface_V1)) {
+      version = VDP_RPC_STREAMDATA_INTERFACE_V1;
+   } else if (LoopbackIsGuid(iid, &GUID_VDPRPC_StreamDataInterface_V2)) {
+      version = VDP_RPC_STREAMDATA_INTERFACE_V2;
+   } else {
+      return false;
+   }
+
+   VDPRPC_StreamDataInterface* stream = (VDPRPC_StreamDataInterface*)iface;
+
+   memset(stream, 0, sizeof *stream);
+   stream->version = version;
+   stream->v1.GetStreamDataHeaderTailSize = StreamGetHeaderTailSize;
+   stream->v1.GetStreamDataHeaderTail = StreamGetHeaderTail;
+   stream->v1.GetMinimalStreamDataSize = StreamGetMinimalSize;
+   stream->v1.GetStreamDataSize = StreamGetSize;
+   stream->v1.GetStreamDataInfo = StreamGetInfo;
+   stream->v2.GetStreamData = StreamGetData;
+   stream->v2.FreeStreamDataPayload = StreamFreePayload;
+   stream->v2.GetStreamDataInfo = StreamGetInfo2;
+   return true;
+}
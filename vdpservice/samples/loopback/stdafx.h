@@ -0,0 +1,27 @@
+/* ********************************************************************************* *
+ * Copyright (C) 2021 VMware, Inc.  All rights reserved. -- VMware Confidential      *
+ * ********************************************************************************* */
+
+/*
+ * stdafx.h --
+ *
+ */
+
+#pragma once
+
+#ifndef USE_WIN_DWORD_RANGE
+   #define USE_WIN_DWORD_RANGE
+#endif
+
+#include "wintypes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "helpers.h"
+#include "LogUtils.h"
+
+#define PINGRPC_TOKEN_NAME "PingRPC"
+#define PINGRPC_MESSAGE    "PING"
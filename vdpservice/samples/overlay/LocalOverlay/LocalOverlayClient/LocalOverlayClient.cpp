@@ -176,7 +176,6 @@ public:
    void OnInvoke(void* messageCtx)
    {
       const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      RPCVariant var(this);
 
       uint32 cmd = iChannelCtx->v1.GetCommand(messageCtx);
       switch (cmd)
@@ -190,37 +189,63 @@ public:
          Disable();
          break;
 
-      case LOCAL_OVERLAY_SET_FORMAT:
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);
-         SetFormat((VDPOverlay_ImageFormat)var.ullVal);
+      case LOCAL_OVERLAY_SET_FORMAT: {
+         VDPOverlay_ImageFormat format;
+         if (Decode<LocalOverlaySetFormatMsg>(messageCtx, format)) {
+            SetFormat(format);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
+        }
 
-      case LOCAL_OVERLAY_SET_COLOR:
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);
-         SetColor(var.ulVal);
+      case LOCAL_OVERLAY_SET_COLOR: {
+         uint32 color;
+         if (Decode<LocalOverlaySetColorMsg>(messageCtx, color)) {
+            SetColor(color);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
+        }
 
-      case LOCAL_OVERLAY_SET_LAYOUT_MODE:
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);
-         SetLayoutMode((VDPOverlay_LayoutMode)var.ullVal);
+      case LOCAL_OVERLAY_SET_LAYOUT_MODE: {
+         VDPOverlay_LayoutMode layoutMode;
+         if (Decode<LocalOverlaySetLayoutModeMsg>(messageCtx, layoutMode)) {
+            SetLayoutMode(layoutMode);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
+        }
 
-      case LOCAL_OVERLAY_SET_LAYER:
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);
-         SetLayer(var.ulVal);
+      case LOCAL_OVERLAY_SET_LAYER: {
+         uint32 layer;
+         if (Decode<LocalOverlaySetLayerMsg>(messageCtx, layer)) {
+            SetLayer(layer);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
+        }
 
       case LOCAL_OVERLAY_SET_POSITION: {
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);  int32 x = var.lVal;
-         iChannelCtx->v1.GetParam(messageCtx, 1, &var);  int32 y = var.lVal;
-         SetPosition(x, y);
+         LocalOverlayPosition pos;
+         if (DecodeStruct(messageCtx, &pos)) {
+            SetPosition(pos.x, pos.y);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
         }
 
       case LOCAL_OVERLAY_SET_SIZE: {
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);  int32 w = var.lVal;
-         iChannelCtx->v1.GetParam(messageCtx, 1, &var);  int32 h = var.lVal;
-         SetSize(w, h);
+         LocalOverlaySize size;
+         if (DecodeStruct(messageCtx, &size)) {
+            SetSize(size.w, size.h);
+         } else {
+            LOG_DEBUG("Bad parameters for command %d", cmd);
+         }
          break;
         }
 
@@ -36,6 +36,9 @@
 
 #include "helpers.h"
 #include "LogUtils.h"
+#include "vdpOverlay.h"
+#include "RPCMessage.h"
+#include "RPCPackedStruct.h"
 
 #define LOCAL_OVERLAY_TOKEN_NAME   "LocalOverlay"
 
@@ -49,3 +52,28 @@ enum {
    LOCAL_OVERLAY_SET_SIZE,
    LOCAL_OVERLAY_SET_FORMAT
 };
+
+/*
+ * Parameters of each command, shared by the guest and the client.
+ */
+typedef RPCMessage<LOCAL_OVERLAY_ENABLE>                                  LocalOverlayEnableMsg;
+typedef RPCMessage<LOCAL_OVERLAY_DISABLE>                                 LocalOverlayDisableMsg;
+typedef RPCMessage<LOCAL_OVERLAY_SET_LAYOUT_MODE, VDPOverlay_LayoutMode>  LocalOverlaySetLayoutModeMsg;
+typedef RPCMessage<LOCAL_OVERLAY_SET_LAYER, uint32>                       LocalOverlaySetLayerMsg;
+typedef RPCMessage<LOCAL_OVERLAY_SET_COLOR, uint32>                       LocalOverlaySetColorMsg;
+typedef RPCMessage<LOCAL_OVERLAY_SET_FORMAT, VDPOverlay_ImageFormat>      LocalOverlaySetFormatMsg;
+
+/*
+ * Multi-field commands, sent as one packed blob to peers that support it
+ * and as one parameter per field (the original format) to those that don't.
+ */
+#define LOCAL_OVERLAY_POSITION_FIELDS(FIELD)                                   \
+   FIELD(int32, x)                                                             \
+   FIELD(int32, y)
+
+#define LOCAL_OVERLAY_SIZE_FIELDS(FIELD)                                       \
+   FIELD(int32, w)                                                             \
+   FIELD(int32, h)
+
+RPC_PACKED_STRUCT(LocalOverlayPosition, 1, LOCAL_OVERLAY_POSITION_FIELDS)
+RPC_PACKED_STRUCT(LocalOverlaySize, 1, LOCAL_OVERLAY_SIZE_FIELDS)
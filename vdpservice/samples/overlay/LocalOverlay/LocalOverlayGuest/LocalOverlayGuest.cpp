@@ -49,22 +49,7 @@ public:
     */
    bool Enable()
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_ENABLE);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
-         return false;
-      }
-
-      return true;
+      return InvokeCommand<LocalOverlayEnableMsg>();
    }
 
 
@@ -77,22 +62,7 @@ public:
     */
    bool Disable()
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_DISABLE);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
-         return false;
-      }
-
-      return true;
+      return InvokeCommand<LocalOverlayDisableMsg>();
    }
 
 
@@ -105,26 +75,7 @@ public:
     */
    bool SetLayoutMode(VDPOverlay_LayoutMode layoutMode)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_LAYOUT_MODE);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromUInt32(&var, layoutMode);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
-         return false;
-      }
-
-      return true;
+      return InvokeCommand<LocalOverlaySetLayoutModeMsg>(layoutMode);
    }
 
 
@@ -137,28 +88,10 @@ public:
     */
    bool SetPosition(int32 x, int32 y)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_POSITION);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromInt32(&var, x);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-      iVariant->v1.VariantFromInt32(&var, y);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
-         return false;
-      }
-
-      return true;
+      LocalOverlayPosition pos = {};
+      pos.x = x;
+      pos.y = y;
+      return InvokeStruct(LOCAL_OVERLAY_SET_POSITION, pos);
    }
 
 
@@ -171,28 +104,10 @@ public:
     */
    bool SetSize(int32 w, int32 h)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_SIZE);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromInt32(&var, w);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-      iVariant->v1.VariantFromInt32(&var, h);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
-         return false;
-      }
-
-      return true;
+      LocalOverlaySize size = {};
+      size.w = w;
+      size.h = h;
+      return InvokeStruct(LOCAL_OVERLAY_SET_SIZE, size);
    }
 
 
@@ -205,22 +120,7 @@ public:
     */
    bool SetColor(uint32 color)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_COLOR);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromUInt32(&var, color);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
+      if (!InvokeCommand<LocalOverlaySetColorMsg>(color)) {
          return false;
       }
 
@@ -238,22 +138,7 @@ public:
     */
    bool SetFormat(VDPOverlay_ImageFormat format)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_FORMAT);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromUInt32(&var, format);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
+      if (!InvokeCommand<LocalOverlaySetFormatMsg>(format)) {
          return false;
       }
 
@@ -271,22 +156,7 @@ public:
     */
    bool SetLayer(uint32 layer)
    {
-      const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-      const VDPRPC_VariantInterface* iVariant = VariantInterface();
-
-      void* messageCtx = NULL;
-      if (!CreateMessage(&messageCtx)) {
-         return false;
-      }
-
-      iChannelCtx->v1.SetCommand(messageCtx, LOCAL_OVERLAY_SET_LAYER);
-
-      RPCVariant var(this);
-      iVariant->v1.VariantFromUInt32(&var, layer);
-      iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      if (!InvokeMessage(messageCtx)) {
-         DestroyMessage(messageCtx);
+      if (!InvokeCommand<LocalOverlaySetLayerMsg>(layer)) {
          return false;
       }
 
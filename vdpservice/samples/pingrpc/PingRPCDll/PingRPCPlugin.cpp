@@ -9,6 +9,7 @@
 
 #include "stdafx.h"
 #include "PingRPCPlugin.h"
+#include "RPCClockSync.h"
 
 
 /*
@@ -41,6 +42,12 @@ VDP_SERVICE_CREATE_INTERFACE(PINGRPC_TOKEN_NAME, rpcClient)
 PingRPCPlugin::PingRPCPlugin(RPCManager *rpcManagerPtr)
    : RPCPluginInstance(rpcManagerPtr)
 {
+   static const RPCCommandEntry commands[] = {
+      RPC_NAMED_COMMAND(PINGRPC_MESSAGE, PingRPCPlugin, OnPing),
+      RPC_NUMBERED_COMMAND(VDP_PING_CMD, PingRPCPlugin, OnTcpPing),
+   };
+
+   RegisterCommands(commands, sizeof commands / sizeof commands[0]);
 }
 
 PingRPCPlugin::~PingRPCPlugin()
@@ -51,56 +58,101 @@ PingRPCPlugin::~PingRPCPlugin()
 /*
  *----------------------------------------------------------------------
  *
- * PingRPCPlugin::OnInvoke --
+ * PingRPCPlugin::OnPing --
  *
- *    This method is called when a peer has sent a message.
+ *    This method is called when the server has sent a ping.
  *
- *    All the parameters that the server sent us are bounced back.
+ *    All the parameters that the server sent us are bounced back.  A
+ *    clock stamp goes back under its name, with the times the ping
+ *    arrived and was answered, so that the server can tell the delay
+ *    of each direction.
  *
  *----------------------------------------------------------------------
  */
 void
-PingRPCPlugin::OnInvoke(void* messageCtx)
+PingRPCPlugin::OnPing(void* messageCtx)
 {
    const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
    const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   uint64 rxNs = RPCClockSync::NowNs();
 
-   if (GetChannelType() != VDPSERVICE_TCPRAW_CHANNEL) {
-      char cmd[32];
-      iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd);
-      if (strcmp(cmd, PINGRPC_MESSAGE) != 0) {
-         LOG("Unknown command \"%s\"", cmd);
-         return;
-      }
-
-      RPCVariant var(this);
-      for (int i=0;  i < iChannelCtx->v1.GetParamCount(messageCtx);  ++i) {
-         iChannelCtx->v1.GetParam(messageCtx, i, &var);
+   RPCVariant var(this);
+   for (int i=0;  i < iChannelCtx->v1.GetParamCount(messageCtx);  ++i) {
+      iChannelCtx->v1.GetParam(messageCtx, i, &var);
+      if (var.vt == VDP_RPC_VT_BLOB &&
+          RPCClockSync::IsStamp(var.blobVal.blobData, var.blobVal.size)) {
+         RPCClockSync::EchoStamp(var.blobVal.blobData, var.blobVal.size, rxNs);
+         iChannelCtx->v1.AppendNamedReturnVal(messageCtx, RPC_CLOCK_STAMP_NAME, &var);
+      } else {
          iChannelCtx->v1.AppendReturnVal(messageCtx, &var);
       }
+      iVariant->v1.VariantClear(&var);   // GetParam() made a copy
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::OnTcpPing --
+ *
+ *    This method is called when the server has sent a ping over the
+ *    raw TCP side channel, it is echoed back in a message of our own.
+ *    A clock stamp after the server's timestamp gets our times as in
+ *    OnPing().
+ *
+ *----------------------------------------------------------------------
+ */
+void
+PingRPCPlugin::OnTcpPing(void* messageCtx)
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+
+   uint64 rxNs = RPCClockSync::NowNs();
+
+   RPCVariant var(this);
+   iChannelCtx->v1.GetParam(messageCtx, 0, &var);
+
+   void *echoCtx;
+   if (!CreateMessage(&echoCtx)) {
+      LOG("Error: cannot create channelCtx to send channel type.");
+      return;
+   }
+
+   // Echo back, with the times in its clock stamp if it has one.
+   if (var.vt == VDP_RPC_VT_BLOB && var.blobVal.size > RPC_CLOCK_PING_OFFSET) {
+      RPCClockSync::EchoStamp(var.blobVal.blobData + RPC_CLOCK_PING_OFFSET,
+                              var.blobVal.size - RPC_CLOCK_PING_OFFSET, rxNs);
+   }
+   iChannelCtx->v1.SetCommand(echoCtx, VDP_PING_ECHO);
+   iChannelCtx->v1.AppendParam(echoCtx, &var);
+
+   if (!InvokeMessage(echoCtx, true)) {
+      DestroyMessage(echoCtx);
+      return;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::OnInvoke --
+ *
+ *    This method is called for the messages that have no handler in
+ *    the command table.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+PingRPCPlugin::OnInvoke(void* messageCtx)
+{
+   const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
+
+   char cmd[32];
+   if (iChannelCtx->v1.GetNamedCommand(messageCtx, cmd, sizeof cmd) && cmd[0] != '\0') {
+      LOG("Unknown command \"%s\"", cmd);
    } else {
-      uint32 cmd = iChannelCtx->v1.GetCommand(messageCtx);
-      if (cmd == VDP_PING_CMD) {
-         RPCVariant var(this);
-         iChannelCtx->v1.GetParam(messageCtx, 0, &var);
-
-         void *echoCtx;
-         if (!CreateMessage(&echoCtx)) {
-            LOG("Error: cannot create channelCtx to send channel type.");
-            return;
-         }
-
-         // Echo back.
-         iChannelCtx->v1.SetCommand(echoCtx, VDP_PING_ECHO);
-         iChannelCtx->v1.AppendParam(echoCtx, &var);
-
-         if (!InvokeMessage(echoCtx, true)) {
-            DestroyMessage(echoCtx);
-            return;
-         }
-      } else {
-         LOG("Unknown command [%d]", cmd);
-         return;
-      }
+      LOG("Unknown command [%d]", iChannelCtx->v1.GetCommand(messageCtx));
    }
 }
@@ -25,6 +25,10 @@ public:
    virtual ~PingRPCPlugin();
 
    void OnInvoke(void* messageCtx);
+
+private:
+   void OnPing(void* messageCtx);
+   void OnTcpPing(void* messageCtx);
 };
 
 
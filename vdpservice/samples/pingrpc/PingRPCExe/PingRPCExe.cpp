@@ -48,6 +48,14 @@ main(int argc, char* argv[])
    RPCManager pingRPCManager(PINGRPC_TOKEN_NAME);
    PingRPCPlugin pingRPCPlugin(options.postMode, &pingRPCManager);
 
+   /* the same seed, so the runs all send the same payloads */
+   RPCPayloadCorpus corpus(options.payloadClass, options.entropy,
+                           options.size, 1);
+
+   if (options.payloadClass != RPC_PAYLOAD_PATTERN || options.entropy > 0) {
+      pingRPCPlugin.SetCorpus(&corpus);
+   }
+
    if (!pingRPCManager.ServerInit2(options.sid, options.type,
                                    options.compressEnabled,
                                    options.encryptionEnabled,
@@ -56,6 +64,15 @@ main(int argc, char* argv[])
       goto done;
    }
 
+   if (options.pumpThread && !pingRPCManager.StartPumpThread(&pingRPCPlugin)) {
+      printf("Warning: StartPumpThread() failed, polling from main thread\n");
+   }
+
+   pingRPCPlugin.SetCreditWindow(options.window, 0);
+   if (options.batchUs > 0) {
+      pingRPCPlugin.SetBatching(options.batchUs, PING_BATCH_BYTES);
+   }
+
    DWORD pingTime = GetTickCount();
    if (options.type != VDPSERVICE_TCPRAW_CHANNEL) {
       for (int i=0;  i < options.n;  ++i) {
@@ -113,6 +130,36 @@ main(int argc, char* argv[])
    double msPing = (double)pingTime / (double)pingRPCPlugin.cntRecv;
    printf("%dms/ping\n", (int32)(msPing + 0.5));
 
+   double msToClient, msToAgent;
+   RPCClockSyncStats clockStats;
+   pingRPCPlugin.GetClockStats(&clockStats);
+   if (pingRPCPlugin.GetOneWay(&msToClient, &msToAgent)) {
+      printf("%.3fms to the client, %.3fms back, clock offset %+.3fms, "
+             "drift %+.2fppm, %llu split below 0\n", msToClient, msToAgent,
+             clockStats.offsetNs / 1e6, clockStats.driftPpm,
+             (unsigned long long)clockStats.rejected);
+   } else if (clockStats.rejected > 0) {
+      printf("one way n/a, %llu round trips split below 0\n",
+             (unsigned long long)clockStats.rejected);
+   }
+
+   RPCBufferPoolStats poolStats;
+   pingRPCPlugin.GetBufferStats(&poolStats);
+   printf("%llu payload buffers used, %llu heap allocations\n",
+          (unsigned long long)poolStats.acquired,
+          (unsigned long long)poolStats.heapAllocs);
+
+   if (options.compressEnabled) {
+      RPCCompressionStats compStats;
+      pingRPCPlugin.GetCompressionStats(&compStats);
+      printf("compression of %s payloads: %llu none, %llu snappy, %llu zlib, "
+             "~%llu bytes saved\n", RPCPayloadCorpus::ClassToStr(options.payloadClass),
+             (unsigned long long)compStats.none,
+             (unsigned long long)compStats.snappy,
+             (unsigned long long)compStats.zlib,
+             (unsigned long long)compStats.estSavedBytes);
+   }
+
 done:
    if (options.delay > 0) {
       ::Sleep(options.delay);
@@ -135,17 +182,24 @@ PingRPCPlugin::PingRPCPlugin(bool bPostMode, RPCManager* rpcManagerPtr)
    : cntRecv(0),
      cntSent(0),
      m_postMode(bPostMode),
-     recvBuf(NULL),
-     recvLen(0),
+     m_corpus(NULL),
+     m_toClientNs(0),
+     m_toAgentNs(0),
+     m_oneWayCnt(0),
+     cntTcpRecv(0),
+     tcpFd(-1),
+     tcpClosed(false),
      RPCPluginInstance(rpcManagerPtr)
 {
+   static const RPCCommandEntry commands[] = {
+      RPC_SEND_COMMAND(PINGRPC_MESSAGE),        // PING_COMMAND
+   };
+
+   RegisterCommands(commands, sizeof commands / sizeof commands[0]);
 }
 
 PingRPCPlugin::~PingRPCPlugin()
 {
-   if (recvBuf) {
-      delete [] recvBuf;
-   }
 }
 
 
@@ -156,6 +210,9 @@ PingRPCPlugin::~PingRPCPlugin()
  *
  *    A timestamp is sent to the client which then bounces the
  *    value back to us so that we can calculate the round-trip time.
+ *    The payload is the pattern of GetStringForPing(), or a blob from
+ *    the corpus if one is set.  A clock stamp goes last, the client
+ *    adds its own times to it so that the round trip can be split.
  *
  *----------------------------------------------------------------------
  */
@@ -163,58 +220,84 @@ bool
 PingRPCPlugin::Ping(int size)                       // IN
 {
    const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
-   const VDPRPC_VariantInterface* iVariant = VariantInterface();
    RPCManager*              rpcManagerPtr  = GetRPCManager();
 
    if (!rpcManagerPtr) {
       return false;
    }
 
+   /*
+    * The payload is built first so that the compression of the
+    * message can be chosen for it.  The buffer is reused from ping to
+    * ping, it goes back to the pool once the ping completes.
+    */
+   RPCBuffer* buffer = NULL;
+   const char* payload = NULL;
+   if (size > 0 && m_corpus != NULL) {
+      payload = m_corpus->Next(size);
+   } else if (size > 0) {
+      buffer = AcquireBuffer(size + 1);
+      GetStringForPing(cntSent, size, buffer->data);
+      payload = buffer->data;
+   }
+
    /*
     * Create a message and give it a name
     */
    void* messageCtx = NULL;
-   if (!CreateMessage(&messageCtx)) {
+   if (!CreateMessage(&messageCtx, 0, payload, payload != NULL ? (uint32)size : 0)) {
+      ReleaseBuffer(buffer);
       return false;
    }
 
-   iChannelCtx->v1.SetNamedCommand(messageCtx, PINGRPC_MESSAGE);
+   SetCommand(messageCtx, PING_COMMAND);
 
    /*
-    * I'm just going to add one parameter to the message, a timestamp.
+    * I'm just going to add one parameter to the message, a timestamp,
+    * and the payload if any.  The variant is reused for all of them.
     */
-   RPCVariant var(this);
+   RPCScratchVariant var;
 
    uint32 ms = GetTickCount();
-   iVariant->v1.VariantFromUInt32(&var, ms);
+   var.SetUInt32(ms);
    iChannelCtx->v1.AppendParam(messageCtx, &var);
 
-   if (size > 0) {
-      char *str = GetStringForPing(cntSent, size);
-      iVariant->v1.VariantInit(&var);   // reuse var
-      iVariant->v1.VariantFromStr(&var, str);
+   if (buffer != NULL) {
+      var.SetStr(buffer->data);
+      iChannelCtx->v1.AppendParam(messageCtx, &var);
+      AttachBuffer(messageCtx, buffer);
+   } else if (payload != NULL) {
+      /* the corpus has NULs, and outlives the message */
+      var.SetBlob(payload, (uint32)size);
       iChannelCtx->v1.AppendParam(messageCtx, &var);
-
-      delete []str;
    }
 
    if (m_postMode) {
-      RPCVariant mode(this);
-      iVariant->v1.VariantFromUInt32(&mode, 1);
-      iChannelCtx->v2.SetOps(messageCtx, VDP_RPC_CHANNEL_CONTEXT_OPT_POST, &mode);
+      SetPostMode(messageCtx, true);
+   } else {
+      RPCClockStamp stamp;
+      RPCClockSync::InitStamp(&stamp);
+      var.SetBlob((const char*)&stamp, sizeof stamp);
+      iChannelCtx->v1.AppendNamedParam(messageCtx, RPC_CLOCK_STAMP_NAME, &var);
    }
 
    /*
     * After a successfull call to invoke, the RPC library owns
     * the message context and will destroy it.  We only need to
-    * destroy it if InvokeMessage() fails.
+    * destroy it if TryInvokeMessage() fails.  While the credit window
+    * is full keep giving RPC time so the completions can come in.
     */
-   if (!InvokeMessage(messageCtx)) {
+   RPCInvokeResult res;
+   while ((res = TryInvokeMessage(messageCtx, size)) == RPC_INVOKE_WOULD_BLOCK) {
+      WaitForCredit(100);
+   }
+
+   if (res != RPC_INVOKE_OK) {
       DestroyMessage(messageCtx);
       return false;
    }
 
-   rpcManagerPtr->Poll();
+   rpcManagerPtr->Poll(0);
    cntSent++;
    return true;
 }
@@ -234,14 +317,14 @@ PingRPCPlugin::OnDone(uint32 requestCtxId, void *returnCtx)
 {
    const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
    const VDPRPC_VariantInterface* iVariant = VariantInterface();
+   uint64 rxNs = RPCClockSync::NowNs();
 
    /*
-    * Make sure the message name matches.
+    * Make sure the message name matches, it is a number once the client
+    * has interned it.
     */
-   char cmd[32];
-   iChannelCtx->v1.GetNamedCommand(returnCtx, cmd, sizeof cmd);
-   if (strcmp(cmd, PINGRPC_MESSAGE) != 0) {
-      LOG("Unknown command \"%s\"", cmd);
+   if (!IsCommand(returnCtx, PING_COMMAND)) {
+      LOG("Unknown command [%d]", iChannelCtx->v1.GetCommand(returnCtx));
       return;
    }
 
@@ -257,7 +340,25 @@ PingRPCPlugin::OnDone(uint32 requestCtxId, void *returnCtx)
    } else {
       iChannelCtx->v1.GetReturnVal(returnCtx, 0, &var);
       uint32 msPing = GetTickCount() - var.ulVal;
-      LOG("Ping took %dms", msPing);
+      iVariant->v1.VariantClear(&var);
+
+      /*
+       * A client that knows the clock stamp returned it last, with the
+       * times the ping got there and was answered.
+       */
+      RPCClockStamp stamp;
+      uint64 toClientNs;
+      uint64 toAgentNs;
+      int n = iChannelCtx->v1.GetReturnValCount(returnCtx);
+      if (n > 1 && iChannelCtx->v1.GetReturnVal(returnCtx, n - 1, &var) &&
+          var.vt == VDP_RPC_VT_BLOB &&
+          RPCClockSync::ReadStamp(var.blobVal.blobData, var.blobVal.size, &stamp) &&
+          RecordClock(stamp, rxNs, &toClientNs, &toAgentNs)) {
+         LOG("Ping took %dms, %.3fms to the client and %.3fms back", msPing,
+             toClientNs / 1e6, toAgentNs / 1e6);
+      } else {
+         LOG("Ping took %dms", msPing);
+      }
    }
    cntRecv++;
 }
@@ -266,35 +367,98 @@ PingRPCPlugin::OnDone(uint32 requestCtxId, void *returnCtx)
 /*
  *----------------------------------------------------------------------
  *
- * PingRPCPlugin::GetStringForPing --
+ * PingRPCPlugin::RecordClock --
  *
- *    Create string fill with patterned data.
+ *    Adds the round trip of a clock stamp answered at <rxNs> to the
+ *    estimate of the client's clock, and splits it by the estimate.
  *
  * Results:
- *    Returns string if succeed.
+ *    true if the delays each way were set.
  *
  * Side Effects:
- *    caller need to delete it.
+ *    None.
  *
  *----------------------------------------------------------------------
  */
 
-char *
-PingRPCPlugin::GetStringForPing(int initValue,     // IN
-                                int size)          // IN
+bool
+PingRPCPlugin::RecordClock(const RPCClockStamp& stamp,   // IN
+                           uint64 rxNs,                  // IN
+                           uint64* toClientNs,           // OUT
+                           uint64* toAgentNs)            // OUT
 {
-   char *str = new char [size + 1];
+   if (!m_clock.AddSample(stamp, rxNs) ||
+       !m_clock.GetOneWay(stamp, rxNs, toClientNs, toAgentNs)) {
+      return false;
+   }
 
-   if (str) {
-      int i;
-      int v;
-      for (i=0, v=initValue; i<size; i++, v++) {
-         str[i] = (char) ((v % 64) + '0');
-      }
-      str[i] ='\0';
+   std::lock_guard<std::mutex> lock(m_oneWayMutex);
+   m_toClientNs += *toClientNs;
+   m_toAgentNs += *toAgentNs;
+   m_oneWayCnt++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::GetOneWay --
+ *
+ *    The average delays of the pings to the client and back.
+ *
+ * Results:
+ *    false if no ping came back with a clock stamp.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+PingRPCPlugin::GetOneWay(double* toClientMs,   // OUT
+                         double* toAgentMs)    // OUT
+{
+   std::lock_guard<std::mutex> lock(m_oneWayMutex);
+
+   if (m_oneWayCnt == 0) {
+      return false;
    }
 
-   return str;
+   *toClientMs = m_toClientNs / 1e6 / m_oneWayCnt;
+   *toAgentMs = m_toAgentNs / 1e6 / m_oneWayCnt;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::GetStringForPing --
+ *
+ *    Fill <str> with patterned data.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    <str> must have room for <size> + 1 bytes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PingRPCPlugin::GetStringForPing(int initValue,     // IN
+                                int size,          // IN
+                                char* str)         // OUT
+{
+   int i;
+   int v;
+   for (i=0, v=initValue; i<size; i++, v++) {
+      str[i] = (char) ((v % 64) + '0');
+   }
+   str[i] ='\0';
 }
 
 
@@ -304,7 +468,8 @@ PingRPCPlugin::GetStringForPing(int initValue,     // IN
  * TcpEchoNotification --
  *
  *    Handle tcp echo notification from client.
- *    (increase recv counter and log RTT)
+ *    (increase recv counter and log RTT, and the delay each way when
+ *    the client filled in the clock stamp)
  *
  * Results:
  *    True.
@@ -323,11 +488,25 @@ TcpEchoNotification(void *context,             // IN
 {
    PingRPCPlugin *pingRPC = reinterpret_cast<PingRPCPlugin *> (context);
    int n = (int)(LONG_PTR)cookie;
+   uint64 rxNs = RPCClockSync::NowNs();
    DWORD origTimestamp = *((DWORD *) data);
 
    pingRPC->cntRecv++;
-   LOG("Tcp recv %d echo %d sent RTT=%d", pingRPC->cntRecv,
-       pingRPC->cntSent, GetTickCount() - origTimestamp);
+
+   RPCClockStamp stamp;
+   uint64 toClientNs;
+   uint64 toAgentNs;
+   if (RPCClockSync::ReadStamp((const char *) data + RPC_CLOCK_PING_OFFSET,
+                               pingRPC->TcpPingSize() - RPC_CLOCK_PING_OFFSET,
+                               &stamp) &&
+       pingRPC->RecordClock(stamp, rxNs, &toClientNs, &toAgentNs)) {
+      LOG("Tcp recv %d echo %d sent RTT=%.3fms (%.3fms to the client, "
+          "%.3fms back)", pingRPC->cntRecv, pingRPC->cntSent,
+          (rxNs - stamp.txNs) / 1e6, toClientNs / 1e6, toAgentNs / 1e6);
+   } else {
+      LOG("Tcp recv %d echo %d sent RTT=%d", pingRPC->cntRecv,
+          pingRPC->cntSent, GetTickCount() - origTimestamp);
+   }
 
    return TRUE;
 }
@@ -445,11 +624,6 @@ PingRPCPlugin::SetTcpTestParam(int cnt,                     // IN
    doCompression = compressionEnabled;
    doEncryption = encryptionEnabled;
 
-   if (recvBuf == NULL) {
-      recvBuf = new char [MAX_RECV_LEN];
-      recvLen = 0;
-   }
-
    return;
 }
 
@@ -457,9 +631,10 @@ PingRPCPlugin::SetTcpTestParam(int cnt,                     // IN
 /*
  *----------------------------------------------------------------------
  *
- * PingRPCPlugin::TcpSend --
+ * PingRPCPlugin::TcpOpen --
  *
- *    Send one RPC command from tcp socket.
+ *    Hand the tcp raw socket to the reactor that serves it, with the
+ *    compression and encryption asked for.
  *
  * Results:
  *    true if it succeeds, otherwise return false.
@@ -471,62 +646,81 @@ PingRPCPlugin::SetTcpTestParam(int cnt,                     // IN
  */
 
 bool
-PingRPCPlugin::TcpSend()
+PingRPCPlugin::TcpOpen()
 {
-   bool rv = true;
-   const VDPRPC_StreamDataInterface* iStreamData = StreamDataInterface();
-   if (pingSize < sizeof uint32) {
-      pingSize = sizeof uint32;
-   }
-
-   // Create source data
-   char *data = new char [pingSize];
-   *((uint32 *) data) = GetTickCount();
-   VDP_RPC_BLOB blob = { (uint32)pingSize, data };
-
    uint32 options = GetChannelObjOptions();
    VM_ASSERT(!doCompression || (options & VDP_RPC_COMP_SNAPPY));
    VM_ASSERT(!doEncryption || (options & VDP_RPC_CRYPTO_AES));
 
    options = (doCompression ? VDP_RPC_COMP_SNAPPY : 0) |
              (doEncryption ? VDP_RPC_CRYPTO_AES : 0) ;
-   static int reqId = 100;
-   reqId++;
-
-   // Create RPC payload
-   int fd = GetTcpRawSocket();
-   VDP_RPC_BLOB payload = {0, NULL};
-   iStreamData->v2.GetStreamData(fd, options, &reqId, VDP_PING_CMD, &blob, &payload);
-   if (payload.size > 0) {
-      int pos = 0;
-      int sent;
-      while (pos < (int)payload.size) {
-         sent = send(fd, payload.blobData + pos, payload.size - pos, 0);
-         if (send > 0) {
-            pos += sent;
-         } else {
-            rv = false;
-            LOG("Error: tcp send failed.");
-            break;
-         }
-      }
-      iStreamData->v2.FreeStreamDataPayload(&payload);
+
+   tcpFd = GetTcpRawSocket();
+   tcpClosed = false;
+   cntTcpRecv = 0;
+
+   /*
+    * Without compression or encryption the sender frames the payload
+    * in place and writes it with one gather call.
+    */
+   return tcpReactor.Init() &&
+          tcpReactor.Add(tcpFd, StreamDataInterface(), options, this);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::TcpSend --
+ *
+ *    Send one RPC command from tcp socket, what the socket does not
+ *    take is queued by the reactor until it is writable.  The payload
+ *    is a timestamp, a clock stamp and garbage.
+ *
+ * Results:
+ *    true if it succeeds, otherwise return false.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+PingRPCPlugin::TcpSend()
+{
+   if (pingSize < RPC_CLOCK_PING_OFFSET + sizeof(RPCClockStamp)) {
+      pingSize = RPC_CLOCK_PING_OFFSET + sizeof(RPCClockStamp);
    }
 
-   delete data;
-   return rv;
+   // Source data, sent from this buffer
+   RPCClockStamp stamp;
+   RPCClockSync::InitStamp(&stamp);
+
+   tcpPayload.resize(pingSize);
+   *((uint32 *) tcpPayload.data()) = GetTickCount();
+   memcpy(tcpPayload.data() + RPC_CLOCK_PING_OFFSET, &stamp, sizeof stamp);
+
+   if (!tcpReactor.Send(tcpFd, VDP_PING_CMD, tcpPayload.data(),
+                        (uint32)pingSize, NULL)) {
+      LOG("Error: tcp send failed.");
+      return false;
+   }
+
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PingRPCPlugin::TcpRecv --
+ * PingRPCPlugin::TcpPoll --
  *
- *    Handle incoming data from tcp socket
+ *    Wait up to msTimeout for the tcp socket, the packets read go to
+ *    OnStreamData().
  *
  * Results:
- *    The number of packets are parsed.
+ *    The number of sockets served, -1 if the socket failed or closed.
  *
  * Side Effects:
  *    None.
@@ -535,60 +729,86 @@ PingRPCPlugin::TcpSend()
  */
 
 int
-PingRPCPlugin::TcpRecv()
+PingRPCPlugin::TcpPoll(int msTimeout)   // IN
 {
-   int fd = GetTcpRawSocket();
-   const VDPService_ObserverInterface* iObserver = VdpObserverInterface();
-   const VDPRPC_StreamDataInterface* iStreamData = StreamDataInterface();
-
-   int recved = 0;
-   int len = recv(fd, recvBuf + recvLen, MAX_RECV_LEN - recvLen, 0);
-   if (len > 0) {
-      int pos = 0;
-      int reqId;
-      int reqCmd;
-      int reqType;
-      Bool cleanup;
-      int packetLen;
-      VDP_RPC_BLOB blobData = {0, NULL};
-      int  minSize = iStreamData->v1.GetMinimalStreamDataSize(fd);
-      recvLen += len;
-
-      while ((pos + minSize) <= recvLen) {
-         packetLen = iStreamData->v1.GetStreamDataSize(fd, recvBuf+pos);
-
-         if (pos + packetLen <= recvLen) {
-            if (iStreamData->v2.GetStreamDataInfo(fd, recvBuf+pos, &reqId,
-                                                  &reqType, &reqCmd,
-                                                  &cleanup, &blobData)) {
-               LOG("Trace: Recv cmd %d data %d byte", reqCmd, blobData.size);
-               BroadcastToObserver(blobData.blobData);
-               if (cleanup) {
-                  iStreamData->v2.FreeStreamDataPayload(&blobData);
-               }
-               recved++;
-               pos += packetLen;
-               continue;
-            } else {
-               LOG("Error: GetStreamDataInfo(v2) failed!");
-            }
-         }
+   int rv = tcpReactor.Poll(msTimeout);
 
-         break;
-      }
+   return tcpClosed ? -1 : rv;
+}
 
-      // recycle bytes already processed
-      if (pos > 0) {
-         if (pos < recvLen) {
-            recvLen -= pos;
-            memmove(recvBuf, recvBuf+pos, recvLen);
-         } else {
-            recvLen = 0;
-         }
-      }
-   }
 
-   return recved;
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::TcpClose --
+ *
+ *    Stop serving the tcp socket.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PingRPCPlugin::TcpClose()
+{
+   tcpReactor.Remove(tcpFd, TCP_POLL_TIMEOUT_MS);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::OnStreamData --
+ *
+ *    Handle one packet from tcp socket.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PingRPCPlugin::OnStreamData(int fd,                      // IN
+                            int reqId,                   // IN
+                            int reqCmd,                  // IN
+                            const VDP_RPC_BLOB* blob)    // IN
+{
+   LOG("Trace: Recv cmd %d data %d byte", reqCmd, blob->size);
+   BroadcastToObserver(blob->blobData);
+   cntTcpRecv++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PingRPCPlugin::OnStreamClosed --
+ *
+ *    The tcp socket was closed or failed, the reactor removed it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side Effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PingRPCPlugin::OnStreamClosed(int fd)   // IN
+{
+   LOG("Error: tcp socket %d closed.", fd);
+   tcpClosed = true;
 }
 
 
@@ -597,7 +817,10 @@ PingRPCPlugin::TcpRecv()
  *
  * TcpPingProc --
  *
- *    Thread start routine for tcp socket ping to vdpservice client
+ *    Thread start routine for tcp socket ping to vdpservice client.
+ *    Up to TCP_PING_WINDOW pings are sent ahead of their echoes, the
+ *    reactor only waits for the socket to be writable while some of
+ *    them are queued.
  *
  * Results:
  *    0 if Tcp ping thread exit successfully, or errCode in PingRPCExe.h.
@@ -611,58 +834,33 @@ PingRPCPlugin::TcpRecv()
 DWORD
 TcpPingProc(LPVOID data)            // IN
 {
-   int fd;
    PingRPCPlugin *pingRPC = reinterpret_cast<PingRPCPlugin *> (data);
-   if (pingRPC == NULL || (fd = pingRPC->GetTcpRawSocket()) == INVALID_SOCKET) {
+   if (pingRPC == NULL || pingRPC->GetTcpRawSocket() == INVALID_SOCKET ||
+       !pingRPC->TcpOpen()) {
       LOG("Error: tcp raw socket not succeed.\n");
       return TCP_SETUP_ERROR;
    }
 
-   int rv;
-   int nRecv = 0;
+   DWORD rv = 0;
    int nSent = 0;
    int total = pingRPC->TcpPingCnt();
-   struct fd_set  rfds;
-   struct fd_set  wfds;
-   struct timeval timeout;
-
-   while (nRecv < total) {
-      FD_ZERO(&rfds);
-      FD_ZERO(&wfds);
-      FD_SET(fd, &rfds);
-      if (nSent < total) {
-         FD_SET(fd, &wfds);
-      }
 
-      timeout.tv_sec = SELECT_TIMEOUT_SEC;
-      timeout.tv_usec = SELECT_TIMEOUT_USEC;
-      rv = select(1, &rfds, &wfds, NULL, &timeout);
-
-      if (rv > 0) {
-         if (FD_ISSET(fd, &wfds)) {
-            if (pingRPC->TcpSend()) {
-               pingRPC->cntSent = ++nSent;
-            } else {
-               LOG("Error: Tcp send failed.");
-               return NETWORK_ERROR;
-            }
+   while (pingRPC->TcpRecvCnt() < total && rv == 0) {
+      while (nSent < total && nSent - pingRPC->TcpRecvCnt() < TCP_PING_WINDOW) {
+         if (!pingRPC->TcpSend()) {
+            LOG("Error: Tcp send failed.");
+            rv = NETWORK_ERROR;
+            break;
          }
+         pingRPC->cntSent = ++nSent;
+      }
 
-         if (FD_ISSET(fd, &rfds)) {
-            int n = pingRPC->TcpRecv();
-            if (n < 0) {
-               LOG("Error: Tcp recv failed.");
-               return NETWORK_ERROR;
-            } else {
-               nRecv += n;
-            }
-         }
-      } else if (rv < 0) {
-         LOG("Error: socket select return %d.", rv);
-         return NETWORK_ERROR;
+      if (rv == 0 && pingRPC->TcpPoll(TCP_POLL_TIMEOUT_MS) < 0) {
+         LOG("Error: Tcp recv failed.");
+         rv = NETWORK_ERROR;
       }
    }
 
-   return 0;
+   pingRPC->TcpClose();
+   return rv;
 }
-
@@ -10,11 +10,15 @@
 #pragma once
 
 #include "RPCManager.h"
+#include "RPCStreamReactor.h"
+#include "RPCPayloadCorpus.h"
+#include "RPCClockSync.h"
+
+#include <mutex>
 
 DWORD TcpPingProc(LPVOID data);
-#define MAX_RECV_LEN                     65536
-#define SELECT_TIMEOUT_SEC               1
-#define SELECT_TIMEOUT_USEC              0
+#define TCP_PING_WINDOW                  16
+#define TCP_POLL_TIMEOUT_MS              1000
 #define TCP_SETUP_ERROR                  -1
 #define NETWORK_ERROR                    -2
 
@@ -26,18 +30,26 @@ DWORD TcpPingProc(LPVOID data);
  *
  *----------------------------------------------------------------------
  */
-class PingRPCPlugin : public RPCPluginInstance
+class PingRPCPlugin : public RPCPluginInstance,
+                      public RPCStreamHandler
 {
 public:
    PingRPCPlugin(bool bPostMode, RPCManager* rpcManagerPtr);
    virtual ~PingRPCPlugin();
 
    bool Ping(int size);
+   void SetCorpus(RPCPayloadCorpus* corpus) { m_corpus = corpus; }
    int cntRecv;
    int cntSent;
 
    virtual void OnDone(uint32 requestCtxId, void *returnCtx);
 
+   /* Delays of the pings each way, by the client's clock stamps */
+   bool RecordClock(const RPCClockStamp& stamp, uint64 rxNs,
+                    uint64* toClientNs, uint64* toAgentNs);
+   bool GetOneWay(double* toClientMs, double* toAgentMs);
+   void GetClockStats(RPCClockSyncStats* stats) { m_clock.GetStats(stats); }
+
    /* Observer interface */
    bool RegisterObserver();
    void UnregisterObserver();
@@ -45,14 +57,28 @@ public:
 
    /* APIs for Tcp Raw socket */
    void SetTcpTestParam(int cnt, int size, bool comp, bool enc);
+   bool TcpOpen();
    bool TcpSend();
-   int  TcpRecv();
+   int  TcpPoll(int msTimeout);
+   void TcpClose();
    int  TcpPingCnt() const { return cntPing; }
+   int  TcpRecvCnt() const { return cntTcpRecv; }
+   int  TcpPingSize() const { return pingSize; }
 
 private:
 
-   /* Create string fill with patterned data */
-   char* GetStringForPing(int initValue, int size);
+   /* index of the ping message in the command table */
+   enum {
+      PING_COMMAND
+   };
+
+   /* RPCStreamHandler, called from the thread that polls tcpReactor */
+   virtual void OnStreamData(int fd, int reqId, int reqCmd,
+                             const VDP_RPC_BLOB* blob);
+   virtual void OnStreamClosed(int fd);
+
+   /* Fill string with patterned data */
+   void GetStringForPing(int initValue, int size, char* str);
 
    /*
     * In post mode, OnDone() indicates when message is delivered
@@ -63,11 +89,24 @@ private:
    bool m_postMode;
    VDPService_ObserverId m_observerId;
 
+   /* payloads of the pings, the pattern if NULL */
+   RPCPayloadCorpus* m_corpus;
+
+   /* the clock of the client, and the sums of the delays each way */
+   RPCClockSync m_clock;
+   std::mutex m_oneWayMutex;
+   uint64 m_toClientNs;
+   uint64 m_toAgentNs;
+   uint64 m_oneWayCnt;
+
    /* Used for tcp raw socket */
    int  cntPing;
    int  pingSize;
-   char *recvBuf;
-   int  recvLen;
+   int  cntTcpRecv;
+   int  tcpFd;
+   bool tcpClosed;
    bool doCompression;
    bool doEncryption;
+   RPCStreamReactor tcpReactor;
+   std::vector<char> tcpPayload;
 };
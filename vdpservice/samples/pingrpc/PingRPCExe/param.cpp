@@ -170,7 +170,8 @@ static void
 Usage(void)
 {
    printf("Usage: PingRPCExe [-h] [-t type] [-s size] [-n count] [-d delay]\n");
-   printf("                  [-i sessionId] [-c] [-e]\n");
+   printf("                  [-i sessionId] [-w window] [-b usec]\n");
+   printf("                  [-P class[:entropy]] [-c] [-e] [-p] [-u]\n");
    printf("Options:\n");
    printf("    -t       specify channel type.\n");
    printf("             main    -- ping send via main channel.(default)\n");
@@ -183,9 +184,15 @@ Usage(void)
    printf("    -i       send ping packet to which windows session.\n");
    printf("             default is current session.\n");
    printf("             Request high priviledge for cross session communication.\n");
+   printf("    -w       Max number of pings in flight. (default 0, unlimited)\n");
+   printf("    -b       Coalesce pings sent within usec microseconds.(not for tcpRaw)\n");
+   printf("    -P       Payload corpus: zeros, pattern (default), pixels, json\n");
+   printf("             or random, with that share of the bytes random,\n");
+   printf("             e.g. json:0.1.\n");
    printf("    -c       Packet will be compressed.(not for type=main)\n");
    printf("    -e       Packet will be encrypted.(Only for tcp and tcpRaw)\n");
    printf("    -p       Ping run in \"post\" mode. (No ack/OnDone needed from peer)\n");
+   printf("    -u       Send and poll from a dedicated RPC pump thread.(not for tcpRaw)\n");
    printf("    -h       Print usage\n");
    printf("Examples:\n");
    printf("    PingRPCExe -h\n");
@@ -229,6 +236,11 @@ ParseOptions(PingOptions& options,           // OUT
    options.compressEnabled = false;
    options.encryptionEnabled = false;
    options.postMode = false;
+   options.pumpThread = false;
+   options.window = 0;
+   options.batchUs = 0;
+   options.payloadClass = RPC_PAYLOAD_PATTERN;
+   options.entropy = 0;
    channelType = "main channel";
 
    // Print help page and run ping with default parametr.
@@ -237,7 +249,7 @@ ParseOptions(PingOptions& options,           // OUT
       return ret;
    }
 
-   while ((opt = getopt(argc, argv, "t:s:n:d:i:ceph")) != EOF) {
+   while ((opt = getopt(argc, argv, "t:s:n:d:i:w:b:P:cepuh")) != EOF) {
       switch (opt) {
       case 't':
          if (_stricmp(optarg, "vchan") == 0) {
@@ -271,6 +283,28 @@ ParseOptions(PingOptions& options,           // OUT
       case 'i':
          options.sid = atoi(optarg);
          break;
+      case 'w':
+         options.window = atoi(optarg);
+         if (options.window < 0) {
+            printf("Warning : Invalid window, set to 0 (unlimited)\n");
+            options.window = 0;
+         }
+         break;
+      case 'b':
+         options.batchUs = atoi(optarg);
+         if (options.batchUs < 0) {
+            printf("Warning : Invalid batch delay, batching is off\n");
+            options.batchUs = 0;
+         }
+         break;
+      case 'P':
+         if (!RPCPayloadCorpus::Parse(optarg, &options.payloadClass,
+                                      &options.entropy)) {
+            printf("Warning : Invalid payload \"%s\", using the pattern\n", optarg);
+            options.payloadClass = RPC_PAYLOAD_PATTERN;
+            options.entropy = 0;
+         }
+         break;
       case 'c':
          options.compressEnabled = true;
          break;
@@ -280,6 +314,9 @@ ParseOptions(PingOptions& options,           // OUT
       case 'p':
          options.postMode = true;
          break;
+      case 'u':
+         options.pumpThread = true;
+         break;
       case 'h':
       case '?':
          Usage();
@@ -302,12 +339,28 @@ ParseOptions(PingOptions& options,           // OUT
          options.encryptionEnabled = false;
       }
 
+      if (options.pumpThread && options.type == VDPSERVICE_TCPRAW_CHANNEL) {
+         printf("Warning: Pump thread is not used for tcp raw socket.\n");
+         options.pumpThread = false;
+      }
+
+      if (options.window > 0 && options.type == VDPSERVICE_TCPRAW_CHANNEL) {
+         printf("Warning: Window is not used for tcp raw socket.\n");
+         options.window = 0;
+      }
+
+      if (options.batchUs > 0 && options.type == VDPSERVICE_TCPRAW_CHANNEL) {
+         printf("Warning: Batching is not used for tcp raw socket.\n");
+         options.batchUs = 0;
+      }
+
       printf("\nPing %d bytes %d times via %s in %s mode\n"
-             "(Encryption : %s   Compression : %s)\n",
+             "(Encryption : %s   Compression : %s   Payload : %s %.2f)\n",
              options.size, options.n, channelType,
              options.postMode ? "post" : "request",
              options.encryptionEnabled ? "on" : "off",
-             options.compressEnabled ? "on" : "off");
+             options.compressEnabled ? "on" : "off",
+             RPCPayloadCorpus::ClassToStr(options.payloadClass), options.entropy);
    }
 
    return ret;
@@ -9,8 +9,11 @@
 
 #pragma once
 
+#include "RPCPayloadCorpus.h"
+
 #define PING_MIN_NUMBER     1
 #define CURRENT_SESSION     -1
+#define PING_BATCH_BYTES    (16 * 1024)
 
 typedef struct {
    VdpServiceChannelType type;    // channel type
@@ -21,6 +24,11 @@ typedef struct {
    bool compressEnabled;          // is compression enabled
    bool encryptionEnabled;        // is encryption enabled
    bool postMode;                 // message in post mode
+   bool pumpThread;               // send via the RPCManager pump thread
+   int window;                    // max pings in flight, 0 is unlimited
+   int batchUs;                   // coalesce pings for this long, 0 is off
+   RPCPayloadClass payloadClass;  // payloads of the pings, see -P
+   double entropy;                // share of random bytes in them
 } PingOptions;
 
 // Parse commandline options